@@ -3,12 +3,59 @@
 
 #include <CL/cl.h>
 
+// sub-buffers, user events and event callbacks are OpenCL 1.1; 1.2 calls
+// are used only where CL_VERSION_1_2 is defined
+#ifndef CL_VERSION_1_1
+#error "cl_wrapper requires OpenCL 1.1 or later headers"
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+/* the program_cache directory helpers and numa_domains' page allocation
+ * use POSIX where it exists; elsewhere they degrade as documented */
+#if defined(__unix__) || defined(__APPLE__)
+#define CL_WRAPPER_POSIX
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#else
+#include <random>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
 #ifdef CL_WRAPPER_EXCEPTIONS_ABORT
-#include <cstdlib>
 #include <csignal>
 #endif
 
@@ -260,6 +307,92 @@ struct context_property_functor {
   }
 };
 
+template<typename QT, typename CPPTYPE>
+struct command_queue_property_functor {
+  CPPTYPE operator()(const QT &queue, cl_uint prop_name) const {
+    cl_int err;
+    CPPTYPE to_return;
+    err = clGetCommandQueueInfo(queue.id(), prop_name, sizeof(to_return),
+        &to_return, NULL);
+    CHECK_CL_ERROR(err);
+    return to_return;
+  }
+};
+
+template<typename KT, typename CPPTYPE>
+struct kernel_property_functor {
+  CPPTYPE operator()(const KT &kernel, cl_uint prop_name) const {
+    cl_int err;
+    CPPTYPE to_return;
+    err = clGetKernelInfo(kernel.id(), prop_name, sizeof(to_return),
+        &to_return, NULL);
+    CHECK_CL_ERROR(err);
+    return to_return;
+  }
+};
+
+template<typename KT>
+struct kernel_property_functor<KT, std::string> {
+  std::string operator()(const KT &kernel, cl_uint prop_name) const {
+    cl_int err;
+    size_t size;
+    err = clGetKernelInfo(kernel.id(), prop_name, 0, NULL, &size);
+    CHECK_CL_ERROR(err);
+    std::string to_return;
+    to_return.resize(size);
+    err = clGetKernelInfo(kernel.id(), prop_name, size, &to_return[0],
+        NULL);
+    CHECK_CL_ERROR(err);
+    // drop the terminating NUL so names compare and print cleanly
+    if(!to_return.empty()) to_return.resize(to_return.size() - 1);
+    return to_return;
+  }
+};
+
+template<typename ET, typename CPPTYPE>
+struct event_property_functor {
+  CPPTYPE operator()(const ET &event, cl_uint prop_name) const {
+    cl_int err;
+    CPPTYPE to_return;
+    err = clGetEventInfo(event.id(), prop_name, sizeof(to_return),
+        &to_return, NULL);
+    CHECK_CL_ERROR(err);
+    return to_return;
+  }
+};
+
+template<typename ET>
+struct event_profiling_functor {
+  cl_ulong operator()(const ET &event, cl_uint prop_name) const {
+    cl_int err;
+    cl_ulong to_return;
+    err = clGetEventProfilingInfo(event.id(), prop_name,
+        sizeof(to_return), &to_return, NULL);
+    CHECK_CL_ERROR(err);
+    return to_return;
+  }
+};
+
+/** \brief bytes covered by region (3 elements) of an image */
+inline size_t image_region_bytes(cl_mem image, const size_t *region) {
+  size_t element_size = 0;
+  clGetImageInfo(image, CL_IMAGE_ELEMENT_SIZE, sizeof(element_size),
+      &element_size, NULL);
+  return element_size * region[0] * region[1] * region[2];
+}
+
+template<typename MT, typename CPPTYPE>
+struct mem_property_functor {
+  CPPTYPE operator()(const MT &mem, cl_uint prop_name) const {
+    cl_int err;
+    CPPTYPE to_return;
+    err = clGetMemObjectInfo(mem.id(), prop_name, sizeof(to_return),
+        &to_return, NULL);
+    CHECK_CL_ERROR(err);
+    return to_return;
+  }
+};
+
 }
 
 /** \brief reference-counted generic wrapper for OpenCL types.  behaves
@@ -276,6 +409,12 @@ public:
       : ref_(w.ref_) {
     upref_();
   }
+  /** \brief new wrapper object takes over other wrapper's reference,
+   * leaving it NULL; refcount is untouched */
+  cl_wrapper(cl_wrapper &&w) noexcept
+      : ref_(w.ref_) {
+    w.ref_ = NULL;
+  }
   /** \brief new wrapper object at t; don't increment refcount */
   cl_wrapper(T t)
       : ref_(t) {
@@ -309,17 +448,30 @@ public:
     return ref_ == w.ref_;
   }
   /** \brief behaves like reset() */
-  cl_wrapper operator=(const cl_wrapper &r) {
+  cl_wrapper& operator=(const cl_wrapper &r) {
     reset(r.ref_);
     return *this;
   }
+  /** \brief takes over r's reference, leaving r NULL; only our old
+   * reference is released */
+  cl_wrapper& operator=(cl_wrapper &&r) noexcept {
+    if(this == &r) return *this;
+    downref_();
+    ref_ = r.ref_;
+    r.ref_ = NULL;
+    return *this;
+  }
   /** \brief behaves like reset() with no automatic reference increment */
-  cl_wrapper operator=(const T &t) {
+  cl_wrapper& operator=(const T &t) {
     if(ref_ == t) return *this;
     downref_();
     ref_ = t;
     return *this;
   }
+  /** \brief exchange references without touching refcounts */
+  void swap(cl_wrapper &w) noexcept {
+    std::swap(ref_, w.ref_);
+  }
 
   /** \brief automatically convert to underlying C type */
   operator T() const {
@@ -342,9 +494,172 @@ protected:
   T ref_;
 };
 
+/** \brief every device property that cannot change while the device
+ * exists, as X(accessor, CL_DEVICE_..., type).  used to build both
+ * device_info and the matching device_ accessors */
+#define CL_WRAPPER_DEVICE_INFO(X) \
+  X(address_bits, CL_DEVICE_ADDRESS_BITS, cl_uint) \
+  X(compiler_available, CL_DEVICE_COMPILER_AVAILABLE, bool) \
+  X(endian_little, CL_DEVICE_ENDIAN_LITTLE, bool) \
+  X(error_correction_support, CL_DEVICE_ERROR_CORRECTION_SUPPORT, bool) \
+  X(execution_capabilities, CL_DEVICE_EXECUTION_CAPABILITIES, \
+      cl_device_exec_capabilities) \
+  X(extensions, CL_DEVICE_EXTENSIONS, std::string) \
+  X(global_mem_cache_size, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, cl_ulong) \
+  X(global_mem_cache_type, CL_DEVICE_GLOBAL_MEM_CACHE_TYPE, \
+      cl_device_mem_cache_type) \
+  X(global_mem_cacheline_size, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE, \
+      cl_uint) \
+  X(global_mem_size, CL_DEVICE_GLOBAL_MEM_SIZE, cl_ulong) \
+  X(image_support, CL_DEVICE_IMAGE_SUPPORT, bool) \
+  X(image2d_max_height, CL_DEVICE_IMAGE2D_MAX_HEIGHT, size_t) \
+  X(image2d_max_width, CL_DEVICE_IMAGE2D_MAX_WIDTH, size_t) \
+  X(image3d_max_depth, CL_DEVICE_IMAGE3D_MAX_DEPTH, size_t) \
+  X(image3d_max_height, CL_DEVICE_IMAGE3D_MAX_HEIGHT, size_t) \
+  X(image3d_max_width, CL_DEVICE_IMAGE3D_MAX_WIDTH, size_t) \
+  X(local_mem_size, CL_DEVICE_LOCAL_MEM_SIZE, cl_ulong) \
+  X(max_clock_frequency, CL_DEVICE_MAX_CLOCK_FREQUENCY, cl_uint) \
+  X(max_compute_units, CL_DEVICE_MAX_COMPUTE_UNITS, cl_uint) \
+  X(max_constant_args, CL_DEVICE_MAX_CONSTANT_ARGS, cl_uint) \
+  X(max_constant_buffer_size, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, \
+      cl_ulong) \
+  X(max_mem_alloc_size, CL_DEVICE_MAX_MEM_ALLOC_SIZE, cl_ulong) \
+  X(max_parameter_size, CL_DEVICE_MAX_PARAMETER_SIZE, size_t) \
+  X(max_read_image_args, CL_DEVICE_MAX_READ_IMAGE_ARGS, cl_uint) \
+  X(max_samplers, CL_DEVICE_MAX_SAMPLERS, cl_uint) \
+  X(max_work_group_size, CL_DEVICE_MAX_WORK_GROUP_SIZE, size_t) \
+  X(max_work_item_dimensions, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, cl_uint) \
+  X(max_work_item_sizes, CL_DEVICE_MAX_WORK_ITEM_SIZES, \
+      std::vector<size_t>) \
+  X(max_write_image_args, CL_DEVICE_MAX_WRITE_IMAGE_ARGS, cl_uint) \
+  X(mem_base_addr_align, CL_DEVICE_MEM_BASE_ADDR_ALIGN, cl_uint) \
+  X(min_data_type_align_size, CL_DEVICE_MIN_DATA_TYPE_ALIGN_SIZE, cl_uint) \
+  X(name, CL_DEVICE_NAME, std::string) \
+  X(platform, CL_DEVICE_PLATFORM, cl_platform_id) \
+  X(preferred_vector_width_char, CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR, \
+      cl_uint) \
+  X(preferred_vector_width_short, CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT, \
+      cl_uint) \
+  X(preferred_vector_width_int, CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, \
+      cl_uint) \
+  X(preferred_vector_width_long, CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG, \
+      cl_uint) \
+  X(preferred_vector_width_float, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, \
+      cl_uint) \
+  X(preferred_vector_width_double, CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE, \
+      cl_uint) \
+  X(profile, CL_DEVICE_PROFILE, std::string) \
+  X(profiling_timer_resolution, CL_DEVICE_PROFILING_TIMER_RESOLUTION, \
+      size_t) \
+  X(queue_properties, CL_DEVICE_QUEUE_PROPERTIES, \
+      cl_command_queue_properties) \
+  X(single_fp_config, CL_DEVICE_SINGLE_FP_CONFIG, cl_device_fp_config) \
+  X(type, CL_DEVICE_TYPE, cl_device_type) \
+  X(vendor, CL_DEVICE_VENDOR, std::string) \
+  X(vendor_id, CL_DEVICE_VENDOR_ID, cl_uint) \
+  X(version, CL_DEVICE_VERSION, std::string) \
+  X(driver_version, CL_DRIVER_VERSION, std::string)
+
+/** \brief immutable snapshot of a device's properties, fetched once per
+ * cl_device_id.  see device_::info() */
+struct device_info {
+#define DEVICE_INFO_FIELD(name, cl_name, type) type name;
+  CL_WRAPPER_DEVICE_INFO(DEVICE_INFO_FIELD)
+#undef DEVICE_INFO_FIELD
+};
+
+namespace detail {
+
+/** \brief process-wide cache of device_info, one entry per device id.
+ * entries for root devices are never freed.  a sub-device's entry lives
+ * while some sub_device_ holds its id, since the driver may hand the id
+ * out again for a different device once the last reference is released;
+ * sub-devices no sub_device_ holds get a snapshot that is not cached.
+ * snapshots are shared, so ones handed out outlive their entry */
+template<typename DT>
+class device_info_registry {
+public:
+  static std::shared_ptr<const device_info> get(const DT &d) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      typename map_type::const_iterator i = infos_.find(d.id());
+      if(i != infos_.end() && i->second.info) return i->second.info;
+    }
+    // query outside the lock; a racing thread's snapshot wins on insert
+    std::shared_ptr<device_info> info = std::make_shared<device_info>();
+#define DEVICE_INFO_QUERY(name, cl_name, type) \
+    info->name = d.template query<type>(cl_name);
+    CL_WRAPPER_DEVICE_INFO(DEVICE_INFO_QUERY)
+#undef DEVICE_INFO_QUERY
+    const bool root = is_root_(d.id());
+    std::lock_guard<std::mutex> lock(mutex_);
+    typename map_type::iterator i = infos_.find(d.id());
+    if(i == infos_.end()) {
+      if(!root) return info;
+      i = infos_.insert(std::make_pair(d.id(), entry())).first;
+    }
+    if(!i->second.info) i->second.info = info;
+    return i->second.info;
+  }
+
+  /** \brief a sub_device_ took a reference to id */
+  static void hold(cl_device_id id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++infos_[id].holders;
+  }
+
+  /** \brief a sub_device_ is about to release its reference to id; the
+   * last one drops the snapshot */
+  static void release(cl_device_id id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    typename map_type::iterator i = infos_.find(id);
+    if(i == infos_.end()) return;
+    if(i->second.holders && --i->second.holders) return;
+    infos_.erase(i);
+  }
+
+  /** \brief number of devices with a snapshot or a holder */
+  static size_t size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return infos_.size();
+  }
+
+private:
+  struct entry {
+    entry() : holders(0) { }
+    std::shared_ptr<const device_info> info;
+    size_t holders;
+  };
+
+  static bool is_root_(cl_device_id id) {
+#ifdef CL_VERSION_1_2
+    // before OpenCL 1.2 the query fails and every device is a root
+    cl_device_id parent = NULL;
+    cl_int err = clGetDeviceInfo(id, CL_DEVICE_PARENT_DEVICE,
+        sizeof(parent), &parent, NULL);
+    return err != CL_SUCCESS || !parent;
+#else
+    (void)id;
+    return true;
+#endif
+  }
+  typedef std::map<cl_device_id, entry> map_type;
+  static std::mutex mutex_;
+  static map_type infos_;
+};
+template<typename DT> std::mutex device_info_registry<DT>::mutex_;
+template<typename DT> typename device_info_registry<DT>::map_type
+    device_info_registry<DT>::infos_;
+
+}
+
 /** \brief opencl device management class.  get a list of all the
  * devices available for a platform using the platform.devices() member
- * function. */
+ * function.  property accessors read from a snapshot shared by every
+ * device_ with the same id (see info()); available() and query() always
+ * ask the driver. */
+template<int UNUSED> class sub_device_;
+
 template<int UNUSED>
 class device_ {
 public:
@@ -353,111 +668,172 @@ public:
   device_(cl_device_id id)
       : id_(id) { }
   device_(const device_ &d)
-      : id_(d.id_) { }
+      : id_(d.id_), info_(std::atomic_load(&d.info_)) { }
 
-  device_& operator=(const device_ &d) { id_ = d.id_; return *this; }
+  device_& operator=(const device_ &d) {
+    id_ = d.id_;
+    std::atomic_store(&info_, std::atomic_load(&d.info_));
+    return *this;
+  }
   bool operator==(const device_ &d) { return id_ == d.id_; }
 
+  /** \brief returns the property snapshot for this device, fetching it
+   * on first use.  the snapshot stays valid while this device_ does */
+  const device_info& info() const {
+    std::shared_ptr<const device_info> i = std::atomic_load(&info_);
+    if(!i) {
+      i = detail::device_info_registry<device_>::get(*this);
+      std::shared_ptr<const device_info> expected;
+      if(!std::atomic_compare_exchange_strong(&info_, &expected, i)) {
+        i = expected;
+      }
+    }
+    return *i;
+  }
+
+  /** \brief queries a property from the driver on every call */
+  template<typename T>
+  T query(cl_device_info cl_name) const {
+    return detail::device_property_functor<device_, T>()(*this, cl_name);
+  }
+
 #define DEVICE_PROPERTY(name, cl_name, type) \
-  type name() const { \
-    return detail::device_property_functor<device_<0>, type >()(*this, \
-        cl_name); \
+  const type& name() const { \
+    return info().name; \
   }
-  DEVICE_PROPERTY(address_bits, CL_DEVICE_ADDRESS_BITS, cl_uint);
-  DEVICE_PROPERTY(available, CL_DEVICE_AVAILABLE, bool);
-  DEVICE_PROPERTY(compiler_available, CL_DEVICE_COMPILER_AVAILABLE,
-      bool);
-  // CL_DEVICE_DOUBLE_FP_CONFIG
-  DEVICE_PROPERTY(endian_little, CL_DEVICE_ENDIAN_LITTLE, bool);
-  DEVICE_PROPERTY(error_correction_support,
-      CL_DEVICE_ERROR_CORRECTION_SUPPORT, bool);
-  DEVICE_PROPERTY(execution_capabilities,
-      CL_DEVICE_EXECUTION_CAPABILITIES, cl_device_exec_capabilities);
-  DEVICE_PROPERTY(extensions, CL_DEVICE_EXTENSIONS, std::string);
-  DEVICE_PROPERTY(global_mem_cache_size,
-      CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, cl_ulong);
-  DEVICE_PROPERTY(global_mem_cache_type,
-      CL_DEVICE_GLOBAL_MEM_CACHE_TYPE, cl_device_mem_cache_type);
-  DEVICE_PROPERTY(global_mem_cacheline_size,
-      CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE, cl_uint);
-  DEVICE_PROPERTY(global_mem_size, CL_DEVICE_GLOBAL_MEM_SIZE, cl_ulong);
-  // CL_DEVICE_HALF_FP_CONFIG
-  DEVICE_PROPERTY(image_support, CL_DEVICE_IMAGE_SUPPORT, bool);
-  DEVICE_PROPERTY(image2d_max_height, CL_DEVICE_IMAGE2D_MAX_HEIGHT,
-      size_t);
-  DEVICE_PROPERTY(image2d_max_width, CL_DEVICE_IMAGE2D_MAX_WIDTH,
-      size_t);
-  DEVICE_PROPERTY(image3d_max_depth, CL_DEVICE_IMAGE3D_MAX_DEPTH,
-      size_t);
-  DEVICE_PROPERTY(image3d_max_height, CL_DEVICE_IMAGE3D_MAX_HEIGHT,
-      size_t);
-  DEVICE_PROPERTY(image3d_max_width, CL_DEVICE_IMAGE3D_MAX_WIDTH,
-      size_t);
-  DEVICE_PROPERTY(local_mem_size, CL_DEVICE_LOCAL_MEM_SIZE, cl_ulong);
-  // CL_DEVICE_LOCAL_MEM_TYPE
-  DEVICE_PROPERTY(max_clock_frequency, CL_DEVICE_MAX_CLOCK_FREQUENCY,
-      cl_uint);
-  DEVICE_PROPERTY(max_compute_units, CL_DEVICE_MAX_COMPUTE_UNITS,
-      cl_uint);
-  DEVICE_PROPERTY(max_constant_args, CL_DEVICE_MAX_CONSTANT_ARGS,
-      cl_uint);
-  DEVICE_PROPERTY(max_constant_buffer_size,
-      CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, cl_ulong);
-  DEVICE_PROPERTY(max_mem_alloc_size, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
-      cl_ulong);
-  DEVICE_PROPERTY(max_parameter_size, CL_DEVICE_MAX_PARAMETER_SIZE,
-      size_t);
-  DEVICE_PROPERTY(max_read_image_args, CL_DEVICE_MAX_READ_IMAGE_ARGS,
-      cl_uint);
-  DEVICE_PROPERTY(max_samplers, CL_DEVICE_MAX_SAMPLERS, cl_uint);
-  DEVICE_PROPERTY(max_work_group_size, CL_DEVICE_MAX_WORK_GROUP_SIZE,
-      size_t);
-  DEVICE_PROPERTY(max_work_item_dimensions,
-      CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, cl_uint);
-  DEVICE_PROPERTY(max_work_item_sizes, CL_DEVICE_MAX_WORK_ITEM_SIZES,
-      std::vector<size_t>);
-  DEVICE_PROPERTY(max_write_image_args, CL_DEVICE_MAX_WRITE_IMAGE_ARGS,
-      cl_uint);
-  DEVICE_PROPERTY(mem_base_addr_align, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
-      cl_uint);
-  DEVICE_PROPERTY(min_data_type_align_size,
-      CL_DEVICE_MIN_DATA_TYPE_ALIGN_SIZE, cl_uint);
-  DEVICE_PROPERTY(name, CL_DEVICE_NAME, std::string);
-  DEVICE_PROPERTY(platform, CL_DEVICE_PLATFORM, cl_platform_id);
-  DEVICE_PROPERTY(preferred_vector_width_char,
-      CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR, cl_uint);
-  DEVICE_PROPERTY(preferred_vector_width_short,
-      CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT, cl_uint);
-  DEVICE_PROPERTY(preferred_vector_width_int,
-      CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, cl_uint);
-  DEVICE_PROPERTY(preferred_vector_width_long,
-      CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG, cl_uint);
-  DEVICE_PROPERTY(preferred_vector_width_float,
-      CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, cl_uint);
-  DEVICE_PROPERTY(preferred_vector_width_double,
-      CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE, cl_uint);
-  DEVICE_PROPERTY(profile, CL_DEVICE_PROFILE, std::string);
-  DEVICE_PROPERTY(profiling_timer_resolution,
-      CL_DEVICE_PROFILING_TIMER_RESOLUTION, size_t);
-  DEVICE_PROPERTY(queue_properties, CL_DEVICE_QUEUE_PROPERTIES,
-      cl_command_queue_properties);
-  DEVICE_PROPERTY(single_fp_config, CL_DEVICE_SINGLE_FP_CONFIG,
-      cl_device_fp_config);
-  DEVICE_PROPERTY(type, CL_DEVICE_TYPE, cl_device_type);
-  DEVICE_PROPERTY(vendor, CL_DEVICE_VENDOR, std::string);
-  DEVICE_PROPERTY(vendor_id, CL_DEVICE_VENDOR_ID, cl_uint);
-  DEVICE_PROPERTY(version, CL_DEVICE_VERSION, std::string);
-  DEVICE_PROPERTY(driver_version, CL_DRIVER_VERSION, std::string);
+  CL_WRAPPER_DEVICE_INFO(DEVICE_PROPERTY)
 #undef DEVICE_PROPERTY
+  /* CL_DEVICE_DOUBLE_FP_CONFIG, CL_DEVICE_HALF_FP_CONFIG and
+   * CL_DEVICE_LOCAL_MEM_TYPE are not wrapped yet */
+
+  /** \brief not cached; a device can become unavailable at any time */
+  bool available() const {
+    return query<bool>(CL_DEVICE_AVAILABLE);
+  }
 
   operator cl_device_id() const { return id_; }
   cl_device_id id() const { return id_; }
 
+#ifdef CL_VERSION_1_2
+  /** \brief splits this device into as many sub-devices of units compute
+   * units each as fit */
+  std::vector<sub_device_<UNUSED> > partition_equally(cl_uint units) const {
+    const cl_device_partition_property props[] = {
+      CL_DEVICE_PARTITION_EQUALLY,
+      static_cast<cl_device_partition_property>(units), 0 };
+    return partition_(props);
+  }
+
+  /** \brief splits this device into one sub-device per entry of counts,
+   * with that many compute units */
+  std::vector<sub_device_<UNUSED> > partition_by_counts(
+      const std::vector<cl_uint> &counts) const {
+    std::vector<cl_device_partition_property> props;
+    props.push_back(CL_DEVICE_PARTITION_BY_COUNTS);
+    for(size_t i=0; i<counts.size(); ++i) {
+      props.push_back(static_cast<cl_device_partition_property>(counts[i]));
+    }
+    props.push_back(CL_DEVICE_PARTITION_BY_COUNTS_LIST_END);
+    props.push_back(0);
+    return partition_(&props[0]);
+  }
+
+  /** \brief splits this device along a cache or memory boundary, e.g.
+   * CL_DEVICE_AFFINITY_DOMAIN_NUMA, CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE or
+   * CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE */
+  std::vector<sub_device_<UNUSED> > partition_by_affinity_domain(
+      cl_device_affinity_domain domain) const {
+    const cl_device_partition_property props[] = {
+      CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+      static_cast<cl_device_partition_property>(domain), 0 };
+    return partition_(props);
+  }
+#endif
+
 protected:
+#ifdef CL_VERSION_1_2
+  std::vector<sub_device_<UNUSED> > partition_(
+      const cl_device_partition_property *props) const {
+    cl_uint n = 0;
+    cl_int err = clCreateSubDevices(id_, props, 0, NULL, &n);
+    if(err != CL_SUCCESS) throw cl_error(err);
+    std::vector<cl_device_id> ids(n);
+    err = clCreateSubDevices(id_, props, n, n ? &ids[0] : NULL, NULL);
+    if(err != CL_SUCCESS) throw cl_error(err);
+    return std::vector<sub_device_<UNUSED> >(ids.begin(), ids.end());
+  }
+#endif
+
   cl_device_id id_;
+  mutable std::shared_ptr<const device_info> info_;
 };
 typedef device_<0> device;
 
+#ifdef CL_VERSION_1_2
+/** \brief a device created by partitioning another.  unlike root
+ * devices, sub-devices are reference counted, so this holds a reference
+ * and releases it when destroyed.  its property snapshot is cached while
+ * some sub_device_ holds the id; plain device copies keep the snapshot
+ * they already fetched */
+template<int UNUSED>
+class sub_device_ : public device_<UNUSED> {
+public:
+  sub_device_() { }
+  /** \brief takes over a reference to id */
+  sub_device_(cl_device_id id)
+      : device_<UNUSED>(id) {
+    if(this->id_) registry::hold(this->id_);
+  }
+  sub_device_(const sub_device_ &d)
+      : device_<UNUSED>(d) {
+    if(!this->id_) return;
+    registry::hold(this->id_);
+    clRetainDevice(this->id_);
+  }
+  sub_device_(sub_device_ &&d) noexcept
+      : device_<UNUSED>(d) {
+    d.id_ = NULL;
+  }
+  ~sub_device_() {
+    release_();
+  }
+
+  sub_device_& operator=(const sub_device_ &d) {
+    if(d.id_) {
+      registry::hold(d.id_);
+      clRetainDevice(d.id_);
+    }
+    release_();
+    device_<UNUSED>::operator=(d);
+    return *this;
+  }
+  sub_device_& operator=(sub_device_ &&d) noexcept {
+    if(this == &d) return *this;
+    release_();
+    device_<UNUSED>::operator=(d);
+    d.id_ = NULL;
+    return *this;
+  }
+
+  /** \brief the device this one was partitioned from */
+  device_<UNUSED> parent() const {
+    return device_<UNUSED>(this->template query<cl_device_id>(
+          CL_DEVICE_PARENT_DEVICE));
+  }
+
+private:
+  typedef detail::device_info_registry<device_<UNUSED> > registry;
+
+  void release_() {
+    if(!this->id_) return;
+    registry::release(this->id_);
+    clReleaseDevice(this->id_);
+    this->id_ = NULL;
+  }
+};
+typedef sub_device_<0> sub_device;
+#endif
+
 /** \brief opencl platform management class.  get a list of all
  * available platforms using the static member platform::platforms() */
 template<int UNUSED>
@@ -486,33 +862,60 @@ public:
   PLATFORM_PROPERTY(extensions, CL_PLATFORM_EXTENSIONS, std::string);
 #undef PLATFORM_PROPERTY
 
+  /** \brief returns this platform's devices of the given type.  the
+   * lists are enumerated once along with platforms() and shared until
+   * refresh(); throws CL_DEVICE_NOT_FOUND if there are none, like
+   * clGetDeviceIDs */
   std::vector<device> devices(cl_device_type type = CL_DEVICE_TYPE_ALL) 
       const {
+    const registry_ *r = registry_acquire_();
+    for(size_t i=0; i<r->platforms.size(); ++i) {
+      if(r->platforms[i].id_ != id_) continue;
+      const type_map_ &cached = r->devices[i];
+      typename type_map_::const_iterator t = cached.find(type);
+      std::vector<device> to_return;
+      if(t != cached.end()) {
+        to_return = t->second;
+      } else {
+        const std::vector<device> &all =
+          cached.find(CL_DEVICE_TYPE_ALL)->second;
+        for(size_t j=0; j<all.size(); ++j) {
+          if(all[j].type() & type) to_return.push_back(all[j]);
+        }
+      }
+      if(to_return.empty()) throw cl_error(CL_DEVICE_NOT_FOUND);
+      return to_return;
+    }
+    return query_devices(type);
+  }
+
+  /** \brief asks the driver for this platform's devices, bypassing the
+   * shared lists used by devices() */
+  std::vector<device> query_devices(cl_device_type type =
+      CL_DEVICE_TYPE_ALL) const {
     cl_int err;
     cl_uint num_devices;
     err = clGetDeviceIDs(id_, type, 0, NULL, &num_devices);
     CHECK_CL_ERROR(err);
-    std::vector<device> to_return(num_devices);
-    err = clGetDeviceIDs(id_, type, num_devices,
-        reinterpret_cast<cl_device_id*>(&to_return[0]), NULL);
+    std::vector<cl_device_id> ids(num_devices);
+    err = clGetDeviceIDs(id_, type, num_devices, &ids[0], NULL);
     CHECK_CL_ERROR(err);
-    return to_return;
+    return std::vector<device>(ids.begin(), ids.end());
   }
 
-  /** \brief returns a reference to a list of all platforms available */
+  /** \brief returns a reference to a list of all platforms available.
+   * the first call enumerates platforms and their devices; afterwards
+   * this is a single atomic load.  safe to call from any thread */
   static const std::vector<platform_>& platforms() {
-    if(!platforms_built_) {
-      cl_int err;
-      cl_uint num_platforms;
-      err = clGetPlatformIDs(0, NULL, &num_platforms);
-      CHECK_CL_ERROR(err);
-      platforms_.resize(num_platforms);
-      err = clGetPlatformIDs(num_platforms,
-          reinterpret_cast<cl_platform_id*>(&platforms_[0]), NULL);
-      CHECK_CL_ERROR(err);
-      platforms_built_ = true;
-    }
-    return platforms_;
+    return registry_acquire_()->platforms;
+  }
+
+  /** \brief enumerates platforms and devices again and returns the new
+   * list.  references returned by earlier platforms() calls remain valid
+   * but keep describing the old enumeration */
+  static const std::vector<platform_>& refresh() {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    return publish_registry_()->platforms;
   }
 
   /** \brief automatically convert to CL type */
@@ -528,12 +931,78 @@ protected:
   cl_platform_id id_;
 
 private:
-  static bool platforms_built_;
-  static std::vector<platform_> platforms_;
+  typedef std::map<cl_device_type, std::vector<device> > type_map_;
+
+  /** \brief one enumeration of every platform, plus each platform's
+   * devices for the standard device types */
+  struct registry_ {
+    std::vector<platform_> platforms;
+    std::vector<type_map_> devices;
+  };
+
+  static const registry_* registry_acquire_() {
+    const registry_ *r = current_.load(std::memory_order_acquire);
+    if(r) return r;
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    r = current_.load(std::memory_order_relaxed);
+    return r ? r : publish_registry_();
+  }
+
+  /** \brief caller must hold registry_mutex_ */
+  static const registry_* publish_registry_() {
+    cl_int err;
+    cl_uint num_platforms;
+    err = clGetPlatformIDs(0, NULL, &num_platforms);
+    // the ICD loader reports "no platforms installed" as
+    // CL_PLATFORM_NOT_FOUND_KHR; publish an empty list for it
+    if(err == -1001) num_platforms = 0;
+    else CHECK_CL_ERROR(err);
+    std::vector<cl_platform_id> ids(num_platforms);
+    if(num_platforms) {
+      err = clGetPlatformIDs(num_platforms, &ids[0], NULL);
+      CHECK_CL_ERROR(err);
+    }
+
+    static const cl_device_type types[] = { CL_DEVICE_TYPE_ALL,
+      CL_DEVICE_TYPE_DEFAULT, CL_DEVICE_TYPE_CPU, CL_DEVICE_TYPE_GPU,
+      CL_DEVICE_TYPE_ACCELERATOR };
+    std::unique_ptr<registry_> r(new registry_);
+    r->platforms.assign(ids.begin(), ids.end());
+    r->devices.resize(num_platforms);
+    for(cl_uint i=0; i<num_platforms; ++i) {
+      for(size_t t=0; t<sizeof(types)/sizeof(types[0]); ++t) {
+        cl_uint num_devices = 0;
+        err = clGetDeviceIDs(ids[i], types[t], 0, NULL, &num_devices);
+        if(err == CL_DEVICE_NOT_FOUND) num_devices = 0;
+        else CHECK_CL_ERROR(err);
+        std::vector<cl_device_id> dev_ids(num_devices);
+        if(num_devices) {
+          err = clGetDeviceIDs(ids[i], types[t], num_devices, &dev_ids[0],
+              NULL);
+          CHECK_CL_ERROR(err);
+        }
+        r->devices[i][types[t]].assign(dev_ids.begin(), dev_ids.end());
+      }
+    }
+
+    const registry_ *published = r.get();
+    registries_.push_back(std::move(r));
+    current_.store(published, std::memory_order_release);
+    return published;
+  }
+
+  static std::atomic<const registry_*> current_;
+  static std::mutex registry_mutex_;
+  /** every registry ever published; never freed so that references
+   * from platforms() outlive refresh() */
+  static std::vector<std::unique_ptr<registry_> > registries_;
 };
-template<int UNUSED> bool platform_<UNUSED>::platforms_built_ = false;
-template<int UNUSED> std::vector<platform_<UNUSED> > 
-    platform_<UNUSED>::platforms_;
+template<int UNUSED> std::atomic<const typename platform_<UNUSED>::registry_*>
+    platform_<UNUSED>::current_(NULL);
+template<int UNUSED> std::mutex platform_<UNUSED>::registry_mutex_;
+template<int UNUSED>
+std::vector<std::unique_ptr<typename platform_<UNUSED>::registry_> >
+    platform_<UNUSED>::registries_;
 typedef platform_<0> platform;
 
 /** \brief OpenCL context wrapper */
@@ -547,6 +1016,9 @@ public:
   context_(const context_ &cl) 
       : cl_wrapper<cl_context>(cl) { }
   /** \brief standard ctors; see cl_wrapper<> */
+  context_(context_ &&cl) noexcept
+      : cl_wrapper<cl_context>(std::move(cl)) { }
+  /** \brief standard ctors; see cl_wrapper<> */
   context_(cl_context c)
       : cl_wrapper<cl_context>(c) { }
   /** \brief create a new context */
@@ -558,23 +1030,42 @@ public:
       CL_CONTEXT_PLATFORM, 
       (cl_context_properties)platform.id(), 
       (cl_context_properties)0 };
-    c = clCreateContext(props, num_devices, 
-        reinterpret_cast<const cl_device_id*>(&devices[0]),
-        NULL, NULL, &err);
+    std::vector<cl_device_id> ids(devices, devices + num_devices);
+    c = clCreateContext(props, num_devices, &ids[0], NULL, NULL, &err);
     CHECK_CL_ERROR(err);
     ref_ = c;
   }
 
+  context_& operator=(const context_ &cl) {
+    cl_wrapper<cl_context>::operator=(cl);
+    return *this;
+  }
+  context_& operator=(context_ &&cl) noexcept {
+    cl_wrapper<cl_context>::operator=(std::move(cl));
+    return *this;
+  }
+
 #define CONTEXT_PROPERTY(name, cl_name, type) \
   type name() const { \
     return detail::context_property_functor<context_<0>, type>()(*this,\
         cl_name); \
   }
-  // CL_CONTEXT_DEVICE
   // CL_CONTEXT_PROPERTIES
   CONTEXT_PROPERTY(reference_count, CL_CONTEXT_REFERENCE_COUNT,
       cl_uint);
 #undef CONTEXT_PROPERTY
+
+  /** \brief returns the devices associated with this context */
+  std::vector<device> devices() const {
+    cl_int err;
+    size_t size;
+    err = clGetContextInfo(ref_, CL_CONTEXT_DEVICES, 0, NULL, &size);
+    CHECK_CL_ERROR(err);
+    std::vector<cl_device_id> ids(size / sizeof(cl_device_id));
+    err = clGetContextInfo(ref_, CL_CONTEXT_DEVICES, size, &ids[0], NULL);
+    CHECK_CL_ERROR(err);
+    return std::vector<device>(ids.begin(), ids.end());
+  }
 };
 typedef context_<0> context;
 
@@ -589,6 +1080,9 @@ public:
   buffer_(const buffer_ &b)
       : cl_wrapper<cl_mem>(b) { }
   /** \brief standard ctors; see cl_wrapper<> */
+  buffer_(buffer_ &&b) noexcept
+      : cl_wrapper<cl_mem>(std::move(b)) { }
+  /** \brief standard ctors; see cl_wrapper<> */
   buffer_(cl_mem m)
       : cl_wrapper<cl_mem>(m) { }
   /** \brief create a new opencl buffer */
@@ -601,84 +1095,427 @@ public:
     CHECK_CL_ERROR(err);
     ref_ = m;
   }
-};
-typedef buffer_<0> buffer;
 
-/** \brief OpenCL 2d image wrapper */
-template<int UNUSED>
-class image2d_ : public cl_wrapper<cl_mem> {
-public:
-  /** \brief standard ctors; see cl_wrapper<> */
-  image2d_()
-      : cl_wrapper<cl_mem>() { }
-  /** \brief standard ctors; see cl_wrapper<> */
-  image2d_(const image2d_ &i)
-      : cl_wrapper<cl_mem>(i) { }
-  /** \brief standard ctors; see cl_wrapper<> */
-  image2d_(cl_mem m)
-      : cl_wrapper<cl_mem>(m) { }
-  /** \brief create a new image2d object */
-  image2d_(const context &context, cl_mem_flags flags,
-      cl_channel_order channel_order,
-      cl_channel_type channel_type,
-      size_t width,
-      size_t height,
-      void *user_data = NULL,
-      size_t pitch = 0)
-      : cl_wrapper<cl_mem>() {
-    cl_int err;
-    cl_image_format format = { channel_order, channel_type };
-    cl_mem i = clCreateImage2D(context.id(),
-        flags,
-        &format,
-        width,
-        height,
-        pitch,
-        user_data,
-        &err);
-    CHECK_CL_ERROR(err);
-    ref_ = i;
+  buffer_& operator=(const buffer_ &b) {
+    cl_wrapper<cl_mem>::operator=(b);
+    return *this;
+  }
+  buffer_& operator=(buffer_ &&b) noexcept {
+    cl_wrapper<cl_mem>::operator=(std::move(b));
+    return *this;
   }
-};
-typedef image2d_<0> image2d;
 
-/** \brief OpenCL 3d image wrapper */
-template<int UNUSED>
-class image3d_ : public cl_wrapper<cl_mem> {
-public:
-  /** \brief standard ctors; see cl_wrapper<> */
-  image3d_() : cl_wrapper<cl_mem>() { }
-  /** \brief standard ctors; see cl_wrapper<> */
-  image3d_(const image3d_ &i) : cl_wrapper<cl_mem>(i) { }
-  /** \brief standard ctors; see cl_wrapper<> */
-  image3d_(cl_mem m) : cl_wrapper<cl_mem>(m) { }
-  /** \brief create a new 3d image */
-  image3d_(const context &context, cl_mem_flags flags,
-      cl_channel_order channel_order,
-      cl_channel_type channel_type,
-      size_t width,
-      size_t height,
-      size_t depth,
-      void *user_data = NULL,
-      size_t row_pitch = 0,
-      size_t slice_pitch = 0)
-      : cl_wrapper<cl_mem>() {
+#define BUFFER_PROPERTY(name, cl_name, type) \
+  type name() const { \
+    return detail::mem_property_functor<buffer_<0>, type>()(*this, \
+        cl_name); \
+  }
+  BUFFER_PROPERTY(size, CL_MEM_SIZE, size_t);
+  BUFFER_PROPERTY(flags, CL_MEM_FLAGS, cl_mem_flags);
+  BUFFER_PROPERTY(offset, CL_MEM_OFFSET, size_t);
+#undef BUFFER_PROPERTY
+
+  /** \brief creates a buffer aliasing size bytes of this one starting at
+   * origin, which must be a multiple of the device's mem_base_addr_align
+   * (in bytes) */
+  buffer_ sub_buffer(cl_mem_flags flags, size_t origin, size_t size)
+      const {
     cl_int err;
-    cl_image_format format = { channel_order, channel_type };
-    cl_mem i = clCreateImage3D(context.id(),
-        flags,
-        &format,
-        width, height, depth,
-        row_pitch, slice_pitch,
-        user_data, &err);
+    cl_buffer_region region = { origin, size };
+    cl_mem m = clCreateSubBuffer(ref_, flags, CL_BUFFER_CREATE_TYPE_REGION,
+        &region, &err);
     CHECK_CL_ERROR(err);
-    ref_ = i;
+    return buffer_(m);
   }
 };
-typedef image3d_<0> image3d;
+typedef buffer_<0> buffer;
 
-/** \brief wrapper for OpenCL kernels.  get them from program objects
- * with .get_kernel() */
+/** \brief counters reported by buffer_pool::stats() */
+struct buffer_pool_stats {
+  /** \brief allocate() calls */
+  cl_ulong allocations;
+  /** \brief allocate() calls served from a free list */
+  cl_ulong reuses;
+  /** \brief live bytes, as requested by callers */
+  cl_ulong bytes_requested;
+  /** \brief live bytes, after rounding up to size classes */
+  cl_ulong bytes_in_use;
+  /** \brief device memory held by the pool: slabs plus whole buffers */
+  cl_ulong bytes_reserved;
+  /** \brief largest bytes_in_use seen so far */
+  cl_ulong high_water_mark;
+
+  double reuse_rate() const {
+    return allocations ? double(reuses) / allocations : 0.0;
+  }
+  /** \brief fraction of reserved memory not backing a live request */
+  double fragmentation() const {
+    return bytes_reserved ? 1.0 - double(bytes_requested) / bytes_reserved
+      : 0.0;
+  }
+};
+
+namespace detail {
+
+/** \brief shared between a buffer_pool and its outstanding handles, so
+ * handles may outlive the pool */
+class buffer_pool_state {
+public:
+  buffer_pool_state(const context &ctx, double max_fraction,
+      size_t slab_size, size_t small_limit)
+      : ctx_(ctx), align_(1), cap_(0), slab_size_(slab_size),
+        small_limit_(small_limit) {
+    std::memset(&stats_, 0, sizeof(stats_));
+    std::vector<device> devices = ctx.devices();
+    cl_ulong mem = 0;
+    for(size_t i=0; i<devices.size(); ++i) {
+      // CL_DEVICE_MEM_BASE_ADDR_ALIGN is in bits
+      align_ = std::max<size_t>(align_, devices[i].mem_base_addr_align() / 8);
+      if(!mem || devices[i].global_mem_size() < mem) {
+        mem = devices[i].global_mem_size();
+      }
+    }
+    cap_ = static_cast<cl_ulong>(mem * max_fraction);
+    slab_size_ = round_up_(std::max(slab_size_, align_), align_);
+    if(small_limit_ > slab_size_) throw cl_error(CL_INVALID_VALUE);
+  }
+
+  /** \brief returns a buffer of at least size bytes; class_size receives
+   * the size class it belongs to */
+  buffer acquire(cl_mem_flags flags, size_t size, size_t &class_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    class_size = size_class_(size);
+    const key_ key(flags, class_size);
+    ++stats_.allocations;
+
+    buffer to_return;
+    std::vector<buffer> &free_list = free_[key];
+    if(!free_list.empty()) {
+      to_return = std::move(free_list.back());
+      free_list.pop_back();
+      ++stats_.reuses;
+    } else if(class_size <= small_limit_) {
+      to_return = carve_(key);
+    } else {
+      make_room_(class_size);
+      to_return = buffer(ctx_, flags, class_size);
+      stats_.bytes_reserved += class_size;
+    }
+
+    stats_.bytes_requested += size;
+    stats_.bytes_in_use += class_size;
+    stats_.high_water_mark = std::max(stats_.high_water_mark,
+        stats_.bytes_in_use);
+    return to_return;
+  }
+
+  void release(buffer &b, cl_mem_flags flags, size_t size,
+      size_t class_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_[key_(flags, class_size)].push_back(std::move(b));
+    stats_.bytes_requested -= size;
+    stats_.bytes_in_use -= class_size;
+  }
+
+  /** \brief releases cached whole buffers; slabs stay reserved */
+  void trim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    trim_();
+  }
+
+  buffer_pool_stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+  cl_ulong capacity() const { return cap_; }
+  size_t alignment() const { return align_; }
+
+private:
+  typedef std::pair<cl_mem_flags, size_t> key_;
+  typedef std::map<key_, std::vector<buffer> > free_map_;
+
+  struct cursor_ {
+    cursor_() : next(0) { }
+    buffer slab;
+    size_t next;
+  };
+
+  static size_t round_up_(size_t v, size_t m) {
+    return (v + m - 1) / m * m;
+  }
+
+  /** \brief small sizes round to a power of two no smaller than the
+   * alignment; large ones to a quarter-octave step, which wastes at
+   * most 25% */
+  size_t size_class_(size_t size) const {
+    size_t p = align_;
+    while(p < size) p <<= 1;
+    if(p <= small_limit_) return p;
+    return round_up_(size, std::max<size_t>(p / 8, 1));
+  }
+
+  /** \brief hands out the next class_size piece of the current slab for
+   * this key, starting a new slab when it is used up */
+  buffer carve_(const key_ &key) {
+    cursor_ &c = cursors_[key];
+    if(!c.slab.id() || c.next + key.second > slab_size_) {
+      make_room_(slab_size_);
+      c.slab = buffer(ctx_, key.first, slab_size_);
+      c.next = 0;
+      stats_.bytes_reserved += slab_size_;
+    }
+    cl_int err;
+    const cl_mem_flags access = key.first &
+      (CL_MEM_READ_WRITE | CL_MEM_READ_ONLY | CL_MEM_WRITE_ONLY);
+    cl_buffer_region region = { c.next, key.second };
+    cl_mem m = clCreateSubBuffer(c.slab.id(), access,
+        CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+    if(err != CL_SUCCESS) throw cl_error(err);
+    c.next += key.second;
+    return buffer(m);
+  }
+
+  /** \brief makes sure bytes more device memory fit under the cap,
+   * trimming the free lists if they would not.  callers count the bytes
+   * in bytes_reserved once the buffer exists */
+  void make_room_(size_t bytes) {
+    if(stats_.bytes_reserved + bytes > cap_) trim_();
+    if(stats_.bytes_reserved + bytes > cap_) {
+      throw cl_error(CL_MEM_OBJECT_ALLOCATION_FAILURE);
+    }
+  }
+
+  void trim_() {
+    for(free_map_::iterator i = free_.begin(); i != free_.end(); ++i) {
+      if(i->first.second <= small_limit_) continue;
+      stats_.bytes_reserved -= i->first.second * i->second.size();
+      i->second.clear();
+    }
+  }
+
+  mutable std::mutex mutex_;
+  const context ctx_;
+  size_t align_;
+  cl_ulong cap_;
+  size_t slab_size_;
+  const size_t small_limit_;
+  free_map_ free_;
+  std::map<key_, cursor_> cursors_;
+  buffer_pool_stats stats_;
+};
+
+}
+
+/** \brief a buffer on loan from a buffer_pool; converts to const
+ * buffer& so it can be passed to command_queue calls directly, and goes
+ * back to the pool when destroyed.  commands using it should be
+ * complete, or be on the same in-order queue as the next user */
+template<int UNUSED>
+class pooled_buffer_ {
+public:
+  pooled_buffer_()
+      : flags_(0), size_(0), class_size_(0) { }
+  pooled_buffer_(const std::shared_ptr<detail::buffer_pool_state> &pool,
+      cl_mem_flags flags, size_t size)
+      : pool_(pool), flags_(flags), size_(size), class_size_(0) {
+    buf_ = pool_->acquire(flags_, size_, class_size_);
+  }
+  pooled_buffer_(pooled_buffer_ &&p) noexcept
+      : pool_(std::move(p.pool_)), buf_(std::move(p.buf_)),
+        flags_(p.flags_), size_(p.size_), class_size_(p.class_size_) { }
+  ~pooled_buffer_() {
+    release();
+  }
+
+  pooled_buffer_& operator=(pooled_buffer_ &&p) noexcept {
+    if(this == &p) return *this;
+    release();
+    pool_ = std::move(p.pool_);
+    buf_ = std::move(p.buf_);
+    flags_ = p.flags_;
+    size_ = p.size_;
+    class_size_ = p.class_size_;
+    return *this;
+  }
+
+  /** \brief returns the buffer to the pool early */
+  void release() {
+    if(pool_ && buf_.id()) pool_->release(buf_, flags_, size_, class_size_);
+    pool_.reset();
+  }
+
+  const buffer& get() const { return buf_; }
+  operator const buffer&() const { return buf_; }
+  cl_mem id() const { return buf_.id(); }
+  /** \brief the size that was asked for; the buffer may be larger */
+  size_t size() const { return size_; }
+
+private:
+  pooled_buffer_(const pooled_buffer_&);
+  pooled_buffer_& operator=(const pooled_buffer_&);
+
+  std::shared_ptr<detail::buffer_pool_state> pool_;
+  buffer buf_;
+  cl_mem_flags flags_;
+  size_t size_;
+  size_t class_size_;
+};
+typedef pooled_buffer_<0> pooled_buffer;
+
+/** \brief recycles device buffers for one context.  freed buffers are
+ * kept on per-(flags, size class) free lists; requests up to small_limit
+ * bytes are carved out of slab_size slabs with clCreateSubBuffer at the
+ * devices' mem_base_addr_align.  the pool holds at most max_fraction of
+ * the smallest device's global_mem_size, releasing cached whole buffers
+ * before it gives up with CL_MEM_OBJECT_ALLOCATION_FAILURE.  small_limit
+ * may not exceed slab_size (CL_INVALID_VALUE) */
+template<int UNUSED>
+class buffer_pool_ {
+public:
+  buffer_pool_(const context &ctx, double max_fraction = 0.5,
+      size_t slab_size = 4 << 20, size_t small_limit = 64 << 10)
+      : state_(std::make_shared<detail::buffer_pool_state>(ctx,
+            max_fraction, slab_size, small_limit)) { }
+
+  /** \brief returns a buffer of at least size bytes */
+  pooled_buffer allocate(cl_mem_flags flags, size_t size) {
+    return pooled_buffer(state_, flags, size);
+  }
+
+  /** \brief releases every cached buffer that is not carved from a
+   * slab */
+  void trim() { state_->trim(); }
+
+  buffer_pool_stats stats() const { return state_->stats(); }
+  /** \brief the most device memory the pool will hold */
+  cl_ulong capacity() const { return state_->capacity(); }
+  /** \brief sub-buffer alignment in bytes */
+  size_t alignment() const { return state_->alignment(); }
+
+private:
+  buffer_pool_(const buffer_pool_&);
+  buffer_pool_& operator=(const buffer_pool_&);
+
+  std::shared_ptr<detail::buffer_pool_state> state_;
+};
+typedef buffer_pool_<0> buffer_pool;
+
+/** \brief OpenCL 2d image wrapper */
+template<int UNUSED>
+class image2d_ : public cl_wrapper<cl_mem> {
+public:
+  /** \brief standard ctors; see cl_wrapper<> */
+  image2d_()
+      : cl_wrapper<cl_mem>() { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  image2d_(const image2d_ &i)
+      : cl_wrapper<cl_mem>(i) { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  image2d_(image2d_ &&i) noexcept
+      : cl_wrapper<cl_mem>(std::move(i)) { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  image2d_(cl_mem m)
+      : cl_wrapper<cl_mem>(m) { }
+  /** \brief create a new image2d object */
+  image2d_(const context &context, cl_mem_flags flags,
+      cl_channel_order channel_order,
+      cl_channel_type channel_type,
+      size_t width,
+      size_t height,
+      void *user_data = NULL,
+      size_t pitch = 0)
+      : cl_wrapper<cl_mem>() {
+    cl_int err;
+    cl_image_format format = { channel_order, channel_type };
+    cl_mem i = clCreateImage2D(context.id(),
+        flags,
+        &format,
+        width,
+        height,
+        pitch,
+        user_data,
+        &err);
+    CHECK_CL_ERROR(err);
+    ref_ = i;
+  }
+
+  image2d_& operator=(const image2d_ &i) {
+    cl_wrapper<cl_mem>::operator=(i);
+    return *this;
+  }
+  image2d_& operator=(image2d_ &&i) noexcept {
+    cl_wrapper<cl_mem>::operator=(std::move(i));
+    return *this;
+  }
+};
+typedef image2d_<0> image2d;
+
+/** \brief OpenCL 3d image wrapper */
+template<int UNUSED>
+class image3d_ : public cl_wrapper<cl_mem> {
+public:
+  /** \brief standard ctors; see cl_wrapper<> */
+  image3d_() : cl_wrapper<cl_mem>() { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  image3d_(const image3d_ &i) : cl_wrapper<cl_mem>(i) { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  image3d_(image3d_ &&i) noexcept : cl_wrapper<cl_mem>(std::move(i)) { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  image3d_(cl_mem m) : cl_wrapper<cl_mem>(m) { }
+  /** \brief create a new 3d image */
+  image3d_(const context &context, cl_mem_flags flags,
+      cl_channel_order channel_order,
+      cl_channel_type channel_type,
+      size_t width,
+      size_t height,
+      size_t depth,
+      void *user_data = NULL,
+      size_t row_pitch = 0,
+      size_t slice_pitch = 0)
+      : cl_wrapper<cl_mem>() {
+    cl_int err;
+    cl_image_format format = { channel_order, channel_type };
+    cl_mem i = clCreateImage3D(context.id(),
+        flags,
+        &format,
+        width, height, depth,
+        row_pitch, slice_pitch,
+        user_data, &err);
+    CHECK_CL_ERROR(err);
+    ref_ = i;
+  }
+
+  image3d_& operator=(const image3d_ &i) {
+    cl_wrapper<cl_mem>::operator=(i);
+    return *this;
+  }
+  image3d_& operator=(image3d_ &&i) noexcept {
+    cl_wrapper<cl_mem>::operator=(std::move(i));
+    return *this;
+  }
+};
+typedef image3d_<0> image3d;
+
+namespace detail {
+
+/** \brief receives the kernel arguments set on this thread while a
+ * command_graph is capturing */
+struct kernel_arg_sink {
+  virtual ~kernel_arg_sink() { }
+  virtual void set_arg(cl_kernel k, cl_uint index, size_t size,
+      const void *value) = 0;
+};
+
+inline kernel_arg_sink*& active_arg_sink() {
+  static thread_local kernel_arg_sink *sink = NULL;
+  return sink;
+}
+
+}
+
+/** \brief wrapper for OpenCL kernels.  get them from program objects
+ * with .get_kernel() */
 template<int UNUSED>
 class kernel_ : public cl_wrapper<cl_kernel> {
 public:
@@ -689,14 +1526,29 @@ public:
   kernel_(const kernel_ &k)
       : cl_wrapper<cl_kernel>(k) { }
   /** \brief standard ctors; see cl_wrapper<> */
+  kernel_(kernel_ &&k) noexcept
+      : cl_wrapper<cl_kernel>(std::move(k)) { }
+  /** \brief standard ctors; see cl_wrapper<> */
   kernel_(cl_kernel k)
       : cl_wrapper<cl_kernel>(k) { }
 
+  kernel_& operator=(const kernel_ &k) {
+    cl_wrapper<cl_kernel>::operator=(k);
+    return *this;
+  }
+  kernel_& operator=(kernel_ &&k) noexcept {
+    cl_wrapper<cl_kernel>::operator=(std::move(k));
+    return *this;
+  }
+
   template<typename T>
   kernel_& set_arg(cl_uint index, const T &value) {
     cl_int err;
     err = clSetKernelArg(ref_, index, sizeof(T), &value);
     CHECK_CL_ERROR(err);
+    if(detail::kernel_arg_sink *sink = detail::active_arg_sink()) {
+      sink->set_arg(ref_, index, sizeof(T), &value);
+    }
     return *this;
   }
 
@@ -704,11 +1556,144 @@ public:
     cl_int err;
     err = clSetKernelArg(ref_, index, bytes, NULL);
     CHECK_CL_ERROR(err);
+    if(detail::kernel_arg_sink *sink = detail::active_arg_sink()) {
+      sink->set_arg(ref_, index, bytes, NULL);
+    }
     return *this;
   }
+
+#define KERNEL_PROPERTY(name, cl_name, type) \
+  type name() const { \
+    return detail::kernel_property_functor<kernel_<0>, type>()(*this, \
+        cl_name); \
+  }
+  KERNEL_PROPERTY(function_name, CL_KERNEL_FUNCTION_NAME, std::string);
+  KERNEL_PROPERTY(num_args, CL_KERNEL_NUM_ARGS, cl_uint);
+#undef KERNEL_PROPERTY
+
+  /** \brief the largest work-group size this kernel can run with on d */
+  size_t work_group_size(const device &d) const {
+    return work_group_info_(d, CL_KERNEL_WORK_GROUP_SIZE);
+  }
+  /** \brief work-group sizes that are a multiple of this run best on d */
+  size_t preferred_work_group_size_multiple(const device &d) const {
+    return work_group_info_(d,
+        CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE);
+  }
+
+private:
+  size_t work_group_info_(const device &d,
+      cl_kernel_work_group_info name) const {
+    size_t to_return;
+    cl_int err = clGetKernelWorkGroupInfo(ref_, d.id(), name,
+        sizeof(to_return), &to_return, NULL);
+    CHECK_CL_ERROR(err);
+    return to_return;
+  }
 };
 typedef kernel_<0> kernel;
 
+/** \brief the outcome of building a program for one device */
+struct device_build {
+  device dev;
+  cl_build_status status;
+  std::string log;
+};
+
+/** \brief thrown when a program fails to build; carries the status and
+ * log of every device the build was for */
+template<int UNUSED>
+class build_error_ : public cl_error {
+public:
+  build_error_(const std::vector<device_build> &builds)
+      : cl_error(CL_BUILD_PROGRAM_FAILURE), builds_(builds) { }
+  ~build_error_() throw() { }
+
+  const std::vector<device_build>& builds() const { return builds_; }
+
+private:
+  std::vector<device_build> builds_;
+};
+typedef build_error_<0> build_error;
+
+namespace detail {
+
+/** \brief the build status and log of p for each of its devices */
+inline std::vector<device_build> build_results(cl_program p) {
+  cl_int err;
+  size_t size;
+  err = clGetProgramInfo(p, CL_PROGRAM_DEVICES, 0, NULL, &size);
+  if(err != CL_SUCCESS) throw cl_error(err);
+  std::vector<cl_device_id> ids(size / sizeof(cl_device_id));
+  err = clGetProgramInfo(p, CL_PROGRAM_DEVICES, size, &ids[0], NULL);
+  if(err != CL_SUCCESS) throw cl_error(err);
+
+  std::vector<device_build> to_return(ids.size());
+  for(size_t i = 0; i < ids.size(); ++i) {
+    device_build &b = to_return[i];
+    b.dev = device(ids[i]);
+    err = clGetProgramBuildInfo(p, ids[i], CL_PROGRAM_BUILD_STATUS,
+        sizeof(cl_build_status), &b.status, NULL);
+    if(err != CL_SUCCESS) throw cl_error(err);
+    size_t log_size = 0;
+    err = clGetProgramBuildInfo(p, ids[i], CL_PROGRAM_BUILD_LOG, 0, NULL,
+        &log_size);
+    if(err != CL_SUCCESS) throw cl_error(err);
+    b.log.resize(log_size);
+    if(log_size) {
+      err = clGetProgramBuildInfo(p, ids[i], CL_PROGRAM_BUILD_LOG,
+          log_size, &b.log[0], NULL);
+      if(err != CL_SUCCESS) throw cl_error(err);
+      b.log.resize(std::strlen(b.log.c_str()));
+    }
+  }
+  return to_return;
+}
+
+/** \brief an asynchronous build in flight; finish() runs once, from the
+ * driver's notify callback or from the thread that started the build */
+struct async_build {
+  async_build(cl_program p)
+      : program(p), done(false) {
+    clRetainProgram(p);
+  }
+  ~async_build() {
+    clReleaseProgram(program);
+  }
+
+  void finish() {
+    if(done.exchange(true)) return;
+    try {
+      std::vector<device_build> builds = build_results(program);
+      for(size_t i = 0; i < builds.size(); ++i) {
+        if(builds[i].status != CL_BUILD_SUCCESS) {
+          throw build_error(builds);
+        }
+      }
+      result.set_value(builds);
+    } catch(...) {
+      result.set_exception(std::current_exception());
+    }
+  }
+
+  void fail(cl_int err) {
+    if(done.exchange(true)) return;
+    result.set_exception(std::make_exception_ptr(cl_error(err)));
+  }
+
+  static void CL_CALLBACK notify(cl_program, void *user_data) {
+    std::unique_ptr<std::shared_ptr<async_build> > self(
+        static_cast<std::shared_ptr<async_build>*>(user_data));
+    (*self)->finish();
+  }
+
+  cl_program program;
+  std::atomic<bool> done;
+  std::promise<std::vector<device_build> > result;
+};
+
+}
+
 /** \brief wrapper for OpenCL program objects.  currently only supports
  * programs for all devices in a context built from source */
 template<int UNUSED>
@@ -719,6 +1704,8 @@ public:
   /** \brief standard ctors; see cl_wrapper<> */
   program_(const program_ &p) : cl_wrapper<cl_program>(p) { }
   /** \brief standard ctors; see cl_wrapper<> */
+  program_(program_ &&p) noexcept : cl_wrapper<cl_program>(std::move(p)) { }
+  /** \brief standard ctors; see cl_wrapper<> */
   program_(cl_program p) : cl_wrapper<cl_program>(p) { }
   /** \brief create program from source code */
   program_(const context &ctx, const std::string &source)
@@ -731,8 +1718,7 @@ public:
     ref_ = p;
   }
   /** \brief create program from source code and build immediately.
-   * n.b. this prevents you from getting to the error log if something
-   * goes wrong because the ctor will throw an exception */
+   * on failure the logs travel in the build_error that is thrown */
   program_(const context &ctx, const std::string &source, const
       std::string &opts) {
     cl_int err;
@@ -744,14 +1730,119 @@ public:
     build(opts);
   }
 
+  program_& operator=(const program_ &p) {
+    cl_wrapper<cl_program>::operator=(p);
+    return *this;
+  }
+  program_& operator=(program_ &&p) noexcept {
+    cl_wrapper<cl_program>::operator=(std::move(p));
+    return *this;
+  }
+
   /** \brief compile this program for all devices associated with this
-   * program's context */
+   * program's context.  throws build_error, with every device's log, if
+   * the build fails */
   void build(const std::string &opts = "") {
     cl_int err;
     err = clBuildProgram(ref_, 0, NULL, opts.c_str(), NULL, NULL);
+    if(err == CL_BUILD_PROGRAM_FAILURE) {
+      throw build_error(detail::build_results(ref_));
+    }
     CHECK_CL_ERROR(err);
   }
 
+  /** \brief starts compiling this program for all devices associated
+   * with this program's context and returns at once if the driver builds
+   * in the background.  the future yields every device's status and log,
+   * or throws build_error if any device failed.  the program must not be
+   * used for anything else until the future is ready */
+  std::future<std::vector<device_build> > build_async(
+      const std::string &opts = "") {
+    std::shared_ptr<detail::async_build> state =
+      std::make_shared<detail::async_build>(ref_);
+    std::future<std::vector<device_build> > to_return =
+      state->result.get_future();
+    std::unique_ptr<std::shared_ptr<detail::async_build> > holder(
+        new std::shared_ptr<detail::async_build>(state));
+    cl_int err = clBuildProgram(ref_, 0, NULL, opts.c_str(),
+        &detail::async_build::notify, holder.get());
+    if(err == CL_SUCCESS || err == CL_BUILD_PROGRAM_FAILURE) {
+      // the callback owns holder now.  a driver that built synchronously
+      // may not have called it yet, so report from here too
+      holder.release();
+      if(err == CL_BUILD_PROGRAM_FAILURE) state->finish();
+    } else {
+      state->fail(err);
+    }
+    return to_return;
+  }
+
+#ifdef CL_VERSION_1_2
+  /** \brief a named header for compile(), found by #include "name" */
+  typedef std::pair<std::string, program_> header;
+
+  /** \brief compiles this program into an object for all devices in its
+   * context without linking it; see link().  throws build_error, with
+   * every device's log, if compilation fails */
+  void compile(const std::string &opts = "",
+      const std::vector<header> &headers = std::vector<header>()) {
+    std::vector<cl_program> ids(headers.size());
+    std::vector<const char*> names(headers.size());
+    for(size_t i=0; i<headers.size(); ++i) {
+      ids[i] = headers[i].second.id();
+      names[i] = headers[i].first.c_str();
+    }
+    cl_int err;
+    err = clCompileProgram(ref_, 0, NULL, opts.c_str(), cl_uint(ids.size()),
+        ids.empty() ? NULL : &ids[0], names.empty() ? NULL : &names[0],
+        NULL, NULL);
+    if(err == CL_COMPILE_PROGRAM_FAILURE) {
+      throw build_error(detail::build_results(ref_));
+    }
+    CHECK_CL_ERROR(err);
+  }
+
+  /** \brief links compiled objects into an executable program for all
+   * devices in ctx.  throws build_error, with every device's log, if
+   * linking fails */
+  static program_ link(const context &ctx,
+      const std::vector<program_> &objects, const std::string &opts = "") {
+    std::vector<cl_program> ids(objects.begin(), objects.end());
+    cl_int err;
+    program_ p(clLinkProgram(ctx.id(), 0, NULL, opts.c_str(),
+          cl_uint(ids.size()), ids.empty() ? NULL : &ids[0], NULL, NULL,
+          &err));
+    if(err == CL_LINK_PROGRAM_FAILURE && p.id()) {
+      throw build_error(detail::build_results(p.id()));
+    }
+    CHECK_CL_ERROR(err);
+    return p;
+  }
+
+  /** \brief CL_PROGRAM_BINARY_TYPE for d */
+  cl_program_binary_type binary_type(const device &d) const {
+    cl_program_binary_type to_return;
+    cl_int err = clGetProgramBuildInfo(ref_, d.id(),
+        CL_PROGRAM_BINARY_TYPE, sizeof(to_return), &to_return, NULL);
+    CHECK_CL_ERROR(err);
+    return to_return;
+  }
+#endif
+
+  /** \brief the build status for d */
+  cl_build_status build_status(const device &d) const {
+    cl_build_status to_return;
+    cl_int err = clGetProgramBuildInfo(ref_, d.id(),
+        CL_PROGRAM_BUILD_STATUS, sizeof(to_return), &to_return, NULL);
+    CHECK_CL_ERROR(err);
+    return to_return;
+  }
+
+  /** \brief the build status and log of every device in devices() */
+  std::vector<device_build> build_results() const {
+    return detail::build_results(ref_);
+  }
+
   /** \brief returns the build log generated by compiling this program
    * */
   std::string build_log(const device &d) const {
@@ -768,239 +1859,5488 @@ public:
     return to_return;
   }
 
-  /** \brief returns a reference to a kernel contained in this program
-   * */
-  kernel get_kernel(const std::string &kname) const {
+  /** \brief returns the devices this program is associated with */
+  std::vector<device> devices() const {
     cl_int err;
-    cl_kernel k = clCreateKernel(ref_, kname.c_str(), &err);
+    size_t size;
+    err = clGetProgramInfo(ref_, CL_PROGRAM_DEVICES, 0, NULL, &size);
     CHECK_CL_ERROR(err);
-    kernel ker(k);
-    return ker;
+    std::vector<cl_device_id> ids(size / sizeof(cl_device_id));
+    err = clGetProgramInfo(ref_, CL_PROGRAM_DEVICES, size, &ids[0], NULL);
+    CHECK_CL_ERROR(err);
+    return std::vector<device>(ids.begin(), ids.end());
+  }
+
+  /** \brief returns the compiled binary for each device in devices(), in
+   * the same order.  a device with no binary gets an empty vector */
+  std::vector<std::vector<unsigned char> > binaries() const {
+    cl_int err;
+    size_t size;
+    err = clGetProgramInfo(ref_, CL_PROGRAM_BINARY_SIZES, 0, NULL, &size);
+    CHECK_CL_ERROR(err);
+    std::vector<size_t> sizes(size / sizeof(size_t));
+    err = clGetProgramInfo(ref_, CL_PROGRAM_BINARY_SIZES, size, &sizes[0],
+        NULL);
+    CHECK_CL_ERROR(err);
+    std::vector<std::vector<unsigned char> > to_return(sizes.size());
+    std::vector<unsigned char*> ptrs(sizes.size());
+    for(size_t i=0; i<sizes.size(); ++i) {
+      to_return[i].resize(sizes[i]);
+      ptrs[i] = sizes[i] ? &to_return[i][0] : NULL;
+    }
+    err = clGetProgramInfo(ref_, CL_PROGRAM_BINARIES,
+        ptrs.size() * sizeof(unsigned char*), &ptrs[0], NULL);
+    CHECK_CL_ERROR(err);
+    return to_return;
+  }
+
+  /** \brief returns a reference to a kernel contained in this program
+   * */
+  kernel get_kernel(const std::string &kname) const {
+    cl_int err;
+    cl_kernel k = clCreateKernel(ref_, kname.c_str(), &err);
+    CHECK_CL_ERROR(err);
+    return kernel(k);
   }
 };
 typedef program_<0> program;
 
-/** \brief event wrapper, returned from many command_queue member
- * functions */
+namespace detail {
+
+/** \brief 64-bit FNV-1a hash; names on-disk cache entries */
+inline cl_ulong fnv1a(const void *data, size_t size,
+    cl_ulong h = 14695981039346656037ULL) {
+  const unsigned char *p = static_cast<const unsigned char*>(data);
+  for(size_t i=0; i<size; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/** \brief appends a length-prefixed field to a cache key so that
+ * ("ab", "c") and ("a", "bc") hash differently */
+inline cl_ulong fnv1a_field(const std::string &s, cl_ulong h) {
+  cl_ulong len = s.size();
+  h = fnv1a(&len, sizeof(len), h);
+  return fnv1a(s.data(), s.size(), h);
+}
+
+inline std::string hex64(cl_ulong v) {
+  char buf[17];
+  std::snprintf(buf, sizeof(buf), "%016llx",
+      static_cast<unsigned long long>(v));
+  return buf;
+}
+
+/** \brief creates dir and any missing parents; errors are left for the
+ * subsequent file operations to report.  without POSIX, dir must
+ * already exist */
+inline void make_dirs(const std::string &dir) {
+#ifdef CL_WRAPPER_POSIX
+  for(size_t pos = dir.find('/', 1); ; pos = dir.find('/', pos + 1)) {
+    mkdir(dir.substr(0, pos).c_str(), 0755);
+    if(pos == std::string::npos) break;
+  }
+#else
+  (void)dir;
+#endif
+}
+
+/** \brief distinguishes this process's temporary files from those of
+ * other processes sharing a directory */
+inline cl_ulong process_token() {
+#ifdef CL_WRAPPER_POSIX
+  return static_cast<cl_ulong>(getpid());
+#else
+  static const cl_ulong token = [] {
+    std::random_device r;
+    return (static_cast<cl_ulong>(r()) << 32) | r();
+  }();
+  return token;
+#endif
+}
+
+/** \brief marks path as just used, for evict_files() */
+inline void touch_file(const std::string &path) {
+#ifdef CL_WRAPPER_POSIX
+  utime(path.c_str(), NULL);
+#else
+  (void)path;
+#endif
+}
+
+inline bool read_file(const std::string &path,
+    std::vector<unsigned char> &out) {
+  FILE *f = std::fopen(path.c_str(), "rb");
+  if(!f) return false;
+  std::fseek(f, 0, SEEK_END);
+  long size = std::ftell(f);
+  std::fseek(f, 0, SEEK_SET);
+  bool ok = size > 0;
+  if(ok) {
+    out.resize(size);
+    ok = std::fread(&out[0], 1, size, f) == static_cast<size_t>(size);
+  }
+  std::fclose(f);
+  return ok;
+}
+
+/** \brief writes to a private temporary file and rename()s it into
+ * place, so concurrent readers in other processes see either the old
+ * file or the complete new one */
+inline bool write_file_atomic(const std::string &path, const void *data,
+    size_t size) {
+  static std::atomic<unsigned> counter(0);
+  const std::string tmp = path + "." + hex64(process_token()) + "." +
+    hex64(counter++) + ".tmp";
+  FILE *f = std::fopen(tmp.c_str(), "wb");
+  if(!f) return false;
+  bool ok = std::fwrite(data, 1, size, f) == size;
+  ok = (std::fclose(f) == 0) && ok;
+  ok = ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+  if(!ok) std::remove(tmp.c_str());
+  return ok;
+}
+
+/** \brief deletes the least recently used files ending in one of
+ * suffixes from dir until their total size is at most max_bytes.  does
+ * nothing without POSIX */
+inline void evict_files(const std::string &dir,
+    const std::vector<std::string> &suffixes, cl_ulong max_bytes) {
+#ifndef CL_WRAPPER_POSIX
+  (void)dir;
+  (void)suffixes;
+  (void)max_bytes;
+#else
+  DIR *d = opendir(dir.c_str());
+  if(!d) return;
+  std::vector<std::pair<time_t, std::pair<std::string, cl_ulong> > > files;
+  cl_ulong total = 0;
+  while(struct dirent *ent = readdir(d)) {
+    const std::string name = ent->d_name;
+    bool match = false;
+    for(size_t i=0; i<suffixes.size() && !match; ++i) {
+      const std::string &suffix = suffixes[i];
+      match = name.size() > suffix.size() && name.compare(name.size() -
+          suffix.size(), suffix.size(), suffix) == 0;
+    }
+    if(!match) continue;
+    const std::string path = dir + "/" + name;
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) continue;
+    files.push_back(std::make_pair(st.st_mtime,
+          std::make_pair(path, static_cast<cl_ulong>(st.st_size))));
+    total += st.st_size;
+  }
+  closedir(d);
+  std::sort(files.begin(), files.end());
+  for(size_t i=0; i<files.size() && total > max_bytes; ++i) {
+    std::remove(files[i].second.first.c_str());
+    total -= files[i].second.second;
+  }
+#endif
+}
+
+/** \brief deletes the temporary files write_file_atomic() left in dir
+ * that have not been written for max_age seconds, as a writer that died
+ * before its rename() leaves them behind.  does nothing without POSIX */
+inline void remove_stale_temporaries(const std::string &dir,
+    time_t max_age) {
+#ifndef CL_WRAPPER_POSIX
+  (void)dir;
+  (void)max_age;
+#else
+  DIR *d = opendir(dir.c_str());
+  if(!d) return;
+  const std::string suffix = ".tmp";
+  const time_t now = time(NULL);
+  std::vector<std::string> stale;
+  while(struct dirent *ent = readdir(d)) {
+    const std::string name = ent->d_name;
+    if(name.size() <= suffix.size() || name.compare(name.size() -
+          suffix.size(), suffix.size(), suffix) != 0) continue;
+    const std::string path = dir + "/" + name;
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0 && now - st.st_mtime > max_age) {
+      stale.push_back(path);
+    }
+  }
+  closedir(d);
+  for(size_t i=0; i<stale.size(); ++i) std::remove(stale[i].c_str());
+#endif
+}
+
+}
+
+/** \brief persistent on-disk cache of program binaries.  build() looks
+ * up a binary for every device in the context, keyed by the source,
+ * build options, device name, driver version and platform version; on a
+ * hit the program is created with clCreateProgramWithBinary, and on a
+ * miss or a binary the driver rejects it is built from source and the
+ * new binaries are stored.  entries are written atomically, so several
+ * processes may share one directory, and the least recently used entries
+ * are deleted once the directory grows past max_bytes, along with
+ * temporaries that writers left behind an hour or more ago.  with
+ * OpenCL 1.2, compile() caches compiled objects the same way and in
+ * memory, so translation units shared between programs are compiled
+ * once */
+template<int UNUSED>
+class program_cache_ {
+public:
+  program_cache_(const std::string &dir, cl_ulong max_bytes = 256 << 20)
+      : dir_(dir), max_bytes_(max_bytes), hits_(0), misses_(0),
+        rejected_(0), object_hits_(0), object_misses_(0) {
+    detail::make_dirs(dir_);
+  }
+
+  /** \brief returns a program for all devices in ctx built from source */
+  program build(const context &ctx, const std::string &source,
+      const std::string &opts = "") {
+    std::vector<device> devices = ctx.devices();
+    std::vector<std::string> paths(devices.size());
+    std::vector<std::vector<unsigned char> > binaries(devices.size());
+    bool found = !devices.empty();
+    const cl_ulong key = key_(source, opts);
+    for(size_t i=0; i<devices.size(); ++i) {
+      paths[i] = path_(key, devices[i], binary_suffix_());
+      found = found && detail::read_file(paths[i], binaries[i]);
+    }
+
+    if(found) {
+      program p = load_(ctx, devices, binaries, opts);
+      if(p.id()) {
+        ++hits_;
+        for(size_t i=0; i<paths.size(); ++i) {
+          detail::touch_file(paths[i]);
+        }
+        return p;
+      }
+      ++rejected_;
+      for(size_t i=0; i<paths.size(); ++i) std::remove(paths[i].c_str());
+    }
+
+    ++misses_;
+    program p(ctx, source);
+    p.build(opts);
+    std::vector<device> built = p.devices();
+    std::vector<std::vector<unsigned char> > bins = p.binaries();
+    for(size_t i=0; i<built.size() && i<bins.size(); ++i) {
+      if(bins[i].empty()) continue;
+      detail::write_file_atomic(path_(key, built[i], binary_suffix_()),
+          &bins[i][0], bins[i].size());
+    }
+    evict_();
+    return p;
+  }
+
+#ifdef CL_VERSION_1_2
+  /** \brief a named header source for compile() */
+  typedef std::pair<std::string, std::string> header;
+
+  /** \brief returns source compiled into an object for all devices in
+   * ctx, for program::link().  objects are looked up in memory, then on
+   * disk, keyed by the source, options and headers as well as the device
+   * and driver, and compiled only on a miss */
+  program compile(const context &ctx, const std::string &source,
+      const std::string &opts = "",
+      const std::vector<header> &headers = std::vector<header>()) {
+    cl_ulong key = key_(source, opts);
+    for(size_t i=0; i<headers.size(); ++i) {
+      key = detail::fnv1a_field(headers[i].first, key);
+      key = detail::fnv1a_field(headers[i].second, key);
+    }
+    const std::pair<cl_context, cl_ulong> mem_key(ctx.id(), key);
+    {
+      std::lock_guard<std::mutex> lock(objects_mutex_);
+      typename object_map::const_iterator it = objects_.find(mem_key);
+      if(it != objects_.end()) {
+        ++object_hits_;
+        return it->second;
+      }
+    }
+
+    std::vector<device> devices = ctx.devices();
+    std::vector<std::string> paths(devices.size());
+    std::vector<std::vector<unsigned char> > binaries(devices.size());
+    bool found = !devices.empty();
+    for(size_t i=0; i<devices.size(); ++i) {
+      paths[i] = path_(key, devices[i], object_suffix_());
+      found = found && detail::read_file(paths[i], binaries[i]);
+    }
+
+    program p;
+    if(found) {
+      p = load_object_(ctx, devices, binaries);
+      if(p.id()) {
+        ++object_hits_;
+        for(size_t i=0; i<paths.size(); ++i) {
+          detail::touch_file(paths[i]);
+        }
+      } else {
+        ++rejected_;
+        for(size_t i=0; i<paths.size(); ++i) std::remove(paths[i].c_str());
+      }
+    }
+
+    if(!p.id()) {
+      ++object_misses_;
+      std::vector<program::header> header_programs;
+      for(size_t i=0; i<headers.size(); ++i) {
+        header_programs.push_back(program::header(headers[i].first,
+              program(ctx, headers[i].second)));
+      }
+      p = program(ctx, source);
+      p.compile(opts, header_programs);
+      std::vector<device> built = p.devices();
+      std::vector<std::vector<unsigned char> > bins = p.binaries();
+      for(size_t i=0; i<built.size() && i<bins.size(); ++i) {
+        if(bins[i].empty()) continue;
+        detail::write_file_atomic(path_(key, built[i], object_suffix_()),
+            &bins[i][0], bins[i].size());
+      }
+      evict_();
+    }
+
+    std::lock_guard<std::mutex> lock(objects_mutex_);
+    return objects_.insert(std::make_pair(mem_key, p)).first->second;
+  }
+
+  /** \brief number of compile() calls satisfied from memory or disk */
+  unsigned long object_hits() const { return object_hits_; }
+  /** \brief number of compile() calls that compiled from source */
+  unsigned long object_misses() const { return object_misses_; }
+
+  /** \brief drops the compiled objects held in memory */
+  void clear_objects() {
+    std::lock_guard<std::mutex> lock(objects_mutex_);
+    objects_.clear();
+  }
+#endif
+
+  /** \brief number of build() calls satisfied from disk */
+  unsigned long hits() const { return hits_; }
+  /** \brief number of build() calls that compiled from source */
+  unsigned long misses() const { return misses_; }
+  /** \brief number of cached binaries the driver refused to load; each
+   * of these is also counted as a miss */
+  unsigned long rejected() const { return rejected_; }
+  const std::string& directory() const { return dir_; }
+
+private:
+  program_cache_(const program_cache_&);
+  program_cache_& operator=(const program_cache_&);
+
+  typedef std::map<std::pair<cl_context, cl_ulong>, program> object_map;
+
+  static const char* binary_suffix_() { return ".clbin"; }
+  static const char* object_suffix_() { return ".clobj"; }
+  /** \brief age past which no writer can still be filling a temporary */
+  static time_t stale_seconds_() { return 60 * 60; }
+
+  static cl_ulong key_(const std::string &source, const std::string &opts) {
+    cl_ulong h = 14695981039346656037ULL;
+    h = detail::fnv1a_field(source, h);
+    return detail::fnv1a_field(opts, h);
+  }
+
+  std::string path_(cl_ulong h, const device &d, const char *suffix) const {
+    h = detail::fnv1a_field(d.name(), h);
+    h = detail::fnv1a_field(d.driver_version(), h);
+    h = detail::fnv1a_field(platform(d.platform()).version(), h);
+    return dir_ + "/" + detail::hex64(h) + suffix;
+  }
+
+  void evict_() const {
+    std::vector<std::string> suffixes;
+    suffixes.push_back(binary_suffix_());
+    suffixes.push_back(object_suffix_());
+    detail::evict_files(dir_, suffixes, max_bytes_);
+    detail::remove_stale_temporaries(dir_, stale_seconds_());
+  }
+
+  /** \brief returns a NULL program if the driver rejects any binary */
+  static program load_(const context &ctx, const std::vector<device>
+      &devices, const std::vector<std::vector<unsigned char> > &binaries,
+      const std::string &opts) {
+    std::vector<cl_device_id> ids(devices.begin(), devices.end());
+    std::vector<size_t> sizes(binaries.size());
+    std::vector<const unsigned char*> ptrs(binaries.size());
+    for(size_t i=0; i<binaries.size(); ++i) {
+      sizes[i] = binaries[i].size();
+      ptrs[i] = &binaries[i][0];
+    }
+    std::vector<cl_int> status(binaries.size());
+    cl_int err;
+    program p(clCreateProgramWithBinary(ctx.id(), ids.size(), &ids[0],
+          &sizes[0], &ptrs[0], &status[0], &err));
+    if(err != CL_SUCCESS) return program();
+    for(size_t i=0; i<status.size(); ++i) {
+      if(status[i] != CL_SUCCESS) return program();
+    }
+    err = clBuildProgram(p.id(), 0, NULL, opts.c_str(), NULL, NULL);
+    if(err != CL_SUCCESS) return program();
+    return p;
+  }
+
+#ifdef CL_VERSION_1_2
+  /** \brief returns a NULL program if the driver rejects any binary or
+   * does not load it as a compiled object */
+  static program load_object_(const context &ctx, const std::vector<device>
+      &devices, const std::vector<std::vector<unsigned char> > &binaries) {
+    std::vector<cl_device_id> ids(devices.begin(), devices.end());
+    std::vector<size_t> sizes(binaries.size());
+    std::vector<const unsigned char*> ptrs(binaries.size());
+    for(size_t i=0; i<binaries.size(); ++i) {
+      sizes[i] = binaries[i].size();
+      ptrs[i] = &binaries[i][0];
+    }
+    std::vector<cl_int> status(binaries.size());
+    cl_int err;
+    program p(clCreateProgramWithBinary(ctx.id(), ids.size(), &ids[0],
+          &sizes[0], &ptrs[0], &status[0], &err));
+    if(err != CL_SUCCESS) return program();
+    for(size_t i=0; i<status.size(); ++i) {
+      if(status[i] != CL_SUCCESS) return program();
+      cl_program_binary_type type;
+      err = clGetProgramBuildInfo(p.id(), ids[i], CL_PROGRAM_BINARY_TYPE,
+          sizeof(type), &type, NULL);
+      if(err != CL_SUCCESS || type != CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT)
+        return program();
+    }
+    return p;
+  }
+#endif
+
+  const std::string dir_;
+  const cl_ulong max_bytes_;
+  std::atomic<unsigned long> hits_;
+  std::atomic<unsigned long> misses_;
+  std::atomic<unsigned long> rejected_;
+  std::atomic<unsigned long> object_hits_;
+  std::atomic<unsigned long> object_misses_;
+  std::mutex objects_mutex_;
+  object_map objects_;
+};
+typedef program_cache_<0> program_cache;
+
+/** \brief -D values for specialized_program, by name; a map, so that a
+ * set of values always produces the same options */
+typedef std::map<std::string, std::string> spec_params;
+
+/** \brief one source built into a separate program for each distinct set
+ * of -D values.  programs are memoized, most recently used first, up to
+ * capacity; builds still running are never evicted, and a variant that
+ * fails to build is dropped once its waiters have seen the build_error,
+ * so that the next get() tries again.  prewarm() queues builds for a
+ * pool of at most threads background threads so that the first get() for
+ * them does not wait on the compiler; a get() for a queued variant builds
+ * it on the calling thread instead.  the destructor cancels queued builds
+ * and joins the pool.  builds go through cache when one is given, which
+ * must then outlive this object */
+template<int UNUSED>
+class specialized_program_ {
+public:
+  specialized_program_(const context &ctx, const std::string &source,
+      const std::string &opts = "", size_t capacity = 32,
+      program_cache *cache = NULL, size_t threads = 2)
+      : state_(std::make_shared<state_type>()) {
+    if(!capacity || !threads) throw cl_error(CL_INVALID_VALUE);
+    state_->ctx = ctx;
+    state_->source = source;
+    state_->opts = opts;
+    state_->capacity = capacity;
+    state_->cache = cache;
+    state_->max_workers = threads;
+    state_->idle = 0;
+    state_->stopping = false;
+    state_->hits = 0;
+    state_->builds = 0;
+  }
+  ~specialized_program_() {
+    std::deque<job> cancelled;
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      state_->stopping = true;
+      cancelled.swap(state_->queue);
+    }
+    state_->cv.notify_all();
+    for(size_t i=0; i<cancelled.size(); ++i) {
+      cancelled[i].build->set_exception(std::make_exception_ptr(
+            cl_error(CL_INVALID_OPERATION)));
+    }
+    for(size_t i=0; i<state_->workers.size(); ++i) {
+      state_->workers[i].join();
+    }
+  }
+
+  /** \brief the program for params, building it on this thread if no
+   * one has started to */
+  program get(const spec_params &params) {
+    std::shared_ptr<std::promise<program> > build;
+    std::shared_future<program> f = lookup_(params, build);
+    if(!build) build = claim_(params);
+    if(build) build_(state_.get(), params, options(params), build);
+    return f.get();
+  }
+
+  /** \brief like get(), but builds on the background pool */
+  std::shared_future<program> get_async(const spec_params &params) {
+    std::shared_ptr<std::promise<program> > build;
+    std::shared_future<program> f = lookup_(params, build);
+    if(build) spawn_(params, build);
+    return f;
+  }
+
+  /** \brief queues background builds of every variant not yet cached.
+   * throws CL_INVALID_VALUE, starting none, if they would not all fit in
+   * capacity alongside the variants already held, since later ones would
+   * evict earlier ones */
+  void prewarm(const std::vector<spec_params> &variants) {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      std::set<spec_params> fresh;
+      for(size_t i=0; i<variants.size(); ++i) {
+        if(!state_->variants.count(variants[i])) fresh.insert(variants[i]);
+      }
+      if(state_->variants.size() + fresh.size() > state_->capacity) {
+        throw cl_error(CL_INVALID_VALUE);
+      }
+    }
+    for(size_t i=0; i<variants.size(); ++i) get_async(variants[i]);
+  }
+
+  /** \brief the build options for params */
+  std::string options(const spec_params &params) const {
+    std::string to_return = state_->opts;
+    for(spec_params::const_iterator it = params.begin();
+        it != params.end(); ++it) {
+      to_return += " -D" + it->first;
+      if(!it->second.empty()) to_return += "=" + it->second;
+    }
+    return to_return;
+  }
+
+  /** \brief number of variants held */
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->variants.size();
+  }
+  size_t capacity() const { return state_->capacity; }
+  /** \brief number of get() and get_async() calls that found their
+   * variant cached or already building */
+  unsigned long hits() const { return state_->hits; }
+  /** \brief number of builds started */
+  unsigned long builds() const { return state_->builds; }
+
+private:
+  typedef std::shared_ptr<std::promise<program> > promise_ptr;
+
+  struct variant {
+    std::shared_future<program> result;
+    /** \brief the promise behind result, to tell builds apart */
+    const std::promise<program> *build;
+    std::list<spec_params>::iterator lru;
+  };
+
+  struct job {
+    spec_params params;
+    std::string opts;
+    promise_ptr build;
+  };
+
+  struct state_type {
+    context ctx;
+    std::string source;
+    std::string opts;
+    size_t capacity;
+    program_cache *cache;
+    std::mutex mutex;
+    std::list<spec_params> lru;
+    std::map<spec_params, variant> variants;
+    std::deque<job> queue;
+    std::condition_variable cv;
+    std::vector<std::thread> workers;
+    size_t max_workers;
+    size_t idle;
+    bool stopping;
+    std::atomic<unsigned long> hits;
+    std::atomic<unsigned long> builds;
+  };
+
+  specialized_program_(const specialized_program_&);
+  specialized_program_& operator=(const specialized_program_&);
+
+  /** \brief returns the future for params.  if it is new, build is set to
+   * the promise the caller must fulfill */
+  std::shared_future<program> lookup_(const spec_params &params,
+      promise_ptr &build) {
+    state_type &state = *state_;
+    std::lock_guard<std::mutex> lock(state.mutex);
+    typename std::map<spec_params, variant>::iterator it =
+      state.variants.find(params);
+    if(it != state.variants.end()) {
+      ++state.hits;
+      state.lru.splice(state.lru.begin(), state.lru, it->second.lru);
+      return it->second.result;
+    }
+
+    ++state.builds;
+    build = std::make_shared<std::promise<program> >();
+    variant v;
+    v.result = build->get_future().share();
+    v.build = build.get();
+    state.lru.push_front(params);
+    v.lru = state.lru.begin();
+    state.variants.insert(std::make_pair(params, v));
+    evict_(state);
+    return v.result;
+  }
+
+  /** \brief drops least recently used variants over capacity, skipping
+   * those still building */
+  static void evict_(state_type &state) {
+    std::list<spec_params>::iterator it = state.lru.end();
+    while(state.variants.size() > state.capacity
+        && it != state.lru.begin()) {
+      --it;
+      variant &v = state.variants.find(*it)->second;
+      if(v.result.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready) {
+        continue;
+      }
+      state.variants.erase(*it);
+      it = state.lru.erase(it);
+    }
+  }
+
+  /** \brief takes the queued build of params off the pool, if any */
+  promise_ptr claim_(const spec_params &params) {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    std::deque<job> &queue = state_->queue;
+    for(typename std::deque<job>::iterator it = queue.begin();
+        it != queue.end(); ++it) {
+      if(it->params != params) continue;
+      promise_ptr to_return = it->build;
+      queue.erase(it);
+      return to_return;
+    }
+    return promise_ptr();
+  }
+
+  static void build_(state_type *state, const spec_params &params,
+      const std::string &opts, const promise_ptr &build) {
+    try {
+      if(state->cache) {
+        build->set_value(state->cache->build(state->ctx, state->source,
+              opts));
+      } else {
+        program p(state->ctx, state->source);
+        p.build(opts);
+        build->set_value(p);
+      }
+      return;
+    } catch(...) {
+      build->set_exception(std::current_exception());
+    }
+    std::lock_guard<std::mutex> lock(state->mutex);
+    typename std::map<spec_params, variant>::iterator it =
+      state->variants.find(params);
+    if(it != state->variants.end() && it->second.build == build.get()) {
+      state->lru.erase(it->second.lru);
+      state->variants.erase(it);
+    }
+  }
+
+  void spawn_(const spec_params &params, const promise_ptr &build) {
+    state_type *state = state_.get();
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      job j;
+      j.params = params;
+      j.opts = options(params);
+      j.build = build;
+      state->queue.push_back(j);
+      if(!state->idle && state->workers.size() < state->max_workers) {
+        state->workers.push_back(std::thread(&work_, state));
+      }
+    }
+    state->cv.notify_one();
+  }
+
+  static void work_(state_type *state) {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    for(;;) {
+      ++state->idle;
+      state->cv.wait(lock, [state] {
+        return state->stopping || !state->queue.empty();
+      });
+      --state->idle;
+      if(state->stopping) return;
+      job j = state->queue.front();
+      state->queue.pop_front();
+      lock.unlock();
+      build_(state, j.params, j.opts, j.build);
+      lock.lock();
+    }
+  }
+
+  std::shared_ptr<state_type> state_;
+};
+typedef specialized_program_<0> specialized_program;
+
+namespace detail {
+
+/** \brief heap-allocated payload for clSetEventCallback */
+struct completion_callback {
+  std::function<void(cl_int)> action;
+
+  static void CL_CALLBACK invoke(cl_event, cl_int status, void *data) {
+    std::unique_ptr<completion_callback> self(
+        static_cast<completion_callback*>(data));
+    self->action(status);
+  }
+};
+
+/** \brief runs action(status) on a driver thread once e reaches
+ * CL_COMPLETE or fails with a negative status.  action must be cheap and
+ * must not make blocking OpenCL calls */
+inline void on_complete(cl_event e, const std::function<void(cl_int)>
+    &action) {
+  std::unique_ptr<completion_callback> cb(new completion_callback);
+  cb->action = action;
+  cl_int err = clSetEventCallback(e, CL_COMPLETE,
+      &completion_callback::invoke, cb.get());
+  if(err != CL_SUCCESS) throw cl_error(err);
+  cb.release();
+}
+
+/** \brief sets p from f(), which may return void */
+template<typename R, typename F>
+void fulfill(std::promise<R> &p, F &f) { p.set_value(f()); }
+
+template<typename F>
+void fulfill(std::promise<void> &p, F &f) { f(); p.set_value(); }
+
+}
+
+template<typename T> class event_future;
+
+/** \brief event wrapper, returned from many command_queue member
+ * functions */
+template<int UNUSED>
+class event_ : public cl_wrapper<cl_event> {
+public:
+  /** \brief standard ctors; see cl_wrapper<> */
+  event_() : cl_wrapper<cl_event>() { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  event_(const event_ &e) : cl_wrapper<cl_event>(e) { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  event_(event_ &&e) noexcept : cl_wrapper<cl_event>(std::move(e)) { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  event_(cl_event e) : cl_wrapper<cl_event>(e) { }
+
+  event_& operator=(const event_ &e) {
+    cl_wrapper<cl_event>::operator=(e);
+    return *this;
+  }
+  event_& operator=(event_ &&e) noexcept {
+    cl_wrapper<cl_event>::operator=(std::move(e));
+    return *this;
+  }
+
+  void wait() {
+    cl_int err;
+    err = clWaitForEvents(1, &ref_);
+    CHECK_CL_ERROR(err);
+  }
+
+  /** \brief CL_QUEUED, CL_SUBMITTED, CL_RUNNING, CL_COMPLETE, or a
+   * negative error code if the command failed */
+  cl_int status() const {
+    return detail::event_property_functor<event_<0>, cl_int>()(*this,
+        CL_EVENT_COMMAND_EXECUTION_STATUS);
+  }
+
+  /* device timestamps in nanoseconds.  only available once the command
+   * has completed, on queues created with CL_QUEUE_PROFILING_ENABLE */
+#define EVENT_PROFILING(name, cl_name) \
+  cl_ulong name() const { \
+    return detail::event_profiling_functor<event_<0> >()(*this, \
+        cl_name); \
+  }
+  EVENT_PROFILING(queued_time, CL_PROFILING_COMMAND_QUEUED);
+  EVENT_PROFILING(submit_time, CL_PROFILING_COMMAND_SUBMIT);
+  EVENT_PROFILING(start_time, CL_PROFILING_COMMAND_START);
+  EVENT_PROFILING(end_time, CL_PROFILING_COMMAND_END);
+#undef EVENT_PROFILING
+
+  /** \brief calls action(status) on a driver thread once this event
+   * completes (status CL_COMPLETE) or fails (negative status).  the
+   * queue must be flushed for this to happen.  action must be cheap and
+   * must not make blocking OpenCL calls */
+  void on_complete(const std::function<void(cl_int)> &action) const {
+    detail::on_complete(ref_, action);
+  }
+
+  /** \brief returns a future holding f()'s result, computed on a driver
+   * thread once this event completes.  as with on_complete(), f must be
+   * cheap and must not make blocking OpenCL calls.  if the event fails,
+   * f is not called and the future holds a cl_error with the event's
+   * status; if f throws, the future holds that exception */
+  template<typename F>
+  auto then(F f) const -> event_future<decltype(f())> {
+    typedef decltype(f()) result_type;
+    std::shared_ptr<std::promise<result_type> > promise =
+      std::make_shared<std::promise<result_type> >();
+    event_future<result_type> to_return(*this, promise->get_future());
+    on_complete([promise, f](cl_int status) mutable {
+      if(status < 0) {
+        promise->set_exception(std::make_exception_ptr(cl_error(status)));
+        return;
+      }
+      try {
+        detail::fulfill(*promise, f);
+      } catch(...) {
+        promise->set_exception(std::current_exception());
+      }
+    });
+    return to_return;
+  }
+};
+typedef event_<0> event;
+
+/** \brief a std::future that resolves when an OpenCL event completes;
+ * see event::then() and make_event_future().  get() and wait() also wait
+ * on the event itself, which flushes its queue so that the completion
+ * callback is guaranteed to run */
+template<typename T>
+class event_future {
+public:
+  event_future() { }
+  event_future(const event &e, std::future<T> &&f)
+      : event_(e), future_(std::move(f)) { }
+
+  /** \brief blocks until the value is available; rethrows a cl_error if
+   * the event failed */
+  T get() {
+    wait_event_();
+    return future_.get();
+  }
+  void wait() {
+    wait_event_();
+    future_.wait();
+  }
+  /** \brief true once the value or error is available; never blocks */
+  bool ready() const {
+    return future_.valid() && future_.wait_for(std::chrono::seconds(0)) ==
+      std::future_status::ready;
+  }
+  bool valid() const { return future_.valid(); }
+  /** \brief the event this future waits for */
+  const event& completion() const { return event_; }
+
+private:
+  void wait_event_() {
+    // failures are reported through the future
+    cl_event e = event_.id();
+    if(e) clWaitForEvents(1, &e);
+  }
+
+  event event_;
+  std::future<T> future_;
+};
+
+namespace detail {
+
+/** \brief hands out value once; shared so that copies of the callback
+ * do not copy value */
+template<typename T>
+struct value_holder {
+  std::shared_ptr<T> value;
+  T operator()() { return std::move(*value); }
+};
+
+}
+
+/** \brief returns a future that yields value, typically a host-side
+ * result buffer, once e completes */
+template<typename T>
+event_future<T> make_event_future(const event &e, T value) {
+  detail::value_holder<T> holder = {
+    std::make_shared<T>(std::move(value)) };
+  return e.then(holder);
+}
+
+template<int N>
+void wait(cl_uint num_events, event_<N> *events) {
+  cl_int err;
+  err = clWaitForEvents(num_events, 
+      reinterpret_cast<cl_event*>(events));
+  CHECK_CL_ERROR(err);
+}
+
+namespace detail {
+
+/** \brief a user event that completes once every event passed to add()
+ * has, and once seal() has been called.  the first negative status among
+ * them becomes the user event's status */
+class event_join {
+public:
+  explicit event_join(cl_context ctx)
+      : state_(std::make_shared<state_type>()) {
+    cl_int err;
+    state_->user = clCreateUserEvent(ctx, &err);
+    if(err != CL_SUCCESS) throw cl_error(err);
+  }
+
+  /** \brief action, if any, runs with e's status before the join counts
+   * e as done */
+  void add(cl_event e, const std::function<void(cl_int)> &action =
+      std::function<void(cl_int)>()) {
+    std::shared_ptr<state_type> state = state_;
+    ++state->pending;
+    try {
+      on_complete(e, [state, action](cl_int status) {
+        if(action) action(status);
+        state->arrive(status);
+      });
+    } catch(...) {
+      --state->pending;
+      throw;
+    }
+  }
+
+  /** \brief no more add() calls; returns the user event */
+  event seal() {
+    clRetainEvent(state_->user);
+    event to_return(state_->user);
+    state_->arrive(CL_COMPLETE);
+    return to_return;
+  }
+
+private:
+  struct state_type {
+    state_type() : user(NULL), pending(1), status(CL_COMPLETE) { }
+    ~state_type() { if(user) clReleaseEvent(user); }
+
+    void arrive(cl_int s) {
+      if(s < 0) {
+        cl_int expected = CL_COMPLETE;
+        status.compare_exchange_strong(expected, s);
+      }
+      if(--pending == 0) clSetUserEventStatus(user, status.load());
+    }
+
+    cl_event user;
+    std::atomic<int> pending;
+    std::atomic<cl_int> status;
+  };
+
+  std::shared_ptr<state_type> state_;
+};
+
+}
+
+/** \brief an event reported by event_set, with the status it ended with
+ * and the tag it was added with */
+struct event_completion {
+  event e;
+  cl_int status;
+  size_t tag;
+};
+
+namespace detail {
+
+/** \brief shared state of an event_set: an intrusive multi-producer,
+ * single-consumer queue (Vyukov's) that completion callbacks push onto
+ * without locking, and a condition variable for consumers to sleep on */
+class event_set_state {
+public:
+  struct node {
+    std::atomic<node*> next;
+    event_completion value;
+  };
+
+  event_set_state()
+      : head_(&stub_), tail_(&stub_), completed_(0), sleepers_(0) {
+    stub_.next.store(NULL);
+  }
+  ~event_set_state() {
+    while(node *n = pop()) delete n;
+  }
+
+  /** \brief called from driver threads */
+  void push(node *n) {
+    n->next.store(NULL, std::memory_order_relaxed);
+    node *prev = head_.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+    ++completed_;
+    if(sleepers_.load()) {
+      { std::lock_guard<std::mutex> lock(mutex_); }
+      cv_.notify_all();
+    }
+  }
+
+  /** \brief called from the consumer only; NULL if nothing is ready,
+   * including briefly while a push is half done */
+  node* pop() {
+    node *tail = tail_;
+    node *next = tail->next.load(std::memory_order_acquire);
+    if(tail == &stub_) {
+      if(!next) return NULL;
+      tail_ = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if(next) {
+      tail_ = next;
+      return tail;
+    }
+    if(tail != head_.load(std::memory_order_acquire)) return NULL;
+    push_stub_();
+    next = tail->next.load(std::memory_order_acquire);
+    if(next) {
+      tail_ = next;
+      return tail;
+    }
+    return NULL;
+  }
+
+  /** \brief sleeps until more than seen events have completed, or until
+   * deadline; returns false on timeout */
+  bool wait_until(size_t seen,
+      const std::chrono::steady_clock::time_point &deadline) {
+    ++sleepers_;
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::function<bool()> ready = [this, seen]() {
+      return completed_.load() > seen;
+    };
+    bool to_return = true;
+    if(deadline == std::chrono::steady_clock::time_point::max()) {
+      cv_.wait(lock, ready);
+    } else {
+      to_return = cv_.wait_until(lock, deadline, ready);
+    }
+    --sleepers_;
+    return to_return;
+  }
+
+private:
+  void push_stub_() {
+    stub_.next.store(NULL, std::memory_order_relaxed);
+    node *prev = head_.exchange(&stub_, std::memory_order_acq_rel);
+    prev->next.store(&stub_, std::memory_order_release);
+  }
+
+  node stub_;
+  std::atomic<node*> head_;
+  node *tail_;
+  std::atomic<size_t> completed_;
+  std::atomic<int> sleepers_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+}
+
+/** \brief collects events in the order they complete.  add() registers a
+ * completion callback that pushes the event onto a lock-free queue, so
+ * taking the next completion costs O(1) however many events are in
+ * flight.  any thread may add(); only one thread at a time may take
+ * completions.  the set may be destroyed with events still pending */
+template<int UNUSED>
+class event_set_ {
+public:
+  typedef std::chrono::steady_clock clock;
+
+  event_set_()
+      : state_(std::make_shared<detail::event_set_state>()), added_(0),
+        taken_(0) { }
+
+  /** \brief watches e; tag comes back with its completion */
+  void add(const event &e, size_t tag = 0) {
+    std::unique_ptr<detail::event_set_state::node> n(
+        new detail::event_set_state::node);
+    n->value.e = e;
+    n->value.status = CL_COMPLETE;
+    n->value.tag = tag;
+    std::shared_ptr<detail::event_set_state> state = state_;
+    detail::event_set_state::node *raw = n.get();
+    ++added_;
+    try {
+      detail::on_complete(e.id(), [state, raw](cl_int status) {
+        raw->value.status = status;
+        state->push(raw);
+      });
+    } catch(...) {
+      --added_;
+      throw;
+    }
+    n.release();
+  }
+
+  /** \brief takes the oldest completion if there is one */
+  bool try_pop_completed(event_completion &c) {
+    detail::event_set_state::node *n = state_->pop();
+    if(!n) return false;
+    c = n->value;
+    delete n;
+    ++taken_;
+    return true;
+  }
+
+  /** \brief waits for the next completion; throws CL_INVALID_VALUE if no
+   * events are pending */
+  event_completion wait_any() {
+    event_completion to_return;
+    if(!wait_any_until(clock::time_point::max(), to_return)) {
+      throw cl_error(CL_INVALID_VALUE);
+    }
+    return to_return;
+  }
+
+  /** \brief waits until the next completion or deadline; returns false
+   * on timeout or if no events are pending */
+  bool wait_any_until(const clock::time_point &deadline,
+      event_completion &c) {
+    for(;;) {
+      if(try_pop_completed(c)) return true;
+      if(size() == 0) return false;
+      if(!state_->wait_until(taken_, deadline)) return false;
+      // the next completion is pushed but may not be linked in yet
+      if(!try_pop_completed(c)) std::this_thread::yield();
+      else return true;
+    }
+  }
+
+  template<typename Rep, typename Period>
+  bool wait_any_for(const std::chrono::duration<Rep, Period> &timeout,
+      event_completion &c) {
+    return wait_any_until(clock::now() + timeout, c);
+  }
+
+  /** \brief appends n completions to out, waiting as needed; stops early
+   * if no events are left pending.  returns how many were appended */
+  size_t wait_n(size_t n, std::vector<event_completion> &out) {
+    return wait_n_until(n, clock::time_point::max(), out);
+  }
+
+  /** \brief like wait_n(), but gives up at deadline */
+  size_t wait_n_until(size_t n, const clock::time_point &deadline,
+      std::vector<event_completion> &out) {
+    size_t got = 0;
+    event_completion c;
+    while(got < n && wait_any_until(deadline, c)) {
+      out.push_back(c);
+      ++got;
+    }
+    return got;
+  }
+
+  template<typename Rep, typename Period>
+  size_t wait_n_for(size_t n,
+      const std::chrono::duration<Rep, Period> &timeout,
+      std::vector<event_completion> &out) {
+    return wait_n_until(n, clock::now() + timeout, out);
+  }
+
+  /** \brief number of events added and not yet taken */
+  size_t size() const { return added_.load() - taken_; }
+  bool empty() const { return size() == 0; }
+
+private:
+  event_set_(const event_set_&);
+  event_set_& operator=(const event_set_&);
+
+  std::shared_ptr<detail::event_set_state> state_;
+  std::atomic<size_t> added_;
+  size_t taken_;
+};
+typedef event_set_<0> event_set;
+
+/** \brief per-label aggregates from command_recorder::stats() */
+struct command_stats {
+  cl_ulong count;
+  /** \brief bytes moved, for transfers */
+  cl_ulong bytes;
+  /** \brief sum of start-to-end times */
+  cl_ulong total_ns;
+  cl_ulong p50_ns;
+  cl_ulong p99_ns;
+
+  double bytes_per_second() const {
+    return total_ns ? bytes * 1e9 / total_ns : 0.0;
+  }
+};
+
+/** \brief collects device timestamps for commands enqueued on queues it
+ * is attached to with command_queue::set_recorder().  each command is
+ * labelled with its kernel name or transfer kind and size; timestamps
+ * are read from a completion callback, so the queues must be created
+ * with CL_QUEUE_PROFILING_ENABLE.  one recorder may serve several queues
+ * and threads.  a queue with no recorder pays one pointer test per
+ * enqueue */
+template<int UNUSED>
+class command_recorder_ {
+public:
+  struct record {
+    std::string label;
+    cl_ulong bytes;
+    cl_command_queue queue;
+    cl_ulong queued;
+    cl_ulong submit;
+    cl_ulong start;
+    cl_ulong end;
+  };
+
+  command_recorder_()
+      : state_(std::make_shared<state_type>()) { }
+
+  /** \brief called by command_queue after each enqueue */
+  void add(const std::string &label, cl_ulong bytes, const event &e,
+      cl_command_queue queue) {
+    const std::shared_ptr<state_type> state = state_;
+    const cl_event id = e.id();
+    detail::on_complete(id, [state, label, bytes, queue, id](cl_int s) {
+      if(s != CL_COMPLETE) return;
+      record r = { label, bytes, queue, 0, 0, 0, 0 };
+      clGetEventProfilingInfo(id, CL_PROFILING_COMMAND_QUEUED,
+          sizeof(cl_ulong), &r.queued, NULL);
+      clGetEventProfilingInfo(id, CL_PROFILING_COMMAND_SUBMIT,
+          sizeof(cl_ulong), &r.submit, NULL);
+      clGetEventProfilingInfo(id, CL_PROFILING_COMMAND_START,
+          sizeof(cl_ulong), &r.start, NULL);
+      clGetEventProfilingInfo(id, CL_PROFILING_COMMAND_END,
+          sizeof(cl_ulong), &r.end, NULL);
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->records.push_back(r);
+    });
+  }
+
+  /** \brief like add(), labelled with k's function name.  names are
+   * looked up once per kernel; the recorder keeps the kernels it has
+   * named alive until clear() */
+  void add(const kernel &k, const event &e, cl_command_queue queue) {
+    std::string name;
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      typename std::map<cl_kernel, std::pair<kernel, std::string> >::
+        const_iterator i = state_->names.find(k.id());
+      if(i != state_->names.end()) name = i->second.second;
+    }
+    if(name.empty()) {
+      name = k.function_name();
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      state_->names.insert(std::make_pair(k.id(), std::make_pair(k, name)));
+    }
+    add(name, 0, e, queue);
+  }
+
+  /** \brief every completed command recorded so far */
+  std::vector<record> records() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->records;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->records.clear();
+    state_->names.clear();
+  }
+
+  /** \brief count, start-to-end percentiles and throughput per label */
+  std::map<std::string, command_stats> stats() const {
+    const std::vector<record> recs = records();
+    std::map<std::string, std::vector<cl_ulong> > durations;
+    std::map<std::string, command_stats> to_return;
+    for(size_t i=0; i<recs.size(); ++i) {
+      command_stats &st = to_return[recs[i].label];
+      const cl_ulong d = recs[i].end - recs[i].start;
+      ++st.count;
+      st.bytes += recs[i].bytes;
+      st.total_ns += d;
+      durations[recs[i].label].push_back(d);
+    }
+    for(typename std::map<std::string, command_stats>::iterator i =
+        to_return.begin(); i != to_return.end(); ++i) {
+      std::vector<cl_ulong> &d = durations[i->first];
+      std::sort(d.begin(), d.end());
+      i->second.p50_ns = d[(d.size() - 1) * 50 / 100];
+      i->second.p99_ns = d[(d.size() - 1) * 99 / 100];
+    }
+    return to_return;
+  }
+
+  /** \brief writes the recorded commands as Chrome trace-event JSON
+   * (chrome://tracing, Perfetto), one track per queue */
+  void write_trace(std::ostream &out) const {
+    const std::vector<record> recs = records();
+    cl_ulong base = recs.empty() ? 0 : recs[0].queued;
+    for(size_t i=0; i<recs.size(); ++i) base = std::min(base, recs[i].queued);
+    std::map<cl_command_queue, size_t> tracks;
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    for(size_t i=0; i<recs.size(); ++i) {
+      const record &r = recs[i];
+      const size_t tid = tracks.insert(std::make_pair(r.queue,
+            tracks.size())).first->second;
+      out << (i ? ",\n" : "\n") << "{\"name\":\"";
+      for(size_t c=0; c<r.label.size(); ++c) {
+        if(r.label[c] == '"' || r.label[c] == '\\') out << '\\';
+        out << r.label[c];
+      }
+      out << "\",\"cat\":\"opencl\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+        << ",\"ts\":" << micros_(r.start - base)
+        << ",\"dur\":" << micros_(r.end - r.start)
+        << ",\"args\":{\"bytes\":" << r.bytes
+        << ",\"queued_us\":" << micros_(r.queued - base)
+        << ",\"submit_us\":" << micros_(r.submit - base) << "}}";
+    }
+    out << "\n]}\n";
+  }
+
+private:
+  struct state_type {
+    std::mutex mutex;
+    std::vector<record> records;
+    std::map<cl_kernel, std::pair<kernel, std::string> > names;
+  };
+
+  /** \brief ns as microseconds with exactly three decimals, whatever the
+   * stream's precision; the default of six digits loses sub-millisecond
+   * resolution a few seconds into a trace */
+  static std::string micros_(cl_ulong ns) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%llu.%03u",
+        static_cast<unsigned long long>(ns / 1000),
+        static_cast<unsigned>(ns % 1000));
+    return buf;
+  }
+
+  std::shared_ptr<state_type> state_;
+};
+typedef command_recorder_<0> command_recorder;
+
+/** \brief host view of a mapped buffer or image region, returned by
+ * command_queue::map_buffer() and map_image().  the region is unmapped
+ * when the view is destroyed, or earlier with unmap(), which also lets
+ * later commands wait on the unmap.  for non-blocking maps, wait() (or
+ * wait on ready()) before touching the data.  image views expose the
+ * driver's row and slice pitch in bytes; use row() to address them */
+template<typename T>
+class mapped_view {
+public:
+  mapped_view()
+      : ptr_(NULL), size_(0), row_pitch_(0), slice_pitch_(0) { }
+  /** \brief takes over a mapping made with clEnqueueMap*; queue and mem
+   * are retained */
+  mapped_view(cl_command_queue queue, cl_mem mem, void *ptr, size_t size,
+      cl_event ready, size_t row_pitch = 0, size_t slice_pitch = 0)
+      : ptr_(static_cast<T*>(ptr)), size_(size), row_pitch_(row_pitch),
+        slice_pitch_(slice_pitch), ready_(ready) {
+    queue_.reset(queue);
+    mem_.reset(mem);
+  }
+  mapped_view(mapped_view &&v) noexcept
+      : queue_(std::move(v.queue_)), mem_(std::move(v.mem_)),
+        ptr_(v.ptr_), size_(v.size_), row_pitch_(v.row_pitch_),
+        slice_pitch_(v.slice_pitch_), ready_(std::move(v.ready_)) {
+    v.ptr_ = NULL;
+  }
+  ~mapped_view() {
+    if(ptr_) {
+      clEnqueueUnmapMemObject(queue_.id(), mem_.id(), ptr_, 0, NULL,
+          NULL);
+    }
+  }
+
+  mapped_view& operator=(mapped_view &&v) noexcept {
+    if(this == &v) return *this;
+    mapped_view tmp(std::move(*this));
+    queue_ = std::move(v.queue_);
+    mem_ = std::move(v.mem_);
+    ptr_ = v.ptr_;
+    size_ = v.size_;
+    row_pitch_ = v.row_pitch_;
+    slice_pitch_ = v.slice_pitch_;
+    ready_ = std::move(v.ready_);
+    v.ptr_ = NULL;
+    return *this;
+  }
+
+  /** \brief enqueues the unmap now; the view is empty afterwards */
+  event unmap(cl_uint num_events = 0, event *events = NULL) {
+    cl_int err;
+    event to_return;
+    err = clEnqueueUnmapMemObject(queue_.id(), mem_.id(), ptr_,
+        num_events, reinterpret_cast<cl_event*>(events),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    ptr_ = NULL;
+    size_ = 0;
+    return to_return;
+  }
+
+  /** \brief completes when the mapped data is available */
+  const event& ready() const { return ready_; }
+  void wait() { if(ready_.id()) ready_.wait(); }
+
+  T* data() const { return ptr_; }
+  T* begin() const { return ptr_; }
+  T* end() const { return ptr_ + size_; }
+  T& operator[](size_t i) const { return ptr_[i]; }
+  /** \brief number of elements; for images, elements in the first row */
+  size_t size() const { return size_; }
+  bool empty() const { return !ptr_; }
+
+  /** \brief bytes between image rows; 0 for buffers */
+  size_t row_pitch() const { return row_pitch_; }
+  /** \brief bytes between 3d image slices; 0 for buffers and 2d images */
+  size_t slice_pitch() const { return slice_pitch_; }
+  /** \brief first element of row y of slice z */
+  T* row(size_t y, size_t z = 0) const {
+    return reinterpret_cast<T*>(reinterpret_cast<char*>(ptr_) +
+        y * row_pitch_ + z * slice_pitch_);
+  }
+
+private:
+  mapped_view(const mapped_view&);
+  mapped_view& operator=(const mapped_view&);
+
+  cl_wrapper<cl_command_queue> queue_;
+  cl_wrapper<cl_mem> mem_;
+  T *ptr_;
+  size_t size_;
+  size_t row_pitch_;
+  size_t slice_pitch_;
+  event ready_;
+};
+
+/** \brief a corner for the *_rect transfers: x in bytes, y in rows and
+ * z in slices */
+struct rect_origin {
+  rect_origin(size_t x = 0, size_t y = 0, size_t z = 0) {
+    v[0] = x;
+    v[1] = y;
+    v[2] = z;
+  }
+  size_t v[3];
+};
+
+/** \brief an extent for the *_rect transfers: width in bytes, height in
+ * rows and depth in slices */
+struct rect_region {
+  rect_region(size_t width, size_t height = 1, size_t depth = 1) {
+    v[0] = width;
+    v[1] = height;
+    v[2] = depth;
+  }
+  size_t bytes() const { return v[0] * v[1] * v[2]; }
+  size_t v[3];
+};
+
+/** \brief bytes per row and per slice of a buffer or host array; 0
+ * means tightly packed */
+struct rect_pitch {
+  rect_pitch(size_t r = 0, size_t s = 0) : row(r), slice(s) { }
+  size_t row;
+  size_t slice;
+};
+
+/** \brief a contiguous piece of a gather or scatter: size bytes at
+ * offset in the buffer and at host */
+struct transfer_range {
+  transfer_range(size_t o, size_t s, void *h)
+      : offset(o), size(s), host(h) { }
+  size_t offset;
+  size_t size;
+  void *host;
+};
+
+namespace detail {
+
+/** \brief count equally sized pieces, stepping buffer_stride through the
+ * buffer and host_stride through host memory; count 1 is a plain
+ * linear transfer */
+struct transfer_run {
+  size_t offset;
+  char *host;
+  size_t size;
+  size_t count;
+  size_t buffer_stride;
+  size_t host_stride;
+};
+
+/** \brief turns ranges into as few runs as it can: ranges contiguous in
+ * both the buffer and host memory are merged, then equally sized ranges
+ * at constant strides on both sides become one rectangular run.  rows of
+ * a rectangular run must not overlap on either side, since the pitch of
+ * a *_rect transfer cannot be smaller than its width; repeated or
+ * overlapping buffer ranges stay linear */
+inline std::vector<transfer_run> coalesce_ranges(
+    std::vector<transfer_range> ranges) {
+  std::sort(ranges.begin(), ranges.end(),
+      [](const transfer_range &a, const transfer_range &b) {
+        return a.offset < b.offset;
+      });
+
+  std::vector<transfer_run> merged;
+  for(size_t i=0; i<ranges.size(); ++i) {
+    char *host = static_cast<char*>(ranges[i].host);
+    if(!ranges[i].size) continue;
+    if(!merged.empty()) {
+      transfer_run &last = merged.back();
+      if(last.offset + last.size == ranges[i].offset
+          && last.host + last.size == host) {
+        last.size += ranges[i].size;
+        continue;
+      }
+    }
+    transfer_run r = { ranges[i].offset, host, ranges[i].size, 1, 0, 0 };
+    merged.push_back(r);
+  }
+
+  std::vector<transfer_run> to_return;
+  for(size_t i=0; i<merged.size(); ) {
+    transfer_run run = merged[i];
+    size_t j = i + 1;
+    if(j < merged.size() && merged[j].size == run.size
+        && merged[j].offset >= run.offset + run.size
+        && merged[j].host >= run.host + run.size) {
+      run.buffer_stride = merged[j].offset - run.offset;
+      run.host_stride = merged[j].host - run.host;
+      while(j < merged.size() && merged[j].size == run.size
+          && merged[j].offset == run.offset + run.count * run.buffer_stride
+          && merged[j].host == run.host + run.count * run.host_stride) {
+        ++run.count;
+        ++j;
+      }
+    }
+    if(run.count == 1) {
+      run.buffer_stride = run.host_stride = 0;
+      j = i + 1;
+    }
+    to_return.push_back(run);
+    i = j;
+  }
+  return to_return;
+}
+
+}
+
+namespace detail {
+
+/** \brief the version number in a CL_DEVICE_VERSION or
+ * CL_PLATFORM_VERSION string, as major * 10 + minor; 0 if unparsable */
+inline int opencl_version(const std::string &s) {
+  int major = 0, minor = 0;
+  if(std::sscanf(s.c_str(), "OpenCL %d.%d", &major, &minor) != 2) return 0;
+  return major * 10 + minor;
+}
+
+template<int UNUSED> class fill_kernels;
+
+}
+
+template<int UNUSED> class command_graph_;
+template<int UNUSED> class work_group_tuner_;
+template<int UNUSED> class staging_pool_;
+
+/** \brief how a command uses a memory object, for dependency tracking;
+ * see command_queue_::set_tracking() */
+struct mem_access {
+  mem_access(cl_mem m, bool w) : mem(m), write(w) { }
+  cl_mem mem;
+  bool write;
+};
+
+/** \brief the command reads m */
+inline mem_access reads(const cl_wrapper<cl_mem> &m) {
+  return mem_access(m.id(), false);
+}
+/** \brief the command writes m, or reads and writes it */
+inline mem_access writes(const cl_wrapper<cl_mem> &m) {
+  return mem_access(m.id(), true);
+}
+
+namespace detail {
+
+/** \brief the last writer and the readers since then of every memory
+ * object used by a tracked command_queue.  sub-buffers are tracked as
+ * their parent.  an unannotated command acts as a barrier: it waits on
+ * everything outstanding and everything after it waits on it.  commands
+ * are numbered when they collect their dependencies; one still being
+ * enqueued by another thread is waited on through a stand-in user event,
+ * created only when something conflicts with it, and commits arriving
+ * out of order never replace the record of a later command */
+class dependency_tracker {
+public:
+  explicit dependency_tracker(cl_context c)
+      : context_(c), next_(0), barrier_seq_(0), commits_(0) { }
+
+  std::mutex mutex;
+
+  struct slot {
+    std::vector<std::pair<cl_mem, bool> > access;
+    bool barrier;
+    size_t seq;
+    cl_event stand_in;
+  };
+  typedef std::list<slot>::iterator ticket;
+
+  /** \brief appends to wait the events a command must wait on and
+   * registers it as being enqueued.  the caller holds mutex */
+  ticket begin(const mem_access *access, size_t n, bool barrier,
+      std::vector<cl_event> &wait) {
+    slot s;
+    s.barrier = barrier;
+    s.stand_in = NULL;
+    if(!barrier) {
+      for(size_t i = 0; i < n; ++i) {
+        s.access.push_back(std::make_pair(root_(access[i].mem),
+              access[i].write));
+      }
+    }
+
+    if(barrier_.get()) wait.push_back(barrier_.get());
+    if(barrier) {
+      for(entry_map::const_iterator it = entries_.begin();
+          it != entries_.end(); ++it) {
+        append_(it->second, true, wait);
+      }
+    } else {
+      for(size_t i = 0; i < s.access.size(); ++i) {
+        entry_map::const_iterator it = entries_.find(s.access[i].first);
+        if(it != entries_.end()) {
+          append_(it->second, s.access[i].second, wait);
+        }
+      }
+    }
+    for(ticket it = in_flight_.begin(); it != in_flight_.end(); ++it) {
+      if(conflict_(*it, s)) wait.push_back(stand_in_(*it));
+    }
+
+    s.seq = ++next_;
+    in_flight_.push_back(s);
+    return --in_flight_.end();
+  }
+
+  /** \brief records e as the command registered as t.  returns its
+   * stand-in, if any, for the caller to complete with e.  the caller
+   * holds mutex */
+  cl_event commit(ticket t, cl_event e) {
+    cl_event to_return = t->stand_in;
+    if(t->seq > barrier_seq_) {
+      if(t->barrier) commit_barrier_(t->seq, e);
+      else commit_access_(*t, e);
+    }
+    in_flight_.erase(t);
+    if(++commits_ % 256 == 0) sweep_();
+    return to_return;
+  }
+
+  /** \brief forgets t, whose enqueue failed.  returns its stand-in, if
+   * any, for the caller to complete.  the caller holds mutex */
+  cl_event abandon(ticket t) {
+    cl_event to_return = t->stand_in;
+    in_flight_.erase(t);
+    return to_return;
+  }
+
+private:
+  struct reader {
+    cl_wrapper<cl_event> e;
+    size_t seq;
+  };
+  struct entry {
+    entry() : writer_seq(0) { }
+    cl_wrapper<cl_event> writer;
+    size_t writer_seq;
+    std::vector<reader> readers;
+  };
+  typedef std::map<cl_mem, entry> entry_map;
+
+  /** \brief a memory object seen before, retained so that its handle is
+   * not reused while cached, and its parent or itself */
+  struct cached_root {
+    cl_wrapper<cl_mem> mem;
+    cl_mem root;
+  };
+
+  cl_mem root_(cl_mem m) {
+    std::map<cl_mem, cached_root>::const_iterator it = roots_.find(m);
+    if(it != roots_.end()) return it->second.root;
+    cl_mem parent = NULL;
+    cl_int err = clGetMemObjectInfo(m, CL_MEM_ASSOCIATED_MEMOBJECT,
+        sizeof(cl_mem), &parent, NULL);
+    cached_root &c = roots_[m];
+    c.mem.reset(m);
+    c.root = err == CL_SUCCESS && parent ? parent : m;
+    return c.root;
+  }
+
+  static bool conflict_(const slot &a, const slot &b) {
+    if(a.barrier || b.barrier) return true;
+    for(size_t i = 0; i < a.access.size(); ++i) {
+      for(size_t j = 0; j < b.access.size(); ++j) {
+        if(a.access[i].first == b.access[j].first
+            && (a.access[i].second || b.access[j].second)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  cl_event stand_in_(slot &s) {
+    if(!s.stand_in) {
+      cl_int err;
+      s.stand_in = clCreateUserEvent(context_, &err);
+      CHECK_CL_ERROR(err);
+    }
+    return s.stand_in;
+  }
+
+  void commit_barrier_(size_t seq, cl_event e) {
+    // later commands that already committed waited on this one
+    for(entry_map::iterator it = entries_.begin(); it != entries_.end();) {
+      entry &en = it->second;
+      if(en.writer_seq < seq) en.writer.reset();
+      drop_readers_before_(en.readers, seq);
+      if(!en.writer.get() && en.readers.empty()) entries_.erase(it++);
+      else ++it;
+    }
+    barrier_.reset(e);
+    barrier_seq_ = seq;
+  }
+
+  void commit_access_(const slot &s, cl_event e) {
+    for(size_t i = 0; i < s.access.size(); ++i) {
+      entry &en = entries_[s.access[i].first];
+      if(en.writer_seq > s.seq) continue;
+      if(s.access[i].second) {
+        en.writer.reset(e);
+        en.writer_seq = s.seq;
+        drop_readers_before_(en.readers, s.seq);
+      } else {
+        if(en.readers.size() >= 32) prune_(en.readers);
+        en.readers.push_back(reader());
+        en.readers.back().e.reset(e);
+        en.readers.back().seq = s.seq;
+      }
+    }
+  }
+
+  static void append_(const entry &en, bool write,
+      std::vector<cl_event> &wait) {
+    if(en.writer.get()) wait.push_back(en.writer.get());
+    if(!write) return;
+    for(size_t i = 0; i < en.readers.size(); ++i) {
+      wait.push_back(en.readers[i].e.get());
+    }
+  }
+
+  static bool complete_(cl_event e) {
+    cl_int status = CL_QUEUED;
+    clGetEventInfo(e, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int),
+        &status, NULL);
+    return status == CL_COMPLETE;
+  }
+
+  static void drop_readers_before_(std::vector<reader> &readers,
+      size_t seq) {
+    size_t kept = 0;
+    for(size_t i = 0; i < readers.size(); ++i) {
+      if(readers[i].seq < seq) continue;
+      if(kept != i) std::swap(readers[kept], readers[i]);
+      ++kept;
+    }
+    readers.resize(kept);
+  }
+
+  static void prune_(std::vector<reader> &readers) {
+    size_t kept = 0;
+    for(size_t i = 0; i < readers.size(); ++i) {
+      if(complete_(readers[i].e.get())) continue;
+      if(kept != i) std::swap(readers[kept], readers[i]);
+      ++kept;
+    }
+    readers.resize(kept);
+  }
+
+  /** \brief forgets memory objects whose commands have all completed */
+  void sweep_() {
+    for(entry_map::iterator it = entries_.begin(); it != entries_.end();) {
+      entry &en = it->second;
+      if(en.writer.get() && complete_(en.writer.get())) en.writer.reset();
+      prune_(en.readers);
+      if(!en.writer.get() && en.readers.empty()) entries_.erase(it++);
+      else ++it;
+    }
+    for(std::map<cl_mem, cached_root>::iterator it = roots_.begin();
+        it != roots_.end();) {
+      if(entries_.count(it->second.root)) ++it;
+      else roots_.erase(it++);
+    }
+  }
+
+  cl_context context_;
+  entry_map entries_;
+  std::map<cl_mem, cached_root> roots_;
+  std::list<slot> in_flight_;
+  cl_wrapper<cl_event> barrier_;
+  size_t next_;
+  size_t barrier_seq_;
+  size_t commits_;
+};
+
+/** \brief the wait list of one enqueue on a command_queue: the caller's
+ * events, plus the tracked dependencies when t is not NULL.  t is locked
+ * only to collect them and to commit, not across the enqueue; a command
+ * that is never committed is abandoned when this goes out of scope */
+class tracked_wait {
+public:
+  tracked_wait(dependency_tracker *t, cl_uint num_events, event *events,
+      const mem_access *access, size_t n, bool barrier = false)
+      : tracker_(t), pending_(false) {
+    const cl_event *ids = reinterpret_cast<const cl_event*>(events);
+    if(!tracker_) {
+      size_ = num_events;
+      list_ = ids;
+      return;
+    }
+    if(num_events) wait_.assign(ids, ids + num_events);
+    {
+      std::lock_guard<std::mutex> lock(tracker_->mutex);
+      ticket_ = tracker_->begin(access, n, barrier, wait_);
+      pending_ = true;
+      // other threads may commit and drop these before the enqueue
+      held_.assign(wait_.begin() + num_events, wait_.end());
+      for(size_t i = 0; i < held_.size(); ++i) clRetainEvent(held_[i]);
+    }
+    std::sort(wait_.begin(), wait_.end());
+    wait_.erase(std::unique(wait_.begin(), wait_.end()), wait_.end());
+    size_ = cl_uint(wait_.size());
+    list_ = size_ ? &wait_[0] : NULL;
+  }
+  ~tracked_wait() {
+    for(size_t i = 0; i < held_.size(); ++i) clReleaseEvent(held_[i]);
+    if(!pending_) return;
+    cl_event stand_in;
+    {
+      std::lock_guard<std::mutex> lock(tracker_->mutex);
+      stand_in = tracker_->abandon(ticket_);
+    }
+    // the command never ran, so what waited on it need not
+    if(stand_in) {
+      clSetUserEventStatus(stand_in, CL_COMPLETE);
+      clReleaseEvent(stand_in);
+    }
+  }
+
+  cl_uint size() const { return size_; }
+  const cl_event* list() const { return list_; }
+
+  /** \brief records the enqueued command's event */
+  void commit(cl_event e) {
+    if(!pending_ || !e) return;
+    cl_event stand_in;
+    {
+      std::lock_guard<std::mutex> lock(tracker_->mutex);
+      stand_in = tracker_->commit(ticket_, e);
+      pending_ = false;
+    }
+    if(stand_in) follow_(stand_in, e);
+  }
+
+private:
+  tracked_wait(const tracked_wait&);
+  tracked_wait& operator=(const tracked_wait&);
+
+  /** \brief completes stand_in when e does */
+  static void follow_(cl_event stand_in, cl_event e) {
+    try {
+      on_complete(e, [stand_in](cl_int status) {
+        clSetUserEventStatus(stand_in, status);
+        clReleaseEvent(stand_in);
+      });
+    } catch(...) {
+      clWaitForEvents(1, &e);
+      clSetUserEventStatus(stand_in, CL_COMPLETE);
+      clReleaseEvent(stand_in);
+    }
+  }
+
+  dependency_tracker *tracker_;
+  dependency_tracker::ticket ticket_;
+  bool pending_;
+  std::vector<cl_event> wait_;
+  std::vector<cl_event> held_;
+  cl_uint size_;
+  const cl_event *list_;
+};
+
+}
+
+/** \brief command_queue wrapper */
+template<int UNUSED>
+class command_queue_ : public cl_wrapper<cl_command_queue> {
+public:
+  /** \brief standard ctors; see cl_wrapper<> */
+  command_queue_()
+      : cl_wrapper<cl_command_queue>(), recorder_(NULL), capture_(NULL),
+        tuner_(NULL) { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  command_queue_(const command_queue_ &q)
+      : cl_wrapper<cl_command_queue>(q), recorder_(q.recorder_),
+        capture_(NULL), tracker_(q.tracker_), tuner_(q.tuner_) { }
+  /** \brief standard ctors; see cl_wrapper<> */
+  command_queue_(command_queue_ &&q) noexcept
+      : cl_wrapper<cl_command_queue>(std::move(q)),
+        recorder_(q.recorder_), capture_(q.capture_),
+        tracker_(std::move(q.tracker_)), tuner_(q.tuner_) {
+    q.capture_ = NULL;
+  }
+  /** \brief standard ctors; see cl_wrapper<> */
+  command_queue_(cl_command_queue q)
+      : cl_wrapper<cl_command_queue>(q), recorder_(NULL), capture_(NULL),
+        tuner_(NULL) { }
+  /** \brief create a new command queue */
+  command_queue_(const context &c, const device &d,
+    cl_command_queue_properties properties = 0) 
+      : cl_wrapper<cl_command_queue>(), recorder_(NULL), capture_(NULL),
+        tuner_(NULL) {
+    cl_int err;
+    cl_command_queue q = NULL;
+    q = clCreateCommandQueue(c.id(), d.id(), properties, &err);
+    CHECK_CL_ERROR(err);
+    ref_ = q;
+  }
+  ~command_queue_() { end_capture_(); }
+
+  command_queue_& operator=(const command_queue_ &q) {
+    if(this == &q) return *this;
+    cl_wrapper<cl_command_queue>::operator=(q);
+    end_capture_();
+    recorder_ = q.recorder_;
+    tracker_ = q.tracker_;
+    tuner_ = q.tuner_;
+    return *this;
+  }
+  command_queue_& operator=(command_queue_ &&q) noexcept {
+    if(this == &q) return *this;
+    cl_wrapper<cl_command_queue>::operator=(std::move(q));
+    end_capture_();
+    recorder_ = q.recorder_;
+    capture_ = q.capture_;
+    q.capture_ = NULL;
+    tracker_ = std::move(q.tracker_);
+    tuner_ = q.tuner_;
+    return *this;
+  }
+
+  /** \brief records every command enqueued through this object (not
+   * through other wrappers of the same cl_command_queue) into r, until
+   * called again with NULL.  r must outlive the attachment */
+  void set_recorder(command_recorder_<UNUSED> *r) { recorder_ = r; }
+  command_recorder_<UNUSED>* recorder() const { return recorder_; }
+
+  /** \brief until end_capture(), buffer reads, writes and copies and
+   * kernel launches through this object are recorded into g instead of
+   * being enqueued, and return placeholder events that stand for them in
+   * later wait lists.  kernel arguments set on this thread are recorded
+   * too.  other commands throw CL_INVALID_OPERATION while capturing.
+   * the capture belongs to this object: copies of it enqueue as usual, a
+   * move takes the capture along, and destroying or assigning over a
+   * capturing queue ends it.  g must outlive the capture */
+  void begin_capture(command_graph_<UNUSED> &g) {
+    if(capture_) throw cl_error(CL_INVALID_OPERATION);
+    g.begin_(ref_);
+    capture_ = &g;
+  }
+  void end_capture() {
+    if(!capture_) throw cl_error(CL_INVALID_OPERATION);
+    command_graph_<UNUSED> *g = capture_;
+    capture_ = NULL;
+    g->end_();
+  }
+  bool capturing() const { return capture_ != NULL; }
+
+  /** \brief with tracking on, buffer and image transfers and kernel
+   * launches through this object, and copies of it made afterwards, also
+   * wait on the earlier commands that touch the same memory objects: a
+   * read waits on the last write, a write on the last write and the reads
+   * since.  kernel launches declare their accesses with the mem_access
+   * overload of run_kernel(); a launch without them waits on everything
+   * outstanding and everything after it waits on it.  meant for queues
+   * created with CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE.  host memory and
+   * mapped views are not tracked */
+  void set_tracking(bool on) {
+    if(on && !tracker_) {
+      tracker_ = std::make_shared<detail::dependency_tracker>(context());
+    } else if(!on) {
+      tracker_.reset();
+    }
+  }
+  bool tracking() const { return tracker_ != NULL; }
+
+  /** \brief kernel launches through this object with a NULL
+   * local_work_size use the size t has tuned for the kernel, device and
+   * global size, if any, until called again with NULL.  t must outlive
+   * the attachment */
+  void set_tuner(work_group_tuner_<UNUSED> *t) { tuner_ = t; }
+  work_group_tuner_<UNUSED>* tuner() const { return tuner_; }
+
+  event read_buffer(const buffer &src, size_t offset, size_t size, void
+      *dest, cl_uint num_events = 0, event *events = NULL, 
+      bool blocking = false) {
+    if(capture_) {
+      return capture_->capture_transfer_(CL_COMMAND_READ_BUFFER, src.id(),
+          NULL, offset, 0, size, dest, blocking, num_events, events);
+    }
+    mem_access access[] = { reads(src) };
+    detail::tracked_wait wait(tracker_.get(), num_events, events, access, 1);
+    cl_int err;
+    event to_return;
+    err = clEnqueueReadBuffer(ref_, src.id(),
+        blocking ? CL_TRUE : CL_FALSE,
+        offset,
+        size,
+        dest,
+        wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) recorder_->add("read_buffer", size, to_return, ref_);
+    return to_return;
+  }
+
+  event write_buffer(const buffer &dst, size_t offset, size_t size, 
+      void *src, cl_uint num_events = 0, event *events = NULL, 
+      bool blocking = false) {
+    if(capture_) {
+      return capture_->capture_transfer_(CL_COMMAND_WRITE_BUFFER, NULL,
+          dst.id(), 0, offset, size, src, blocking, num_events, events);
+    }
+    mem_access access[] = { writes(dst) };
+    detail::tracked_wait wait(tracker_.get(), num_events, events, access, 1);
+    cl_int err;
+    event to_return;
+    err = clEnqueueWriteBuffer(ref_, dst.id(),
+        blocking ? CL_TRUE : CL_FALSE,
+        offset,
+        size,
+        src,
+        wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) recorder_->add("write_buffer", size, to_return, ref_);
+    return to_return;
+  }
+
+  event copy_buffer(const buffer &src, const buffer &dst, 
+      size_t src_offset, size_t dst_offset,
+      size_t size, 
+      cl_uint num_events = 0, event *events = NULL) {
+    if(capture_) {
+      return capture_->capture_transfer_(CL_COMMAND_COPY_BUFFER, src.id(),
+          dst.id(), src_offset, dst_offset, size, NULL, false, num_events,
+          events);
+    }
+    mem_access access[] = { reads(src), writes(dst) };
+    detail::tracked_wait wait(tracker_.get(), num_events, events, access, 2);
+    cl_int err;
+    event to_return;
+    err = clEnqueueCopyBuffer(ref_, src.id(), dst.id(),
+        src_offset, dst_offset, size,
+        wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) recorder_->add("copy_buffer", size, to_return, ref_);
+    return to_return;
+  }
+
+  /** \brief reads region of src, a 2-D or 3-D array laid out with
+   * buffer_pitch, into dst laid out with host_pitch */
+  event read_buffer_rect(const buffer &src, const rect_origin &buffer_origin,
+      const rect_origin &host_origin, const rect_region &region,
+      const rect_pitch &buffer_pitch, const rect_pitch &host_pitch,
+      void *dst, cl_uint num_events = 0, event *events = NULL,
+      bool blocking = false) {
+    not_capturing_();
+    mem_access access[] = { reads(src) };
+    detail::tracked_wait wait(tracker_.get(), num_events, events, access, 1);
+    cl_int err;
+    event to_return;
+    err = clEnqueueReadBufferRect(ref_, src.id(),
+        blocking ? CL_TRUE : CL_FALSE,
+        buffer_origin.v, host_origin.v, region.v,
+        buffer_pitch.row, buffer_pitch.slice,
+        host_pitch.row, host_pitch.slice,
+        dst, wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) {
+      recorder_->add("read_buffer_rect", region.bytes(), to_return, ref_);
+    }
+    return to_return;
+  }
+
+  /** \brief writes region of src, laid out with host_pitch, into dst
+   * laid out with buffer_pitch */
+  event write_buffer_rect(const buffer &dst,
+      const rect_origin &buffer_origin, const rect_origin &host_origin,
+      const rect_region &region, const rect_pitch &buffer_pitch,
+      const rect_pitch &host_pitch, void *src, cl_uint num_events = 0,
+      event *events = NULL, bool blocking = false) {
+    not_capturing_();
+    mem_access access[] = { writes(dst) };
+    detail::tracked_wait wait(tracker_.get(), num_events, events, access, 1);
+    cl_int err;
+    event to_return;
+    err = clEnqueueWriteBufferRect(ref_, dst.id(),
+        blocking ? CL_TRUE : CL_FALSE,
+        buffer_origin.v, host_origin.v, region.v,
+        buffer_pitch.row, buffer_pitch.slice,
+        host_pitch.row, host_pitch.slice,
+        src, wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) {
+      recorder_->add("write_buffer_rect", region.bytes(), to_return, ref_);
+    }
+    return to_return;
+  }
+
+  event copy_buffer_rect(const buffer &src, const buffer &dst,
+      const rect_origin &src_origin, const rect_origin &dst_origin,
+      const rect_region &region, const rect_pitch &src_pitch,
+      const rect_pitch &dst_pitch, cl_uint num_events = 0,
+      event *events = NULL) {
+    not_capturing_();
+    mem_access access[] = { reads(src), writes(dst) };
+    detail::tracked_wait wait(tracker_.get(), num_events, events, access, 2);
+    cl_int err;
+    event to_return;
+    err = clEnqueueCopyBufferRect(ref_, src.id(), dst.id(),
+        src_origin.v, dst_origin.v, region.v,
+        src_pitch.row, src_pitch.slice,
+        dst_pitch.row, dst_pitch.slice,
+        wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) {
+      recorder_->add("copy_buffer_rect", region.bytes(), to_return, ref_);
+    }
+    return to_return;
+  }
+
+  /** \brief reads each range of src to its host pointer, coalescing
+   * neighbouring and evenly strided ranges into single linear or
+   * rectangular transfers.  returns an event for all of them */
+  event gather(const buffer &src, const std::vector<transfer_range> &ranges,
+      cl_uint num_events = 0, event *events = NULL) {
+    return transfer_ranges_(src, ranges, false, num_events, events);
+  }
+
+  /** \brief writes each range from its host pointer into dst, coalescing
+   * like gather().  ranges must not overlap in dst */
+  event scatter(const buffer &dst, const std::vector<transfer_range> &ranges,
+      cl_uint num_events = 0, event *events = NULL) {
+    return transfer_ranges_(dst, ranges, true, num_events, events);
+  }
+
+  /** \brief fills size bytes of dst from offset with copies of the
+   * pattern_size byte pattern, without a transfer from the host.
+   * pattern_size must be a power of two no larger than 128 that divides
+   * offset and size.  devices older than OpenCL 1.2 use a fill kernel
+   * built once per context */
+  event fill_buffer(const buffer &dst, const void *pattern,
+      size_t pattern_size, size_t offset, size_t size,
+      cl_uint num_events = 0, event *events = NULL) {
+    not_capturing_();
+    if(!pattern_size || pattern_size > 128
+        || (pattern_size & (pattern_size - 1))
+        || offset % pattern_size || size % pattern_size) {
+      throw cl_error(CL_INVALID_VALUE);
+    }
+#ifdef CL_VERSION_1_2
+    if(native_fill_()) {
+      mem_access access[] = { writes(dst) };
+      detail::tracked_wait wait(tracker_.get(), num_events, events,
+          access, 1);
+      event to_return;
+      cl_int err = clEnqueueFillBuffer(ref_, dst.id(), pattern,
+          pattern_size, offset, size, wait.size(), wait.list(),
+          reinterpret_cast<cl_event*>(&to_return));
+      CHECK_CL_ERROR(err);
+      wait.commit(to_return.id());
+      if(recorder_) recorder_->add("fill_buffer", size, to_return, ref_);
+      return to_return;
+    }
+#endif
+    return detail::fill_kernels<UNUSED>::get(context())->fill_buffer(
+        *this, dst, pattern, pattern_size, offset, size, num_events,
+        events);
+  }
+
+  /** \brief sets every pixel of region to color: four cl_floats, or
+   * four cl_ints or cl_uints for unnormalized integer formats.  like
+   * fill_buffer, falls back to a kernel before OpenCL 1.2; the fallback
+   * fills a scratch 2d image and copies it into each slice of region
+      \param origin: 3-element size_t array
+      \param region: 3-element size_t array */
+  template<typename T>
+  event fill_image(const T &image, const void *color,
+      const size_t *origin, const size_t *region,
+      cl_uint num_events = 0, event *events = NULL) {
+    not_capturing_();
+#ifdef CL_VERSION_1_2
+    if(native_fill_()) {
+      mem_access access[] = { writes(image) };
+      detail::tracked_wait wait(tracker_.get(), num_events, events,
+          access, 1);
+      event to_return;
+      cl_int err = clEnqueueFillImage(ref_, image.id(), color, origin,
+          region, wait.size(), wait.list(),
+          reinterpret_cast<cl_event*>(&to_return));
+      CHECK_CL_ERROR(err);
+      wait.commit(to_return.id());
+      if(recorder_) {
+        recorder_->add("fill_image",
+            detail::image_region_bytes(image.id(), region), to_return,
+            ref_);
+      }
+      return to_return;
+    }
+#endif
+    return detail::fill_kernels<UNUSED>::get(context())->fill_image(
+        *this, image.id(), color, origin, region, num_events, events);
+  }
+
+  event run_kernel(const kernel &k, cl_uint work_dim, 
+      const size_t *global_work_size,
+      const size_t *local_work_size,
+      cl_uint num_events = 0,
+      event *events = NULL) {
+    return run_kernel(k, work_dim, NULL, global_work_size,
+        local_work_size, num_events, events);
+  }
+
+  /** \brief like run_kernel() above, but global ids start at
+   * global_work_offset (work_dim elements, or NULL for 0) */
+  event run_kernel(const kernel &k, cl_uint work_dim,
+      const size_t *global_work_offset,
+      const size_t *global_work_size,
+      const size_t *local_work_size,
+      cl_uint num_events,
+      event *events) {
+    return run_kernel_(k, work_dim, global_work_offset, global_work_size,
+        local_work_size, NULL, 0, true, num_events, events);
+  }
+
+  /** \brief like run_kernel() above, declaring the memory objects the
+   * kernel reads and writes, e.g. { reads(a), writes(b) }, for queues with
+   * set_tracking() on */
+  event run_kernel(const kernel &k, cl_uint work_dim,
+      const size_t *global_work_size,
+      const size_t *local_work_size,
+      const std::vector<mem_access> &access,
+      cl_uint num_events = 0,
+      event *events = NULL) {
+    return run_kernel_(k, work_dim, NULL, global_work_size,
+        local_work_size, access.empty() ? NULL : &access[0], access.size(),
+        false, num_events, events);
+  }
+
+  /** \brief like run_kernel() above, with a global_work_offset */
+  event run_kernel(const kernel &k, cl_uint work_dim,
+      const size_t *global_work_offset,
+      const size_t *global_work_size,
+      const size_t *local_work_size,
+      const std::vector<mem_access> &access,
+      cl_uint num_events = 0,
+      event *events = NULL) {
+    return run_kernel_(k, work_dim, global_work_offset, global_work_size,
+        local_work_size, access.empty() ? NULL : &access[0], access.size(),
+        false, num_events, events);
+  }
+
+  /** \brief runs k over the range in tiles along its last dimension, each
+   * sized to take about budget_seconds, so that no single launch trips a
+   * display watchdog and other work can run between tiles.  the first
+   * tile is a small probe; later tiles are sized from the measured time
+   * per work-group row, using profiling when the queue has it.  at most
+   * in_flight tiles are outstanding; each time one completes, between (if
+   * set) may enqueue urgent work on this queue ahead of the next tile.
+   * without CL_QUEUE_PROFILING_ENABLE tiles are timed on the host, so
+   * in_flight is taken as 1 and the work between() enqueues is finished
+   * before the next tile is issued, leaving nothing else in the measured
+   * interval.  every tile waits on the given events.  returns an event
+   * for the whole range */
+  event tiled_launch(const kernel &k, cl_uint work_dim,
+      const size_t *global_work_offset,
+      const size_t *global_work_size,
+      const size_t *local_work_size,
+      double budget_seconds,
+      const std::function<void(command_queue_&)> &between =
+        std::function<void(command_queue_&)>(),
+      unsigned in_flight = 2,
+      cl_uint num_events = 0,
+      event *events = NULL) {
+    not_capturing_();
+    if(work_dim < 1 || work_dim > 3) throw cl_error(CL_INVALID_WORK_DIMENSION);
+    if(!(budget_seconds > 0)) throw cl_error(CL_INVALID_VALUE);
+    const bool profiled = (properties() & CL_QUEUE_PROFILING_ENABLE) != 0;
+    if(!in_flight || !profiled) in_flight = 1;
+
+    const cl_uint d = work_dim - 1;
+    size_t offset[3], size[3];
+    for(cl_uint i=0; i<work_dim; ++i) {
+      offset[i] = global_work_offset ? global_work_offset[i] : 0;
+      size[i] = global_work_size[i];
+    }
+    const size_t unit = local_work_size ? local_work_size[d] : 1;
+    if(!unit || size[d] % unit) throw cl_error(CL_INVALID_WORK_GROUP_SIZE);
+    const size_t units = size[d] / unit;
+    const size_t first = offset[d];
+    const double budget_ns = budget_seconds * 1e9;
+    typedef std::chrono::steady_clock clock;
+
+    struct tile {
+      event done;
+      size_t units;
+      clock::time_point issued;
+    };
+    std::vector<tile> pending;
+    detail::event_join join(context());
+    double ns_per_unit = 0;
+    size_t next = 0;
+    try {
+      while(next < units) {
+        // calibrate on the probe before issuing anything else
+        const size_t limit = ns_per_unit ? in_flight : 1;
+        while(pending.size() >= limit) {
+          tile &t = pending.front();
+          t.done.wait();
+          double ns = profiled
+            ? double(t.done.end_time() - t.done.start_time())
+            : std::chrono::duration<double, std::nano>(clock::now()
+                - t.issued).count();
+          double rate = std::max(ns, 1.0) / t.units;
+          ns_per_unit = ns_per_unit ? 0.5 * (ns_per_unit + rate) : rate;
+          pending.erase(pending.begin());
+          if(between) {
+            between(*this);
+            if(!profiled) finish();
+          }
+        }
+
+        size_t n = std::max<size_t>(1, units / 64);
+        if(ns_per_unit) {
+          n = size_t(std::max(1.0, std::min(double(units),
+                  budget_ns / ns_per_unit)));
+        }
+        n = std::min(n, units - next);
+        offset[d] = first + next * unit;
+        size[d] = n * unit;
+        tile t;
+        t.units = n;
+        t.issued = clock::now();
+        t.done = run_kernel(k, work_dim, offset, size, local_work_size,
+            num_events, events);
+        join.add(t.done.id());
+        pending.push_back(t);
+        flush();
+        next += n;
+      }
+    } catch(...) {
+      join.seal();
+      throw;
+    }
+    return join.seal();
+  }
+
+#define COMMAND_QUEUE_PROPERTY(name, cl_name, type) \
+  type name() const { \
+    return detail::command_queue_property_functor<command_queue_<0>, \
+        type>()(*this, cl_name); \
+  }
+  COMMAND_QUEUE_PROPERTY(context, CL_QUEUE_CONTEXT, cl_context);
+  COMMAND_QUEUE_PROPERTY(device, CL_QUEUE_DEVICE, cl_device_id);
+  COMMAND_QUEUE_PROPERTY(properties, CL_QUEUE_PROPERTIES,
+      cl_command_queue_properties);
+#undef COMMAND_QUEUE_PROPERTY
+
+  /** \brief issues all enqueued commands to the device */
+  void flush() {
+    cl_int err;
+    err = clFlush(ref_);
+    CHECK_CL_ERROR(err);
+  }
+
+  /** \brief blocks until all enqueued commands have completed */
+  void finish() {
+    cl_int err;
+    err = clFinish(ref_);
+    CHECK_CL_ERROR(err);
+  }
+
+  /** \brief maps count elements of b starting at element offset; count
+   * 0 maps the rest of the buffer.  throws CL_INVALID_VALUE if offset is
+   * past the end.  non-blocking maps must wait on the view's ready()
+   * event before touching the data */
+  template<typename T>
+  mapped_view<T> map_buffer(const buffer &b, cl_map_flags flags,
+      size_t offset = 0, size_t count = 0,
+      cl_uint num_events = 0, event *events = NULL,
+      bool blocking = true) {
+    not_capturing_();
+    const size_t elements = b.size() / sizeof(T);
+    if(offset > elements) throw cl_error(CL_INVALID_VALUE);
+    if(!count) count = elements - offset;
+    cl_int err;
+    cl_event ready = NULL;
+    void *ptr = clEnqueueMapBuffer(ref_, b.id(),
+        blocking ? CL_TRUE : CL_FALSE,
+        flags,
+        offset * sizeof(T),
+        count * sizeof(T),
+        num_events,
+        reinterpret_cast<cl_event*>(events),
+        &ready,
+        &err);
+    CHECK_CL_ERROR(err);
+    mapped_view<T> to_return(ref_, b.id(), ptr, count, ready);
+    if(recorder_) {
+      recorder_->add("map_buffer", count * sizeof(T), to_return.ready(),
+          ref_);
+    }
+    return to_return;
+  }
+
+  /** \param origin: 3-element size_t array
+      \param region: 3-element size_t array */
+  template<typename T, typename I>
+  mapped_view<T> map_image(const I &image, cl_map_flags flags,
+      const size_t *origin, const size_t *region,
+      cl_uint num_events = 0, event *events = NULL,
+      bool blocking = true) {
+    not_capturing_();
+    cl_int err;
+    cl_event ready = NULL;
+    size_t row_pitch = 0, slice_pitch = 0;
+    void *ptr = clEnqueueMapImage(ref_, image.id(),
+        blocking ? CL_TRUE : CL_FALSE,
+        flags, origin, region,
+        &row_pitch, &slice_pitch,
+        num_events,
+        reinterpret_cast<cl_event*>(events),
+        &ready,
+        &err);
+    CHECK_CL_ERROR(err);
+    mapped_view<T> to_return(ref_, image.id(), ptr, region[0], ready,
+        row_pitch, slice_pitch);
+    if(recorder_) {
+      recorder_->add("map_image",
+          detail::image_region_bytes(image.id(), region),
+          to_return.ready(), ref_);
+    }
+    return to_return;
+  }
+
+  /** \brief returns an event that will complete when all commands
+   * enqueued up to this point have completed execution.  a clFlush()
+   * could be emulated by performing queue.marker().wait(). */
+  event marker() {
+    not_capturing_();
+    cl_int err;
+    event to_return;
+    err = clEnqueueMarker(ref_,
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    return to_return;
+  }
+
+  void wait_for_events(cl_uint num_events, event *events) {
+    not_capturing_();
+    cl_int err;
+    err = clEnqueueWaitForEvents(ref_, num_events,
+        reinterpret_cast<cl_event*>(events));
+    CHECK_CL_ERROR(err);
+  }
+
+  void wait_for_event(const event &e) {
+    not_capturing_();
+    cl_event id = e.id();
+    cl_int err;
+    err = clEnqueueWaitForEvents(ref_, 1, &id);
+    CHECK_CL_ERROR(err);
+  }
+
+  /** \brief nothing enqueued after this point will be executed by the
+   * device until everything before it has completed execution */
+  void barrier() {
+    not_capturing_();
+    cl_int err;
+    err = clEnqueueBarrier(ref_);
+    CHECK_CL_ERROR(err);
+  }
+
+  /** \param origin: 3-element size_t array
+      \param region: 3-element size_t array */
+  template<typename T>
+  event read_image(const T &image, 
+      const size_t *origin, const size_t *region, 
+      void *dst, 
+      int num_events = 0, event *events = NULL,
+      size_t row_pitch = 0, size_t slice_pitch = 0) {
+    not_capturing_();
+    mem_access access[] = { reads(image) };
+    detail::tracked_wait wait(tracker_.get(), cl_uint(num_events), events,
+        access, 1);
+    cl_int err;
+    event to_return;
+    err = clEnqueueReadImage(
+        ref_, image.id(), CL_FALSE, origin, region, row_pitch,
+        slice_pitch, dst, wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) {
+      recorder_->add("read_image",
+          detail::image_region_bytes(image.id(), region), to_return, ref_);
+    }
+    return to_return;
+  }
+
+  /** \param origin: 3-element size_t array
+      \param region: 3-element size_t array */
+  template<typename T>
+  event write_image(const T &image,
+      const size_t *origin, const size_t *region,
+      void *src,
+      size_t row_pitch = 0, size_t slice_pitch = 0,
+      int num_events = 0, event *events = NULL) {
+    not_capturing_();
+    mem_access access[] = { writes(image) };
+    detail::tracked_wait wait(tracker_.get(), cl_uint(num_events), events,
+        access, 1);
+    cl_int err;
+    event to_return;
+    err = clEnqueueWriteImage(
+        ref_, image.id(), CL_FALSE, origin, region, row_pitch,
+        slice_pitch, src, wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) {
+      recorder_->add("write_image",
+          detail::image_region_bytes(image.id(), region), to_return, ref_);
+    }
+    return to_return;
+  }
+
+  /** \param origin: 3-element size_t array
+      \param region: 3-element size_t array */
+  template<typename T>
+  event copy_image_to_buffer(const T &src, buffer &dst, 
+      size_t *origin, size_t *region, size_t offset,
+      cl_uint num_events = 0, event *events = NULL) {
+    not_capturing_();
+    mem_access access[] = { reads(src), writes(dst) };
+    detail::tracked_wait wait(tracker_.get(), num_events, events, access, 2);
+    cl_int err;
+    event to_return;
+    err = clEnqueueCopyImageToBuffer(
+        ref_, src.id(), dst.id(),
+        origin, region, offset,
+        wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) {
+      recorder_->add("copy_image_to_buffer",
+          detail::image_region_bytes(src.id(), region), to_return, ref_);
+    }
+    return to_return;
+  }
+
+  /** \param origin: 3-element size_t array
+      \param region: 3-element size_t array */
+  template<typename T>
+  event copy_buffer_to_image(const buffer &src, T &dst,
+      size_t offset, size_t *origin, size_t *region,
+      cl_uint num_events = 0, event *events = NULL) {
+    not_capturing_();
+    mem_access access[] = { reads(src), writes(dst) };
+    detail::tracked_wait wait(tracker_.get(), num_events, events, access, 2);
+    cl_int err;
+    event to_return;
+    err = clEnqueueCopyBufferToImage(
+        ref_, src.id(), dst.id(),
+        offset, origin, region,
+        wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) {
+      recorder_->add("copy_buffer_to_image",
+          detail::image_region_bytes(dst.id(), region), to_return, ref_);
+    }
+    return to_return;
+  }
+
+private:
+  friend class detail::fill_kernels<UNUSED>;
+  friend class staging_pool_<UNUSED>;
+
+  /** \brief whether the device takes clEnqueueFill*; its version is
+   * read from the cached device_info */
+  bool native_fill_() const {
+    return detail::opencl_version(device_<UNUSED>(device()).version())
+      >= 12;
+  }
+
+  event transfer_ranges_(const buffer &b,
+      const std::vector<transfer_range> &ranges, bool write,
+      cl_uint num_events, event *events) {
+    not_capturing_();
+    std::vector<detail::transfer_run> runs =
+      detail::coalesce_ranges(ranges);
+    if(runs.size() == 1 && runs[0].count == 1) {
+      const detail::transfer_run &r = runs[0];
+      return write
+        ? write_buffer(b, r.offset, r.size, r.host, num_events, events)
+        : read_buffer(b, r.offset, r.size, r.host, num_events, events);
+    }
+
+    detail::event_join join(context());
+    try {
+      for(size_t i=0; i<runs.size(); ++i) {
+        const detail::transfer_run &r = runs[i];
+        event e;
+        if(r.count == 1) {
+          e = write
+            ? write_buffer(b, r.offset, r.size, r.host, num_events, events)
+            : read_buffer(b, r.offset, r.size, r.host, num_events, events);
+        } else {
+          // the run starts at the buffer origin's row, so x and y of the
+          // origin come from dividing its offset by the row pitch
+          const rect_origin origin(r.offset % r.buffer_stride,
+              r.offset / r.buffer_stride);
+          const rect_region region(r.size, r.count);
+          e = write
+            ? write_buffer_rect(b, origin, rect_origin(), region,
+                rect_pitch(r.buffer_stride), rect_pitch(r.host_stride),
+                r.host, num_events, events)
+            : read_buffer_rect(b, origin, rect_origin(), region,
+                rect_pitch(r.buffer_stride), rect_pitch(r.host_stride),
+                r.host, num_events, events);
+        }
+        join.add(e.id());
+      }
+    } catch(...) {
+      join.seal();
+      throw;
+    }
+    return join.seal();
+  }
+
+  event run_kernel_(const kernel &k, cl_uint work_dim,
+      const size_t *global_work_offset,
+      const size_t *global_work_size,
+      const size_t *local_work_size,
+      const mem_access *access, size_t num_access, bool barrier,
+      cl_uint num_events, event *events) {
+    size_t tuned[3];
+    if(!local_work_size && tuner_ && tuner_->local_size(*this, k, work_dim,
+          global_work_size, tuned)) {
+      local_work_size = tuned;
+    }
+    if(capture_) {
+      return capture_->capture_kernel_(k.id(), work_dim, global_work_offset,
+          global_work_size, local_work_size, num_events, events);
+    }
+    detail::tracked_wait wait(tracker_.get(), num_events, events, access,
+        num_access, barrier);
+    cl_int err;
+    event to_return;
+    err = clEnqueueNDRangeKernel(ref_, k.id(), work_dim,
+        global_work_offset, global_work_size, local_work_size,
+        wait.size(), wait.list(),
+        reinterpret_cast<cl_event*>(&to_return));
+    CHECK_CL_ERROR(err);
+    wait.commit(to_return.id());
+    if(recorder_) recorder_->add(k, to_return, ref_);
+    return to_return;
+  }
+
+  void not_capturing_() const {
+    if(capture_) throw cl_error(CL_INVALID_OPERATION);
+  }
+
+  /** \brief end_capture() for the destructor and move assignment */
+  void end_capture_() noexcept {
+    if(!capture_) return;
+    command_graph_<UNUSED> *g = capture_;
+    capture_ = NULL;
+    try {
+      g->end_();
+    } catch(...) { }
+  }
+
+  command_recorder_<UNUSED> *recorder_;
+  command_graph_<UNUSED> *capture_;
+  std::shared_ptr<detail::dependency_tracker> tracker_;
+  work_group_tuner_<UNUSED> *tuner_;
+};
+typedef command_queue_<0> command_queue;
+
+namespace detail {
+
+/** \brief a kernel argument recorded by a command_graph; local
+ * arguments have a size but no bytes */
+struct graph_arg {
+  cl_uint index;
+  size_t size;
+  bool local;
+  std::vector<unsigned char> bytes;
+};
+
+/** \brief one recorded command of a command_graph.  type is the
+ * CL_COMMAND_* value of the command; for reads src is the buffer and host
+ * the destination, for writes dst is the buffer and host the source */
+struct graph_node {
+  graph_node()
+      : type(0), src_offset(0), dst_offset(0), size(0), host(NULL),
+        blocking(false), work_dim(0), has_offset(false), has_local(false) {
+    for(int i = 0; i < 3; ++i) offset[i] = global[i] = local[i] = 0;
+  }
+
+  cl_command_type type;
+  cl_wrapper<cl_mem> src;
+  cl_wrapper<cl_mem> dst;
+  size_t src_offset;
+  size_t dst_offset;
+  size_t size;
+  void *host;
+  bool blocking;
+
+  cl_wrapper<cl_kernel> kernel;
+  cl_uint work_dim;
+  bool has_offset;
+  bool has_local;
+  size_t offset[3];
+  size_t global[3];
+  size_t local[3];
+  std::vector<graph_arg> args;
+
+  /** \brief earlier nodes this one waits on */
+  std::vector<size_t> deps;
+  /** \brief events from outside the capture this one waits on */
+  std::vector<cl_wrapper<cl_event> > external;
+};
+
+}
+
+/** \brief a recorded sequence of buffer transfers and kernel launches
+ * that can be replayed with one pass over precomputed dependency lists.
+ * record with command_queue_::begin_capture() and end_capture(); kernel
+ * arguments set on the capturing thread between the two are recorded and
+ * set again before each replayed launch, while arguments set before
+ * begin_capture() are left as they are.  buffers, scalar arguments,
+ * offsets and host pointers can be patched between replays.  replay
+ * changes the arguments of the recorded kernels, so typed_kernel objects
+ * wrapping them need invalidate() afterwards */
+template<int UNUSED>
+class command_graph_ : private detail::kernel_arg_sink {
+public:
+  command_graph_()
+      : capturing_(false), linked_(0), context_(NULL) { }
+  ~command_graph_() {
+    if(detail::active_arg_sink() == this) detail::active_arg_sink() = NULL;
+    abandon_placeholders_();
+  }
+
+  /** \brief enqueues every recorded command on q.  commands with no
+   * recorded dependencies wait on the given events.  returns an event
+   * that completes with the last command, or a marker if the graph has
+   * several independent tails.  the placeholder events returned while
+   * capturing complete with their commands in the first replay */
+  event replay(command_queue &q, cl_uint num_events = 0,
+      event *events = NULL) {
+    if(capturing_) throw cl_error(CL_INVALID_OPERATION);
+    if(nodes_.empty()) return q.marker();
+    cl_command_queue queue = q.id();
+    done_.assign(nodes_.size(), NULL);
+    try {
+      for(size_t i = 0; i < nodes_.size(); ++i) {
+        done_[i] = enqueue_(queue, nodes_[i], num_events, events);
+        if(i == linked_) {
+          event placeholder = placeholders_[i];
+          detail::on_complete(done_[i], [placeholder](cl_int status) {
+            clSetUserEventStatus(placeholder.id(), status);
+          });
+          ++linked_;
+        }
+      }
+    } catch(...) {
+      release_done_();
+      throw;
+    }
+
+    event to_return;
+    if(tails_.size() == 1) {
+      cl_event tail = done_[tails_[0]];
+      done_[tails_[0]] = NULL;
+      to_return = tail;
+    } else {
+      cl_int err = clEnqueueMarker(queue,
+          reinterpret_cast<cl_event*>(&to_return));
+      if(err != CL_SUCCESS) {
+        release_done_();
+        throw cl_error(err);
+      }
+    }
+    release_done_();
+    return to_return;
+  }
+
+  /** \brief the node recorded for a placeholder event returned while
+   * capturing; throws CL_INVALID_EVENT for other events */
+  size_t node(const event &placeholder) const {
+    typename std::map<cl_event, size_t>::const_iterator it =
+      placeholder_nodes_.find(placeholder.id());
+    if(it == placeholder_nodes_.end()) throw cl_error(CL_INVALID_EVENT);
+    return it->second;
+  }
+
+  /** \brief points every recorded command and kernel argument that
+   * uses from at to */
+  void replace_buffer(const buffer &from, const buffer &to) {
+    cl_mem old_mem = from.id(), new_mem = to.id();
+    for(size_t i = 0; i < nodes_.size(); ++i) {
+      detail::graph_node &n = nodes_[i];
+      if(n.src == old_mem) n.src.reset(new_mem);
+      if(n.dst == old_mem) n.dst.reset(new_mem);
+      for(size_t j = 0; j < n.args.size(); ++j) {
+        detail::graph_arg &a = n.args[j];
+        if(a.local || a.size != sizeof(cl_mem)) continue;
+        if(std::memcmp(&a.bytes[0], &old_mem, sizeof(cl_mem))) continue;
+        std::memcpy(&a.bytes[0], &new_mem, sizeof(cl_mem));
+      }
+    }
+  }
+
+  /** \brief changes argument index of kernel node n */
+  template<typename T>
+  void set_arg(size_t n, cl_uint index, const T &value) {
+    detail::graph_arg &a = arg_(kernel_node_(n), index);
+    a.size = sizeof(T);
+    a.local = false;
+    a.bytes.assign(reinterpret_cast<const unsigned char*>(&value),
+        reinterpret_cast<const unsigned char*>(&value) + sizeof(T));
+  }
+
+  /** \brief changes the __local size of argument index of kernel node n */
+  void set_local_mem_size(size_t n, cl_uint index, size_t bytes) {
+    detail::graph_arg &a = arg_(kernel_node_(n), index);
+    a.size = bytes;
+    a.local = true;
+    a.bytes.clear();
+  }
+
+  /** \brief changes the global work offset of kernel node n; NULL
+   * removes it */
+  void set_global_offset(size_t n, const size_t *offset) {
+    detail::graph_node &k = kernel_node_(n);
+    k.has_offset = offset != NULL;
+    for(cl_uint i = 0; i < k.work_dim; ++i) {
+      k.offset[i] = offset ? offset[i] : 0;
+    }
+  }
+
+  /** \brief changes the buffer offsets and size of transfer node n; the
+   * offset on the host side of a read or write is ignored */
+  void set_transfer(size_t n, size_t src_offset, size_t dst_offset,
+      size_t size) {
+    detail::graph_node &t = transfer_node_(n);
+    t.src_offset = src_offset;
+    t.dst_offset = dst_offset;
+    t.size = size;
+  }
+
+  /** \brief changes the host pointer of read or write node n */
+  void set_host_ptr(size_t n, void *ptr) {
+    detail::graph_node &t = transfer_node_(n);
+    if(t.type == CL_COMMAND_COPY_BUFFER) throw cl_error(CL_INVALID_VALUE);
+    t.host = ptr;
+  }
+
+  size_t size() const { return nodes_.size(); }
+  bool empty() const { return nodes_.empty(); }
+
+  /** \brief forgets every recorded command */
+  void clear() {
+    if(capturing_) throw cl_error(CL_INVALID_OPERATION);
+    abandon_placeholders_();
+    linked_ = 0;
+    nodes_.clear();
+    tails_.clear();
+    placeholders_.clear();
+    placeholder_nodes_.clear();
+  }
+
+private:
+  friend class command_queue_<UNUSED>;
+
+  command_graph_(const command_graph_&);
+  command_graph_& operator=(const command_graph_&);
+
+  void begin_(cl_command_queue queue) {
+    if(capturing_ || detail::active_arg_sink()) {
+      throw cl_error(CL_INVALID_OPERATION);
+    }
+    cl_int err = clGetCommandQueueInfo(queue, CL_QUEUE_CONTEXT,
+        sizeof(cl_context), &context_, NULL);
+    CHECK_CL_ERROR(err);
+    clear();
+    pending_args_.clear();
+    capturing_ = true;
+    detail::active_arg_sink() = this;
+  }
+
+  void end_() {
+    if(detail::active_arg_sink() == this) detail::active_arg_sink() = NULL;
+    capturing_ = false;
+    pending_args_.clear();
+
+    std::vector<bool> has_dependent(nodes_.size(), false);
+    for(size_t i = 0; i < nodes_.size(); ++i) {
+      for(size_t j = 0; j < nodes_[i].deps.size(); ++j) {
+        has_dependent[nodes_[i].deps[j]] = true;
+      }
+    }
+    for(size_t i = 0; i < nodes_.size(); ++i) {
+      if(!has_dependent[i]) tails_.push_back(i);
+    }
+  }
+
+  /** \brief fails the placeholders that no replay has reached, so that
+   * nothing outside the graph waits on them forever */
+  void abandon_placeholders_() {
+    for(size_t i = linked_; i < placeholders_.size(); ++i) {
+      clSetUserEventStatus(placeholders_[i].id(), CL_INVALID_OPERATION);
+    }
+  }
+
+  virtual void set_arg(cl_kernel k, cl_uint index, size_t size,
+      const void *value) {
+    std::vector<detail::graph_arg> &args = pending_args_[k];
+    detail::graph_arg *a = NULL;
+    for(size_t i = 0; i < args.size(); ++i) {
+      if(args[i].index == index) a = &args[i];
+    }
+    if(!a) {
+      args.push_back(detail::graph_arg());
+      a = &args.back();
+      a->index = index;
+    }
+    a->size = size;
+    a->local = value == NULL;
+    const unsigned char *bytes = static_cast<const unsigned char*>(value);
+    if(value) a->bytes.assign(bytes, bytes + size);
+    else a->bytes.clear();
+  }
+
+  event capture_transfer_(cl_command_type type, cl_mem src, cl_mem dst,
+      size_t src_offset, size_t dst_offset, size_t size, void *host,
+      bool blocking, cl_uint num_events, event *events) {
+    detail::graph_node n;
+    n.type = type;
+    n.src.reset(src);
+    n.dst.reset(dst);
+    n.src_offset = src_offset;
+    n.dst_offset = dst_offset;
+    n.size = size;
+    n.host = host;
+    n.blocking = blocking;
+    return add_(n, num_events, events);
+  }
+
+  event capture_kernel_(cl_kernel k, cl_uint work_dim,
+      const size_t *offset, const size_t *global, const size_t *local,
+      cl_uint num_events, event *events) {
+    if(work_dim < 1 || work_dim > 3) throw cl_error(CL_INVALID_WORK_DIMENSION);
+    detail::graph_node n;
+    n.type = CL_COMMAND_NDRANGE_KERNEL;
+    n.kernel.reset(k);
+    n.work_dim = work_dim;
+    n.has_offset = offset != NULL;
+    n.has_local = local != NULL;
+    for(cl_uint i = 0; i < work_dim; ++i) {
+      n.offset[i] = offset ? offset[i] : 0;
+      n.global[i] = global[i];
+      n.local[i] = local ? local[i] : 0;
+    }
+    typename std::map<cl_kernel, std::vector<detail::graph_arg> >::iterator
+      it = pending_args_.find(k);
+    if(it != pending_args_.end()) n.args = it->second;
+    return add_(n, num_events, events);
+  }
+
+  event add_(detail::graph_node &n, cl_uint num_events, event *events) {
+    for(cl_uint i = 0; i < num_events; ++i) {
+      typename std::map<cl_event, size_t>::const_iterator it =
+        placeholder_nodes_.find(events[i].id());
+      if(it != placeholder_nodes_.end()) {
+        n.deps.push_back(it->second);
+      } else {
+        n.external.push_back(cl_wrapper<cl_event>());
+        n.external.back().reset(events[i].id());
+      }
+    }
+
+    cl_int err;
+    event placeholder = clCreateUserEvent(context_, &err);
+    CHECK_CL_ERROR(err);
+    placeholders_.push_back(placeholder);
+    placeholder_nodes_[placeholder.id()] = nodes_.size();
+    nodes_.push_back(std::move(n));
+    return placeholder;
+  }
+
+  cl_event enqueue_(cl_command_queue queue, const detail::graph_node &n,
+      cl_uint num_events, event *events) {
+    wait_.clear();
+    for(size_t i = 0; i < n.deps.size(); ++i) {
+      wait_.push_back(done_[n.deps[i]]);
+    }
+    for(size_t i = 0; i < n.external.size(); ++i) {
+      wait_.push_back(n.external[i].get());
+    }
+    if(n.deps.empty()) {
+      for(cl_uint i = 0; i < num_events; ++i) {
+        wait_.push_back(events[i].id());
+      }
+    }
+    cl_uint num_wait = cl_uint(wait_.size());
+    const cl_event *wait = num_wait ? &wait_[0] : NULL;
+
+    cl_int err = CL_INVALID_OPERATION;
+    cl_event e = NULL;
+    cl_bool blocking = n.blocking ? CL_TRUE : CL_FALSE;
+    switch(n.type) {
+    case CL_COMMAND_READ_BUFFER:
+      err = clEnqueueReadBuffer(queue, n.src.get(), blocking, n.src_offset,
+          n.size, n.host, num_wait, wait, &e);
+      break;
+    case CL_COMMAND_WRITE_BUFFER:
+      err = clEnqueueWriteBuffer(queue, n.dst.get(), blocking,
+          n.dst_offset, n.size, n.host, num_wait, wait, &e);
+      break;
+    case CL_COMMAND_COPY_BUFFER:
+      err = clEnqueueCopyBuffer(queue, n.src.get(), n.dst.get(),
+          n.src_offset, n.dst_offset, n.size, num_wait, wait, &e);
+      break;
+    case CL_COMMAND_NDRANGE_KERNEL:
+      for(size_t i = 0; i < n.args.size(); ++i) {
+        const detail::graph_arg &a = n.args[i];
+        err = clSetKernelArg(n.kernel.get(), a.index, a.size,
+            a.local ? NULL : &a.bytes[0]);
+        CHECK_CL_ERROR(err);
+      }
+      err = clEnqueueNDRangeKernel(queue, n.kernel.get(), n.work_dim,
+          n.has_offset ? n.offset : NULL, n.global,
+          n.has_local ? n.local : NULL, num_wait, wait, &e);
+      break;
+    }
+    CHECK_CL_ERROR(err);
+    return e;
+  }
+
+  void release_done_() {
+    for(size_t i = 0; i < done_.size(); ++i) {
+      if(done_[i]) clReleaseEvent(done_[i]);
+    }
+    done_.clear();
+  }
+
+  detail::graph_node& kernel_node_(size_t n) {
+    if(n >= nodes_.size() || nodes_[n].type != CL_COMMAND_NDRANGE_KERNEL) {
+      throw cl_error(CL_INVALID_VALUE);
+    }
+    return nodes_[n];
+  }
+
+  detail::graph_node& transfer_node_(size_t n) {
+    if(n >= nodes_.size() || nodes_[n].type == CL_COMMAND_NDRANGE_KERNEL) {
+      throw cl_error(CL_INVALID_VALUE);
+    }
+    return nodes_[n];
+  }
+
+  static detail::graph_arg& arg_(detail::graph_node &n, cl_uint index) {
+    for(size_t i = 0; i < n.args.size(); ++i) {
+      if(n.args[i].index == index) return n.args[i];
+    }
+    n.args.push_back(detail::graph_arg());
+    n.args.back().index = index;
+    return n.args.back();
+  }
+
+  bool capturing_;
+  /** \brief placeholders [0, linked_) complete with a replayed command */
+  size_t linked_;
+  cl_context context_;
+  std::vector<detail::graph_node> nodes_;
+  std::vector<size_t> tails_;
+  std::vector<event> placeholders_;
+  std::map<cl_event, size_t> placeholder_nodes_;
+  std::map<cl_kernel, std::vector<detail::graph_arg> > pending_args_;
+  std::vector<cl_event> done_;
+  std::vector<cl_event> wait_;
+};
+typedef command_graph_<0> command_graph;
+
+namespace detail {
+
+/** \brief shared between a staging_pool and the completion callbacks of
+ * the transfers using its slabs */
+class staging_pool_state {
+public:
+  struct slab {
+    buffer mem;
+    void *host;
+  };
+
+  staging_pool_state(const context &ctx, const command_queue &queue,
+      size_t slab_size, size_t max_slabs)
+      : ctx_(ctx), queue_(ctx, queue.device()), slab_size_(slab_size),
+        max_slabs_(max_slabs), creating_(0), stopping_(false) { }
+  ~staging_pool_state() {
+    stop_worker_();
+  }
+
+  /** \brief returns an idle slab, creating one if the pool is below
+   * max_slabs and otherwise sleeping until release().  every queue
+   * handed to acquire() is flushed before sleeping, so that the
+   * transfers holding slabs can complete */
+  slab* acquire(command_queue &q) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    track_(q);
+    while(idle_.empty()) {
+      if(slabs_.size() + creating_ < max_slabs_) {
+        // map outside the lock; the reservation keeps others under
+        // max_slabs meanwhile
+        ++creating_;
+        lock.unlock();
+        std::unique_ptr<slab> s;
+        try {
+          s = create_();
+        } catch(...) {
+          lock.lock();
+          --creating_;
+          idle_cv_.notify_all();
+          throw;
+        }
+        lock.lock();
+        --creating_;
+        slabs_.push_back(std::move(s));
+        return slabs_.back().get();
+      }
+      lock.unlock();
+      flush_();
+      lock.lock();
+      idle_cv_.wait(lock, [this] {
+        return !idle_.empty() || slabs_.size() + creating_ < max_slabs_;
+      });
+    }
+    slab *s = idle_.back();
+    idle_.pop_back();
+    return s;
+  }
+
+  void release(slab *s) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_back(s);
+    idle_cv_.notify_one();
+  }
+
+  /** \brief runs f on the pool's copy thread, which is started on first
+   * use, so that driver callbacks return at once */
+  void post(const std::function<void()> &f) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(!worker_.joinable()) worker_ = std::thread([this] { work_(); });
+    tasks_.push_back(f);
+    work_cv_.notify_one();
+  }
+
+  /** \brief flushes every queue handed to acquire(), waits for every
+   * slab to come back, then unmaps them all */
+  void shutdown() {
+    flush_();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_cv_.wait(lock, [this] {
+        return idle_.size() == slabs_.size() && !creating_;
+      });
+    }
+    stop_worker_();
+    for(size_t i=0; i<slabs_.size(); ++i) {
+      clEnqueueUnmapMemObject(queue_.id(), slabs_[i]->mem.id(),
+          slabs_[i]->host, 0, NULL, NULL);
+    }
+    clFinish(queue_.id());
+    slabs_.clear();
+    idle_.clear();
+    queues_.clear();
+  }
+
+  size_t slab_size() const { return slab_size_; }
+  const context& ctx() const { return ctx_; }
+
+private:
+  std::unique_ptr<slab> create_() {
+    std::unique_ptr<slab> s(new slab);
+    s->mem = buffer(ctx_, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+        slab_size_);
+    cl_int err;
+    s->host = clEnqueueMapBuffer(queue_.id(), s->mem.id(), CL_TRUE,
+        CL_MAP_READ | CL_MAP_WRITE, 0, slab_size_, 0, NULL, NULL, &err);
+    if(err != CL_SUCCESS) throw cl_error(err);
+    return s;
+  }
+
+  /** \brief caller must hold mutex_ */
+  void track_(const command_queue &q) {
+    for(size_t i=0; i<queues_.size(); ++i) {
+      if(queues_[i].id() == q.id()) return;
+    }
+    queues_.push_back(q);
+  }
+
+  void flush_() {
+    std::vector<command_queue> queues;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queues = queues_;
+    }
+    for(size_t i=0; i<queues.size(); ++i) queues[i].flush();
+  }
+
+  void work_() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for(;;) {
+      work_cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+      if(tasks_.empty()) return;
+      std::function<void()> f = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      f();
+      lock.lock();
+    }
+  }
+
+  void stop_worker_() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      work_cv_.notify_all();
+    }
+    if(worker_.joinable()) worker_.join();
+  }
+
+  std::mutex mutex_;
+  std::condition_variable idle_cv_;
+  std::condition_variable work_cv_;
+  const context ctx_;
+  /** maps and unmaps slabs, so that they never wait behind transfers */
+  command_queue queue_;
+  const size_t slab_size_;
+  const size_t max_slabs_;
+  std::vector<std::unique_ptr<slab> > slabs_;
+  std::vector<slab*> idle_;
+  /** slabs being created outside the lock */
+  size_t creating_;
+  std::vector<command_queue> queues_;
+  std::deque<std::function<void()> > tasks_;
+  bool stopping_;
+  std::thread worker_;
+};
+
+}
+
+/** \brief pool of pinned host slabs (CL_MEM_ALLOC_HOST_PTR buffers kept
+ * mapped) for faster transfers from and to pageable host memory.
+ * staged_write() copies through a slab before the DMA is enqueued, and
+ * staged_read() copies out of one, on the pool's copy thread, when the
+ * DMA completes.  transfers larger than a slab are split into slab-sized
+ * chunks.  each slab returns to the pool when its transfer is done; when
+ * all max_slabs are busy, callers flush the queues the pool has seen and
+ * sleep until one returns.  the destructor does the same until every
+ * slab is back, so staged transfers must not wait on events that are
+ * never completed */
+template<int UNUSED>
+class staging_pool_ {
+public:
+  /** \brief slabs are created on demand and mapped through a queue the
+   * pool creates on queue's device.  queue must belong to ctx */
+  staging_pool_(const context &ctx, const command_queue &queue,
+      size_t slab_size = 4 << 20, size_t max_slabs = 16)
+      : state_(std::make_shared<detail::staging_pool_state>(ctx, queue,
+            slab_size, max_slabs)) { }
+  ~staging_pool_() {
+    state_->shutdown();
+  }
+
+  /** \brief writes size bytes from pageable src to dst at offset.  src
+   * may be reused as soon as this returns.  tracked and recorded on q
+   * like write_buffer() */
+  event staged_write(command_queue &q, const buffer &dst, size_t offset,
+      size_t size, const void *src, cl_uint num_events = 0,
+      event *events = NULL) {
+    q.not_capturing_();
+    const std::shared_ptr<detail::staging_pool_state> state = state_;
+    const size_t slab_size = state->slab_size();
+    // the chunks share one tracked command, so they need not serialize
+    mem_access access[] = { writes(dst) };
+    detail::tracked_wait wait(q.tracker_.get(), num_events, events,
+        access, 1);
+    detail::event_join join(state->ctx().id());
+    for(size_t done = 0; done < size; done += slab_size) {
+      const size_t n = std::min(slab_size, size - done);
+      detail::staging_pool_state::slab *s = state->acquire(q);
+      std::memcpy(s->host, static_cast<const char*>(src) + done, n);
+      cl_event e;
+      cl_int err = clEnqueueWriteBuffer(q.id(), dst.id(), CL_FALSE,
+          offset + done, n, s->host, wait.size(), wait.list(), &e);
+      if(err != CL_SUCCESS) {
+        state->release(s);
+        join.seal();
+        throw cl_error(err);
+      }
+      event chunk(e);
+      join.add(e, [state, s](cl_int) { state->release(s); });
+    }
+    event to_return = join.seal();
+    wait.commit(to_return.id());
+    if(q.recorder_) q.recorder_->add("staged_write", size, to_return, q.id());
+    return to_return;
+  }
+
+  /** \brief reads size bytes from src at offset into pageable dst.  dst
+   * is filled when the returned event completes.  tracked and recorded
+   * on q like read_buffer() */
+  event staged_read(command_queue &q, const buffer &src, size_t offset,
+      size_t size, void *dst, cl_uint num_events = 0,
+      event *events = NULL) {
+    q.not_capturing_();
+    const std::shared_ptr<detail::staging_pool_state> state = state_;
+    const size_t slab_size = state->slab_size();
+    mem_access access[] = { reads(src) };
+    detail::tracked_wait wait(q.tracker_.get(), num_events, events,
+        access, 1);
+    detail::event_join join(state->ctx().id());
+    for(size_t done = 0; done < size; done += slab_size) {
+      const size_t n = std::min(slab_size, size - done);
+      detail::staging_pool_state::slab *s = state->acquire(q);
+      cl_int err;
+      // the join waits for the copy out of the slab, not just the DMA
+      event copied(clCreateUserEvent(state->ctx().id(), &err));
+      if(err != CL_SUCCESS) {
+        state->release(s);
+        join.seal();
+        throw cl_error(err);
+      }
+      cl_event e;
+      err = clEnqueueReadBuffer(q.id(), src.id(), CL_FALSE,
+          offset + done, n, s->host, wait.size(), wait.list(), &e);
+      if(err != CL_SUCCESS) {
+        state->release(s);
+        join.seal();
+        throw cl_error(err);
+      }
+      event chunk(e);
+      join.add(copied.id());
+      char *out = static_cast<char*>(dst) + done;
+      detail::staging_pool_state *raw = state.get();
+      chunk.on_complete([state, raw, s, out, n, copied](cl_int status) {
+        state->post([raw, s, out, n, copied, status] {
+          if(status == CL_COMPLETE) std::memcpy(out, s->host, n);
+          raw->release(s);
+          clSetUserEventStatus(copied.id(), status);
+        });
+      });
+    }
+    event to_return = join.seal();
+    wait.commit(to_return.id());
+    if(q.recorder_) q.recorder_->add("staged_read", size, to_return, q.id());
+    return to_return;
+  }
+
+private:
+  staging_pool_(const staging_pool_&);
+  staging_pool_& operator=(const staging_pool_&);
+
+  std::shared_ptr<detail::staging_pool_state> state_;
+};
+typedef staging_pool_<0> staging_pool;
+
+/** \brief spreads range-partitionable kernel launches over several
+ * devices of one context.  submit() splits the first dimension of the
+ * global range in proportion to each device's weight and returns one
+ * event for the whole launch.  weights start at max_compute_units *
+ * max_clock_frequency and are replaced, per kernel, by the work-items
+ * per nanosecond measured from profiling once every device has run a
+ * piece of that kernel; until then, each unmeasured device gets at least
+ * one piece of every submit.  the kernel must compute its indices from
+ * get_global_id(), which includes the offset of its piece */
+template<int UNUSED>
+class device_scheduler_ {
+public:
+  /** \brief devices defaults to every device in ctx; each device gets
+   * queues_per_device profiling-enabled queues used round-robin */
+  device_scheduler_(const context &ctx,
+      const std::vector<device> &devices = std::vector<device>(),
+      size_t queues_per_device = 1)
+      : ctx_(ctx), devices_(devices.empty() ? ctx.devices() : devices),
+        state_(std::make_shared<state_type>()) {
+    for(size_t i=0; i<devices_.size(); ++i) {
+      queues_.push_back(std::vector<command_queue>());
+      for(size_t j=0; j<std::max<size_t>(queues_per_device, 1); ++j) {
+        queues_.back().push_back(command_queue(ctx_, devices_[i],
+              CL_QUEUE_PROFILING_ENABLE));
+      }
+      state_->guess.push_back(double(devices_[i].max_compute_units()) *
+          std::max<cl_uint>(devices_[i].max_clock_frequency(), 1));
+    }
+    next_queue_.assign(devices_.size(), 0);
+  }
+
+  /** \brief enqueues k over global_work_size, split along dimension 0
+   * in multiples of local_work_size[0] (if given).  the returned event
+   * completes when every piece has, and fails if any piece fails */
+  event submit(const kernel &k, cl_uint work_dim,
+      const size_t *global_work_size,
+      const size_t *local_work_size = NULL,
+      cl_uint num_events = 0, event *events = NULL) {
+    const size_t grain = local_work_size ? local_work_size[0] : 1;
+    const size_t units = global_work_size[0] / grain;
+    const std::vector<size_t> share = shares_(k, units);
+
+    std::vector<size_t> offset(work_dim, 0);
+    std::vector<size_t> global(global_work_size,
+        global_work_size + work_dim);
+    detail::event_join join(ctx_.id());
+    size_t start = 0;
+    for(size_t i=0; i<devices_.size(); ++i) {
+      const size_t n = share[i];
+      if(!n) continue;
+      offset[0] = start * grain;
+      global[0] = n * grain;
+      start += n;
+
+      command_queue &q = queues_[i][next_queue_[i]++ % queues_[i].size()];
+      event e = q.run_kernel(k, work_dim, &offset[0], &global[0],
+          local_work_size, num_events, events);
+      const std::shared_ptr<state_type> state = state_;
+      const cl_event id = e.id();
+      const cl_kernel kid = k.id();
+      const size_t items = n * grain, device_index = i;
+      join.add(id, [state, id, kid, items, device_index](cl_int status) {
+        if(status == CL_COMPLETE) {
+          state->measure(kid, device_index, items, id);
+        }
+      });
+      q.flush();
+    }
+    return join.seal();
+  }
+
+  /** \brief the current relative weight of each device for k */
+  std::vector<double> weights(const kernel &k) const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    typename std::map<cl_kernel, std::vector<double> >::const_iterator i
+      = state_->rates.find(k.id());
+    if(i == state_->rates.end()) return state_->guess;
+    for(size_t d=0; d<i->second.size(); ++d) {
+      if(i->second[d] <= 0) return state_->guess;
+    }
+    return i->second;
+  }
+
+  size_t num_devices() const { return devices_.size(); }
+  const device& device_at(size_t i) const { return devices_[i]; }
+  /** \brief queue j of device i, for work that should not be split */
+  command_queue& queue(size_t i, size_t j = 0) { return queues_[i][j]; }
+
+  /** \brief blocks until everything submitted so far has completed */
+  void finish() {
+    for(size_t i=0; i<queues_.size(); ++i) {
+      for(size_t j=0; j<queues_[i].size(); ++j) queues_[i][j].finish();
+    }
+  }
+
+private:
+  device_scheduler_(const device_scheduler_&);
+  device_scheduler_& operator=(const device_scheduler_&);
+
+  /** \brief splits units over the devices by weight.  a device without a
+   * rate for k yet gets at least one unit, taken from the largest share,
+   * so that it is measured; a measured device may get none */
+  std::vector<size_t> shares_(const kernel &k, size_t units) const {
+    const std::vector<double> w = weights(k);
+    std::vector<bool> measured(w.size(), false);
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      typename std::map<cl_kernel, std::vector<double> >::const_iterator i
+        = state_->rates.find(k.id());
+      for(size_t d=0; i != state_->rates.end() && d<i->second.size(); ++d) {
+        measured[d] = i->second[d] > 0;
+      }
+    }
+    double total = 0;
+    for(size_t i=0; i<w.size(); ++i) total += w[i];
+    std::vector<size_t> to_return(w.size(), 0);
+    size_t given = 0;
+    for(size_t i=0; i+1<w.size(); ++i) {
+      to_return[i] = std::min(units - given,
+          static_cast<size_t>(units * w[i] / total + 0.5));
+      given += to_return[i];
+    }
+    if(!w.empty()) to_return.back() = units - given;
+    for(size_t i=0; i<w.size(); ++i) {
+      if(to_return[i] || measured[i]) continue;
+      const size_t donor = std::max_element(to_return.begin(),
+          to_return.end()) - to_return.begin();
+      if(to_return[donor] < 2) break;
+      --to_return[donor];
+      ++to_return[i];
+    }
+    return to_return;
+  }
+
+  struct state_type {
+    /** \brief folds one piece's work-items per ns into the device's
+     * rate for kernel k; runs on a driver callback thread */
+    void measure(cl_kernel k, size_t device_index, size_t items,
+        cl_event e) {
+      cl_ulong start = 0, end = 0;
+      if(clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_START,
+            sizeof(start), &start, NULL) != CL_SUCCESS) return;
+      if(clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_END,
+            sizeof(end), &end, NULL) != CL_SUCCESS) return;
+      if(end <= start) return;
+      const double rate = double(items) / (end - start);
+      std::lock_guard<std::mutex> lock(mutex);
+      std::vector<double> &r = rates[k];
+      r.resize(guess.size(), 0.0);
+      r[device_index] = r[device_index] > 0 ?
+        0.7 * r[device_index] + 0.3 * rate : rate;
+    }
+
+    std::mutex mutex;
+    std::vector<double> guess;
+    std::map<cl_kernel, std::vector<double> > rates;
+  };
+
+  const context ctx_;
+  const std::vector<device> devices_;
+  std::vector<std::vector<command_queue> > queues_;
+  std::vector<size_t> next_queue_;
+  std::shared_ptr<state_type> state_;
+};
+typedef device_scheduler_<0> device_scheduler;
+
+/** \brief a __local kernel argument of the given size in bytes, for
+ * typed_kernel; see kernel_::set_local_mem_size() */
+struct local_mem {
+  explicit local_mem(size_t b = 0) : bytes(b) { }
+  size_t bytes;
+};
+
+namespace detail {
+
+/** \brief how a typed_kernel argument of type T reaches clSetKernelArg:
+ * the value it caches, and the size and pointer it passes */
+template<typename T, typename Enable = void>
+struct kernel_arg_traits {
+  static_assert(std::is_trivially_copyable<T>::value,
+      "kernel arguments must be trivially copyable");
+  static_assert(!std::is_same<T, bool>::value,
+      "bool is not a valid kernel argument type");
+  static_assert(!std::is_pointer<T>::value,
+      "pass memory objects, not host pointers");
+  typedef T storage;
+  static storage store(const T &v) { return v; }
+  static size_t size(const storage&) { return sizeof(T); }
+  static const void* value(const storage &s) { return &s; }
+};
+
+template<typename T>
+struct kernel_arg_traits<T, typename std::enable_if<
+    std::is_base_of<cl_wrapper<cl_mem>, T>::value>::type> {
+  typedef cl_mem storage;
+  static storage store(const T &v) { return v.id(); }
+  static size_t size(const storage&) { return sizeof(cl_mem); }
+  static const void* value(const storage &s) { return &s; }
+};
+
+template<>
+struct kernel_arg_traits<local_mem> {
+  typedef size_t storage;
+  static storage store(const local_mem &v) { return v.bytes; }
+  static size_t size(const storage &s) { return s; }
+  static const void* value(const storage&) { return NULL; }
+};
+
+template<size_t... I> struct index_list { };
+
+template<size_t N, size_t... I>
+struct make_index_list : make_index_list<N - 1, N - 1, I...> { };
+
+template<size_t... I>
+struct make_index_list<0, I...> {
+  typedef index_list<I...> type;
+};
+
+template<typename... T> struct storage_size;
+template<> struct storage_size<> {
+  static const size_t value = 0;
+};
+template<typename T, typename... Rest>
+struct storage_size<T, Rest...> {
+  static const size_t value = sizeof(typename kernel_arg_traits<T>::storage)
+    + storage_size<Rest...>::value;
+};
+
+}
+
+/** \brief a kernel whose argument types are fixed at compile time.
+ * set_args() binds every argument in one call and skips clSetKernelArg
+ * for arguments whose bytes are unchanged since they were last set
+ * through this object, so relaunching with one scalar changed costs one
+ * driver call.  memory objects (buffer, image2d, image3d) are passed by
+ * handle and local_mem by size.  if the underlying kernel's arguments are
+ * changed some other way, call invalidate() */
+template<typename... Args>
+class typed_kernel {
+public:
+  static_assert(detail::storage_size<Args...>::value <= 1024,
+      "arguments exceed the minimum CL_DEVICE_MAX_PARAMETER_SIZE");
+
+  typed_kernel() {
+    invalidate();
+  }
+  /** \brief throws CL_INVALID_KERNEL_ARGS if k does not take exactly
+   * sizeof...(Args) arguments */
+  explicit typed_kernel(const kernel &k)
+      : kernel_(k) {
+    if(kernel_.num_args() != sizeof...(Args)) {
+      throw cl_error(CL_INVALID_KERNEL_ARGS);
+    }
+    invalidate();
+  }
+
+  typed_kernel& set_args(const Args&... args) {
+    bind_(typename detail::make_index_list<sizeof...(Args)>::type(),
+        args...);
+    return *this;
+  }
+
+  /** \brief binds args and enqueues the kernel on q after the given
+   * events */
+  event operator()(command_queue &q, cl_uint work_dim,
+      const size_t *global_work_size, const size_t *local_work_size,
+      const Args&... args, cl_uint num_events = 0, event *events = NULL) {
+    set_args(args...);
+    return q.run_kernel(kernel_, work_dim, global_work_size,
+        local_work_size, num_events, events);
+  }
+
+  /** \brief like operator() above, but global ids start at
+   * global_work_offset (work_dim elements, or NULL for 0) */
+  event operator()(command_queue &q, cl_uint work_dim,
+      const size_t *global_work_offset, const size_t *global_work_size,
+      const size_t *local_work_size, const Args&... args,
+      cl_uint num_events, event *events) {
+    set_args(args...);
+    return q.run_kernel(kernel_, work_dim, global_work_offset,
+        global_work_size, local_work_size, num_events, events);
+  }
+
+  /** \brief forget which values are bound; the next set_args() sets
+   * every argument */
+  void invalidate() {
+    bound_.fill(false);
+  }
+
+  const kernel& get() const { return kernel_; }
+  operator const kernel&() const { return kernel_; }
+
+private:
+  template<size_t... I>
+  void bind_(detail::index_list<I...>, const Args&... args) {
+    const int expand[] = { 0, (bind_one_<I>(args), 0)... };
+    (void)expand;
+  }
+
+  template<size_t I>
+  void bind_one_(const typename std::tuple_element<I,
+      std::tuple<Args...> >::type &arg) {
+    typedef detail::kernel_arg_traits<typename std::tuple_element<I,
+            std::tuple<Args...> >::type> traits;
+    const typename traits::storage s = traits::store(arg);
+    typename traits::storage &cached = std::get<I>(cache_);
+    detail::kernel_arg_sink *sink = detail::active_arg_sink();
+    if(!sink && bound_[I] && std::memcmp(&cached, &s, sizeof(s)) == 0) {
+      return;
+    }
+    cl_int err = clSetKernelArg(kernel_.id(), I, traits::size(s),
+        traits::value(s));
+    CHECK_CL_ERROR(err);
+    if(sink) sink->set_arg(kernel_.id(), I, traits::size(s),
+        traits::value(s));
+    cached = s;
+    bound_[I] = true;
+  }
+
+  kernel kernel_;
+  std::tuple<typename detail::kernel_arg_traits<Args>::storage...> cache_;
+  std::array<bool, sizeof...(Args)> bound_;
+};
+
+namespace detail {
+
+/** \brief shared state of a kernel_pool: a fixed array of kernel slots
+ * and a lock-free stack of free slot indices.  the stack head packs a
+ * 32-bit ABA tag above the index */
+class kernel_pool_state {
+public:
+  static const uint32_t nil = 0xffffffffu;
+
+  kernel_pool_state(const program &p, const std::string &name,
+      size_t capacity)
+      : program_(p), name_(name), slots_(capacity),
+        next_(new std::atomic<uint32_t>[capacity]),
+        head_(pack_(nil, 0)), created_(0), overflow_(0) {
+    if(capacity >= nil) throw cl_error(CL_INVALID_VALUE);
+  }
+
+  /** \brief pops a free instance into k and returns its slot, or nil if
+   * every slot is taken and k was created outside the pool */
+  uint32_t acquire(kernel &k) {
+    uint64_t h = head_.load(std::memory_order_acquire);
+    while(index_(h) != nil) {
+      uint32_t i = index_(h);
+      uint64_t n = pack_(next_[i].load(std::memory_order_relaxed),
+          tag_(h) + 1);
+      if(head_.compare_exchange_weak(h, n, std::memory_order_acquire,
+            std::memory_order_acquire)) {
+        k = slots_[i];
+        return i;
+      }
+    }
+
+    // create before claiming a slot, so a failed clCreateKernel does not
+    // leave a hole in the pool
+    k = create_();
+    uint32_t c = created_.load(std::memory_order_relaxed);
+    while(c < slots_.size()) {
+      if(created_.compare_exchange_weak(c, c + 1,
+            std::memory_order_relaxed)) {
+        slots_[c] = k;
+        return c;
+      }
+    }
+    overflow_.fetch_add(1, std::memory_order_relaxed);
+    return nil;
+  }
+
+  /** \brief pushes slot i back onto the free stack */
+  void release(uint32_t i) {
+    if(i == nil) return;
+    uint64_t h = head_.load(std::memory_order_relaxed);
+    do {
+      next_[i].store(index_(h), std::memory_order_relaxed);
+    } while(!head_.compare_exchange_weak(h, pack_(i, tag_(h) + 1),
+          std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  size_t capacity() const { return slots_.size(); }
+  size_t created() const { return created_.load(); }
+  size_t overflow() const { return overflow_.load(); }
+
+private:
+  static uint64_t pack_(uint32_t index, uint32_t tag) {
+    return (uint64_t(tag) << 32) | index;
+  }
+  static uint32_t index_(uint64_t h) { return uint32_t(h); }
+  static uint32_t tag_(uint64_t h) { return uint32_t(h >> 32); }
+
+  kernel create_() const {
+    cl_int err;
+    cl_kernel k = clCreateKernel(program_.id(), name_.c_str(), &err);
+    CHECK_CL_ERROR(err);
+    return kernel(k);
+  }
+
+  program program_;
+  std::string name_;
+  std::vector<kernel> slots_;
+  std::unique_ptr<std::atomic<uint32_t>[]> next_;
+  std::atomic<uint64_t> head_;
+  std::atomic<uint32_t> created_;
+  std::atomic<size_t> overflow_;
+};
+
+}
+
+/** \brief an instance borrowed from a kernel_pool.  it is the only user
+ * of its cl_kernel until it goes back to the pool: when the handle is
+ * destroyed or release()d, or when the event passed to release_after()
+ * completes */
+template<int UNUSED>
+class pooled_kernel_ {
+public:
+  pooled_kernel_()
+      : slot_(detail::kernel_pool_state::nil) { }
+  explicit pooled_kernel_(
+      const std::shared_ptr<detail::kernel_pool_state> &pool)
+      : pool_(pool) {
+    slot_ = pool_->acquire(kernel_);
+  }
+  pooled_kernel_(pooled_kernel_ &&p) noexcept
+      : pool_(std::move(p.pool_)), kernel_(std::move(p.kernel_)),
+        slot_(p.slot_) { }
+  ~pooled_kernel_() {
+    release();
+  }
+
+  pooled_kernel_& operator=(pooled_kernel_ &&p) noexcept {
+    if(this == &p) return *this;
+    release();
+    pool_ = std::move(p.pool_);
+    kernel_ = std::move(p.kernel_);
+    slot_ = p.slot_;
+    return *this;
+  }
+
+  /** \brief returns the instance to the pool now */
+  void release() {
+    if(pool_) pool_->release(slot_);
+    pool_.reset();
+    kernel_.reset();
+  }
+
+  /** \brief returns the instance to the pool once e completes; this
+   * handle is empty afterwards */
+  void release_after(const event &e) {
+    if(!pool_) return;
+    std::shared_ptr<detail::kernel_pool_state> pool = pool_;
+    uint32_t slot = slot_;
+    detail::on_complete(e.id(), [pool, slot](cl_int) {
+      pool->release(slot);
+    });
+    pool_.reset();
+    kernel_.reset();
+  }
+
+  /** \brief enqueues the kernel on q and hands it back to the pool when
+   * the launch completes */
+  event launch(command_queue &q, cl_uint work_dim,
+      const size_t *global_work_size, const size_t *local_work_size = NULL,
+      cl_uint num_events = 0, event *events = NULL) {
+    event e = q.run_kernel(kernel_, work_dim, global_work_size,
+        local_work_size, num_events, events);
+    release_after(e);
+    return e;
+  }
+
+  kernel& get() { return kernel_; }
+  const kernel& get() const { return kernel_; }
+  operator const kernel&() const { return kernel_; }
+  cl_kernel id() const { return kernel_.id(); }
+
+private:
+  pooled_kernel_(const pooled_kernel_&);
+  pooled_kernel_& operator=(const pooled_kernel_&);
+
+  std::shared_ptr<detail::kernel_pool_state> pool_;
+  kernel kernel_;
+  uint32_t slot_;
+};
+typedef pooled_kernel_<0> pooled_kernel;
+
+/** \brief hands out exclusive instances of one kernel of a program, so
+ * threads can set arguments and launch without sharing a cl_kernel.
+ * instances are created with clCreateKernel on first demand and kept on a
+ * lock-free free list; past capacity, acquire() creates throwaway
+ * instances that are released rather than pooled */
+template<int UNUSED>
+class kernel_pool_ {
+public:
+  kernel_pool_(const program &p, const std::string &name,
+      size_t capacity = 64)
+      : state_(std::make_shared<detail::kernel_pool_state>(p, name,
+            capacity)) { }
+
+  pooled_kernel acquire() {
+    return pooled_kernel(state_);
+  }
+
+  size_t capacity() const { return state_->capacity(); }
+  /** \brief pooled instances created so far */
+  size_t created() const { return state_->created(); }
+  /** \brief throwaway instances created because the pool was exhausted */
+  size_t overflow() const { return state_->overflow(); }
+
+private:
+  std::shared_ptr<detail::kernel_pool_state> state_;
+};
+typedef kernel_pool_<0> kernel_pool;
+
+namespace detail {
+
+/** \brief values built once per key and shared, most recently used
+ * first, up to capacity.  build runs outside the lock; concurrent get()s
+ * of a key being built wait for it, a failed build is forgotten so the
+ * next get() retries, and builds still running are never evicted */
+template<typename K, typename V>
+class build_cache {
+public:
+  explicit build_cache(size_t capacity)
+      : capacity_(capacity) { }
+
+  /** \brief the value of key, calling build() for a shared_ptr<V> if
+   * there is none; rethrows what build() threw */
+  template<typename F>
+  std::shared_ptr<V> get(const K &key, F build) {
+    typedef std::promise<std::shared_ptr<V> > promise_type;
+    std::unique_ptr<promise_type> mine;
+    std::shared_future<std::shared_ptr<V> > value;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      typename std::map<K, entry>::iterator i = entries_.find(key);
+      if(i != entries_.end()) {
+        lru_.splice(lru_.begin(), lru_, i->second.lru);
+        value = i->second.value;
+      } else {
+        mine.reset(new promise_type());
+        lru_.push_front(key);
+        entry &e = entries_[key];
+        e.value = value = mine->get_future().share();
+        e.build = mine.get();
+        e.lru = lru_.begin();
+        evict_();
+      }
+    }
+    if(mine) {
+      try {
+        mine->set_value(build());
+      } catch(...) {
+        mine->set_exception(std::current_exception());
+        std::lock_guard<std::mutex> lock(mutex_);
+        typename std::map<K, entry>::iterator i = entries_.find(key);
+        if(i != entries_.end() && i->second.build == mine.get()) {
+          lru_.erase(i->second.lru);
+          entries_.erase(i);
+        }
+      }
+    }
+    return value.get();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+private:
+  struct entry {
+    std::shared_future<std::shared_ptr<V> > value;
+    /** \brief the promise behind value, told apart from a later retry */
+    const void *build;
+    typename std::list<K>::iterator lru;
+  };
+
+  void evict_() {
+    typename std::list<K>::iterator i = lru_.end();
+    while(entries_.size() > capacity_ && i != lru_.begin()) {
+      --i;
+      typename std::map<K, entry>::iterator e = entries_.find(*i);
+      if(e->second.value.wait_for(std::chrono::seconds(0))
+          != std::future_status::ready) {
+        continue;
+      }
+      entries_.erase(e);
+      i = lru_.erase(i);
+    }
+  }
+
+  const size_t capacity_;
+  mutable std::mutex mutex_;
+  std::map<K, entry> entries_;
+  std::list<K> lru_;
+};
+
+/** \brief OpenCL C 1.0 stand-ins for clEnqueueFillBuffer.  fill_uint4
+ * writes 16 bytes per work item and is used when offset and size are
+ * multiples of 16 */
+inline const char* fill_buffer_source() {
+  return
+    "__kernel void fill_uint4(__global uint4 *dst,\n"
+    "    __constant uint4 *pattern, ulong first, uint mask) {\n"
+    "  size_t i = get_global_id(0);\n"
+    "  dst[first + i] = pattern[i & mask];\n"
+    "}\n"
+    "__kernel void fill_uchar(__global uchar *dst,\n"
+    "    __constant uchar *pattern, ulong first, uint mask) {\n"
+    "  size_t i = get_global_id(0);\n"
+    "  dst[first + i] = pattern[i & mask];\n"
+    "}\n";
+}
+
+/** \brief stand-ins for clEnqueueFillImage, one per write_image*.  kept
+ * apart from fill_buffer_source() so devices without images still build
+ * that */
+inline const char* fill_image_source() {
+  return
+    "__kernel void fill_imagef(__write_only image2d_t dst,\n"
+    "    float4 color) {\n"
+    "  write_imagef(dst, (int2)(get_global_id(0), get_global_id(1)),\n"
+    "      color);\n"
+    "}\n"
+    "__kernel void fill_imagei(__write_only image2d_t dst,\n"
+    "    int4 color) {\n"
+    "  write_imagei(dst, (int2)(get_global_id(0), get_global_id(1)),\n"
+    "      color);\n"
+    "}\n"
+    "__kernel void fill_imageui(__write_only image2d_t dst,\n"
+    "    uint4 color) {\n"
+    "  write_imageui(dst, (int2)(get_global_id(0), get_global_id(1)),\n"
+    "      color);\n"
+    "}\n";
+}
+
+/** \brief the fallback fill kernels of one context.  the buffer kernels
+ * are built on first use and the image kernels on the first
+ * fill_image(), so a failed image build leaves fill_buffer() working.
+ * the last few contexts used are cached; an entry keeps its context
+ * alive, so a context handle is never reused while it is a key */
+template<int UNUSED>
+class fill_kernels {
+public:
+  static std::shared_ptr<fill_kernels> get(cl_context ctx) {
+    return cache_.get(ctx, [ctx] {
+      clRetainContext(ctx);
+      const context c(ctx);
+      return std::shared_ptr<fill_kernels>(new fill_kernels(c));
+    });
+  }
+
+  /** \brief contexts with kernels cached */
+  static size_t cached() { return cache_.size(); }
+
+  event fill_buffer(command_queue &q, const buffer &dst,
+      const void *pattern, size_t pattern_size, size_t offset, size_t size,
+      cl_uint num_events, event *events) {
+    const bool wide = offset % 16 == 0 && size % 16 == 0;
+    const size_t unit = wide ? 16 : 1;
+    // the wide kernel needs the pattern repeated out to a whole uint4
+    std::vector<char> expanded(std::max(pattern_size, unit));
+    for(size_t i=0; i<expanded.size(); i+=pattern_size) {
+      std::memcpy(&expanded[i], pattern, pattern_size);
+    }
+    buffer p(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        expanded.size(), &expanded[0]);
+
+    pooled_kernel_<UNUSED> k = (wide ? uint4_ : uchar_).acquire();
+    k.get().set_arg(0, dst.id());
+    k.get().set_arg(1, p.id());
+    k.get().set_arg(2, cl_ulong(offset / unit));
+    k.get().set_arg(3, cl_uint(expanded.size() / unit - 1));
+    const size_t global = size / unit;
+    std::vector<mem_access> access(1, writes(dst));
+    event e = q.run_kernel(k.get(), 1, &global, NULL, access,
+        num_events, events);
+    k.release_after(e);
+    return e;
+  }
+
+  /** \brief fills a scratch 2d image of region[0] x region[1] and copies
+   * it into each slice of region.  writes go to the scratch image only,
+   * since 3d images are not writable from OpenCL C 1.0 and 2d images
+   * the caller made read-only are not writable at all */
+  event fill_image(command_queue &q, cl_mem image, const void *color,
+      const size_t *origin, const size_t *region, cl_uint num_events,
+      event *events) {
+    cl_image_format format;
+    cl_int err = clGetImageInfo(image, CL_IMAGE_FORMAT, sizeof(format),
+        &format, NULL);
+    CHECK_CL_ERROR(err);
+    clRetainMemObject(image);
+    const cl_wrapper<cl_mem> target(image);
+    const image2d slice(context_, CL_MEM_READ_WRITE,
+        format.image_channel_order, format.image_channel_data_type,
+        region[0], region[1]);
+
+    pooled_kernel_<UNUSED> k = image_kernels_(format).acquire();
+    k.get().set_arg(0, slice.id());
+    cl_uint raw[4];
+    std::memcpy(raw, color, sizeof(raw));
+    k.get().set_arg(1, raw);
+    const size_t global[] = { region[0], region[1] };
+    std::vector<mem_access> access(1, writes(slice));
+    event e = q.run_kernel(k.get(), 2, global, NULL, access, 0, NULL);
+    k.release_after(e);
+
+    detail::event_join join(context_.id());
+    try {
+      const size_t zero[] = { 0, 0, 0 };
+      const size_t copy_region[] = { region[0], region[1], 1 };
+      for(size_t z=0; z<region[2]; ++z) {
+        std::vector<event> after(events, events + num_events);
+        after.push_back(e);
+        mem_access copy_access[] = { writes(target) };
+        tracked_wait wait(q.tracker_.get(), cl_uint(after.size()),
+            &after[0], copy_access, 1);
+        const size_t dst_origin[] = { origin[0], origin[1], origin[2] + z };
+        event c;
+        err = clEnqueueCopyImage(q.id(), slice.id(), image, zero,
+            dst_origin, copy_region, wait.size(), wait.list(),
+            reinterpret_cast<cl_event*>(&c));
+        CHECK_CL_ERROR(err);
+        wait.commit(c.id());
+        if(q.recorder_) {
+          q.recorder_->add("fill_image",
+              image_region_bytes(image, copy_region), c, q.id());
+        }
+        join.add(c.id());
+      }
+    } catch(...) {
+      join.seal();
+      throw;
+    }
+    return join.seal();
+  }
+
+private:
+  explicit fill_kernels(const context &c)
+      : context_(c), program_(c, fill_buffer_source(), ""),
+        uint4_(program_, "fill_uint4", 16),
+        uchar_(program_, "fill_uchar", 16) { }
+  fill_kernels(const fill_kernels&);
+  fill_kernels& operator=(const fill_kernels&);
+
+  struct image_kernels {
+    explicit image_kernels(const program &p)
+        : program_(p), f(p, "fill_imagef", 16), i(p, "fill_imagei", 16),
+          ui(p, "fill_imageui", 16) { }
+    program program_;
+    kernel_pool_<UNUSED> f;
+    kernel_pool_<UNUSED> i;
+    kernel_pool_<UNUSED> ui;
+  };
+
+  kernel_pool_<UNUSED>& image_kernels_(const cl_image_format &f) {
+    std::unique_lock<std::mutex> lock(images_mutex_);
+    if(!images_) {
+      images_.reset(new image_kernels(program(context_,
+              fill_image_source(), "")));
+    }
+    lock.unlock();
+    switch(f.image_channel_data_type) {
+      case CL_SIGNED_INT8:
+      case CL_SIGNED_INT16:
+      case CL_SIGNED_INT32:
+        return images_->i;
+      case CL_UNSIGNED_INT8:
+      case CL_UNSIGNED_INT16:
+      case CL_UNSIGNED_INT32:
+        return images_->ui;
+      default:
+        return images_->f;
+    }
+  }
+
+  context context_;
+  program program_;
+  kernel_pool_<UNUSED> uint4_;
+  kernel_pool_<UNUSED> uchar_;
+  std::mutex images_mutex_;
+  std::unique_ptr<image_kernels> images_;
+
+  static build_cache<cl_context, fill_kernels> cache_;
+};
+template<int UNUSED> build_cache<cl_context, fill_kernels<UNUSED> >
+    fill_kernels<UNUSED>::cache_(4);
+
+}
+
+/** \brief what one stream_pipeline run did.  the busy times are device
+ * time summed from profiling; a stage's stall is the wall time it spent
+ * idle, waiting on the host or on its neighbours */
+struct stream_stats {
+  cl_ulong chunks;
+  cl_ulong bytes_in;
+  cl_ulong bytes_out;
+  double seconds;
+  /** \brief host time spent in the source and sink callbacks */
+  double source_seconds;
+  double sink_seconds;
+  /** \brief host time spent waiting for a slot to come back */
+  double wait_seconds;
+  double upload_busy;
+  double compute_busy;
+  double download_busy;
+
+  double throughput() const { return seconds ? bytes_in / seconds : 0.0; }
+  double upload_stall() const { return seconds - upload_busy; }
+  double compute_stall() const { return seconds - compute_busy; }
+  double download_stall() const { return seconds - download_busy; }
+};
+
+/** \brief streams input larger than device memory through a kernel
+ * stage in fixed-size chunks.  depth slots, each a device input and
+ * output buffer with pinned host staging, rotate over an upload, a
+ * compute and a download queue so that the transfers of neighbouring
+ * chunks overlap the compute of the current one.  with two queues,
+ * compute and download share one.  the queues are created with
+ * CL_QUEUE_PROFILING_ENABLE for stream_stats */
+template<int UNUSED>
+class stream_pipeline_ {
+public:
+  /** \brief fills at most capacity bytes at dst and returns how many it
+   * wrote; 0 ends the stream */
+  typedef std::function<size_t(void *dst, size_t capacity)> source_type;
+  /** \brief enqueues the work for one chunk on queue, waiting on the
+   * given events, and returns the event of its last command.  out_bytes
+   * starts at in_bytes scaled by out_chunk / in_chunk and may be changed
+   * to the number of bytes written to out */
+  typedef std::function<event(command_queue &queue, const buffer &in,
+      size_t in_bytes, const buffer &out, size_t &out_bytes,
+      cl_uint num_events, event *events)> stage_type;
+  /** \brief consumes bytes of output at src, in chunk order */
+  typedef std::function<void(const void *src, size_t bytes)> sink_type;
+
+  stream_pipeline_(const context &ctx, const device &d, size_t in_chunk,
+      size_t out_chunk, size_t depth = 3, size_t num_queues = 3)
+      : in_chunk_(in_chunk), out_chunk_(out_chunk) {
+    if(!in_chunk || !out_chunk || depth < 2 || num_queues < 2
+        || num_queues > 3) {
+      throw cl_error(CL_INVALID_VALUE);
+    }
+    if(std::max(in_chunk, out_chunk) > d.max_mem_alloc_size()) {
+      throw cl_error(CL_INVALID_BUFFER_SIZE);
+    }
+    upload_ = command_queue(ctx, d, CL_QUEUE_PROFILING_ENABLE);
+    compute_ = command_queue(ctx, d, CL_QUEUE_PROFILING_ENABLE);
+    download_ = num_queues == 3
+      ? command_queue(ctx, d, CL_QUEUE_PROFILING_ENABLE) : compute_;
+
+    for(size_t i = 0; i < depth; ++i) {
+      std::unique_ptr<slot> s(new slot);
+      s->in = buffer(ctx, CL_MEM_READ_ONLY, in_chunk_);
+      s->out = buffer(ctx, CL_MEM_WRITE_ONLY, out_chunk_);
+      s->pinned_in = buffer(ctx, CL_MEM_ALLOC_HOST_PTR, in_chunk_);
+      s->pinned_out = buffer(ctx, CL_MEM_ALLOC_HOST_PTR, out_chunk_);
+      s->host_in = upload_.map_buffer<unsigned char>(s->pinned_in,
+          CL_MAP_WRITE);
+      s->host_out = download_.map_buffer<unsigned char>(s->pinned_out,
+          CL_MAP_READ);
+      s->busy = false;
+      slots_.push_back(std::move(s));
+    }
+  }
+
+  /** \brief pulls chunks from source until it returns 0, runs stage on
+   * each, and hands the results to sink in order.  returns once every
+   * chunk has reached the sink */
+  stream_stats run(const source_type &source, const stage_type &stage,
+      const sink_type &sink) {
+    stream_stats stats = stream_stats();
+    clock::time_point begin = clock::now();
+    size_t next = 0;
+    try {
+      for(;;) {
+        slot &s = *slots_[next % slots_.size()];
+        if(s.busy) drain_(s, sink, stats);
+
+        clock::time_point t = clock::now();
+        s.in_bytes = source(s.host_in.data(), in_chunk_);
+        stats.source_seconds += seconds_(t);
+        if(!s.in_bytes) break;
+        if(s.in_bytes > in_chunk_) throw cl_error(CL_INVALID_VALUE);
+
+        s.upload = upload_.write_buffer(s.in, 0, s.in_bytes,
+            s.host_in.data());
+        s.out_bytes = size_t(double(s.in_bytes) * out_chunk_ / in_chunk_);
+        s.compute = stage(compute_, s.in, s.in_bytes, s.out, s.out_bytes, 1,
+            &s.upload);
+        if(s.out_bytes > out_chunk_) throw cl_error(CL_INVALID_VALUE);
+        s.download = download_.read_buffer(s.out, 0, s.out_bytes,
+            s.host_out.data(), 1, &s.compute);
+        s.busy = true;
+        upload_.flush();
+        compute_.flush();
+        download_.flush();
+
+        ++stats.chunks;
+        stats.bytes_in += s.in_bytes;
+        ++next;
+      }
+      for(size_t i = 0; i < slots_.size(); ++i) {
+        slot &s = *slots_[(next + i) % slots_.size()];
+        if(s.busy) drain_(s, sink, stats);
+      }
+    } catch(...) {
+      upload_.finish();
+      compute_.finish();
+      download_.finish();
+      for(size_t i = 0; i < slots_.size(); ++i) slots_[i]->busy = false;
+      throw;
+    }
+    stats.seconds = seconds_(begin);
+    return stats;
+  }
+
+  size_t depth() const { return slots_.size(); }
+  size_t in_chunk() const { return in_chunk_; }
+  size_t out_chunk() const { return out_chunk_; }
+
+private:
+  typedef std::chrono::steady_clock clock;
+
+  struct slot {
+    buffer in;
+    buffer out;
+    buffer pinned_in;
+    buffer pinned_out;
+    mapped_view<unsigned char> host_in;
+    mapped_view<unsigned char> host_out;
+    size_t in_bytes;
+    size_t out_bytes;
+    event upload;
+    event compute;
+    event download;
+    bool busy;
+  };
+
+  stream_pipeline_(const stream_pipeline_&);
+  stream_pipeline_& operator=(const stream_pipeline_&);
+
+  static double seconds_(clock::time_point since) {
+    return std::chrono::duration<double>(clock::now() - since).count();
+  }
+
+  static double busy_(const event &e) {
+    return (e.end_time() - e.start_time()) * 1e-9;
+  }
+
+  /** \brief waits for s's chunk and passes it to the sink */
+  void drain_(slot &s, const sink_type &sink, stream_stats &stats) {
+    clock::time_point t = clock::now();
+    s.download.wait();
+    stats.wait_seconds += seconds_(t);
+    s.busy = false;
+
+    stats.upload_busy += busy_(s.upload);
+    stats.compute_busy += busy_(s.compute);
+    stats.download_busy += busy_(s.download);
+    stats.bytes_out += s.out_bytes;
+
+    t = clock::now();
+    sink(s.host_out.data(), s.out_bytes);
+    stats.sink_seconds += seconds_(t);
+  }
+
+  const size_t in_chunk_;
+  const size_t out_chunk_;
+  command_queue upload_;
+  command_queue compute_;
+  command_queue download_;
+  std::vector<std::unique_ptr<slot> > slots_;
+};
+typedef stream_pipeline_<0> stream_pipeline;
+
+/** \brief picks local work sizes by timing.  tune() runs a kernel with
+ * each candidate local size (powers of two that divide the global size,
+ * within the device's max_work_item_sizes and the smaller of its
+ * max_work_group_size and the kernel's work_group_size, no smaller than
+ * the kernel's preferred multiple) and with the driver's choice, and
+ * keeps the fastest.  results are keyed by device name and driver
+ * version, the program's source and build options, kernel name and
+ * global size, and persist in a text database at path if one is given.
+ * attach with command_queue_::set_tuner() so launches without a local
+ * size use the tuned one; launches never tune, since tuning runs the
+ * kernel many times with its current arguments and only the caller knows
+ * whether that is safe.  lookups are memoized per kernel object, up to
+ * memo_capacity of them, least recently used first out */
+template<int UNUSED>
+class work_group_tuner_ {
+public:
+  explicit work_group_tuner_(const std::string &path = "",
+      unsigned repeats = 3, size_t memo_capacity = 256)
+      : path_(path), repeats_(repeats ? repeats : 1),
+        memo_capacity_(memo_capacity ? memo_capacity : 1) {
+    std::vector<unsigned char> data;
+    if(path_.empty() || !detail::read_file(path_, data)) return;
+    std::istringstream in(std::string(data.begin(), data.end()));
+    std::string line;
+    while(std::getline(in, line)) {
+      std::istringstream fields(line);
+      std::string hash, name;
+      cl_uint dim;
+      size_t g[3];
+      result r;
+      if(fields >> hash >> name >> dim >> g[0] >> g[1] >> g[2]
+          >> r.local[0] >> r.local[1] >> r.local[2] >> r.ns) {
+        db_[db_key(hash, name, dim, g[0], g[1], g[2])] = r;
+      }
+    }
+  }
+
+  /** \brief times the candidates for k over global on q, which must have
+   * CL_QUEUE_PROFILING_ENABLE, records the fastest, saves the database
+   * and returns the best time in nanoseconds.  local, if not NULL,
+   * receives the chosen size, all zeros if the driver's choice won */
+  cl_ulong tune(command_queue &q, const kernel &k, cl_uint work_dim,
+      const size_t *global_work_size, size_t *local = NULL) {
+    if(work_dim < 1 || work_dim > 3) throw cl_error(CL_INVALID_WORK_DIMENSION);
+    if(!(q.properties() & CL_QUEUE_PROFILING_ENABLE)) {
+      throw cl_error(CL_INVALID_QUEUE_PROPERTIES);
+    }
+    device d(q.device());
+    std::vector<std::array<size_t, 3> > candidates =
+      candidates_(d, k, work_dim, global_work_size);
+    candidates.push_back(std::array<size_t, 3>());
+
+    result best;
+    best.ns = 0;
+    for(size_t i=0; i<candidates.size(); ++i) {
+      const size_t *l = candidates[i][0] ? &candidates[i][0] : NULL;
+      cl_ulong ns = time_(q, k, work_dim, global_work_size, l);
+      if(ns && (!best.ns || ns < best.ns)) {
+        best.ns = ns;
+        for(int j=0; j<3; ++j) best.local[j] = candidates[i][j];
+      }
+    }
+    if(!best.ns) throw cl_error(CL_INVALID_WORK_GROUP_SIZE);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      db_[db_key_(d, k, work_dim, global_work_size)] = best;
+      remember_(memo_key_(d.id(), k, work_dim, global_work_size), k, best);
+    }
+    save();
+    if(local) {
+      for(cl_uint j=0; j<work_dim; ++j) local[j] = best.local[j];
+    }
+    return best.ns;
+  }
+
+  /** \brief fills local with the tuned size for k over global on q's
+   * device and returns true, or returns false if the shape is untuned or
+   * the driver's choice won */
+  bool local_size(const command_queue &q, const kernel &k,
+      cl_uint work_dim, const size_t *global_work_size, size_t *local) {
+    if(work_dim < 1 || work_dim > 3) return false;
+    const cl_device_id id = q.device();
+    const memo_key mk = memo_key_(id, k, work_dim, global_work_size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    typename memo_map::iterator it = memo_.find(mk);
+    const result *r;
+    if(it != memo_.end()) {
+      memo_lru_.splice(memo_lru_.begin(), memo_lru_, it->second.lru);
+      r = &it->second.r;
+    } else {
+      result none;
+      none.ns = 0;
+      for(int j=0; j<3; ++j) none.local[j] = 0;
+      typename db_map::const_iterator db = db_.find(db_key_(device(id),
+            k, work_dim, global_work_size));
+      r = &remember_(mk, k, db != db_.end() ? db->second : none);
+    }
+    if(!r->local[0]) return false;
+    for(cl_uint j=0; j<work_dim; ++j) local[j] = r->local[j];
+    return true;
+  }
+
+  /** \brief number of kernel and shape lookups memoized */
+  size_t memo_size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return memo_.size();
+  }
+
+  /** \brief writes the database to path, if there is one */
+  bool save() const {
+    if(path_.empty()) return false;
+    std::ostringstream out;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for(typename db_map::const_iterator it = db_.begin();
+          it != db_.end(); ++it) {
+        const db_key &key = it->first;
+        const result &r = it->second;
+        out << std::get<0>(key) << " " << std::get<1>(key) << " "
+          << std::get<2>(key) << " " << std::get<3>(key) << " "
+          << std::get<4>(key) << " " << std::get<5>(key) << " "
+          << r.local[0] << " " << r.local[1] << " " << r.local[2] << " "
+          << r.ns << "\n";
+      }
+    }
+    const std::string data = out.str();
+    return detail::write_file_atomic(path_, data.data(), data.size());
+  }
+
+  /** \brief number of tuned shapes in the database */
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return db_.size();
+  }
+
+private:
+  struct result {
+    size_t local[3];
+    cl_ulong ns;
+  };
+  typedef std::tuple<std::string, std::string, cl_uint, size_t, size_t,
+          size_t> db_key;
+  typedef std::map<db_key, result> db_map;
+  typedef std::tuple<cl_device_id, cl_kernel, cl_uint, size_t, size_t,
+          size_t> memo_key;
+  /** \brief per kernel object; holds a reference so the handle cannot be
+   * reused by another kernel while it is a key */
+  struct memo_entry {
+    kernel k;
+    result r;
+    typename std::list<memo_key>::iterator lru;
+  };
+  typedef std::map<memo_key, memo_entry> memo_map;
+
+  work_group_tuner_(const work_group_tuner_&);
+  work_group_tuner_& operator=(const work_group_tuner_&);
+
+  /** \brief memoizes r for mk, evicting the least recently used entry
+   * past capacity.  the caller holds mutex_ */
+  const result& remember_(const memo_key &mk, const kernel &k,
+      const result &r) {
+    typename memo_map::iterator it = memo_.find(mk);
+    if(it == memo_.end()) {
+      memo_lru_.push_front(mk);
+      memo_entry &e = memo_[mk];
+      e.k = k;
+      e.lru = memo_lru_.begin();
+      it = memo_.find(mk);
+      while(memo_.size() > memo_capacity_) {
+        memo_.erase(memo_lru_.back());
+        memo_lru_.pop_back();
+      }
+    } else {
+      memo_lru_.splice(memo_lru_.begin(), memo_lru_, it->second.lru);
+    }
+    it->second.r = r;
+    return it->second.r;
+  }
+
+  static size_t dim_(const size_t *global, cl_uint work_dim, cl_uint i) {
+    return i < work_dim ? global[i] : 1;
+  }
+
+  static db_key db_key_(const device &d, const kernel &k, cl_uint work_dim,
+      const size_t *global) {
+    cl_ulong h = 14695981039346656037ULL;
+    h = detail::fnv1a_field(d.name(), h);
+    h = detail::fnv1a_field(d.driver_version(), h);
+    // same-named kernels of other programs or options tune apart
+    cl_program p;
+    cl_int err = clGetKernelInfo(k.id(), CL_KERNEL_PROGRAM, sizeof(p), &p,
+        NULL);
+    CHECK_CL_ERROR(err);
+    size_t size;
+    err = clGetProgramInfo(p, CL_PROGRAM_SOURCE, 0, NULL, &size);
+    CHECK_CL_ERROR(err);
+    std::string text(size, '\0');
+    err = clGetProgramInfo(p, CL_PROGRAM_SOURCE, size, &text[0], NULL);
+    CHECK_CL_ERROR(err);
+    h = detail::fnv1a_field(text, h);
+    err = clGetProgramBuildInfo(p, d.id(), CL_PROGRAM_BUILD_OPTIONS, 0,
+        NULL, &size);
+    CHECK_CL_ERROR(err);
+    text.assign(size, '\0');
+    err = clGetProgramBuildInfo(p, d.id(), CL_PROGRAM_BUILD_OPTIONS, size,
+        &text[0], NULL);
+    CHECK_CL_ERROR(err);
+    h = detail::fnv1a_field(text, h);
+    return db_key(detail::hex64(h), k.function_name(), work_dim,
+        dim_(global, work_dim, 0), dim_(global, work_dim, 1),
+        dim_(global, work_dim, 2));
+  }
+
+  static memo_key memo_key_(cl_device_id d, const kernel &k,
+      cl_uint work_dim, const size_t *global) {
+    return memo_key(d, k.id(), work_dim, dim_(global, work_dim, 0),
+        dim_(global, work_dim, 1), dim_(global, work_dim, 2));
+  }
+
+  static std::vector<std::array<size_t, 3> > candidates_(const device &d,
+      const kernel &k, cl_uint work_dim, const size_t *global) {
+    const size_t max_group = std::min(d.max_work_group_size(),
+        k.work_group_size(d));
+    const size_t multiple = std::min(max_group,
+        k.preferred_work_group_size_multiple(d));
+    const std::vector<size_t> &max_items = d.max_work_item_sizes();
+
+    std::vector<size_t> sizes[3];
+    for(cl_uint i=0; i<3; ++i) {
+      if(i >= work_dim) {
+        sizes[i].push_back(1);
+        continue;
+      }
+      size_t limit = std::min(global[i],
+          i < max_items.size() ? max_items[i] : global[i]);
+      for(size_t p=1; p<=limit; p*=2) {
+        if(global[i] % p == 0) sizes[i].push_back(p);
+      }
+    }
+
+    std::vector<std::array<size_t, 3> > to_return;
+    for(size_t a=0; a<sizes[0].size(); ++a) {
+      for(size_t b=0; b<sizes[1].size(); ++b) {
+        for(size_t c=0; c<sizes[2].size(); ++c) {
+          size_t n = sizes[0][a] * sizes[1][b] * sizes[2][c];
+          if(n > max_group || n < multiple) continue;
+          std::array<size_t, 3> l = {{ sizes[0][a], sizes[1][b],
+            sizes[2][c] }};
+          to_return.push_back(l);
+        }
+      }
+    }
+    return to_return;
+  }
+
+  /** \brief fastest of repeats timed runs after one warm-up, or 0 if the
+   * driver refuses local */
+  cl_ulong time_(command_queue &q, const kernel &k, cl_uint work_dim,
+      const size_t *global, const size_t *local) const {
+    cl_ulong best = 0;
+    for(unsigned i=0; i<=repeats_; ++i) {
+      event e;
+      cl_int err = clEnqueueNDRangeKernel(q.id(), k.id(), work_dim, NULL,
+          global, local, 0, NULL, reinterpret_cast<cl_event*>(&e));
+      if(err != CL_SUCCESS) return 0;
+      e.wait();
+      if(i == 0) continue;
+      cl_ulong ns = e.end_time() - e.start_time();
+      if(!best || ns < best) best = ns ? ns : 1;
+    }
+    return best;
+  }
+
+  const std::string path_;
+  const unsigned repeats_;
+  const size_t memo_capacity_;
+  mutable std::mutex mutex_;
+  db_map db_;
+  memo_map memo_;
+  std::list<memo_key> memo_lru_;
+};
+typedef work_group_tuner_<0> work_group_tuner;
+
+#ifdef CL_VERSION_1_2
+namespace detail {
+
+/** \brief page-aligned host memory preferring NUMA node node on Linux;
+ * plain pages elsewhere on POSIX and heap memory without it.  bound says
+ * whether the preference took.  freed by release() when its buffer
+ * goes */
+struct numa_block {
+  numa_block(size_t b, unsigned node)
+      : bytes(b), bound(false) {
+#ifdef CL_WRAPPER_POSIX
+    ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED) throw cl_error(CL_OUT_OF_HOST_MEMORY);
+#else
+    ptr = std::malloc(bytes);
+    if(!ptr) throw cl_error(CL_OUT_OF_HOST_MEMORY);
+#endif
+#ifdef __linux__
+    // MPOL_PREFERRED, so that a full node spills over instead of failing;
+    // pages are placed on first touch, after this
+    const int mpol_preferred = 1;
+    unsigned long mask = 0;
+    if(node < 8 * sizeof(mask)) mask = 1UL << node;
+    if(mask) {
+      bound = syscall(SYS_mbind, ptr, bytes, mpol_preferred, &mask,
+          8 * sizeof(mask) + 1, 0) == 0;
+    }
+#else
+    (void)node;
+#endif
+  }
+  ~numa_block() {
+#ifdef CL_WRAPPER_POSIX
+    munmap(ptr, bytes);
+#else
+    std::free(ptr);
+#endif
+  }
+
+  static void CL_CALLBACK release(cl_mem, void *user_data) {
+    delete static_cast<numa_block*>(user_data);
+  }
+
+  void *ptr;
+  size_t bytes;
+  bool bound;
+};
+
+}
+
+/** \brief a device split along its NUMA domains, with a context and
+ * queue per domain.  falls back to
+ * CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE where the driver cannot
+ * split by NUMA node, in which case by_numa() is false and no domain has
+ * a node.  after a NUMA split domain i is assumed to be NUMA node i,
+ * which is how drivers such as pocl order them */
 template<int UNUSED>
-class event_ : public cl_wrapper<cl_event> {
+class numa_domains_ {
 public:
-  /** \brief standard ctors; see cl_wrapper<> */
-  event_() : cl_wrapper<cl_event>() { }
-  /** \brief standard ctors; see cl_wrapper<> */
-  event_(const event_ &e) : cl_wrapper<cl_event>(e) { }
-  /** \brief standard ctors; see cl_wrapper<> */
-  event_(cl_event e) : cl_wrapper<cl_event>(e) { }
+  /** \brief domain::node when the domain is not a known NUMA node */
+  static const unsigned no_node = ~0u;
 
-  void wait() {
-    cl_int err;
-    err = clWaitForEvents(1, &ref_);
+  struct domain {
+    sub_device dev;
+    context ctx;
+    command_queue queue;
+    unsigned node;
+  };
+
+  explicit numa_domains_(const device &d,
+      cl_command_queue_properties properties = 0)
+      : by_numa_(true), unbound_(0) {
+    std::vector<sub_device> parts;
+    try {
+      parts = d.partition_by_affinity_domain(CL_DEVICE_AFFINITY_DOMAIN_NUMA);
+    } catch(const cl_error&) {
+      parts = d.partition_by_affinity_domain(
+          CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE);
+      by_numa_ = false;
+    }
+    const platform p(d.platform());
+    for(size_t i=0; i<parts.size(); ++i) {
+      domain dom;
+      dom.dev = parts[i];
+      const device plain = dom.dev;
+      dom.ctx = context(p, 1, &plain);
+      dom.queue = command_queue(dom.ctx, plain, properties);
+      dom.node = by_numa_ ? unsigned(i) : no_node;
+      domains_.push_back(std::move(dom));
+    }
+  }
+
+  size_t size() const { return domains_.size(); }
+  /** \brief whether the driver split the device by NUMA node */
+  bool by_numa() const { return by_numa_; }
+  /** \brief host_buffer() calls whose memory could not be bound to the
+   * domain's node, because it has none or the kernel refused */
+  unsigned long unbound() const { return unbound_; }
+  domain& operator[](size_t i) { return domains_[i]; }
+  const domain& operator[](size_t i) const { return domains_[i]; }
+
+  /** \brief a CL_MEM_USE_HOST_PTR buffer in domain i's context whose host
+   * memory prefers that domain's node, if it has one (see unbound());
+   * flags must not include another host pointer flag */
+  buffer host_buffer(size_t i, cl_mem_flags flags, size_t size) const {
+    const domain &dom = domains_.at(i);
+    std::unique_ptr<detail::numa_block> block(
+        new detail::numa_block(size, dom.node));
+    if(!block->bound) ++unbound_;
+    buffer to_return(dom.ctx, flags | CL_MEM_USE_HOST_PTR, size,
+        block->ptr);
+    cl_int err = clSetMemObjectDestructorCallback(to_return.id(),
+        &detail::numa_block::release, block.get());
     CHECK_CL_ERROR(err);
+    block.release();
+    return to_return;
   }
+
+private:
+  std::vector<domain> domains_;
+  bool by_numa_;
+  mutable std::atomic<unsigned long> unbound_;
 };
-typedef event_<0> event;
+template<int UNUSED> const unsigned numa_domains_<UNUSED>::no_node;
+typedef numa_domains_<0> numa_domains;
+#endif
 
-template<int N>
-void wait(cl_uint num_events, event_<N> *events) {
-  cl_int err;
-  err = clWaitForEvents(num_events, 
-      reinterpret_cast<cl_event*>(events));
-  CHECK_CL_ERROR(err);
-}
+namespace detail {
 
-/** \brief command_queue wrapper */
+enum device_type_kind { unsigned_type, signed_type, float_type };
+
+/** \brief the OpenCL C spelling of T and of the unsigned type of its
+ * size, the device's preferred vector width for T and what kind of
+ * number T is */
+template<typename T> struct device_type { };
+
+#define CL_WRAPPER_DEVICE_TYPE(T, cl_name, unsigned_cl_name, width, k) \
+template<> struct device_type<T> { \
+  static const char* name() { return #cl_name; } \
+  static const char* unsigned_name() { return #unsigned_cl_name; } \
+  static cl_uint preferred_width(const device &d) { \
+    return d.preferred_vector_width_##width(); \
+  } \
+  static const device_type_kind kind = k; \
+};
+CL_WRAPPER_DEVICE_TYPE(cl_char, char, uchar, char, signed_type)
+CL_WRAPPER_DEVICE_TYPE(cl_uchar, uchar, uchar, char, unsigned_type)
+CL_WRAPPER_DEVICE_TYPE(cl_short, short, ushort, short, signed_type)
+CL_WRAPPER_DEVICE_TYPE(cl_ushort, ushort, ushort, short, unsigned_type)
+CL_WRAPPER_DEVICE_TYPE(cl_int, int, uint, int, signed_type)
+CL_WRAPPER_DEVICE_TYPE(cl_uint, uint, uint, int, unsigned_type)
+CL_WRAPPER_DEVICE_TYPE(cl_long, long, ulong, long, signed_type)
+CL_WRAPPER_DEVICE_TYPE(cl_ulong, ulong, ulong, long, unsigned_type)
+CL_WRAPPER_DEVICE_TYPE(cl_float, float, uint, float, float_type)
+CL_WRAPPER_DEVICE_TYPE(cl_double, double, ulong, double, float_type)
+#undef CL_WRAPPER_DEVICE_TYPE
+
+/** \brief programs generated by device_vector, with a kernel_pool per
+ * kernel, keyed by context and a hash of the source.  the last 64 used
+ * are cached and keep their context alive; builds run outside the cache
+ * lock.  a source whose hash collides with a cached one is built without
+ * being cached */
 template<int UNUSED>
-class command_queue_ : public cl_wrapper<cl_command_queue> {
+class algorithm_programs {
 public:
-  /** \brief standard ctors; see cl_wrapper<> */
-  command_queue_() : cl_wrapper<cl_command_queue>() { }
-  /** \brief standard ctors; see cl_wrapper<> */
-  command_queue_(const command_queue_ &q)
-      : cl_wrapper<cl_command_queue>(q) { }
-  /** \brief standard ctors; see cl_wrapper<> */
-  command_queue_(cl_command_queue q)
-      : cl_wrapper<cl_command_queue>(q) { }
-  /** \brief create a new command queue */
-  command_queue_(const context &c, const device &d,
-    cl_command_queue_properties properties = 0) 
-      : cl_wrapper<cl_command_queue>() {
-    cl_int err;
-    cl_command_queue q = NULL;
-    q = clCreateCommandQueue(c.id(), d.id(), properties, &err);
-    CHECK_CL_ERROR(err);
-    ref_ = q;
+  static pooled_kernel_<UNUSED> acquire(cl_context ctx,
+      const std::string &source, const std::string &name) {
+    const key k(ctx, fnv1a_field(source, 14695981039346656037ULL));
+    std::shared_ptr<entry> e = cache_.get(k, [ctx, &source] {
+      return build_(ctx, source);
+    });
+    if(e->source != source) e = build_(ctx, source);
+    std::lock_guard<std::mutex> lock(e->mutex);
+    std::unique_ptr<kernel_pool_<UNUSED> > &pool = e->pools[name];
+    if(!pool) pool.reset(new kernel_pool_<UNUSED>(e->prog, name, 16));
+    return pool->acquire();
   }
 
-  event read_buffer(const buffer &src, size_t offset, size_t size, void
-      *dest, cl_uint num_events = 0, event *events = NULL, 
-      bool blocking = false) {
-    cl_int err;
-    event to_return;
-    err = clEnqueueReadBuffer(ref_, src.id(),
-        blocking ? CL_TRUE : CL_FALSE,
-        offset,
-        size,
-        dest,
-        num_events,
-        reinterpret_cast<cl_event*>(events),
-        reinterpret_cast<cl_event*>(&to_return));
-    CHECK_CL_ERROR(err);
+  /** \brief programs cached */
+  static size_t cached() { return cache_.size(); }
+
+private:
+  struct entry {
+    context ctx;
+    std::string source;
+    program prog;
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<kernel_pool_<UNUSED> > > pools;
+  };
+  typedef std::pair<cl_context, cl_ulong> key;
+
+  static std::shared_ptr<entry> build_(cl_context ctx,
+      const std::string &source) {
+    std::shared_ptr<entry> to_return = std::make_shared<entry>();
+    clRetainContext(ctx);
+    to_return->ctx = context(ctx);
+    to_return->source = source;
+    to_return->prog = program(to_return->ctx, source, "");
     return to_return;
   }
 
-  event write_buffer(const buffer &dst, size_t offset, size_t size, 
-      void *src, cl_uint num_events = 0, event *events = NULL, 
+  static build_cache<key, entry> cache_;
+};
+template<int UNUSED> build_cache<typename algorithm_programs<UNUSED>::key,
+    typename algorithm_programs<UNUSED>::entry>
+    algorithm_programs<UNUSED>::cache_(64);
+
+inline const char* reduce_source() {
+  return
+    "__kernel void reduce(__global const T *in, ulong n, T init,\n"
+    "    __global T *out, __local T *scratch) {\n"
+    "  size_t lid = get_local_id(0);\n"
+    "  ulong gid = get_global_id(0), gsize = get_global_size(0);\n"
+    "  ulong nv = n / VW;\n"
+    "  TV vacc = (TV)(init);\n"
+    "  for(ulong i = gid; i < nv; i += gsize) {\n"
+    "    vacc = opv(vacc, LOADV(i, in));\n"
+    "  }\n"
+    "  T acc = FOLD(vacc);\n"
+    "  for(ulong i = nv * VW + gid; i < n; i += gsize) {\n"
+    "    acc = op(acc, in[i]);\n"
+    "  }\n"
+    "  scratch[lid] = acc;\n"
+    "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  for(size_t s = get_local_size(0) / 2; s > 0; s >>= 1) {\n"
+    "    if(lid < s) scratch[lid] = op(scratch[lid], scratch[lid + s]);\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  }\n"
+    "  if(lid == 0) out[get_group_id(0)] = scratch[0];\n"
+    "}\n";
+}
+
+inline const char* scan_source() {
+  return
+    "__kernel void scan_blocks(__global const T *in, __global T *out,\n"
+    "    ulong n, __global T *totals, __local T *scratch) {\n"
+    "  size_t lid = get_local_id(0);\n"
+    "  size_t lsize = get_local_size(0);\n"
+    "  ulong base = (ulong)get_global_id(0) * VW;\n"
+    "  T v[VW];\n"
+    "  T run = 0;\n"
+    "  for(int j = 0; j < VW && base + j < n; ++j) {\n"
+    "    run = j ? op(run, in[base + j]) : in[base + j];\n"
+    "    v[j] = run;\n"
+    "  }\n"
+    "  scratch[lid] = run;\n"
+    "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  for(size_t off = 1; off < lsize; off <<= 1) {\n"
+    "    T t = scratch[lid];\n"
+    "    if(lid >= off) t = op(scratch[lid - off], t);\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    scratch[lid] = t;\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  }\n"
+    "  if(base < n) {\n"
+    "    for(int j = 0; j < VW && base + j < n; ++j) {\n"
+    "      out[base + j] = lid ? op(scratch[lid - 1], v[j]) : v[j];\n"
+    "    }\n"
+    "    if(lid == lsize - 1 || base + VW >= n) {\n"
+    "      totals[get_group_id(0)] = scratch[lid];\n"
+    "    }\n"
+    "  }\n"
+    "}\n"
+    "__kernel void add_prefix(__global T *data, ulong n,\n"
+    "    __global const T *totals) {\n"
+    "  size_t g = get_group_id(0);\n"
+    "  if(g == 0) return;\n"
+    "  T p = totals[g - 1];\n"
+    "  ulong base = (ulong)get_global_id(0) * VW;\n"
+    "  for(int j = 0; j < VW && base + j < n; ++j) {\n"
+    "    data[base + j] = op(p, data[base + j]);\n"
+    "  }\n"
+    "}\n";
+}
+
+inline const char* radix_source() {
+  return
+    "#define DIGIT(x, s) ((uint)(KEY(x) >> (s)) & 15u)\n"
+    "__kernel void radix_count(__global const T *keys, ulong n,\n"
+    "    ulong chunk, uint shift, __global uint *hist) {\n"
+    "  size_t id = get_global_id(0);\n"
+    "  size_t items = get_global_size(0);\n"
+    "  uint counts[16];\n"
+    "  for(int d = 0; d < 16; ++d) counts[d] = 0;\n"
+    "  ulong end = min((ulong)(id + 1) * chunk, n);\n"
+    "  for(ulong i = (ulong)id * chunk; i < end; ++i) {\n"
+    "    ++counts[DIGIT(keys[i], shift)];\n"
+    "  }\n"
+    "  for(int d = 0; d < 16; ++d) hist[d * items + id] = counts[d];\n"
+    "}\n"
+    "__kernel void radix_scatter(__global const T *keys, __global T *out,\n"
+    "    ulong n, ulong chunk, uint shift, __global const uint *hist,\n"
+    "    __global const uint *scanned) {\n"
+    "  size_t id = get_global_id(0);\n"
+    "  size_t items = get_global_size(0);\n"
+    "  uint offsets[16];\n"
+    "  for(int d = 0; d < 16; ++d) {\n"
+    "    offsets[d] = scanned[d * items + id] - hist[d * items + id];\n"
+    "  }\n"
+    "  ulong end = min((ulong)(id + 1) * chunk, n);\n"
+    "  for(ulong i = (ulong)id * chunk; i < end; ++i) {\n"
+    "    T x = keys[i];\n"
+    "    out[offsets[DIGIT(x, shift)]++] = x;\n"
+    "  }\n"
+    "}\n";
+}
+
+inline const char* copy_if_source() {
+  return
+    "__kernel void flag(__global const T *in, __global uint *flags,\n"
+    "    ulong n) {\n"
+    "  ulong i = get_global_id(0);\n"
+    "  if(i < n) {\n"
+    "    T x = in[i];\n"
+    "    flags[i] = (PRED) ? 1 : 0;\n"
+    "  }\n"
+    "}\n"
+    "__kernel void compact(__global const T *in, __global T *out,\n"
+    "    __global const uint *pos, ulong n) {\n"
+    "  ulong i = get_global_id(0);\n"
+    "  if(i < n) {\n"
+    "    uint p = pos[i];\n"
+    "    if(p != (i ? pos[i - 1] : 0)) out[p - 1] = in[i];\n"
+    "  }\n"
+    "}\n";
+}
+
+/** \brief whether expr compares, uses a logical operator or ?:, or calls
+ * a relational builtin.  those give -1 for true on vectors but 1 on
+ * scalars, so transform runs such expressions one element at a time */
+inline bool has_relational(const std::string &expr) {
+  static const char *builtins[] = { "isequal", "isnotequal", "isgreater",
+    "isgreaterequal", "isless", "islessequal", "islessgreater", "isfinite",
+    "isinf", "isnan", "isnormal", "isordered", "isunordered", "signbit",
+    "any", "all", "select" };
+  for(size_t i=0; i<expr.size(); ) {
+    const char c = expr[i];
+    if(std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+      size_t end = i;
+      while(end < expr.size() && (std::isalnum(
+              static_cast<unsigned char>(expr[end])) || expr[end] == '_')) {
+        ++end;
+      }
+      const std::string word = expr.substr(i, end - i);
+      for(size_t b=0; b<sizeof(builtins) / sizeof(builtins[0]); ++b) {
+        if(word == builtins[b]) return true;
+      }
+      i = end;
+      continue;
+    }
+    const char next = i + 1 < expr.size() ? expr[i + 1] : '\0';
+    if((c == '<' || c == '>') && next == c) {
+      // a shift
+      i += 2;
+      continue;
+    }
+    if(c == '<' || c == '>' || c == '!' || c == '?'
+        || (c == '=' && next == '=') || (c == '&' && next == '&')
+        || (c == '|' && next == '|')) {
+      return true;
+    }
+    ++i;
+  }
+  return false;
+}
+
+inline const char* transform_source() {
+  return
+    "__kernel void transform(__global const T *in, __global OUT *out,\n"
+    "    ulong n) {\n"
+    "  ulong i = get_global_id(0);\n"
+    "  if((i + 1) * VW <= n) {\n"
+    "    TV x = LOADV(i, in);\n"
+    "    STOREV(CONVERT_OUTV(EXPR), i, out);\n"
+    "  } else {\n"
+    "    for(ulong j = i * VW; j < n; ++j) {\n"
+    "      T x = in[j];\n"
+    "      out[j] = CONVERT_OUT(EXPR);\n"
+    "    }\n"
+    "  }\n"
+    "}\n";
+}
+
+}
+
+/** \brief a typed array in device memory with bulk algorithms.  T is one
+ * of the OpenCL scalar types cl_char through cl_double.  the algorithms
+ * take their operations as OpenCL C source and run kernels generated
+ * from them, built once per context and operation and cached while
+ * recently used.  element-wise kernels process as many elements
+ * per work item as the device's preferred vector width for T, and
+ * reduce and inclusive_scan size their work groups to fit the device's
+ * local memory.  everything is enqueued on the vector's queue and
+ * chained with events, so the queue may be out of order.  vectors move
+ * but do not copy; only the view constructor shares a buffer */
+template<typename T>
+class device_vector {
+public:
+  typedef T value_type;
+
+  device_vector()
+      : size_(0) { }
+  /** \brief an uninitialized vector of n elements */
+  device_vector(const command_queue &q, size_t n,
+      cl_mem_flags flags = CL_MEM_READ_WRITE)
+      : queue_(q), size_(n) {
+    if(n) buffer_ = buffer(queue_context_(), flags, n * sizeof(T));
+  }
+  /** \brief a copy of host, made before the constructor returns */
+  device_vector(const command_queue &q, const std::vector<T> &host,
+      cl_mem_flags flags = CL_MEM_READ_WRITE)
+      : queue_(q), size_(host.size()) {
+    if(size_) {
+      buffer_ = buffer(queue_context_(), flags | CL_MEM_COPY_HOST_PTR,
+          size_ * sizeof(T), const_cast<T*>(&host[0]));
+    }
+  }
+  /** \brief views the first n elements of b */
+  device_vector(const command_queue &q, const buffer &b, size_t n)
+      : queue_(q), buffer_(b), size_(n) { }
+  device_vector(device_vector &&v) noexcept
+      : queue_(std::move(v.queue_)), buffer_(std::move(v.buffer_)),
+        size_(v.size_) {
+    v.size_ = 0;
+  }
+
+  device_vector& operator=(device_vector &&v) noexcept {
+    if(this != &v) {
+      queue_ = std::move(v.queue_);
+      buffer_ = std::move(v.buffer_);
+      size_ = v.size_;
+      v.size_ = 0;
+    }
+    return *this;
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const buffer& get() const { return buffer_; }
+  command_queue& queue() { return queue_; }
+
+  event read(T *dst, cl_uint num_events = 0, event *events = NULL,
       bool blocking = false) {
-    cl_int err;
-    event to_return;
-    err = clEnqueueWriteBuffer(ref_, dst.id(),
-        blocking ? CL_TRUE : CL_FALSE,
-        offset,
-        size,
-        src,
-        num_events,
-        reinterpret_cast<cl_event*>(events),
-        reinterpret_cast<cl_event*>(&to_return));
-    CHECK_CL_ERROR(err);
+    if(!size_) return queue_.marker();
+    return queue_.read_buffer(buffer_, 0, size_ * sizeof(T), dst,
+        num_events, events, blocking);
+  }
+  event write(const T *src, cl_uint num_events = 0, event *events = NULL,
+      bool blocking = false) {
+    if(!size_) return queue_.marker();
+    return queue_.write_buffer(buffer_, 0, size_ * sizeof(T),
+        const_cast<T*>(src), num_events, events, blocking);
+  }
+  /** \brief blocks until every element is read back */
+  std::vector<T> to_host(cl_uint num_events = 0, event *events = NULL) {
+    std::vector<T> to_return(size_);
+    if(size_) read(&to_return[0], num_events, events, true);
     return to_return;
   }
 
-  event copy_buffer(const buffer &src, const buffer &dst, 
-      size_t src_offset, size_t dst_offset,
-      size_t size, 
+  /** \brief sets out[i] to expr for each element x of this vector.  expr
+   * is OpenCL C in x that must also compile with x of T's vector types,
+   * such as "x * 2" or "fabs(x)"; its value is converted to U.  an expr
+   * that compares, as "x > 0" or "isnan(x)" do, runs on scalars only, so
+   * true is always 1.  out must be at least as long as this vector */
+  template<typename U>
+  event transform(device_vector<U> &out, const std::string &expr,
       cl_uint num_events = 0, event *events = NULL) {
-    cl_int err;
-    event to_return;
-    err = clEnqueueCopyBuffer(ref_, src.id(), dst.id(),
-        src_offset, dst_offset, size,
-        num_events, reinterpret_cast<cl_event*>(events),
-        reinterpret_cast<cl_event*>(&to_return));
-    CHECK_CL_ERROR(err);
-    return to_return;
+    if(out.size() < size_) throw cl_error(CL_INVALID_VALUE);
+    if(!size_) return queue_.marker();
+    const cl_uint vw = detail::has_relational(expr) ? 1 : width_();
+    const std::string out_name = detail::device_type<U>::name();
+    std::ostringstream src;
+    src << prelude_(vw, detail::device_type<U>::kind
+        == detail::float_type && sizeof(U) == 8)
+      << "#define OUT " << out_name << "\n"
+      << "#define CONVERT_OUT convert_" << out_name << "\n"
+      << "#define CONVERT_OUTV convert_" << vector_name_(out_name, vw)
+      << "\n#define EXPR (" << expr << ")\n"
+      << detail::transform_source();
+    pooled_kernel k = kernel_(src.str(), "transform");
+    k.get().set_arg(0, buffer_.id());
+    k.get().set_arg(1, out.get().id());
+    k.get().set_arg(2, cl_ulong(size_));
+    return launch_(k, (size_ + vw - 1) / vw, NULL, num_events, events);
   }
 
-  event run_kernel(const kernel &k, cl_uint work_dim, 
-      const size_t *global_work_size,
-      const size_t *local_work_size,
-      cl_uint num_events = 0,
+  /** \brief folds every element with op, OpenCL C in a and b such as
+   * "a + b" or "max(a, b)" that must also compile for T's vector types.
+   * op must be associative and commutative, and init its identity.
+   * blocks until the result is read back */
+  T reduce(const std::string &op, const T &init, cl_uint num_events = 0,
       event *events = NULL) {
-    cl_int err;
-    event to_return;
-    err = clEnqueueNDRangeKernel(ref_, k.id(), work_dim,
-        NULL, global_work_size, local_work_size,
-        num_events,
-        reinterpret_cast<cl_event*>(events),
-        reinterpret_cast<cl_event*>(&to_return));
-    CHECK_CL_ERROR(err);
+    if(!size_) return init;
+    const cl_uint vw = width_();
+    const std::string src = op_prelude_(op, vw) + detail::reduce_source();
+    pooled_kernel k = kernel_(src, "reduce");
+    const device d(queue_.device());
+    const size_t local = local_size_(k.get(), sizeof(T));
+    const size_t items = std::max<size_t>(1, size_ / vw);
+    const size_t groups = std::min((items + local - 1) / local,
+        size_t(d.max_compute_units()) * 4);
+    buffer partials(queue_context_(), CL_MEM_READ_WRITE,
+        groups * sizeof(T));
+
+    k.get().set_arg(0, buffer_.id());
+    k.get().set_arg(1, cl_ulong(size_));
+    k.get().set_arg(2, init);
+    k.get().set_arg(3, partials.id());
+    k.get().set_local_mem_size(4, local * sizeof(T));
+    event e = launch_(k, groups * local, &local, num_events, events);
+    if(groups > 1) {
+      // one more group folds the partials in place
+      pooled_kernel last = kernel_(src, "reduce");
+      last.get().set_arg(0, partials.id());
+      last.get().set_arg(1, cl_ulong(groups));
+      last.get().set_arg(2, init);
+      last.get().set_arg(3, partials.id());
+      last.get().set_local_mem_size(4, local * sizeof(T));
+      e = launch_(last, local, &local, 1, &e);
+    }
+    T to_return;
+    queue_.read_buffer(partials, 0, sizeof(T), &to_return, 1, &e, true);
     return to_return;
   }
 
-  /** \brief returns an event that will complete when all commands
-   * enqueued up to this point have completed execution.  a clFlush()
-   * could be emulated by performing queue.marker().wait(). */
-  event marker() {
-    cl_int err;
-    event to_return;
-    err = clEnqueueMarker(ref_,
-        reinterpret_cast<cl_event*>(&to_return));
-    CHECK_CL_ERROR(err);
-    return to_return;
+  /** \brief replaces each element with op folded over it and every
+   * element before it.  op is OpenCL C in a and b, such as "a + b", and
+   * must be associative.  each work item scans as many consecutive
+   * elements as the preferred vector width, then work groups combine
+   * them in local memory, recursing over the group totals */
+  event inclusive_scan(const std::string &op, cl_uint num_events = 0,
+      event *events = NULL) {
+    if(!size_) return queue_.marker();
+    return scan_(buffer_, size_, op_prelude_(op, width_())
+        + detail::scan_source(), num_events, events);
   }
 
-  void wait_for_events(cl_uint num_events, event *events) {
-    cl_int err;
-    err = clEnqueueWaitForEvents(ref_, num_events,
-        reinterpret_cast<cl_event*>(events));
-    CHECK_CL_ERROR(err);
+  /** \brief sorts the elements into ascending order with a stable radix
+   * sort over four bits a pass.  floating point keys order by their
+   * bits, so -0 sorts before +0 and NaNs sort to the ends by sign.  at
+   * most 2^32 - 1 elements */
+  event radix_sort(cl_uint num_events = 0, event *events = NULL) {
+    if(size_ < 2) return queue_.marker();
+    if(size_ > 0xffffffffu) throw cl_error(CL_INVALID_VALUE);
+    const std::string src = key_prelude_() + detail::radix_source();
+
+    // each work item counts and then scatters one contiguous chunk, so
+    // the order within a digit is kept
+    const device d(queue_.device());
+    size_t items = std::min((size_ + 63) / 64,
+        size_t(d.max_compute_units()) * 256);
+    const size_t chunk = (size_ + items - 1) / items;
+    items = (size_ + chunk - 1) / chunk;
+    device_vector<cl_uint> hist(queue_, 16 * items);
+    device_vector<cl_uint> scanned(queue_, 16 * items);
+    buffer from = buffer_;
+    buffer to(queue_context_(), CL_MEM_READ_WRITE, size_ * sizeof(T));
+
+    event e;
+    cl_uint wait_n = num_events;
+    event *wait = events;
+    // sizeof(T) * 2 passes is even, so the result lands in buffer_
+    for(cl_uint shift=0; shift<8 * sizeof(T); shift+=4) {
+      pooled_kernel count = kernel_(src, "radix_count");
+      count.get().set_arg(0, from.id());
+      count.get().set_arg(1, cl_ulong(size_));
+      count.get().set_arg(2, cl_ulong(chunk));
+      count.get().set_arg(3, shift);
+      count.get().set_arg(4, hist.get().id());
+      e = launch_(count, items, NULL, wait_n, wait);
+      wait_n = 1;
+      wait = &e;
+
+      e = queue_.copy_buffer(hist.get(), scanned.get(), 0, 0,
+          16 * items * sizeof(cl_uint), 1, &e);
+      e = scanned.inclusive_scan("a + b", 1, &e);
+
+      pooled_kernel scatter = kernel_(src, "radix_scatter");
+      scatter.get().set_arg(0, from.id());
+      scatter.get().set_arg(1, to.id());
+      scatter.get().set_arg(2, cl_ulong(size_));
+      scatter.get().set_arg(3, cl_ulong(chunk));
+      scatter.get().set_arg(4, shift);
+      scatter.get().set_arg(5, hist.get().id());
+      scatter.get().set_arg(6, scanned.get().id());
+      e = launch_(scatter, items, NULL, 1, &e);
+      std::swap(from, to);
+    }
+    return e;
   }
 
-  void wait_for_event(event e) {
-    wait_for_events(1, &e);
+  /** \brief copies the elements x for which pred, OpenCL C in x such as
+   * "x > 0", holds to the front of out, keeping their order, and returns
+   * how many it copied.  out must be at least as long as this vector
+   * and must not share its buffer.  blocks until the count is read back */
+  size_t copy_if(device_vector &out, const std::string &pred,
+      cl_uint num_events = 0, event *events = NULL) {
+    if(out.size() < size_) throw cl_error(CL_INVALID_VALUE);
+    // compact reads elements other work items would be overwriting
+    if(&out == this || (size_ && out.buffer_.id() == buffer_.id())) {
+      throw cl_error(CL_INVALID_VALUE);
+    }
+    if(!size_) return 0;
+    if(size_ > 0xffffffffu) throw cl_error(CL_INVALID_VALUE);
+    const std::string src = prelude_(1, false) + "#define PRED ("
+      + pred + ")\n" + detail::copy_if_source();
+    device_vector<cl_uint> pos(queue_, size_);
+
+    pooled_kernel flag = kernel_(src, "flag");
+    flag.get().set_arg(0, buffer_.id());
+    flag.get().set_arg(1, pos.get().id());
+    flag.get().set_arg(2, cl_ulong(size_));
+    event e = launch_(flag, size_, NULL, num_events, events);
+    e = pos.inclusive_scan("a + b", 1, &e);
+
+    pooled_kernel compact = kernel_(src, "compact");
+    compact.get().set_arg(0, buffer_.id());
+    compact.get().set_arg(1, out.get().id());
+    compact.get().set_arg(2, pos.get().id());
+    compact.get().set_arg(3, cl_ulong(size_));
+    e = launch_(compact, size_, NULL, 1, &e);
+
+    cl_uint count;
+    queue_.read_buffer(pos.get(), (size_ - 1) * sizeof(cl_uint),
+        sizeof(cl_uint), &count, 1, &e, true);
+    return count;
   }
 
-  /** \brief nothing enqueued after this point will be executed by the
-   * device until everything before it has completed execution */
-  void barrier() {
-    cl_int err;
-    err = clEnqueueBarrier(ref_);
-    CHECK_CL_ERROR(err);
+private:
+  context queue_context_() const {
+    cl_context c = queue_.context();
+    clRetainContext(c);
+    return context(c);
   }
 
-  /** \param origin: 3-element size_t array
-      \param region: 3-element size_t array */
-  template<typename T>
-  event read_image(const T &image, 
-      const size_t *origin, const size_t *region, 
-      void *dst, 
-      int num_events = 0, event *events = NULL,
-      size_t row_pitch = 0, size_t slice_pitch = 0) {
-    cl_int err;
-    event to_return;
-    err = clEnqueueReadImage(
-        ref_, image.id(), CL_FALSE, origin, region, row_pitch,
-        slice_pitch, dst, num_events,
-        reinterpret_cast<cl_event*>(events),
-        reinterpret_cast<cl_event*>(&to_return));
-    CHECK_CL_ERROR(err);
+  /** \brief the preferred vector width for T, as a valid vector size */
+  cl_uint width_() const {
+    const cl_uint w = detail::device_type<T>::preferred_width(
+        device(queue_.device()));
+    cl_uint to_return = 1;
+    while(to_return * 2 <= w && to_return < 16) to_return *= 2;
     return to_return;
   }
 
-  /** \param origin: 3-element size_t array
-      \param region: 3-element size_t array */
-  template<typename T>
-  event write_image(const T &image,
-      const size_t *origin, const size_t *region,
-      void *src,
-      size_t row_pitch = 0, size_t slice_pitch = 0,
-      int num_events = 0, event *events = NULL) {
-    cl_int err;
-    event to_return;
-    err = clEnqueueWriteImage(
-        ref_, image.id(), CL_FALSE, origin, region, row_pitch,
-        slice_pitch, src, num_events,
-        reinterpret_cast<cl_event*>(events),
-        reinterpret_cast<cl_event*>(&to_return));
-    CHECK_CL_ERROR(err);
-    return to_return;
+  static std::string vector_name_(const std::string &base, cl_uint vw) {
+    if(vw == 1) return base;
+    std::ostringstream to_return;
+    to_return << base << vw;
+    return to_return.str();
   }
 
-  /** \param origin: 3-element size_t array
-      \param region: 3-element size_t array */
-  template<typename T>
-  event copy_image_to_buffer(const T &src, buffer &dst, 
-      size_t *origin, size_t *region, size_t offset,
-      cl_uint num_events = 0, event *events = NULL) {
-    cl_int err;
-    event to_return;
-    err = clEnqueueCopyImageToBuffer(
-        ref_, src.id(), dst.id(),
-        origin, region, offset,
-        num_events,
-        reinterpret_cast<cl_event*>(events),
-        reinterpret_cast<cl_event*>(&to_return));
-    CHECK_CL_ERROR(err);
-    return to_return;
+  /** \brief T, its vector type TV of width VW and vector loads and
+   * stores that fall back to plain indexing when VW is 1 */
+  static std::string prelude_(cl_uint vw, bool other_fp64) {
+    const std::string name = detail::device_type<T>::name();
+    std::ostringstream to_return;
+    if(other_fp64 || (detail::device_type<T>::kind == detail::float_type
+          && sizeof(T) == 8)) {
+      to_return << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+    }
+    to_return << "#define T " << name << "\n"
+      << "#define UT " << detail::device_type<T>::unsigned_name() << "\n"
+      << "#define BITS " << 8 * sizeof(T) << "\n"
+      << "#define VW " << vw << "\n"
+      << "#define TV " << vector_name_(name, vw) << "\n";
+    if(vw == 1) {
+      to_return << "#define LOADV(i, p) ((p)[i])\n"
+        << "#define STOREV(v, i, p) ((p)[i] = (v))\n";
+    } else {
+      to_return << "#define LOADV(i, p) vload" << vw << "(i, p)\n"
+        << "#define STOREV(v, i, p) vstore" << vw << "(v, i, p)\n";
+    }
+    return to_return.str();
   }
 
-  /** \param origin: 3-element size_t array
-      \param region: 3-element size_t array */
-  template<typename T>
-  event copy_buffer_to_image(const buffer &src, T &dst,
-      size_t offset, size_t *origin, size_t *region,
-      cl_uint num_events = 0, event *events = NULL) {
-    cl_int err;
-    event to_return;
-    err = clEnqueueCopyBufferToImage(
-        ref_, src.id(), dst.id(),
-        offset, origin, region,
-        num_events,
-        reinterpret_cast<cl_event*>(events),
-        reinterpret_cast<cl_event*>(&to_return));
-    CHECK_CL_ERROR(err);
+  /** \brief the prelude plus op and opv, op for scalars and vectors, and
+   * FOLD, which folds the components of a TV with op */
+  static std::string op_prelude_(const std::string &op, cl_uint vw) {
+    std::ostringstream to_return;
+    to_return << prelude_(vw, false)
+      << "T op(T a, T b) { return (" << op << "); }\n";
+    if(vw == 1) {
+      to_return << "#define opv op\n#define FOLD(v) (v)\n";
+      return to_return.str();
+    }
+    to_return << "TV opv(TV a, TV b) { return (" << op << "); }\n";
+    std::string fold = "v.s0";
+    for(cl_uint i=1; i<vw; ++i) {
+      fold = "op(" + fold + ", v.s" + "0123456789abcdef"[i] + ")";
+    }
+    to_return << "#define FOLD(v) " << fold << "\n";
+    return to_return.str();
+  }
+
+  /** \brief the prelude plus KEY, which maps T to UT so that unsigned
+   * order matches T's order */
+  static std::string key_prelude_() {
+    std::ostringstream to_return;
+    to_return << prelude_(1, false);
+    switch(detail::device_type<T>::kind) {
+      case detail::unsigned_type:
+        to_return << "#define KEY(x) (x)\n";
+        break;
+      case detail::signed_type:
+        to_return << "#define KEY(x) ((UT)(x) ^ ((UT)1 << (BITS - 1)))\n";
+        break;
+      case detail::float_type:
+        to_return << "UT float_key(T x) {\n"
+          << "  UT b = as_" << detail::device_type<T>::unsigned_name()
+          << "(x);\n"
+          << "  return b ^ ((b >> (BITS - 1)) ? (UT)~(UT)0\n"
+          << "      : (UT)1 << (BITS - 1));\n"
+          << "}\n"
+          << "#define KEY(x) float_key(x)\n";
+        break;
+    }
+    return to_return.str();
+  }
+
+  pooled_kernel kernel_(const std::string &source,
+      const std::string &name) const {
+    return detail::algorithm_programs<0>::acquire(queue_.context(),
+        source, name);
+  }
+
+  /** \brief the largest power of two work group size k can run with
+   * bytes_per_item of local memory per work item */
+  size_t local_size_(const kernel &k, size_t bytes_per_item) const {
+    const device d(queue_.device());
+    size_t limit = std::min(d.max_work_group_size(),
+        k.work_group_size(d));
+    if(bytes_per_item) {
+      limit = std::min(limit, size_t(d.local_mem_size() / bytes_per_item));
+    }
+    size_t to_return = 1;
+    while(to_return * 2 <= limit) to_return *= 2;
     return to_return;
   }
+
+  event launch_(pooled_kernel &k, size_t global, const size_t *local,
+      cl_uint num_events, event *events) {
+    event e = queue_.run_kernel(k.get(), 1, &global, local, num_events,
+        events);
+    k.release_after(e);
+    return e;
+  }
+
+  /** \brief scans count elements of data in place with the scan kernels
+   * in src */
+  event scan_(const buffer &data, size_t count, const std::string &src,
+      cl_uint num_events, event *events) {
+    pooled_kernel blocks = kernel_(src, "scan_blocks");
+    pooled_kernel add = kernel_(src, "add_prefix");
+    const cl_uint vw = width_();
+    // add_prefix must run with the same groups as scan_blocks
+    const size_t local = std::min(local_size_(blocks.get(), sizeof(T)),
+        local_size_(add.get(), 0));
+    const size_t groups = (count + local * vw - 1) / (local * vw);
+    buffer totals(queue_context_(), CL_MEM_READ_WRITE,
+        groups * sizeof(T));
+
+    blocks.get().set_arg(0, data.id());
+    blocks.get().set_arg(1, data.id());
+    blocks.get().set_arg(2, cl_ulong(count));
+    blocks.get().set_arg(3, totals.id());
+    blocks.get().set_local_mem_size(4, local * sizeof(T));
+    event e = launch_(blocks, groups * local, &local, num_events, events);
+    if(groups == 1) return e;
+
+    e = scan_(totals, groups, src, 1, &e);
+    add.get().set_arg(0, data.id());
+    add.get().set_arg(1, cl_ulong(count));
+    add.get().set_arg(2, totals.id());
+    return launch_(add, groups * local, &local, 1, &e);
+  }
+
+  device_vector(const device_vector&);
+  device_vector& operator=(const device_vector&);
+
+  command_queue queue_;
+  buffer buffer_;
+  size_t size_;
 };
-typedef command_queue_<0> command_queue;
 
 #undef CHECK_CL_ERROR
 
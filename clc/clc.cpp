@@ -1,6 +1,8 @@
 #include <cl_wrapper/cl_wrapper.hpp>
 
+#include <cstdlib>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <list>
 #include <sstream>
@@ -8,8 +10,8 @@
 #include <vector>
 
 void print_usage(char *progname) { 
-  std::cout << "usage: " << progname << " [-l] | [-p ID] [-o OPTS] PATH"
-    << std::endl;
+  std::cout << "usage: " << progname
+    << " [-l] | [-a | -p ID] [-o OPTS] PATH" << std::endl;
 }
 
 void list_devices(cl::platform p) {
@@ -62,23 +64,34 @@ void list_platforms() {
   }
 }
 
+void print_builds(const std::vector<cl::device_build> &builds) {
+  for(unsigned i=0; i<builds.size(); ++i) {
+    std::cout << "\nbuild log for " << builds[i].dev.name() << " ("
+      << (builds[i].status == CL_BUILD_SUCCESS ? "success" : "failed")
+      << "):\n" << builds[i].log << "\n";
+  }
+}
+
 void build_program(const std::string &path, const std::string &opts, 
-    int platform_id) {
+    const std::vector<int> &platform_ids) {
   const std::vector<cl::platform> &platforms =
     cl::platform::platforms();
-  cl::platform platform = platforms[platform_id];
-  std::cout << "building to platform " << platform_id << ": "
-    << platform.name() << "\n";
+  std::vector<cl::context> contexts;
+  for(unsigned p=0; p<platform_ids.size(); ++p) {
+    cl::platform platform = platforms[platform_ids[p]];
+    std::cout << "building to platform " << platform_ids[p] << ": "
+      << platform.name() << "\n";
 
-  std::vector<cl::device> devices = platform.devices();
-  std::cout << "building on the following devices:\n";
-  for(unsigned i=0; i<devices.size(); ++i) {
-    std::cout << i << ": " << devices[i].name() << ", ";
-    std::cout << "driver version: " <<
-      devices[i].driver_version() << "\n";
-  }
+    std::vector<cl::device> devices = platform.devices();
+    std::cout << "building on the following devices:\n";
+    for(unsigned i=0; i<devices.size(); ++i) {
+      std::cout << i << ": " << devices[i].name() << ", ";
+      std::cout << "driver version: " <<
+        devices[i].driver_version() << "\n";
+    }
 
-  cl::context context(platform, devices.size(), &devices[0]);
+    contexts.push_back(cl::context(platform, devices.size(), &devices[0]));
+  }
 
   // FIXME add support for windows paths?
   const size_t last_slash = path.find_last_of('/');
@@ -124,9 +137,34 @@ void build_program(const std::string &path, const std::string &opts,
   infile.close();
 
   std::cout << "attempting to compile " << path << "... ";
-  cl::program p(context, build_stream.str());
-  try {
-    p.build(opts);
+  // drivers that build synchronously block in clBuildProgram even with
+  // a callback, so give each platform its own thread
+  std::vector<std::future<std::vector<cl::device_build> > > builds;
+  for(unsigned p=0; p<contexts.size(); ++p) {
+    cl::program program(contexts[p], build_stream.str());
+    builds.push_back(std::async(std::launch::async, [program, opts] {
+      cl::program to_build = program;
+      return to_build.build_async(opts).get();
+    }));
+  }
+
+  bool failed = false;
+  std::vector<std::vector<cl::device_build> > results;
+  for(unsigned p=0; p<builds.size(); ++p) {
+    try {
+      results.push_back(builds[p].get());
+    } catch(const cl::build_error &err) {
+      results.push_back(err.builds());
+      failed = true;
+    } catch(const cl::cl_error &err) {
+      std::cout << "\nplatform " << platform_ids[p] << ": " << err.what()
+        << "\n";
+      results.push_back(std::vector<cl::device_build>());
+      failed = true;
+    }
+  }
+
+  if(!failed) {
     std::cout << "success!" << std::endl;
 
     const std::string &header_path = path + ".hpp";
@@ -141,11 +179,13 @@ void build_program(const std::string &path, const std::string &opts,
 
     std::cout << "cpp-ready files written to "
       << header_path << " and " << cpp_path << "\n";
-  } catch(const cl::cl_error &err) {
+  } else {
     std::cout << "compilation failed!" << std::endl;
   }
-  std::cout << "\nbuild log:\n" << p.build_log(platform.devices()[0])
-    << "\n";
+  for(unsigned p=0; p<results.size(); ++p) {
+    std::cout << "\nplatform " << platform_ids[p] << ":";
+    print_builds(results[p]);
+  }
 }
 
 int main(int argc, char *argv[]) {
@@ -168,9 +208,14 @@ int main(int argc, char *argv[]) {
   }
 
   int platform_id = 0;
+  bool platform_given = false;
+  bool all_platforms = false;
   std::string opts = "";
   while(arguments.size() > 1) {
-    if(arguments.front() == "-p") {
+    if(arguments.front() == "-a") {
+      arguments.pop_front();
+      all_platforms = true;
+    } else if(arguments.front() == "-p") {
       arguments.pop_front();
       if(arguments.size() < 1) {
         std::cout << "-p switch provided with no platform id\n";
@@ -180,6 +225,7 @@ int main(int argc, char *argv[]) {
       std::stringstream ss;
       ss << arguments.front();
       ss >> platform_id;
+      platform_given = true;
       arguments.pop_front();
     } else if(arguments.front() == "-o") {
       arguments.pop_front();
@@ -190,8 +236,17 @@ int main(int argc, char *argv[]) {
       }
       opts = arguments.front();
       arguments.pop_front();
+    } else {
+      std::cout << "unknown switch " << arguments.front() << "\n";
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
     }
   }
+  if(all_platforms && platform_given) {
+    std::cout << "-a and -p cannot be used together\n";
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
   if(arguments.size() < 1) {
     std::cout << "no PATH provided\n";
     print_usage(argv[0]);
@@ -199,7 +254,14 @@ int main(int argc, char *argv[]) {
   }
 
   try {
-    build_program(arguments.front(), opts, platform_id);
+    std::vector<int> platform_ids(1, platform_id);
+    if(all_platforms) {
+      platform_ids.clear();
+      for(unsigned i=0; i<cl::platform::platforms().size(); ++i) {
+        platform_ids.push_back(i);
+      }
+    }
+    build_program(arguments.front(), opts, platform_ids);
     return EXIT_SUCCESS;
   } catch(const std::exception &e) {
     std::cout << "caught exception: " << e.what() << std::endl;
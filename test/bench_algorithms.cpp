@@ -0,0 +1,141 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <execution>
+#include <numeric>
+#include <random>
+
+/* device_vector transform, reduce, inclusive_scan, radix_sort and copy_if
+ * against the std:: parallel algorithms on the same data, on the first
+ * CPU device found (or the first device if there is none).  device times
+ * include waiting for the result but not copying it back.  every device
+ * result is checked against the std:: one, and any mismatch fails the
+ * run */
+
+namespace {
+
+template<typename F>
+double seconds_per(unsigned reps, F f) {
+  f();
+  auto begin = std::chrono::steady_clock::now();
+  for(unsigned i=0; i<reps; ++i) f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - begin).count() / reps;
+}
+
+/** \brief reports where dev first differs from cpu */
+bool same(const char *name, size_t n, const std::vector<cl_uint> &dev,
+    const std::vector<cl_uint> &cpu) {
+  if(dev.size() != cpu.size()) {
+    std::fprintf(stderr, "%s of %lu elements: %lu results, expected %lu\n",
+        name, static_cast<unsigned long>(n),
+        static_cast<unsigned long>(dev.size()),
+        static_cast<unsigned long>(cpu.size()));
+    return false;
+  }
+  auto diff = std::mismatch(dev.begin(), dev.end(), cpu.begin());
+  if(diff.first == dev.end()) return true;
+  std::fprintf(stderr, "%s of %lu elements: [%lu] is %u, expected %u\n",
+      name, static_cast<unsigned long>(n),
+      static_cast<unsigned long>(diff.first - dev.begin()), *diff.first,
+      *diff.second);
+  return false;
+}
+
+bool pick_device(cl::platform &platform, cl::device &device) {
+  const std::vector<cl::platform> &ps = cl::platform::platforms();
+  for(size_t i=0; i<ps.size(); ++i) {
+    try {
+      std::vector<cl::device> cpus = ps[i].devices(CL_DEVICE_TYPE_CPU);
+      platform = ps[i];
+      device = cpus[0];
+      return true;
+    } catch(const cl::cl_error&) { }
+  }
+  if(ps.empty()) return false;
+  platform = ps[0];
+  device = ps[0].devices()[0];
+  return true;
+}
+
+}
+
+int main() {
+  cl::platform p;
+  cl::device d;
+  if(!pick_device(p, d)) {
+    std::fprintf(stderr, "no OpenCL platform\n");
+    return 1;
+  }
+  cl::context ctx(p, 1, &d);
+  cl::command_queue q(ctx, d);
+  const auto par = std::execution::par_unseq;
+
+  std::printf("%s\n%10s %-10s %12s %12s  (Melements/s)\n",
+      d.name().c_str(), "elements", "algorithm", "device", "std::par");
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<cl_uint> dist;
+  bool ok = true;
+  for(size_t n = 1 << 16; n <= (size_t(1) << 26); n *= 8) {
+    std::vector<cl_uint> host(n);
+    for(size_t i=0; i<n; ++i) host[i] = dist(rng);
+    std::vector<cl_uint> out(n);
+    cl::device_vector<cl_uint> in(q, host), result(q, n);
+    const unsigned reps = static_cast<unsigned>(std::max<size_t>(3,
+          std::min<size_t>(100, (size_t(64) << 20) / n)));
+    const double me = n / 1e6;
+    auto row = [&](const char *name, double dev, double cpu) {
+      std::printf("%10lu %-10s %12.1f %12.1f\n",
+          static_cast<unsigned long>(n), name, me / dev, me / cpu);
+    };
+
+    row("transform", seconds_per(reps, [&] {
+      in.transform(result, "x * 3u + 1u").wait();
+    }), seconds_per(reps, [&] {
+      std::transform(par, host.begin(), host.end(), out.begin(),
+          [](cl_uint x) { return x * 3u + 1u; });
+    }));
+    ok = same("transform", n, result.to_host(), out) && ok;
+
+    cl_uint dev_sum = 0, cpu_sum = 0;
+    row("reduce", seconds_per(reps, [&] {
+      dev_sum = in.reduce("a + b", 0u);
+    }), seconds_per(reps, [&] {
+      cpu_sum = std::reduce(par, host.begin(), host.end(), 0u);
+    }));
+    ok = same("reduce", n, std::vector<cl_uint>(1, dev_sum),
+        std::vector<cl_uint>(1, cpu_sum)) && ok;
+
+    row("scan", seconds_per(reps, [&] {
+      result.write(&host[0]);
+      result.inclusive_scan("a + b").wait();
+    }), seconds_per(reps, [&] {
+      std::inclusive_scan(par, host.begin(), host.end(), out.begin());
+    }));
+    ok = same("scan", n, result.to_host(), out) && ok;
+
+    row("sort", seconds_per(reps, [&] {
+      result.write(&host[0]);
+      result.radix_sort().wait();
+    }), seconds_per(reps, [&] {
+      out = host;
+      std::sort(par, out.begin(), out.end());
+    }));
+    ok = same("sort", n, result.to_host(), out) && ok;
+
+    size_t dev_kept = 0, cpu_kept = 0;
+    row("copy_if", seconds_per(reps, [&] {
+      dev_kept = in.copy_if(result, "(x & 1u) != 0");
+    }), seconds_per(reps, [&] {
+      cpu_kept = std::copy_if(par, host.begin(), host.end(), out.begin(),
+          [](cl_uint x) { return (x & 1u) != 0; }) - out.begin();
+    }));
+    std::vector<cl_uint> kept = result.to_host();
+    kept.resize(std::min(dev_kept, n));
+    out.resize(cpu_kept);
+    ok = same("copy_if", n, kept, out) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,60 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include <chrono>
+#include <cstdio>
+
+/* clearing a buffer with write_buffer from a zeroed host array, with
+ * fill_buffer, and with the OpenCL 1.0 fill kernel fill_buffer falls back
+ * to, 4KB to 1GB, on the first device of the first platform */
+
+namespace {
+
+template<typename F>
+double seconds_per(unsigned reps, F f) {
+  f();
+  auto begin = std::chrono::steady_clock::now();
+  for(unsigned i=0; i<reps; ++i) f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - begin).count() / reps;
+}
+
+}
+
+int main() {
+  if(cl::platform::platforms().empty()) {
+    std::fprintf(stderr, "no OpenCL platform\n");
+    return 1;
+  }
+  cl::platform p = cl::platform::platforms()[0];
+  std::vector<cl::device> devs = p.devices();
+  cl::context ctx(p, 1, &devs[0]);
+  cl::command_queue q(ctx, devs[0]);
+  std::shared_ptr<cl::detail::fill_kernels<0> > fallback =
+    cl::detail::fill_kernels<0>::get(ctx.id());
+  const size_t limit = std::min<cl_ulong>(devs[0].max_mem_alloc_size(),
+      size_t(1) << 30);
+
+  std::printf("%s\n%10s %12s %12s %12s  (MB/s)\n", devs[0].name().c_str(),
+      "bytes", "write", "fill", "kernel");
+  const cl_uint zero = 0;
+  for(size_t size = 4 << 10; size <= limit; size *= 4) {
+    cl::buffer b(ctx, CL_MEM_READ_WRITE, size);
+    std::vector<char> host(size, 0);
+    const unsigned reps = static_cast<unsigned>(std::max<size_t>(3,
+          std::min<size_t>(1000, (size_t(256) << 20) / size)));
+    const double mb = size / 1e6;
+    double w = seconds_per(reps, [&] {
+      q.write_buffer(b, 0, size, &host[0]).wait();
+    });
+    double f = seconds_per(reps, [&] {
+      q.fill_buffer(b, &zero, sizeof(zero), 0, size).wait();
+    });
+    double k = seconds_per(reps, [&] {
+      fallback->fill_buffer(q, b, &zero, sizeof(zero), 0, size, 0,
+          NULL).wait();
+    });
+    std::printf("%10lu %12.1f %12.1f %12.1f\n",
+        static_cast<unsigned long>(size), mb / w, mb / f, mb / k);
+  }
+  return 0;
+}
@@ -0,0 +1,91 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include <chrono>
+#include <cstdio>
+
+/* microseconds per pass over a write, a chain of kernel launches that
+ * ping-pong between two buffers, and a read, enqueued by hand (setting
+ * arguments and building wait lists each time) and replayed from a
+ * command_graph.  runs on the first device of the first platform */
+
+namespace {
+
+const char *source =
+  "__kernel void step(__global const float *x, __global float *y,\n"
+  "    float a) {\n"
+  "  y[get_global_id(0)] = a * x[get_global_id(0)];\n"
+  "}\n";
+
+const unsigned passes = 500;
+const size_t global = 1024;
+
+struct pipeline {
+  pipeline(cl::context &ctx, cl::program &prog) : host(global) {
+    k = prog.get_kernel("step");
+    for(int i=0; i<2; ++i) {
+      b[i] = cl::buffer(ctx, CL_MEM_READ_WRITE, global * sizeof(float));
+    }
+  }
+
+  /** \brief one pass; every command waits on the one before */
+  cl::event enqueue(cl::command_queue &q, unsigned launches) {
+    cl::event e = q.write_buffer(b[0], 0, global * sizeof(float),
+        &host[0]);
+    for(unsigned i=0; i<launches; ++i) {
+      k.set_arg(0, b[i % 2].id());
+      k.set_arg(1, b[(i + 1) % 2].id());
+      k.set_arg(2, 1.0f);
+      e = q.run_kernel(k, 1, &global, NULL, 1, &e);
+    }
+    return q.read_buffer(b[launches % 2], 0, global * sizeof(float),
+        &host[0], 1, &e);
+  }
+
+  std::vector<float> host;
+  cl::kernel k;
+  cl::buffer b[2];
+};
+
+template<typename F>
+double micros_per_pass(cl::command_queue &q, F f) {
+  f();
+  q.finish();
+  auto begin = std::chrono::steady_clock::now();
+  for(unsigned i=0; i<passes; ++i) f();
+  q.finish();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - begin).count()
+    / passes;
+}
+
+}
+
+int main() {
+  if(cl::platform::platforms().empty()) {
+    std::fprintf(stderr, "no OpenCL platform\n");
+    return 1;
+  }
+  cl::platform p = cl::platform::platforms()[0];
+  std::vector<cl::device> devs = p.devices();
+  cl::context ctx(p, 1, &devs[0]);
+  cl::command_queue q(ctx, devs[0]);
+  cl::program prog(ctx, source, "");
+  pipeline work(ctx, prog);
+
+  std::printf("%s\n%8s %12s %12s  (us/pass)\n", devs[0].name().c_str(),
+      "launches", "manual", "replay");
+  for(unsigned launches = 1; launches <= 256; launches *= 4) {
+    double manual = micros_per_pass(q, [&]() {
+      work.enqueue(q, launches);
+    });
+
+    cl::command_graph g;
+    q.begin_capture(g);
+    work.enqueue(q, launches);
+    q.end_capture();
+    double replayed = micros_per_pass(q, [&]() { g.replay(q); });
+
+    std::printf("%8u %12.1f %12.1f\n", launches, manual, replayed);
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+/* launches per second from 1 to 64 host threads, each with its own
+ * queue, for three ways of getting a kernel to set arguments on: a
+ * kernel_pool, one kernel shared under a mutex, and clCreateKernel per
+ * launch.  runs on the first device of the first platform */
+
+namespace {
+
+const char *source =
+  "__kernel void scale(__global float *x, float a) {\n"
+  "  x[get_global_id(0)] *= a;\n"
+  "}\n";
+
+const unsigned launches_per_thread = 2000;
+
+template<typename F>
+double launches_per_second(unsigned threads, F f) {
+  std::vector<std::thread> pool;
+  auto begin = std::chrono::steady_clock::now();
+  for(unsigned t=0; t<threads; ++t) pool.push_back(std::thread(f, t));
+  for(unsigned t=0; t<threads; ++t) pool[t].join();
+  auto end = std::chrono::steady_clock::now();
+  return threads * launches_per_thread
+    / std::chrono::duration<double>(end - begin).count();
+}
+
+}
+
+int main() {
+  if(cl::platform::platforms().empty()) {
+    std::fprintf(stderr, "no OpenCL platform\n");
+    return 1;
+  }
+  cl::platform p = cl::platform::platforms()[0];
+  std::vector<cl::device> devs = p.devices();
+  cl::context ctx(p, 1, &devs[0]);
+  cl::program prog(ctx, source, "");
+  const size_t global = 256;
+
+  std::printf("%s\n%8s %12s %12s %12s  (launches/s)\n",
+      devs[0].name().c_str(), "threads", "kernel_pool", "mutex",
+      "create");
+  for(unsigned threads = 1; threads <= 64; threads *= 2) {
+    std::vector<cl::command_queue> queues;
+    std::vector<cl::buffer> buffers;
+    for(unsigned t=0; t<threads; ++t) {
+      queues.push_back(cl::command_queue(ctx, devs[0]));
+      buffers.push_back(cl::buffer(ctx, CL_MEM_READ_WRITE,
+            global * sizeof(float)));
+    }
+
+    cl::kernel_pool kp(prog, "scale", 64);
+    double pooled = launches_per_second(threads, [&](unsigned t) {
+      for(unsigned i=0; i<launches_per_thread; ++i) {
+        cl::pooled_kernel k = kp.acquire();
+        k.get().set_arg(0, buffers[t].id());
+        k.get().set_arg(1, 1.0f);
+        k.launch(queues[t], 1, &global);
+      }
+      queues[t].finish();
+    });
+
+    cl::kernel shared = prog.get_kernel("scale");
+    std::mutex shared_mutex;
+    double locked = launches_per_second(threads, [&](unsigned t) {
+      for(unsigned i=0; i<launches_per_thread; ++i) {
+        std::lock_guard<std::mutex> lock(shared_mutex);
+        shared.set_arg(0, buffers[t].id());
+        shared.set_arg(1, 1.0f);
+        queues[t].run_kernel(shared, 1, &global, NULL);
+      }
+      queues[t].finish();
+    });
+
+    double created = launches_per_second(threads, [&](unsigned t) {
+      for(unsigned i=0; i<launches_per_thread; ++i) {
+        cl::kernel k = prog.get_kernel("scale");
+        k.set_arg(0, buffers[t].id());
+        k.set_arg(1, 1.0f);
+        queues[t].run_kernel(k, 1, &global, NULL);
+      }
+      queues[t].finish();
+    });
+
+    std::printf("%8u %12.0f %12.0f %12.0f\n", threads, pooled, locked,
+        created);
+  }
+  return 0;
+}
@@ -0,0 +1,76 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <numeric>
+
+/* reading a result buffer with read_buffer against map_buffer, on the
+ * first CPU device found (or the first device if there is none).  each
+ * pass reads every float so that lazily mapped pages are touched */
+
+namespace {
+
+template<typename F>
+double seconds_per(unsigned reps, F f) {
+  f();
+  auto begin = std::chrono::steady_clock::now();
+  for(unsigned i=0; i<reps; ++i) f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - begin).count() / reps;
+}
+
+bool pick_device(cl::platform &platform, cl::device &device) {
+  const std::vector<cl::platform> &ps = cl::platform::platforms();
+  for(size_t i=0; i<ps.size(); ++i) {
+    try {
+      std::vector<cl::device> cpus = ps[i].devices(CL_DEVICE_TYPE_CPU);
+      platform = ps[i];
+      device = cpus[0];
+      return true;
+    } catch(const cl::cl_error&) { }
+  }
+  if(ps.empty()) return false;
+  platform = ps[0];
+  device = ps[0].devices()[0];
+  return true;
+}
+
+}
+
+int main() {
+  cl::platform p;
+  cl::device d;
+  if(!pick_device(p, d)) {
+    std::fprintf(stderr, "no OpenCL platform\n");
+    return 1;
+  }
+  cl::context ctx(p, 1, &d);
+  cl::command_queue q(ctx, d);
+  const size_t limit = std::min<cl_ulong>(d.max_mem_alloc_size(),
+      size_t(1) << 30);
+
+  std::printf("%s\n%12s %12s %12s  (MB/s, including a pass over the "
+      "data)\n", d.name().c_str(), "bytes", "read", "map");
+  volatile float sink = 0;
+  for(size_t size = 1 << 20; size <= limit; size *= 4) {
+    const size_t n = size / sizeof(float);
+    std::vector<float> init(n, 1.0f), host(n);
+    cl::buffer b(ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR
+        | CL_MEM_COPY_HOST_PTR, size, &init[0]);
+    const unsigned reps = static_cast<unsigned>(std::max<size_t>(3,
+          std::min<size_t>(100, (size_t(1) << 30) / size)));
+    const double mb = size / 1e6;
+    double read = seconds_per(reps, [&] {
+      q.read_buffer(b, 0, size, &host[0], 0, NULL, true);
+      sink = std::accumulate(host.begin(), host.end(), 0.0f);
+    });
+    double map = seconds_per(reps, [&] {
+      cl::mapped_view<float> v = q.map_buffer<float>(b, CL_MAP_READ);
+      sink = std::accumulate(v.begin(), v.end(), 0.0f);
+    });
+    std::printf("%12lu %12.1f %12.1f\n", static_cast<unsigned long>(size),
+        mb / read, mb / map);
+  }
+  q.finish();
+  return 0;
+}
@@ -0,0 +1,84 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "stub_cl.hpp"
+
+#include <chrono>
+#include <cstdio>
+
+/* counts clRetain and clRelease calls on the enqueue path.  links the
+ * stub, so the times measure the wrapper and not a driver.  every event
+ * returned is released once when it dies; nothing should be retained */
+
+namespace {
+
+struct totals {
+  unsigned long retains, releases;
+  double ns;
+};
+
+template<typename F>
+totals measure(unsigned iterations, F f) {
+  stub::reset_counters();
+  auto begin = std::chrono::steady_clock::now();
+  for(unsigned i=0; i<iterations; ++i) f();
+  auto end = std::chrono::steady_clock::now();
+  totals t;
+  t.retains = stub::counters().retains;
+  t.releases = stub::counters().releases;
+  t.ns = std::chrono::duration<double, std::nano>(end - begin).count();
+  return t;
+}
+
+void report(const char *name, unsigned iterations, const totals &t) {
+  std::printf("%-28s %8.3f retains %8.3f releases %10.1f ns per iteration\n",
+      name, double(t.retains) / iterations, double(t.releases) / iterations,
+      t.ns / iterations);
+}
+
+}
+
+int main() {
+  const unsigned iterations = 100000;
+  cl::platform p = cl::platform::platforms()[0];
+  std::vector<cl::device> devs = p.devices();
+  cl::context ctx(p, 1, &devs[0]);
+  cl::command_queue q(ctx, devs[0]);
+  cl::program prog(ctx, "__kernel void k(__global float *a) { }", "");
+  cl::kernel k = prog.get_kernel("k");
+  float host[64];
+  cl::buffer b(ctx, CL_MEM_READ_WRITE, sizeof(host));
+  k.set_arg(0, b.id());
+  const size_t global = 64;
+
+  totals launch = measure(iterations, [&] {
+    cl::event e = q.run_kernel(k, 1, &global, NULL);
+  });
+  report("run_kernel", iterations, launch);
+
+  totals transfer = measure(iterations, [&] {
+    cl::event w = q.write_buffer(b, 0, sizeof(host), host);
+    cl::event r = q.read_buffer(b, 0, sizeof(host), host, 1, &w);
+  });
+  report("write_buffer + read_buffer", iterations, transfer);
+
+  std::vector<cl::event> pending;
+  pending.reserve(16);
+  totals chained = measure(iterations, [&] {
+    pending.push_back(q.run_kernel(k, 1, &global, NULL));
+    if(pending.size() == 16) pending.clear();
+  });
+  report("run_kernel into a vector", iterations, chained);
+
+  // for comparison: one copy of the returned event per launch
+  totals copied = measure(iterations, [&] {
+    cl::event e = q.run_kernel(k, 1, &global, NULL);
+    cl::event copy(e);
+  });
+  report("run_kernel, event copied", iterations, copied);
+  q.finish();
+
+  const bool ok = launch.retains == 0 && transfer.retains == 0
+    && chained.retains == 0 && copied.retains == iterations;
+  if(!ok) std::printf("unexpected retains on the enqueue path\n");
+  return ok ? 0 : 1;
+}
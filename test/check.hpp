@@ -0,0 +1,92 @@
+#ifndef _CL_WRAPPER_TEST_CHECK_HPP_
+#define _CL_WRAPPER_TEST_CHECK_HPP_
+
+/* the tests' only assertion: report the failing line and keep going, so
+ * one run lists every broken check.  main() returns test_result() */
+
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+inline int& test_failures() {
+  static int failures = 0;
+  return failures;
+}
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond \
+        ") failed" << std::endl; \
+      ++test_failures(); \
+    } \
+  } while(0)
+
+/** \brief CHECK that expr throws cl::cl_error with the given code */
+#define CHECK_THROWS_CL(expr, code) do { \
+    cl_int caught_ = CL_SUCCESS; \
+    try { expr; } \
+    catch(const cl::cl_error &e) { caught_ = e.err_code(); } \
+    CHECK(caught_ == (code)); \
+  } while(0)
+
+inline int test_result() {
+  if(test_failures()) {
+    std::cerr << test_failures() << " check(s) failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+/** \brief a context and a queue on the first device of the first
+ * platform, which most fixtures start from */
+struct test_queue {
+  explicit test_queue(cl_command_queue_properties properties = 0) {
+    cl::platform p = cl::platform::platforms()[0];
+    dev = p.devices()[0];
+    ctx = cl::context(p, 1, &dev);
+    q = cl::command_queue(ctx, dev, properties);
+  }
+  cl::device dev;
+  cl::context ctx;
+  cl::command_queue q;
+};
+
+/** \brief a fresh directory under /tmp, deleted with the files in it */
+struct test_dir {
+  test_dir() {
+    char name[] = "/tmp/cl_wrapper_test.XXXXXX";
+    path = mkdtemp(name) ? name : "";
+  }
+  ~test_dir() {
+    std::vector<std::string> names = files();
+    for(size_t i=0; i<names.size(); ++i) std::remove(names[i].c_str());
+    rmdir(path.c_str());
+  }
+  /** \brief the paths of the files in this directory ending in suffix */
+  std::vector<std::string> files(const std::string &suffix = "") const {
+    std::vector<std::string> to_return;
+    DIR *d = opendir(path.c_str());
+    if(!d) return to_return;
+    while(struct dirent *ent = readdir(d)) {
+      const std::string name = ent->d_name;
+      if(name == "." || name == ".." || name.size() < suffix.size()
+          || name.compare(name.size() - suffix.size(), suffix.size(),
+            suffix) != 0) continue;
+      to_return.push_back(path + "/" + name);
+    }
+    closedir(d);
+    return to_return;
+  }
+  std::string path;
+private:
+  test_dir(const test_dir&);
+  test_dir& operator=(const test_dir&);
+};
+
+#endif
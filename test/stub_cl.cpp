@@ -0,0 +1,1923 @@
+#include "stub_cl.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#ifndef CL_PLATFORM_NOT_FOUND_KHR
+#define CL_PLATFORM_NOT_FOUND_KHR -1001
+#endif
+
+/* objects.  every handle is a refcounted object, except platforms and
+ * root devices, which live for the whole process */
+
+struct stub_object {
+  stub_object() : refs(1) { ++stub::counters().live_objects; }
+  virtual ~stub_object() { --stub::counters().live_objects; }
+  std::atomic<cl_int> refs;
+};
+
+struct _cl_platform_id {
+  cl_uint index;
+};
+
+struct _cl_device_id {
+  _cl_device_id()
+      : platform(NULL), index(0), parent(NULL), units(0), domain(0),
+        sub(false), refs(1) { }
+  cl_platform_id platform;
+  cl_uint index;
+  cl_device_id parent;
+  cl_uint units;
+  /** affinity domain this sub-device was split along, or 0 */
+  cl_device_affinity_domain domain;
+  std::vector<cl_device_partition_property> partition;
+  bool sub;
+  std::atomic<cl_int> refs;
+};
+
+struct _cl_context : stub_object {
+  ~_cl_context();
+  std::vector<cl_device_id> devices;
+};
+
+struct _cl_command_queue : stub_object {
+  ~_cl_command_queue();
+  cl_context context;
+  cl_device_id device;
+  cl_command_queue_properties properties;
+  std::mutex mutex;
+  /** incomplete commands, each holding a reference */
+  std::set<cl_event> pending;
+  cl_event last;
+  /** submissions held back until the next flush */
+  std::vector<std::function<void()> > unflushed;
+};
+
+struct _cl_mem : stub_object {
+  _cl_mem()
+      : context(NULL), flags(0), type(CL_MEM_OBJECT_BUFFER), size(0),
+        data(NULL), owns(false), host_ptr(NULL), parent(NULL), origin(0),
+        width(0), height(0), depth(0), element_size(0), row_pitch(0),
+        slice_pitch(0), map_count(0) { }
+  ~_cl_mem();
+  cl_context context;
+  cl_mem_flags flags;
+  cl_mem_object_type type;
+  size_t size;
+  char *data;
+  bool owns;
+  void *host_ptr;
+  cl_mem parent;
+  size_t origin;
+  cl_image_format format;
+  size_t width, height, depth, element_size, row_pitch, slice_pitch;
+  std::atomic<cl_uint> map_count;
+  std::vector<std::pair<void (CL_CALLBACK *)(cl_mem, void*), void*> >
+    destructors;
+};
+
+struct _cl_program : stub_object {
+  ~_cl_program();
+  cl_context context;
+  std::string source;
+  std::string options;
+  std::string log;
+  cl_build_status status;
+  cl_program_binary_type binary_type;
+  std::map<std::string, cl_uint> kernels;
+};
+
+struct _cl_kernel : stub_object {
+  ~_cl_kernel();
+  cl_program program;
+  std::string name;
+  std::vector<std::vector<char> > args;
+  std::vector<size_t> arg_sizes;
+  std::vector<bool> set;
+};
+
+struct _cl_event : stub_object {
+  _cl_event()
+      : context(NULL), queue(NULL), type(0), status(CL_QUEUED),
+        profiled(false), queued(0), submit(0), start(0), end(0) { }
+  cl_context context;
+  cl_command_queue queue;
+  cl_command_type type;
+  cl_int status;
+  bool profiled;
+  cl_ulong queued, submit, start, end;
+  std::vector<std::function<void(cl_int)> > callbacks;
+};
+
+namespace {
+
+std::mutex event_mutex;
+std::condition_variable event_cv;
+std::mutex hook_mutex;
+std::function<void(const stub::launch&)> launch_hook;
+
+const cl_uint max_platforms = 8;
+const cl_uint max_devices = 8;
+_cl_platform_id platforms[max_platforms];
+_cl_device_id devices[max_platforms][max_devices];
+std::once_flag devices_once;
+
+void init_devices() {
+  std::call_once(devices_once, [] {
+    for(cl_uint p=0; p<max_platforms; ++p) {
+      platforms[p].index = p;
+      for(cl_uint d=0; d<max_devices; ++d) {
+        devices[p][d].platform = &platforms[p];
+        devices[p][d].index = d;
+      }
+    }
+  });
+}
+
+cl_ulong now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+cl_int answer(const void *value, size_t size, size_t param_value_size,
+    void *param_value, size_t *param_value_size_ret) {
+  if(param_value_size_ret) *param_value_size_ret = size;
+  if(param_value) {
+    if(param_value_size < size) return CL_INVALID_VALUE;
+    std::memcpy(param_value, value, size);
+  }
+  return CL_SUCCESS;
+}
+
+template<typename T>
+cl_int answer(const T &value, size_t param_value_size, void *param_value,
+    size_t *param_value_size_ret) {
+  return answer(&value, sizeof(T), param_value_size, param_value,
+      param_value_size_ret);
+}
+
+cl_int answer_string(const std::string &s, size_t param_value_size,
+    void *param_value, size_t *param_value_size_ret) {
+  return answer(s.c_str(), s.size() + 1, param_value_size, param_value,
+      param_value_size_ret);
+}
+
+/* internal references; only the clRetain and clRelease entry points
+ * count towards counters() */
+void retain(stub_object *o) {
+  ++o->refs;
+}
+
+template<typename T>
+void release(T *o) {
+  if(--o->refs == 0) delete o;
+}
+
+void release_device(cl_device_id d) {
+  if(d->sub && --d->refs == 0) {
+    --stub::counters().live_objects;
+    delete d;
+  }
+}
+
+}
+
+/* objects drop their references to other objects when they die */
+
+_cl_context::~_cl_context() {
+  for(size_t i=0; i<devices.size(); ++i) release_device(devices[i]);
+}
+
+_cl_command_queue::~_cl_command_queue() {
+  if(last) release(last);
+  release(context);
+}
+
+_cl_mem::~_cl_mem() {
+  for(size_t i=destructors.size(); i-->0; ) {
+    destructors[i].first(this, destructors[i].second);
+  }
+  if(owns) std::free(data);
+  if(parent) release(parent);
+  release(context);
+}
+
+_cl_program::~_cl_program() {
+  release(context);
+}
+
+_cl_kernel::~_cl_kernel() {
+  release(program);
+}
+
+namespace {
+
+/* events */
+
+void complete(cl_event e, cl_int status) {
+  std::vector<std::function<void(cl_int)> > callbacks;
+  {
+    std::lock_guard<std::mutex> lock(event_mutex);
+    if(e->status <= CL_COMPLETE) return;
+    e->status = status;
+    if(e->profiled && !e->end) e->end = now_ns();
+    callbacks.swap(e->callbacks);
+  }
+  event_cv.notify_all();
+  for(size_t i=0; i<callbacks.size(); ++i) callbacks[i](status);
+}
+
+/** \brief runs f(status) once e completes, at once if it has */
+void when_complete(cl_event e, const std::function<void(cl_int)> &f) {
+  cl_int status;
+  {
+    std::lock_guard<std::mutex> lock(event_mutex);
+    status = e->status;
+    if(status > CL_COMPLETE) {
+      e->callbacks.push_back(f);
+      return;
+    }
+  }
+  f(status);
+}
+
+cl_int event_status(cl_event e) {
+  std::lock_guard<std::mutex> lock(event_mutex);
+  return e->status;
+}
+
+void flush_queue(cl_command_queue q) {
+  std::vector<std::function<void()> > submit;
+  {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    submit.swap(q->unflushed);
+  }
+  for(size_t i=0; i<submit.size(); ++i) submit[i]();
+}
+
+/** \brief waits for e, flushing its queue first as clWaitForEvents
+ * does */
+void wait_event(cl_event e) {
+  cl_command_queue q = NULL;
+  {
+    std::lock_guard<std::mutex> lock(event_mutex);
+    // a pending command holds its queue, so the queue is alive here
+    if(e->status > CL_COMPLETE && e->queue) {
+      q = e->queue;
+      ++q->refs;
+    }
+  }
+  if(q) {
+    flush_queue(q);
+    release(q);
+  }
+  std::unique_lock<std::mutex> lock(event_mutex);
+  event_cv.wait(lock, [e] { return e->status <= CL_COMPLETE; });
+}
+
+/** \brief enqueues work on q after the wait list and, for in-order
+ * queues, after the previous command */
+cl_int enqueue(cl_command_queue q, cl_command_type type, cl_uint n,
+    const cl_event *wait, cl_event *out, const std::function<void()> &work,
+    bool blocking = false, bool barrier = false) {
+  if(!q) return CL_INVALID_COMMAND_QUEUE;
+  if((n && !wait) || (!n && wait)) return CL_INVALID_EVENT_WAIT_LIST;
+  for(cl_uint i=0; i<n; ++i) {
+    if(!wait[i]) return CL_INVALID_EVENT_WAIT_LIST;
+  }
+  ++stub::counters().enqueues;
+
+  cl_event e = new _cl_event;
+  e->context = q->context;
+  e->queue = q;
+  e->type = type;
+  e->profiled = (q->properties & CL_QUEUE_PROFILING_ENABLE) != 0;
+  if(e->profiled) e->queued = e->submit = now_ns();
+  retain(q);
+
+  std::vector<cl_event> deps(wait, wait + n);
+  {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    if(barrier) {
+      deps.insert(deps.end(), q->pending.begin(), q->pending.end());
+    } else if(!(q->properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+        && q->last) {
+      deps.push_back(q->last);
+    }
+    for(size_t i=0; i<deps.size(); ++i) retain(deps[i]);
+    // one reference for pending and one for last
+    retain(e);
+    q->pending.insert(e);
+    if(q->last) release(q->last);
+    retain(e);
+    q->last = e;
+  }
+  if(out) {
+    retain(e);
+    *out = e;
+  }
+
+  struct state {
+    std::atomic<size_t> remaining;
+    std::atomic<cl_int> error;
+  };
+  std::shared_ptr<state> s = std::make_shared<state>();
+  s->remaining = deps.size() + 1;
+  s->error = CL_SUCCESS;
+  std::function<void()> run = [q, e, work, s]() {
+    cl_int status = s->error;
+    if(status == CL_SUCCESS) {
+      if(e->profiled) e->start = now_ns();
+      work();
+      complete(e, CL_COMPLETE);
+    } else {
+      complete(e, CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST);
+    }
+    {
+      std::lock_guard<std::mutex> lock(q->mutex);
+      q->pending.erase(e);
+    }
+    event_cv.notify_all();
+    release(e);
+    release(e);
+    release(q);
+  };
+  for(size_t i=0; i<deps.size(); ++i) {
+    cl_event dep = deps[i];
+    when_complete(dep, [s, run, dep](cl_int status) {
+      if(status < 0) s->error = status;
+      if(--s->remaining == 0) run();
+      release(dep);
+    });
+  }
+  std::function<void()> submit = [s, run] {
+    if(--s->remaining == 0) run();
+  };
+  if(stub::settings().defer_until_flush) {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    q->unflushed.push_back(submit);
+  } else {
+    submit();
+  }
+  if(blocking) {
+    wait_event(e);
+    if(event_status(e) < 0) {
+      return CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+    }
+  }
+  return CL_SUCCESS;
+}
+
+/* memory */
+
+bool in_bounds(cl_mem m, size_t offset, size_t size) {
+  return offset <= m->size && size <= m->size - offset;
+}
+
+/** \brief checks and completes a rect transfer's pitches, as
+ * clEnqueue*BufferRect does */
+bool rect_pitches(const size_t *region, size_t &row_pitch,
+    size_t &slice_pitch) {
+  if(!region[0] || !region[1] || !region[2]) return false;
+  if(!row_pitch) row_pitch = region[0];
+  if(row_pitch < region[0]) return false;
+  if(!slice_pitch) slice_pitch = region[1] * row_pitch;
+  if(slice_pitch < region[1] * row_pitch) return false;
+  if(slice_pitch % row_pitch) return false;
+  return true;
+}
+
+size_t rect_offset(const size_t *origin, size_t row_pitch,
+    size_t slice_pitch) {
+  return origin[2] * slice_pitch + origin[1] * row_pitch + origin[0];
+}
+
+/** \brief bytes from a rect's first to one past its last byte */
+size_t rect_extent(const size_t *region, size_t row_pitch,
+    size_t slice_pitch) {
+  return (region[2] - 1) * slice_pitch + (region[1] - 1) * row_pitch
+    + region[0];
+}
+
+void copy_rect(char *dst, size_t dst_row, size_t dst_slice,
+    const char *src, size_t src_row, size_t src_slice,
+    const size_t *region) {
+  for(size_t z=0; z<region[2]; ++z) {
+    for(size_t y=0; y<region[1]; ++y) {
+      std::memmove(dst + z * dst_slice + y * dst_row,
+          src + z * src_slice + y * src_row, region[0]);
+    }
+  }
+}
+
+size_t channel_count(cl_channel_order o) {
+  switch(o) {
+    case CL_RGBA: return 4;
+    case CL_R: return 1;
+    default: return 0;
+  }
+}
+
+size_t channel_size(cl_channel_type t) {
+  switch(t) {
+    case CL_UNORM_INT8: case CL_SNORM_INT8: case CL_SIGNED_INT8:
+    case CL_UNSIGNED_INT8:
+      return 1;
+    case CL_UNORM_INT16: case CL_SNORM_INT16: case CL_SIGNED_INT16:
+    case CL_UNSIGNED_INT16: case CL_HALF_FLOAT:
+      return 2;
+    case CL_SIGNED_INT32: case CL_UNSIGNED_INT32: case CL_FLOAT:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+cl_mem create_image(cl_context context, cl_mem_flags flags,
+    const cl_image_format *format, size_t width, size_t height,
+    size_t depth, size_t row_pitch, size_t slice_pitch, void *host_ptr,
+    cl_int *errcode_ret) {
+  cl_int dummy;
+  cl_int &err = errcode_ret ? *errcode_ret : dummy;
+  if(!context) { err = CL_INVALID_CONTEXT; return NULL; }
+  if(!stub::settings().image_support) {
+    err = CL_INVALID_OPERATION;
+    return NULL;
+  }
+  const size_t element = format ? channel_count(format->image_channel_order)
+    * channel_size(format->image_channel_data_type) : 0;
+  if(!element) { err = CL_IMAGE_FORMAT_NOT_SUPPORTED; return NULL; }
+  if(!width || !height || !depth) {
+    err = CL_INVALID_IMAGE_SIZE;
+    return NULL;
+  }
+  cl_mem m = new _cl_mem;
+  m->context = context;
+  retain(context);
+  m->flags = flags;
+  m->type = depth > 1 ? CL_MEM_OBJECT_IMAGE3D : CL_MEM_OBJECT_IMAGE2D;
+  m->format = *format;
+  m->width = width;
+  m->height = height;
+  m->depth = depth > 1 ? depth : 0;
+  m->element_size = element;
+  m->row_pitch = width * element;
+  m->slice_pitch = m->row_pitch * height;
+  m->size = m->slice_pitch * depth;
+  m->data = static_cast<char*>(std::calloc(1, m->size));
+  m->owns = true;
+  if(host_ptr && (flags & (CL_MEM_COPY_HOST_PTR | CL_MEM_USE_HOST_PTR))) {
+    if(!row_pitch) row_pitch = m->row_pitch;
+    if(!slice_pitch) slice_pitch = row_pitch * height;
+    const size_t region[] = { m->row_pitch, height, depth };
+    copy_rect(m->data, m->row_pitch, m->slice_pitch,
+        static_cast<char*>(host_ptr), row_pitch, slice_pitch, region);
+  }
+  err = CL_SUCCESS;
+  return m;
+}
+
+bool image_region_ok(cl_mem image, const size_t *origin,
+    const size_t *region) {
+  const size_t depth = image->depth ? image->depth : 1;
+  return image->type != CL_MEM_OBJECT_BUFFER
+    && origin[0] + region[0] <= image->width
+    && origin[1] + region[1] <= image->height
+    && origin[2] + region[2] <= depth
+    && region[0] && region[1] && region[2];
+}
+
+/** \brief the bytes of one pixel of color in image's format */
+std::vector<char> pixel(cl_mem image, const void *color) {
+  const size_t channels = channel_count(image->format.image_channel_order);
+  const cl_channel_type type = image->format.image_channel_data_type;
+  const size_t size = channel_size(type);
+  std::vector<char> to_return(image->element_size);
+  for(size_t c=0; c<channels; ++c) {
+    char *dst = &to_return[c * size];
+    const float f = static_cast<const float*>(color)[c];
+    const cl_int i = static_cast<const cl_int*>(color)[c];
+    const cl_uint u = static_cast<const cl_uint*>(color)[c];
+    switch(type) {
+      case CL_FLOAT: std::memcpy(dst, &f, 4); break;
+      case CL_UNORM_INT8: {
+        const cl_uchar v = static_cast<cl_uchar>(
+            std::min(1.0f, std::max(0.0f, f)) * 255.0f + 0.5f);
+        std::memcpy(dst, &v, 1);
+        break;
+      }
+      case CL_SIGNED_INT8: case CL_SIGNED_INT16: case CL_SIGNED_INT32:
+        std::memcpy(dst, &i, size);
+        break;
+      default:
+        std::memcpy(dst, &u, size);
+        break;
+    }
+  }
+  return to_return;
+}
+
+cl_uint root_units(cl_device_id d) {
+  if(d->sub) return d->units;
+  const stub::settings_type &s = stub::settings();
+  return d->index < s.device_compute_units.size()
+    ? s.device_compute_units[d->index] : s.compute_units;
+}
+
+/* programs */
+
+/** \brief the kernels in source and their argument counts, found by
+ * looking for "__kernel void name(" */
+std::map<std::string, cl_uint> parse_kernels(const std::string &source) {
+  std::map<std::string, cl_uint> to_return;
+  const std::string marker = "__kernel void ";
+  for(size_t pos = source.find(marker); pos != std::string::npos;
+      pos = source.find(marker, pos + 1)) {
+    size_t name_begin = pos + marker.size();
+    size_t paren = source.find('(', name_begin);
+    if(paren == std::string::npos) break;
+    std::string name = source.substr(name_begin, paren - name_begin);
+    size_t close = source.find(')', paren);
+    if(close == std::string::npos) break;
+    std::string params = source.substr(paren + 1, close - paren - 1);
+    cl_uint args = params.find_first_not_of(" \n\t") == std::string::npos
+      ? 0 : cl_uint(std::count(params.begin(), params.end(), ',') + 1);
+    to_return[name] = args;
+  }
+  return to_return;
+}
+
+const std::string binary_magic = "stub binary\n";
+const std::string object_magic = "stub object\n";
+
+/** \brief the bytes CL_PROGRAM_BINARIES returns for p */
+std::string program_binary(cl_program p) {
+  return (p->binary_type == CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT
+      ? object_magic : binary_magic) + p->source;
+}
+
+}
+
+namespace stub {
+
+settings_type::settings_type()
+    : num_platforms(1), devices_per_platform(1),
+      device_type(CL_DEVICE_TYPE_CPU), platform_version("OpenCL 1.2 stub"),
+      device_version("OpenCL 1.2 stub"), image_support(true),
+      compute_units(8), max_work_group_size(256),
+      kernel_work_group_size(256), local_mem_size(32768),
+      global_mem_size(cl_ulong(1) << 30), mem_base_addr_align(1024),
+      preferred_vector_width(4), numa_nodes(2), defer_until_flush(false),
+      build_millis(0), fail_buffers(0) { }
+
+settings_type& settings() {
+  static settings_type s;
+  return s;
+}
+
+counters_type& counters() {
+  static counters_type c;
+  return c;
+}
+
+void reset_counters() {
+  counters_type &c = counters();
+  c.retains = 0;
+  c.releases = 0;
+  c.platform_queries = 0;
+  c.enqueues = 0;
+  c.launches = 0;
+  c.builds = 0;
+  c.compiles = 0;
+  c.links = 0;
+  c.peak_building = c.building.load();
+  c.kernels_created = 0;
+  c.kernel_queries = 0;
+  c.buffers_created = 0;
+}
+
+void set_launch_hook(const std::function<void(const launch&)> &hook) {
+  std::lock_guard<std::mutex> lock(hook_mutex);
+  launch_hook = hook;
+}
+
+char* mem_data(cl_mem m) {
+  return m->data;
+}
+
+}
+
+extern "C" {
+
+/* platforms and devices */
+
+CL_API_ENTRY cl_int CL_API_CALL clGetPlatformIDs(cl_uint num_entries,
+    cl_platform_id *platforms_out, cl_uint *num_platforms) {
+  init_devices();
+  ++stub::counters().platform_queries;
+  const cl_uint n = std::min(stub::settings().num_platforms, max_platforms);
+  if(num_platforms) *num_platforms = n;
+  if(!n) return CL_PLATFORM_NOT_FOUND_KHR;
+  if(platforms_out) {
+    if(!num_entries) return CL_INVALID_VALUE;
+    for(cl_uint i=0; i<n && i<num_entries; ++i) {
+      platforms_out[i] = &platforms[i];
+    }
+  }
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetPlatformInfo(cl_platform_id p,
+    cl_platform_info name, size_t size, void *value, size_t *size_ret) {
+  if(!p) return CL_INVALID_PLATFORM;
+  std::string s;
+  switch(name) {
+    case CL_PLATFORM_PROFILE: s = "FULL_PROFILE"; break;
+    case CL_PLATFORM_VERSION: s = stub::settings().platform_version; break;
+    case CL_PLATFORM_NAME: s = "stub platform " + std::to_string(p->index);
+      break;
+    case CL_PLATFORM_VENDOR: s = "cl_wrapper tests"; break;
+    case CL_PLATFORM_EXTENSIONS: s = ""; break;
+    default: return CL_INVALID_VALUE;
+  }
+  return answer_string(s, size, value, size_ret);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetDeviceIDs(cl_platform_id p,
+    cl_device_type type, cl_uint num_entries, cl_device_id *out,
+    cl_uint *num_devices) {
+  init_devices();
+  if(!p) return CL_INVALID_PLATFORM;
+  const stub::settings_type &s = stub::settings();
+  const bool match = type == CL_DEVICE_TYPE_ALL
+    || type == CL_DEVICE_TYPE_DEFAULT || (type & s.device_type);
+  const cl_uint n = match ? std::min(s.devices_per_platform, max_devices)
+    : 0;
+  if(num_devices) *num_devices = n;
+  if(!n) return CL_DEVICE_NOT_FOUND;
+  if(out) {
+    if(!num_entries) return CL_INVALID_VALUE;
+    for(cl_uint i=0; i<n && i<num_entries; ++i) {
+      out[i] = &devices[p->index][i];
+    }
+  }
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetDeviceInfo(cl_device_id d,
+    cl_device_info name, size_t size, void *value, size_t *size_ret) {
+  if(!d) return CL_INVALID_DEVICE;
+  const stub::settings_type &s = stub::settings();
+  const cl_uint units = root_units(d);
+  switch(name) {
+    case CL_DEVICE_NAME:
+      return answer_string(d->sub ? "stub sub-device" : "stub device", size,
+          value, size_ret);
+    case CL_DEVICE_VENDOR:
+      return answer_string("cl_wrapper tests", size, value, size_ret);
+    case CL_DRIVER_VERSION:
+      return answer_string("1.0", size, value, size_ret);
+    case CL_DEVICE_PROFILE:
+      return answer_string("FULL_PROFILE", size, value, size_ret);
+    case CL_DEVICE_VERSION:
+      return answer_string(s.device_version, size, value, size_ret);
+    case CL_DEVICE_EXTENSIONS:
+      return answer_string("", size, value, size_ret);
+    case CL_DEVICE_PLATFORM:
+      return answer(d->platform, size, value, size_ret);
+    case CL_DEVICE_TYPE:
+      return answer(cl_device_type(s.device_type), size, value, size_ret);
+    case CL_DEVICE_MAX_WORK_ITEM_SIZES: {
+      const size_t sizes[] = { s.max_work_group_size,
+        s.max_work_group_size, s.max_work_group_size };
+      return answer(sizes, sizeof(sizes), size, value, size_ret);
+    }
+    case CL_DEVICE_MAX_WORK_GROUP_SIZE:
+    case CL_DEVICE_IMAGE2D_MAX_WIDTH:
+    case CL_DEVICE_IMAGE2D_MAX_HEIGHT:
+    case CL_DEVICE_IMAGE3D_MAX_WIDTH:
+    case CL_DEVICE_IMAGE3D_MAX_HEIGHT:
+    case CL_DEVICE_IMAGE3D_MAX_DEPTH:
+    case CL_DEVICE_PROFILING_TIMER_RESOLUTION:
+      return answer(name == CL_DEVICE_MAX_WORK_GROUP_SIZE
+          ? s.max_work_group_size : size_t(1), size, value, size_ret);
+    case CL_DEVICE_MAX_PARAMETER_SIZE:
+      return answer(size_t(1024), size, value, size_ret);
+    case CL_DEVICE_LOCAL_MEM_SIZE:
+      return answer(s.local_mem_size, size, value, size_ret);
+    case CL_DEVICE_GLOBAL_MEM_SIZE:
+      return answer(s.global_mem_size, size, value, size_ret);
+    case CL_DEVICE_MAX_MEM_ALLOC_SIZE:
+      return answer(s.global_mem_size / 4, size, value, size_ret);
+    case CL_DEVICE_GLOBAL_MEM_CACHE_SIZE:
+    case CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE:
+      return answer(cl_ulong(65536), size, value, size_ret);
+    case CL_DEVICE_MAX_COMPUTE_UNITS:
+      return answer(units, size, value, size_ret);
+    case CL_DEVICE_MEM_BASE_ADDR_ALIGN:
+      return answer(s.mem_base_addr_align, size, value, size_ret);
+    case CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR:
+    case CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT:
+    case CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT:
+    case CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG:
+    case CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT:
+    case CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE:
+      return answer(s.preferred_vector_width, size, value, size_ret);
+    case CL_DEVICE_IMAGE_SUPPORT:
+      return answer(cl_bool(s.image_support), size, value, size_ret);
+    case CL_DEVICE_AVAILABLE:
+    case CL_DEVICE_COMPILER_AVAILABLE:
+    case CL_DEVICE_ENDIAN_LITTLE:
+      return answer(cl_bool(CL_TRUE), size, value, size_ret);
+    case CL_DEVICE_ERROR_CORRECTION_SUPPORT:
+      return answer(cl_bool(CL_FALSE), size, value, size_ret);
+    case CL_DEVICE_ADDRESS_BITS:
+      return answer(cl_uint(64), size, value, size_ret);
+    case CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS:
+      return answer(cl_uint(3), size, value, size_ret);
+    case CL_DEVICE_QUEUE_PROPERTIES:
+      return answer(cl_command_queue_properties(
+            CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE
+            | CL_QUEUE_PROFILING_ENABLE), size, value, size_ret);
+    case CL_DEVICE_PARENT_DEVICE:
+      return answer(d->parent, size, value, size_ret);
+    case CL_DEVICE_REFERENCE_COUNT:
+      return answer(cl_uint(d->refs.load()), size, value, size_ret);
+    case CL_DEVICE_PARTITION_TYPE:
+      return answer(d->partition.empty() ? NULL : &d->partition[0],
+          d->partition.size() * sizeof(cl_device_partition_property), size,
+          value, size_ret);
+    case CL_DEVICE_EXECUTION_CAPABILITIES:
+    case CL_DEVICE_SINGLE_FP_CONFIG:
+      return answer(cl_bitfield(1), size, value, size_ret);
+    default:
+      // remaining scalar properties: report 1 at the caller's size
+      if(size_ret) *size_ret = size ? size : sizeof(cl_ulong);
+      if(value) {
+        std::memset(value, 0, size);
+        static_cast<char*>(value)[0] = 1;
+      }
+      return CL_SUCCESS;
+  }
+}
+
+#ifdef CL_VERSION_1_2
+CL_API_ENTRY cl_int CL_API_CALL clCreateSubDevices(cl_device_id d,
+    const cl_device_partition_property *props, cl_uint num_entries,
+    cl_device_id *out, cl_uint *num_devices) {
+  if(!d) return CL_INVALID_DEVICE;
+  if(!props) return CL_INVALID_VALUE;
+  const cl_uint units = root_units(d);
+  std::vector<cl_uint> parts;
+  cl_device_affinity_domain domain = 0;
+  switch(props[0]) {
+    case CL_DEVICE_PARTITION_EQUALLY: {
+      const cl_uint each = cl_uint(props[1]);
+      if(!each || each > units) return CL_INVALID_VALUE;
+      parts.assign(units / each, each);
+      break;
+    }
+    case CL_DEVICE_PARTITION_BY_COUNTS:
+      for(size_t i=1; props[i] != CL_DEVICE_PARTITION_BY_COUNTS_LIST_END;
+          ++i) {
+        parts.push_back(cl_uint(props[i]));
+      }
+      break;
+    case CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN: {
+      domain = cl_device_affinity_domain(props[1]);
+      cl_uint n = 2;
+      if(domain == CL_DEVICE_AFFINITY_DOMAIN_NUMA) {
+        n = stub::settings().numa_nodes;
+        if(n < 2) return CL_DEVICE_PARTITION_FAILED;
+      } else if(domain == CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE) {
+        domain = stub::settings().numa_nodes > 1
+          ? cl_device_affinity_domain(CL_DEVICE_AFFINITY_DOMAIN_NUMA)
+          : cl_device_affinity_domain(CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE);
+        if(domain == CL_DEVICE_AFFINITY_DOMAIN_NUMA) {
+          n = stub::settings().numa_nodes;
+        }
+      }
+      if(units < n) return CL_DEVICE_PARTITION_FAILED;
+      parts.assign(n, units / n);
+      break;
+    }
+    default:
+      return CL_INVALID_VALUE;
+  }
+  if(num_devices) *num_devices = cl_uint(parts.size());
+  if(!out) return CL_SUCCESS;
+  if(num_entries < parts.size()) return CL_INVALID_VALUE;
+  for(size_t i=0; i<parts.size(); ++i) {
+    cl_device_id sub = new _cl_device_id;
+    sub->platform = d->platform;
+    sub->parent = d;
+    sub->units = parts[i];
+    sub->sub = true;
+    sub->domain = domain;
+    sub->partition.push_back(props[0]);
+    if(props[0] == CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN) {
+      sub->partition.push_back(cl_device_partition_property(domain));
+    } else {
+      sub->partition.push_back(cl_device_partition_property(parts[i]));
+    }
+    sub->partition.push_back(0);
+    ++stub::counters().live_objects;
+    out[i] = sub;
+  }
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainDevice(cl_device_id d) {
+  if(!d) return CL_INVALID_DEVICE;
+  if(d->sub) {
+    ++stub::counters().retains;
+    ++d->refs;
+  }
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseDevice(cl_device_id d) {
+  if(!d) return CL_INVALID_DEVICE;
+  if(d->sub) ++stub::counters().releases;
+  release_device(d);
+  return CL_SUCCESS;
+}
+#endif
+
+/* contexts and queues */
+
+CL_API_ENTRY cl_context CL_API_CALL clCreateContext(
+    const cl_context_properties *, cl_uint num_devices,
+    const cl_device_id *devices_in,
+    void (CL_CALLBACK *)(const char*, const void*, size_t, void*), void *,
+    cl_int *errcode_ret) {
+  if(!num_devices || !devices_in) {
+    if(errcode_ret) *errcode_ret = CL_INVALID_VALUE;
+    return NULL;
+  }
+  cl_context c = new _cl_context;
+  c->devices.assign(devices_in, devices_in + num_devices);
+  for(cl_uint i=0; i<num_devices; ++i) {
+    if(devices_in[i]->sub) ++devices_in[i]->refs;
+  }
+  if(errcode_ret) *errcode_ret = CL_SUCCESS;
+  return c;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainContext(cl_context c) {
+  if(!c) return CL_INVALID_CONTEXT;
+  ++stub::counters().retains;
+  retain(c);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseContext(cl_context c) {
+  if(!c) return CL_INVALID_CONTEXT;
+  ++stub::counters().releases;
+  release(c);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetContextInfo(cl_context c,
+    cl_context_info name, size_t size, void *value, size_t *size_ret) {
+  if(!c) return CL_INVALID_CONTEXT;
+  switch(name) {
+    case CL_CONTEXT_REFERENCE_COUNT:
+      return answer(cl_uint(c->refs.load()), size, value, size_ret);
+    case CL_CONTEXT_DEVICES:
+      return answer(&c->devices[0], c->devices.size() * sizeof(cl_device_id),
+          size, value, size_ret);
+    case CL_CONTEXT_NUM_DEVICES:
+      return answer(cl_uint(c->devices.size()), size, value, size_ret);
+    default:
+      return CL_INVALID_VALUE;
+  }
+}
+
+CL_API_ENTRY cl_command_queue CL_API_CALL clCreateCommandQueue(
+    cl_context c, cl_device_id d, cl_command_queue_properties properties,
+    cl_int *errcode_ret) {
+  if(!c || std::find(c->devices.begin(), c->devices.end(), d) ==
+      c->devices.end()) {
+    if(errcode_ret) *errcode_ret = c ? CL_INVALID_DEVICE : CL_INVALID_CONTEXT;
+    return NULL;
+  }
+  cl_command_queue q = new _cl_command_queue;
+  q->context = c;
+  retain(c);
+  q->device = d;
+  q->properties = properties;
+  q->last = NULL;
+  if(errcode_ret) *errcode_ret = CL_SUCCESS;
+  return q;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainCommandQueue(cl_command_queue q) {
+  if(!q) return CL_INVALID_COMMAND_QUEUE;
+  ++stub::counters().retains;
+  retain(q);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseCommandQueue(cl_command_queue q) {
+  if(!q) return CL_INVALID_COMMAND_QUEUE;
+  ++stub::counters().releases;
+  release(q);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetCommandQueueInfo(cl_command_queue q,
+    cl_command_queue_info name, size_t size, void *value, size_t *size_ret) {
+  if(!q) return CL_INVALID_COMMAND_QUEUE;
+  switch(name) {
+    case CL_QUEUE_CONTEXT:
+      return answer(q->context, size, value, size_ret);
+    case CL_QUEUE_DEVICE:
+      return answer(q->device, size, value, size_ret);
+    case CL_QUEUE_REFERENCE_COUNT:
+      return answer(cl_uint(q->refs.load()), size, value, size_ret);
+    case CL_QUEUE_PROPERTIES:
+      return answer(q->properties, size, value, size_ret);
+    default:
+      return CL_INVALID_VALUE;
+  }
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clFlush(cl_command_queue q) {
+  if(!q) return CL_INVALID_COMMAND_QUEUE;
+  flush_queue(q);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clFinish(cl_command_queue q) {
+  if(!q) return CL_INVALID_COMMAND_QUEUE;
+  flush_queue(q);
+  std::unique_lock<std::mutex> lock(event_mutex);
+  event_cv.wait(lock, [q] {
+    std::lock_guard<std::mutex> queue_lock(q->mutex);
+    return q->pending.empty();
+  });
+  return CL_SUCCESS;
+}
+
+/* memory objects */
+
+CL_API_ENTRY cl_mem CL_API_CALL clCreateBuffer(cl_context c,
+    cl_mem_flags flags, size_t size, void *host_ptr, cl_int *errcode_ret) {
+  cl_int dummy;
+  cl_int &err = errcode_ret ? *errcode_ret : dummy;
+  if(!c) { err = CL_INVALID_CONTEXT; return NULL; }
+  if(!size || size > stub::settings().global_mem_size) {
+    err = CL_INVALID_BUFFER_SIZE;
+    return NULL;
+  }
+  const bool wants_ptr = (flags & (CL_MEM_USE_HOST_PTR
+        | CL_MEM_COPY_HOST_PTR)) != 0;
+  if(wants_ptr != (host_ptr != NULL)) {
+    err = CL_INVALID_HOST_PTR;
+    return NULL;
+  }
+  int fail = stub::settings().fail_buffers.load();
+  while(fail > 0) {
+    if(stub::settings().fail_buffers.compare_exchange_weak(fail, fail - 1)) {
+      err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+      return NULL;
+    }
+  }
+  cl_mem m = new _cl_mem;
+  m->context = c;
+  retain(c);
+  m->flags = flags;
+  m->size = size;
+  if(flags & CL_MEM_USE_HOST_PTR) {
+    m->data = static_cast<char*>(host_ptr);
+    m->host_ptr = host_ptr;
+  } else {
+    m->data = static_cast<char*>(std::calloc(1, size));
+    m->owns = true;
+    if(flags & CL_MEM_COPY_HOST_PTR) std::memcpy(m->data, host_ptr, size);
+  }
+  ++stub::counters().buffers_created;
+  err = CL_SUCCESS;
+  return m;
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL clCreateSubBuffer(cl_mem parent,
+    cl_mem_flags flags, cl_buffer_create_type type, const void *info,
+    cl_int *errcode_ret) {
+  cl_int dummy;
+  cl_int &err = errcode_ret ? *errcode_ret : dummy;
+  if(!parent || parent->parent || parent->type != CL_MEM_OBJECT_BUFFER) {
+    err = CL_INVALID_MEM_OBJECT;
+    return NULL;
+  }
+  const cl_buffer_region *r = static_cast<const cl_buffer_region*>(info);
+  if(type != CL_BUFFER_CREATE_TYPE_REGION || !r || !r->size
+      || !in_bounds(parent, r->origin, r->size)) {
+    err = CL_INVALID_VALUE;
+    return NULL;
+  }
+  if(r->origin % (stub::settings().mem_base_addr_align / 8)) {
+    err = CL_MISALIGNED_SUB_BUFFER_OFFSET;
+    return NULL;
+  }
+  cl_mem m = new _cl_mem;
+  m->context = parent->context;
+  retain(m->context);
+  m->flags = flags ? flags : parent->flags;
+  m->size = r->size;
+  m->data = parent->data + r->origin;
+  m->parent = parent;
+  retain(parent);
+  m->origin = r->origin;
+  err = CL_SUCCESS;
+  return m;
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL clCreateImage2D(cl_context c,
+    cl_mem_flags flags, const cl_image_format *format, size_t width,
+    size_t height, size_t row_pitch, void *host_ptr, cl_int *errcode_ret) {
+  return create_image(c, flags, format, width, height, 1, row_pitch, 0,
+      host_ptr, errcode_ret);
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL clCreateImage3D(cl_context c,
+    cl_mem_flags flags, const cl_image_format *format, size_t width,
+    size_t height, size_t depth, size_t row_pitch, size_t slice_pitch,
+    void *host_ptr, cl_int *errcode_ret) {
+  if(depth < 2) {
+    if(errcode_ret) *errcode_ret = CL_INVALID_IMAGE_SIZE;
+    return NULL;
+  }
+  return create_image(c, flags, format, width, height, depth, row_pitch,
+      slice_pitch, host_ptr, errcode_ret);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainMemObject(cl_mem m) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  ++stub::counters().retains;
+  retain(m);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseMemObject(cl_mem m) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  ++stub::counters().releases;
+  release(m);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clSetMemObjectDestructorCallback(cl_mem m,
+    void (CL_CALLBACK *f)(cl_mem, void*), void *user_data) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  if(!f) return CL_INVALID_VALUE;
+  m->destructors.push_back(std::make_pair(f, user_data));
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetMemObjectInfo(cl_mem m,
+    cl_mem_info name, size_t size, void *value, size_t *size_ret) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  switch(name) {
+    case CL_MEM_TYPE: return answer(m->type, size, value, size_ret);
+    case CL_MEM_FLAGS: return answer(m->flags, size, value, size_ret);
+    case CL_MEM_SIZE: return answer(m->size, size, value, size_ret);
+    case CL_MEM_HOST_PTR: return answer(m->host_ptr, size, value, size_ret);
+    case CL_MEM_MAP_COUNT:
+      return answer(cl_uint(m->map_count.load()), size, value, size_ret);
+    case CL_MEM_REFERENCE_COUNT:
+      return answer(cl_uint(m->refs.load()), size, value, size_ret);
+    case CL_MEM_CONTEXT: return answer(m->context, size, value, size_ret);
+    case CL_MEM_ASSOCIATED_MEMOBJECT:
+      return answer(m->parent, size, value, size_ret);
+    case CL_MEM_OFFSET: return answer(m->origin, size, value, size_ret);
+    default: return CL_INVALID_VALUE;
+  }
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetImageInfo(cl_mem m,
+    cl_image_info name, size_t size, void *value, size_t *size_ret) {
+  if(!m || m->type == CL_MEM_OBJECT_BUFFER) return CL_INVALID_MEM_OBJECT;
+  switch(name) {
+    case CL_IMAGE_FORMAT: return answer(m->format, size, value, size_ret);
+    case CL_IMAGE_ELEMENT_SIZE:
+      return answer(m->element_size, size, value, size_ret);
+    case CL_IMAGE_ROW_PITCH:
+      return answer(m->row_pitch, size, value, size_ret);
+    case CL_IMAGE_SLICE_PITCH:
+      return answer(m->depth ? m->slice_pitch : size_t(0), size, value,
+          size_ret);
+    case CL_IMAGE_WIDTH: return answer(m->width, size, value, size_ret);
+    case CL_IMAGE_HEIGHT: return answer(m->height, size, value, size_ret);
+    case CL_IMAGE_DEPTH: return answer(m->depth, size, value, size_ret);
+    default: return CL_INVALID_VALUE;
+  }
+}
+
+/* programs and kernels */
+
+CL_API_ENTRY cl_program CL_API_CALL clCreateProgramWithSource(
+    cl_context c, cl_uint count, const char **strings,
+    const size_t *lengths, cl_int *errcode_ret) {
+  if(!c || !count || !strings) {
+    if(errcode_ret) *errcode_ret = c ? CL_INVALID_VALUE : CL_INVALID_CONTEXT;
+    return NULL;
+  }
+  cl_program p = new _cl_program;
+  p->context = c;
+  retain(c);
+  for(cl_uint i=0; i<count; ++i) {
+    p->source += lengths && lengths[i] ? std::string(strings[i], lengths[i])
+      : std::string(strings[i]);
+  }
+  p->status = CL_BUILD_NONE;
+  p->binary_type = CL_PROGRAM_BINARY_TYPE_NONE;
+  if(errcode_ret) *errcode_ret = CL_SUCCESS;
+  return p;
+}
+
+CL_API_ENTRY cl_program CL_API_CALL clCreateProgramWithBinary(cl_context c,
+    cl_uint num_devices, const cl_device_id *, const size_t *lengths,
+    const unsigned char **binaries, cl_int *binary_status,
+    cl_int *errcode_ret) {
+  if(!c || !num_devices) {
+    if(errcode_ret) *errcode_ret = c ? CL_INVALID_VALUE : CL_INVALID_CONTEXT;
+    return NULL;
+  }
+  std::string source;
+  bool object = false;
+  for(cl_uint i=0; i<num_devices; ++i) {
+    const std::string bin(reinterpret_cast<const char*>(binaries[i]),
+        lengths[i]);
+    object = bin.compare(0, object_magic.size(), object_magic) == 0;
+    const bool ok = object
+      || bin.compare(0, binary_magic.size(), binary_magic) == 0;
+    if(binary_status) binary_status[i] = ok ? CL_SUCCESS : CL_INVALID_BINARY;
+    if(!ok) {
+      if(errcode_ret) *errcode_ret = CL_INVALID_BINARY;
+      return NULL;
+    }
+    source = bin.substr((object ? object_magic : binary_magic).size());
+  }
+  const char *src = source.c_str();
+  cl_program p = clCreateProgramWithSource(c, 1, &src, NULL, errcode_ret);
+  if(p && object) {
+    p->status = CL_BUILD_SUCCESS;
+    p->binary_type = CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT;
+  }
+  return p;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainProgram(cl_program p) {
+  if(!p) return CL_INVALID_PROGRAM;
+  ++stub::counters().retains;
+  retain(p);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseProgram(cl_program p) {
+  if(!p) return CL_INVALID_PROGRAM;
+  ++stub::counters().releases;
+  release(p);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clBuildProgram(cl_program p, cl_uint,
+    const cl_device_id *, const char *options,
+    void (CL_CALLBACK *notify)(cl_program, void*), void *user_data) {
+  if(!p) return CL_INVALID_PROGRAM;
+  stub::counters_type &c = stub::counters();
+  ++c.builds;
+  const stub::settings_type &s = stub::settings();
+  const unsigned millis = s.build_millis;
+  const long now = ++c.building;
+  for(long peak = c.peak_building; now > peak
+      && !c.peak_building.compare_exchange_weak(peak, now); ) { }
+  std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+  --c.building;
+  p->options = options ? options : "";
+  p->log.clear();
+  if(!s.build_error_marker.empty()
+      && p->source.find(s.build_error_marker) != std::string::npos) {
+    p->log = "error: found " + s.build_error_marker;
+  } else if(!s.image_support
+      && (p->source.find("image2d_t") != std::string::npos
+        || p->source.find("image3d_t") != std::string::npos)) {
+    p->log = "error: images are not supported";
+  }
+  p->status = p->log.empty() ? CL_BUILD_SUCCESS : CL_BUILD_ERROR;
+  if(p->status == CL_BUILD_SUCCESS) {
+    p->kernels = parse_kernels(p->source);
+    p->binary_type = CL_PROGRAM_BINARY_TYPE_EXECUTABLE;
+  }
+  if(notify) notify(p, user_data);
+  return p->status == CL_BUILD_SUCCESS ? CL_SUCCESS
+    : CL_BUILD_PROGRAM_FAILURE;
+}
+
+#ifdef CL_VERSION_1_2
+CL_API_ENTRY cl_int CL_API_CALL clCompileProgram(cl_program p, cl_uint,
+    const cl_device_id *, const char *options, cl_uint num_headers,
+    const cl_program *headers, const char **header_names,
+    void (CL_CALLBACK *notify)(cl_program, void*), void *user_data) {
+  if(!p) return CL_INVALID_PROGRAM;
+  if(num_headers && (!headers || !header_names)) return CL_INVALID_VALUE;
+  ++stub::counters().compiles;
+  const stub::settings_type &s = stub::settings();
+  p->options = options ? options : "";
+  p->log.clear();
+  if(!s.build_error_marker.empty()
+      && p->source.find(s.build_error_marker) != std::string::npos) {
+    p->log = "error: found " + s.build_error_marker;
+  }
+  p->status = p->log.empty() ? CL_BUILD_SUCCESS : CL_BUILD_ERROR;
+  p->binary_type = p->log.empty() ? CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT
+    : CL_PROGRAM_BINARY_TYPE_NONE;
+  if(notify) notify(p, user_data);
+  return p->status == CL_BUILD_SUCCESS ? CL_SUCCESS
+    : CL_COMPILE_PROGRAM_FAILURE;
+}
+
+CL_API_ENTRY cl_program CL_API_CALL clLinkProgram(cl_context c, cl_uint,
+    const cl_device_id *, const char *options, cl_uint num_programs,
+    const cl_program *programs, void (CL_CALLBACK *notify)(cl_program,
+      void*), void *user_data, cl_int *errcode_ret) {
+  cl_int dummy;
+  cl_int &err = errcode_ret ? *errcode_ret : dummy;
+  if(!c) { err = CL_INVALID_CONTEXT; return NULL; }
+  if(!num_programs || !programs) { err = CL_INVALID_VALUE; return NULL; }
+  std::string source;
+  for(cl_uint i=0; i<num_programs; ++i) {
+    if(!programs[i]) { err = CL_INVALID_PROGRAM; return NULL; }
+    if(programs[i]->binary_type != CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT) {
+      err = CL_INVALID_OPERATION;
+      return NULL;
+    }
+    source += programs[i]->source;
+  }
+  ++stub::counters().links;
+  const char *src = source.c_str();
+  cl_program p = clCreateProgramWithSource(c, 1, &src, NULL, &err);
+  if(!p) return NULL;
+  const stub::settings_type &s = stub::settings();
+  p->options = options ? options : "";
+  if(!s.link_error_marker.empty()
+      && source.find(s.link_error_marker) != std::string::npos) {
+    p->log = "error: undefined " + s.link_error_marker;
+    p->status = CL_BUILD_ERROR;
+  } else {
+    p->status = CL_BUILD_SUCCESS;
+    p->kernels = parse_kernels(source);
+    p->binary_type = CL_PROGRAM_BINARY_TYPE_EXECUTABLE;
+  }
+  if(notify) notify(p, user_data);
+  err = p->status == CL_BUILD_SUCCESS ? CL_SUCCESS
+    : CL_LINK_PROGRAM_FAILURE;
+  return p;
+}
+#endif
+
+CL_API_ENTRY cl_int CL_API_CALL clGetProgramInfo(cl_program p,
+    cl_program_info name, size_t size, void *value, size_t *size_ret) {
+  if(!p) return CL_INVALID_PROGRAM;
+  const std::vector<cl_device_id> &devs = p->context->devices;
+  switch(name) {
+    case CL_PROGRAM_REFERENCE_COUNT:
+      return answer(cl_uint(p->refs.load()), size, value, size_ret);
+    case CL_PROGRAM_CONTEXT:
+      return answer(p->context, size, value, size_ret);
+    case CL_PROGRAM_NUM_DEVICES:
+      return answer(cl_uint(devs.size()), size, value, size_ret);
+    case CL_PROGRAM_DEVICES:
+      return answer(&devs[0], devs.size() * sizeof(cl_device_id), size,
+          value, size_ret);
+    case CL_PROGRAM_SOURCE:
+      return answer_string(p->source, size, value, size_ret);
+    case CL_PROGRAM_BINARY_SIZES: {
+      std::vector<size_t> sizes(devs.size(),
+          p->status == CL_BUILD_SUCCESS ? program_binary(p).size() : 0);
+      return answer(&sizes[0], sizes.size() * sizeof(size_t), size, value,
+          size_ret);
+    }
+    case CL_PROGRAM_BINARIES: {
+      if(size_ret) *size_ret = devs.size() * sizeof(unsigned char*);
+      if(!value) return CL_SUCCESS;
+      unsigned char **out = static_cast<unsigned char**>(value);
+      const std::string bin = program_binary(p);
+      for(size_t i=0; i<devs.size(); ++i) {
+        if(out[i] && p->status == CL_BUILD_SUCCESS) {
+          std::memcpy(out[i], bin.data(), bin.size());
+        }
+      }
+      return CL_SUCCESS;
+    }
+    case CL_PROGRAM_NUM_KERNELS:
+      return answer(size_t(p->kernels.size()), size, value, size_ret);
+    default:
+      return CL_INVALID_VALUE;
+  }
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetProgramBuildInfo(cl_program p,
+    cl_device_id, cl_program_build_info name, size_t size, void *value,
+    size_t *size_ret) {
+  if(!p) return CL_INVALID_PROGRAM;
+  switch(name) {
+    case CL_PROGRAM_BUILD_STATUS:
+      return answer(p->status, size, value, size_ret);
+    case CL_PROGRAM_BUILD_OPTIONS:
+      return answer_string(p->options, size, value, size_ret);
+    case CL_PROGRAM_BUILD_LOG:
+      return answer_string(p->log, size, value, size_ret);
+#ifdef CL_VERSION_1_2
+    case CL_PROGRAM_BINARY_TYPE:
+      return answer(p->binary_type, size, value, size_ret);
+#endif
+    default:
+      return CL_INVALID_VALUE;
+  }
+}
+
+CL_API_ENTRY cl_kernel CL_API_CALL clCreateKernel(cl_program p,
+    const char *name, cl_int *errcode_ret) {
+  cl_int dummy;
+  cl_int &err = errcode_ret ? *errcode_ret : dummy;
+  if(!p) { err = CL_INVALID_PROGRAM; return NULL; }
+  if(p->status != CL_BUILD_SUCCESS) {
+    err = CL_INVALID_PROGRAM_EXECUTABLE;
+    return NULL;
+  }
+  std::map<std::string, cl_uint>::const_iterator it =
+    p->kernels.find(name ? name : "");
+  if(it == p->kernels.end()) { err = CL_INVALID_KERNEL_NAME; return NULL; }
+  cl_kernel k = new _cl_kernel;
+  k->program = p;
+  retain(p);
+  k->name = it->first;
+  k->args.resize(it->second);
+  k->arg_sizes.resize(it->second);
+  k->set.resize(it->second);
+  ++stub::counters().kernels_created;
+  err = CL_SUCCESS;
+  return k;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clCreateKernelsInProgram(cl_program p,
+    cl_uint num_kernels, cl_kernel *kernels, cl_uint *num_kernels_ret) {
+  if(!p) return CL_INVALID_PROGRAM;
+  if(num_kernels_ret) *num_kernels_ret = cl_uint(p->kernels.size());
+  if(!kernels) return CL_SUCCESS;
+  if(num_kernels < p->kernels.size()) return CL_INVALID_VALUE;
+  cl_uint i = 0;
+  for(std::map<std::string, cl_uint>::const_iterator it =
+      p->kernels.begin(); it != p->kernels.end(); ++it) {
+    cl_int err;
+    kernels[i++] = clCreateKernel(p, it->first.c_str(), &err);
+  }
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainKernel(cl_kernel k) {
+  if(!k) return CL_INVALID_KERNEL;
+  ++stub::counters().retains;
+  retain(k);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseKernel(cl_kernel k) {
+  if(!k) return CL_INVALID_KERNEL;
+  ++stub::counters().releases;
+  release(k);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clSetKernelArg(cl_kernel k, cl_uint index,
+    size_t size, const void *value) {
+  if(!k) return CL_INVALID_KERNEL;
+  if(index >= k->args.size()) return CL_INVALID_ARG_INDEX;
+  if(!size) return CL_INVALID_ARG_SIZE;
+  k->arg_sizes[index] = size;
+  if(value) {
+    const char *bytes = static_cast<const char*>(value);
+    k->args[index].assign(bytes, bytes + size);
+  } else {
+    k->args[index].clear();
+  }
+  k->set[index] = true;
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetKernelInfo(cl_kernel k,
+    cl_kernel_info name, size_t size, void *value, size_t *size_ret) {
+  if(!k) return CL_INVALID_KERNEL;
+  ++stub::counters().kernel_queries;
+  switch(name) {
+    case CL_KERNEL_FUNCTION_NAME:
+      return answer_string(k->name, size, value, size_ret);
+    case CL_KERNEL_NUM_ARGS:
+      return answer(cl_uint(k->args.size()), size, value, size_ret);
+    case CL_KERNEL_REFERENCE_COUNT:
+      return answer(cl_uint(k->refs.load()), size, value, size_ret);
+    case CL_KERNEL_CONTEXT:
+      return answer(k->program->context, size, value, size_ret);
+    case CL_KERNEL_PROGRAM:
+      return answer(k->program, size, value, size_ret);
+    default:
+      return CL_INVALID_VALUE;
+  }
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetKernelWorkGroupInfo(cl_kernel k,
+    cl_device_id, cl_kernel_work_group_info name, size_t size, void *value,
+    size_t *size_ret) {
+  if(!k) return CL_INVALID_KERNEL;
+  switch(name) {
+    case CL_KERNEL_WORK_GROUP_SIZE:
+      return answer(stub::settings().kernel_work_group_size, size, value,
+          size_ret);
+    case CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE:
+      return answer(size_t(8), size, value, size_ret);
+    case CL_KERNEL_COMPILE_WORK_GROUP_SIZE: {
+      const size_t zero[] = { 0, 0, 0 };
+      return answer(zero, sizeof(zero), size, value, size_ret);
+    }
+    case CL_KERNEL_LOCAL_MEM_SIZE:
+    case CL_KERNEL_PRIVATE_MEM_SIZE:
+      return answer(cl_ulong(0), size, value, size_ret);
+    default:
+      return CL_INVALID_VALUE;
+  }
+}
+
+/* events */
+
+CL_API_ENTRY cl_int CL_API_CALL clWaitForEvents(cl_uint n,
+    const cl_event *events) {
+  if(!n || !events) return CL_INVALID_VALUE;
+  cl_int to_return = CL_SUCCESS;
+  for(cl_uint i=0; i<n; ++i) {
+    if(!events[i]) return CL_INVALID_EVENT;
+    wait_event(events[i]);
+    if(event_status(events[i]) < 0) {
+      to_return = CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+    }
+  }
+  return to_return;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetEventInfo(cl_event e,
+    cl_event_info name, size_t size, void *value, size_t *size_ret) {
+  if(!e) return CL_INVALID_EVENT;
+  switch(name) {
+    case CL_EVENT_COMMAND_QUEUE:
+      return answer(e->queue, size, value, size_ret);
+    case CL_EVENT_COMMAND_TYPE:
+      return answer(e->type, size, value, size_ret);
+    case CL_EVENT_REFERENCE_COUNT:
+      return answer(cl_uint(e->refs.load()), size, value, size_ret);
+    case CL_EVENT_COMMAND_EXECUTION_STATUS:
+      return answer(event_status(e), size, value, size_ret);
+    case CL_EVENT_CONTEXT:
+      return answer(e->context, size, value, size_ret);
+    default:
+      return CL_INVALID_VALUE;
+  }
+}
+
+CL_API_ENTRY cl_event CL_API_CALL clCreateUserEvent(cl_context c,
+    cl_int *errcode_ret) {
+  if(!c) {
+    if(errcode_ret) *errcode_ret = CL_INVALID_CONTEXT;
+    return NULL;
+  }
+  cl_event e = new _cl_event;
+  e->context = c;
+  e->type = 0x1204;
+  e->status = CL_SUBMITTED;
+  if(errcode_ret) *errcode_ret = CL_SUCCESS;
+  return e;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainEvent(cl_event e) {
+  if(!e) return CL_INVALID_EVENT;
+  ++stub::counters().retains;
+  retain(e);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseEvent(cl_event e) {
+  if(!e) return CL_INVALID_EVENT;
+  ++stub::counters().releases;
+  release(e);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clSetUserEventStatus(cl_event e,
+    cl_int status) {
+  if(!e || e->queue) return CL_INVALID_EVENT;
+  if(status > CL_COMPLETE) return CL_INVALID_VALUE;
+  if(event_status(e) <= CL_COMPLETE) return CL_INVALID_OPERATION;
+  complete(e, status);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clSetEventCallback(cl_event e,
+    cl_int type, void (CL_CALLBACK *f)(cl_event, cl_int, void*),
+    void *user_data) {
+  if(!e) return CL_INVALID_EVENT;
+  if(!f || type != CL_COMPLETE) return CL_INVALID_VALUE;
+  retain(e);
+  when_complete(e, [e, f, user_data](cl_int status) {
+    f(e, status, user_data);
+    release(e);
+  });
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetEventProfilingInfo(cl_event e,
+    cl_profiling_info name, size_t size, void *value, size_t *size_ret) {
+  if(!e) return CL_INVALID_EVENT;
+  if(!e->profiled || event_status(e) != CL_COMPLETE) {
+    return CL_PROFILING_INFO_NOT_AVAILABLE;
+  }
+  switch(name) {
+    case CL_PROFILING_COMMAND_QUEUED:
+      return answer(e->queued, size, value, size_ret);
+    case CL_PROFILING_COMMAND_SUBMIT:
+      return answer(e->submit, size, value, size_ret);
+    case CL_PROFILING_COMMAND_START:
+      return answer(e->start, size, value, size_ret);
+    case CL_PROFILING_COMMAND_END:
+      return answer(e->end, size, value, size_ret);
+    default:
+      return CL_INVALID_VALUE;
+  }
+}
+
+/* buffer commands */
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueReadBuffer(cl_command_queue q,
+    cl_mem m, cl_bool blocking, size_t offset, size_t size, void *ptr,
+    cl_uint n, const cl_event *wait, cl_event *out) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  if(!ptr || !in_bounds(m, offset, size)) return CL_INVALID_VALUE;
+  return enqueue(q, CL_COMMAND_READ_BUFFER, n, wait, out, [=] {
+    std::memcpy(ptr, m->data + offset, size);
+  }, blocking != CL_FALSE);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueWriteBuffer(cl_command_queue q,
+    cl_mem m, cl_bool blocking, size_t offset, size_t size, const void *ptr,
+    cl_uint n, const cl_event *wait, cl_event *out) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  if(!ptr || !in_bounds(m, offset, size)) return CL_INVALID_VALUE;
+  return enqueue(q, CL_COMMAND_WRITE_BUFFER, n, wait, out, [=] {
+    std::memcpy(m->data + offset, ptr, size);
+  }, blocking != CL_FALSE);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueCopyBuffer(cl_command_queue q,
+    cl_mem src, cl_mem dst, size_t src_offset, size_t dst_offset,
+    size_t size, cl_uint n, const cl_event *wait, cl_event *out) {
+  if(!src || !dst) return CL_INVALID_MEM_OBJECT;
+  if(!size || !in_bounds(src, src_offset, size)
+      || !in_bounds(dst, dst_offset, size)) {
+    return CL_INVALID_VALUE;
+  }
+  return enqueue(q, CL_COMMAND_COPY_BUFFER, n, wait, out, [=] {
+    std::memmove(dst->data + dst_offset, src->data + src_offset, size);
+  });
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueReadBufferRect(cl_command_queue q,
+    cl_mem m, cl_bool blocking, const size_t *buffer_origin,
+    const size_t *host_origin, const size_t *region, size_t buffer_row,
+    size_t buffer_slice, size_t host_row, size_t host_slice, void *ptr,
+    cl_uint n, const cl_event *wait, cl_event *out) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  if(!ptr || !rect_pitches(region, buffer_row, buffer_slice)
+      || !rect_pitches(region, host_row, host_slice)
+      || !in_bounds(m, rect_offset(buffer_origin, buffer_row, buffer_slice),
+        rect_extent(region, buffer_row, buffer_slice))) {
+    return CL_INVALID_VALUE;
+  }
+  const size_t r[] = { region[0], region[1], region[2] };
+  char *dst = static_cast<char*>(ptr) + rect_offset(host_origin, host_row,
+      host_slice);
+  const char *src = m->data + rect_offset(buffer_origin, buffer_row,
+      buffer_slice);
+  return enqueue(q, 0x1201, n, wait, out, [=] {
+    copy_rect(dst, host_row, host_slice, src, buffer_row, buffer_slice, r);
+  }, blocking != CL_FALSE);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueWriteBufferRect(cl_command_queue q,
+    cl_mem m, cl_bool blocking, const size_t *buffer_origin,
+    const size_t *host_origin, const size_t *region, size_t buffer_row,
+    size_t buffer_slice, size_t host_row, size_t host_slice, const void *ptr,
+    cl_uint n, const cl_event *wait, cl_event *out) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  if(!ptr || !rect_pitches(region, buffer_row, buffer_slice)
+      || !rect_pitches(region, host_row, host_slice)
+      || !in_bounds(m, rect_offset(buffer_origin, buffer_row, buffer_slice),
+        rect_extent(region, buffer_row, buffer_slice))) {
+    return CL_INVALID_VALUE;
+  }
+  const size_t r[] = { region[0], region[1], region[2] };
+  const char *src = static_cast<const char*>(ptr) + rect_offset(host_origin,
+      host_row, host_slice);
+  char *dst = m->data + rect_offset(buffer_origin, buffer_row,
+      buffer_slice);
+  return enqueue(q, 0x1202, n, wait, out, [=] {
+    copy_rect(dst, buffer_row, buffer_slice, src, host_row, host_slice, r);
+  }, blocking != CL_FALSE);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueCopyBufferRect(cl_command_queue q,
+    cl_mem src, cl_mem dst, const size_t *src_origin,
+    const size_t *dst_origin, const size_t *region, size_t src_row,
+    size_t src_slice, size_t dst_row, size_t dst_slice, cl_uint n,
+    const cl_event *wait, cl_event *out) {
+  if(!src || !dst) return CL_INVALID_MEM_OBJECT;
+  if(!rect_pitches(region, src_row, src_slice)
+      || !rect_pitches(region, dst_row, dst_slice)
+      || !in_bounds(src, rect_offset(src_origin, src_row, src_slice),
+        rect_extent(region, src_row, src_slice))
+      || !in_bounds(dst, rect_offset(dst_origin, dst_row, dst_slice),
+        rect_extent(region, dst_row, dst_slice))) {
+    return CL_INVALID_VALUE;
+  }
+  const size_t r[] = { region[0], region[1], region[2] };
+  const char *from = src->data + rect_offset(src_origin, src_row,
+      src_slice);
+  char *to = dst->data + rect_offset(dst_origin, dst_row, dst_slice);
+  return enqueue(q, 0x1203, n, wait, out, [=] {
+    copy_rect(to, dst_row, dst_slice, from, src_row, src_slice, r);
+  });
+}
+
+#ifdef CL_VERSION_1_2
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueFillBuffer(cl_command_queue q,
+    cl_mem m, const void *pattern, size_t pattern_size, size_t offset,
+    size_t size, cl_uint n, const cl_event *wait, cl_event *out) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  if(!pattern || !pattern_size || pattern_size > 128
+      || (pattern_size & (pattern_size - 1)) || offset % pattern_size
+      || size % pattern_size || !in_bounds(m, offset, size)) {
+    return CL_INVALID_VALUE;
+  }
+  std::vector<char> bytes(static_cast<const char*>(pattern),
+      static_cast<const char*>(pattern) + pattern_size);
+  return enqueue(q, 0x1207, n, wait, out, [=] {
+    for(size_t i=0; i<size; i+=pattern_size) {
+      std::memcpy(m->data + offset + i, &bytes[0], pattern_size);
+    }
+  });
+}
+#endif
+
+CL_API_ENTRY void* CL_API_CALL clEnqueueMapBuffer(cl_command_queue q,
+    cl_mem m, cl_bool blocking, cl_map_flags, size_t offset, size_t size,
+    cl_uint n, const cl_event *wait, cl_event *out, cl_int *errcode_ret) {
+  cl_int dummy;
+  cl_int &err = errcode_ret ? *errcode_ret : dummy;
+  if(!m) { err = CL_INVALID_MEM_OBJECT; return NULL; }
+  if(!size || !in_bounds(m, offset, size)) {
+    err = CL_INVALID_VALUE;
+    return NULL;
+  }
+  ++m->map_count;
+  err = enqueue(q, 0x11FB, n, wait, out, [] { }, blocking != CL_FALSE);
+  if(err != CL_SUCCESS) {
+    --m->map_count;
+    return NULL;
+  }
+  return m->data + offset;
+}
+
+CL_API_ENTRY void* CL_API_CALL clEnqueueMapImage(cl_command_queue q,
+    cl_mem m, cl_bool blocking, cl_map_flags, const size_t *origin,
+    const size_t *region, size_t *row_pitch, size_t *slice_pitch,
+    cl_uint n, const cl_event *wait, cl_event *out, cl_int *errcode_ret) {
+  cl_int dummy;
+  cl_int &err = errcode_ret ? *errcode_ret : dummy;
+  if(!m) { err = CL_INVALID_MEM_OBJECT; return NULL; }
+  if(!row_pitch || !image_region_ok(m, origin, region)) {
+    err = CL_INVALID_VALUE;
+    return NULL;
+  }
+  *row_pitch = m->row_pitch;
+  if(slice_pitch) *slice_pitch = m->depth ? m->slice_pitch : 0;
+  ++m->map_count;
+  err = enqueue(q, 0x11FC, n, wait, out, [] { }, blocking != CL_FALSE);
+  if(err != CL_SUCCESS) {
+    --m->map_count;
+    return NULL;
+  }
+  return m->data + origin[2] * m->slice_pitch + origin[1] * m->row_pitch
+    + origin[0] * m->element_size;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueUnmapMemObject(cl_command_queue q,
+    cl_mem m, void *ptr, cl_uint n, const cl_event *wait, cl_event *out) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  if(!ptr || !m->map_count) return CL_INVALID_VALUE;
+  return enqueue(q, 0x11FD, n, wait, out, [m] { --m->map_count; });
+}
+
+/* image commands */
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueReadImage(cl_command_queue q,
+    cl_mem m, cl_bool blocking, const size_t *origin, const size_t *region,
+    size_t row_pitch, size_t slice_pitch, void *ptr, cl_uint n,
+    const cl_event *wait, cl_event *out) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  if(!ptr || !image_region_ok(m, origin, region)) return CL_INVALID_VALUE;
+  const size_t r[] = { region[0] * m->element_size, region[1], region[2] };
+  if(!row_pitch) row_pitch = r[0];
+  if(!slice_pitch) slice_pitch = row_pitch * r[1];
+  const size_t o[] = { origin[0] * m->element_size, origin[1], origin[2] };
+  const char *src = m->data + rect_offset(o, m->row_pitch, m->slice_pitch);
+  return enqueue(q, 0x11F6, n, wait, out, [=] {
+    copy_rect(static_cast<char*>(ptr), row_pitch, slice_pitch, src,
+        m->row_pitch, m->slice_pitch, r);
+  }, blocking != CL_FALSE);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueWriteImage(cl_command_queue q,
+    cl_mem m, cl_bool blocking, const size_t *origin, const size_t *region,
+    size_t row_pitch, size_t slice_pitch, const void *ptr, cl_uint n,
+    const cl_event *wait, cl_event *out) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  if(!ptr || !image_region_ok(m, origin, region)) return CL_INVALID_VALUE;
+  const size_t r[] = { region[0] * m->element_size, region[1], region[2] };
+  if(!row_pitch) row_pitch = r[0];
+  if(!slice_pitch) slice_pitch = row_pitch * r[1];
+  const size_t o[] = { origin[0] * m->element_size, origin[1], origin[2] };
+  char *dst = m->data + rect_offset(o, m->row_pitch, m->slice_pitch);
+  return enqueue(q, 0x11F7, n, wait, out, [=] {
+    copy_rect(dst, m->row_pitch, m->slice_pitch,
+        static_cast<const char*>(ptr), row_pitch, slice_pitch, r);
+  }, blocking != CL_FALSE);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueCopyImage(cl_command_queue q,
+    cl_mem src, cl_mem dst, const size_t *src_origin,
+    const size_t *dst_origin, const size_t *region, cl_uint n,
+    const cl_event *wait, cl_event *out) {
+  if(!src || !dst) return CL_INVALID_MEM_OBJECT;
+  if(!image_region_ok(src, src_origin, region)
+      || !image_region_ok(dst, dst_origin, region)) {
+    return CL_INVALID_VALUE;
+  }
+  if(src->element_size != dst->element_size) {
+    return CL_IMAGE_FORMAT_MISMATCH;
+  }
+  const size_t r[] = { region[0] * src->element_size, region[1],
+    region[2] };
+  const size_t so[] = { src_origin[0] * src->element_size, src_origin[1],
+    src_origin[2] };
+  const size_t d_o[] = { dst_origin[0] * dst->element_size, dst_origin[1],
+    dst_origin[2] };
+  const char *from = src->data + rect_offset(so, src->row_pitch,
+      src->slice_pitch);
+  char *to = dst->data + rect_offset(d_o, dst->row_pitch, dst->slice_pitch);
+  return enqueue(q, 0x11F8, n, wait, out, [=] {
+    copy_rect(to, dst->row_pitch, dst->slice_pitch, from, src->row_pitch,
+        src->slice_pitch, r);
+  });
+}
+
+#ifdef CL_VERSION_1_2
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueFillImage(cl_command_queue q,
+    cl_mem m, const void *color, const size_t *origin, const size_t *region,
+    cl_uint n, const cl_event *wait, cl_event *out) {
+  if(!m) return CL_INVALID_MEM_OBJECT;
+  if(!color || !image_region_ok(m, origin, region)) return CL_INVALID_VALUE;
+  const std::vector<char> px = pixel(m, color);
+  const size_t r[] = { region[0], region[1], region[2] };
+  const size_t o[] = { origin[0], origin[1], origin[2] };
+  return enqueue(q, 0x1208, n, wait, out, [=] {
+    for(size_t z=0; z<r[2]; ++z) {
+      for(size_t y=0; y<r[1]; ++y) {
+        for(size_t x=0; x<r[0]; ++x) {
+          std::memcpy(m->data + (o[2] + z) * m->slice_pitch
+              + (o[1] + y) * m->row_pitch + (o[0] + x) * m->element_size,
+              &px[0], px.size());
+        }
+      }
+    }
+  });
+}
+#endif
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueCopyImageToBuffer(
+    cl_command_queue q, cl_mem src, cl_mem dst, const size_t *origin,
+    const size_t *region, size_t offset, cl_uint n, const cl_event *wait,
+    cl_event *out) {
+  if(!src || !dst) return CL_INVALID_MEM_OBJECT;
+  if(!image_region_ok(src, origin, region)) return CL_INVALID_VALUE;
+  const size_t r[] = { region[0] * src->element_size, region[1],
+    region[2] };
+  if(!in_bounds(dst, offset, r[0] * r[1] * r[2])) return CL_INVALID_VALUE;
+  const size_t o[] = { origin[0] * src->element_size, origin[1],
+    origin[2] };
+  const char *from = src->data + rect_offset(o, src->row_pitch,
+      src->slice_pitch);
+  return enqueue(q, 0x11F9, n, wait, out, [=] {
+    copy_rect(dst->data + offset, r[0], r[0] * r[1], from, src->row_pitch,
+        src->slice_pitch, r);
+  });
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueCopyBufferToImage(
+    cl_command_queue q, cl_mem src, cl_mem dst, size_t offset,
+    const size_t *origin, const size_t *region, cl_uint n,
+    const cl_event *wait, cl_event *out) {
+  if(!src || !dst) return CL_INVALID_MEM_OBJECT;
+  if(!image_region_ok(dst, origin, region)) return CL_INVALID_VALUE;
+  const size_t r[] = { region[0] * dst->element_size, region[1],
+    region[2] };
+  if(!in_bounds(src, offset, r[0] * r[1] * r[2])) return CL_INVALID_VALUE;
+  const size_t o[] = { origin[0] * dst->element_size, origin[1],
+    origin[2] };
+  char *to = dst->data + rect_offset(o, dst->row_pitch, dst->slice_pitch);
+  return enqueue(q, 0x11FA, n, wait, out, [=] {
+    copy_rect(to, dst->row_pitch, dst->slice_pitch, src->data + offset,
+        r[0], r[0] * r[1], r);
+  });
+}
+
+/* kernels and synchronization */
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueNDRangeKernel(cl_command_queue q,
+    cl_kernel k, cl_uint dim, const size_t *offset, const size_t *global,
+    const size_t *local, cl_uint n, const cl_event *wait, cl_event *out) {
+  if(!k) return CL_INVALID_KERNEL;
+  if(dim < 1 || dim > 3) return CL_INVALID_WORK_DIMENSION;
+  if(!global) return CL_INVALID_GLOBAL_WORK_SIZE;
+  stub::launch l;
+  l.name = k->name;
+  l.dim = dim;
+  l.has_local = local != NULL;
+  size_t group = 1;
+  for(cl_uint i=0; i<3; ++i) {
+    l.offset[i] = offset && i < dim ? offset[i] : 0;
+    l.global[i] = i < dim ? global[i] : 1;
+    l.local[i] = local && i < dim ? local[i] : 1;
+    if(!l.global[i]) return CL_INVALID_GLOBAL_WORK_SIZE;
+    if(local && (!l.local[i] || l.global[i] % l.local[i])) {
+      return CL_INVALID_WORK_GROUP_SIZE;
+    }
+    group *= l.local[i];
+  }
+  if(group > stub::settings().kernel_work_group_size) {
+    return CL_INVALID_WORK_GROUP_SIZE;
+  }
+  for(size_t i=0; i<k->set.size(); ++i) {
+    if(!k->set[i]) return CL_INVALID_KERNEL_ARGS;
+  }
+  l.args = k->args;
+  l.arg_sizes = k->arg_sizes;
+  ++stub::counters().launches;
+  return enqueue(q, CL_COMMAND_NDRANGE_KERNEL, n, wait, out, [l] {
+    std::function<void(const stub::launch&)> hook;
+    {
+      std::lock_guard<std::mutex> lock(hook_mutex);
+      hook = launch_hook;
+    }
+    if(hook) hook(l);
+  });
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueMarker(cl_command_queue q,
+    cl_event *out) {
+  if(!out) return CL_INVALID_VALUE;
+  return enqueue(q, 0x11FE, 0, NULL, out, [] { }, false, true);
+}
+
+#ifdef CL_VERSION_1_2
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueMarkerWithWaitList(
+    cl_command_queue q, cl_uint n, const cl_event *wait, cl_event *out) {
+  return enqueue(q, 0x11FE, n, wait, out, [] { }, false, n == 0);
+}
+#endif
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueWaitForEvents(cl_command_queue q,
+    cl_uint n, const cl_event *wait) {
+  if(!n || !wait) return CL_INVALID_VALUE;
+  return enqueue(q, 0x11FE, n, wait, NULL, [] { });
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clEnqueueBarrier(cl_command_queue q) {
+  return enqueue(q, 0x11FE, 0, NULL, NULL, [] { }, false, true);
+}
+
+}
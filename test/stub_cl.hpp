@@ -0,0 +1,104 @@
+#ifndef _CL_WRAPPER_TEST_STUB_CL_HPP_
+#define _CL_WRAPPER_TEST_STUB_CL_HPP_
+
+/* a small in-process OpenCL implementation that the tests link in place
+ * of libOpenCL.  commands run on the host as soon as their wait lists
+ * are complete; kernels do nothing unless a launch hook is installed.
+ * the knobs below are read when the matching objects are queried, so
+ * tests set them before touching the wrapper */
+
+#include <CL/cl.h>
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace stub {
+
+struct settings_type {
+  settings_type();
+
+  cl_uint num_platforms;
+  cl_uint devices_per_platform;
+  cl_device_type device_type;
+  std::string platform_version;
+  std::string device_version;
+  bool image_support;
+  cl_uint compute_units;
+  /** \brief per-device overrides of compute_units, by index within the
+   * platform */
+  std::vector<cl_uint> device_compute_units;
+  size_t max_work_group_size;
+  size_t kernel_work_group_size;
+  cl_ulong local_mem_size;
+  cl_ulong global_mem_size;
+  cl_uint mem_base_addr_align;
+  cl_uint preferred_vector_width;
+  /** \brief NUMA nodes clCreateSubDevices reports; 0 fails NUMA splits */
+  cl_uint numa_nodes;
+  /** \brief commands wait for clFlush, clFinish or a blocking call
+   * before they run, as on drivers that batch submissions */
+  bool defer_until_flush;
+  /** \brief programs whose source contains this fail to build */
+  std::string build_error_marker;
+  /** \brief clLinkProgram fails if an object's source contains this */
+  std::string link_error_marker;
+  /** \brief how long each clBuildProgram takes */
+  std::atomic<unsigned> build_millis;
+  /** \brief the next this many clCreateBuffer calls fail */
+  std::atomic<int> fail_buffers;
+};
+settings_type& settings();
+
+struct counters_type {
+  std::atomic<unsigned long> retains;
+  std::atomic<unsigned long> releases;
+  std::atomic<unsigned long> platform_queries;
+  std::atomic<unsigned long> enqueues;
+  std::atomic<unsigned long> launches;
+  std::atomic<unsigned long> builds;
+  std::atomic<unsigned long> compiles;
+  std::atomic<unsigned long> links;
+  /** \brief clBuildProgram calls running now, and the most at once */
+  std::atomic<long> building;
+  std::atomic<long> peak_building;
+  std::atomic<unsigned long> kernels_created;
+  std::atomic<unsigned long> kernel_queries;
+  std::atomic<unsigned long> buffers_created;
+  /** \brief objects created minus objects destroyed */
+  std::atomic<long> live_objects;
+};
+counters_type& counters();
+void reset_counters();
+
+/** \brief one clEnqueueNDRangeKernel, with the kernel's arguments as they
+ * were when it was enqueued.  local memory arguments have no bytes */
+struct launch {
+  std::string name;
+  cl_uint dim;
+  size_t offset[3];
+  size_t global[3];
+  size_t local[3];
+  bool has_local;
+  std::vector<std::vector<char> > args;
+  std::vector<size_t> arg_sizes;
+
+  template<typename T>
+  T arg(cl_uint i) const {
+    T to_return;
+    std::memcpy(&to_return, &args.at(i)[0], sizeof(T));
+    return to_return;
+  }
+};
+
+/** \brief called on the thread that runs each kernel launch */
+void set_launch_hook(const std::function<void(const launch&)> &hook);
+
+/** \brief the host memory behind a buffer or image */
+char* mem_data(cl_mem m);
+
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+namespace {
+
+void failed_whole_buffers_are_not_reserved() {
+  const cl::context ctx = test_queue().ctx;
+  cl::buffer_pool pool(ctx);
+  // the cap is half of 64MB; before the fix, four failures of 8MB each
+  // used it up for good
+  for(int i=0; i<4; ++i) {
+    stub::settings().fail_buffers = 1;
+    CHECK_THROWS_CL(pool.allocate(CL_MEM_READ_WRITE, 8 << 20),
+        CL_MEM_OBJECT_ALLOCATION_FAILURE);
+    CHECK(pool.stats().bytes_reserved == 0);
+    CHECK(pool.stats().bytes_in_use == 0);
+  }
+  cl::pooled_buffer b = pool.allocate(CL_MEM_READ_WRITE, 24 << 20);
+  CHECK(b.id() != NULL);
+  CHECK(pool.stats().bytes_reserved == 24 << 20);
+}
+
+void failed_slabs_are_not_reserved() {
+  const cl::context ctx = test_queue().ctx;
+  cl::buffer_pool pool(ctx, 0.5, 1 << 20, 64 << 10);
+  stub::settings().fail_buffers = 1;
+  CHECK_THROWS_CL(pool.allocate(CL_MEM_READ_WRITE, 1000),
+      CL_MEM_OBJECT_ALLOCATION_FAILURE);
+  CHECK(pool.stats().bytes_reserved == 0);
+  cl::pooled_buffer b = pool.allocate(CL_MEM_READ_WRITE, 1000);
+  CHECK(b.id() != NULL);
+  CHECK(pool.stats().bytes_reserved == 1 << 20);
+}
+
+void cap_is_enforced() {
+  const cl::context ctx = test_queue().ctx;
+  cl::buffer_pool pool(ctx);
+  cl::pooled_buffer a = pool.allocate(CL_MEM_READ_WRITE, 24 << 20);
+  CHECK_THROWS_CL(pool.allocate(CL_MEM_READ_WRITE, 16 << 20),
+      CL_MEM_OBJECT_ALLOCATION_FAILURE);
+  a.release();
+  // the cached 24MB buffer is trimmed to make room
+  cl::pooled_buffer b = pool.allocate(CL_MEM_READ_WRITE, 16 << 20);
+  CHECK(pool.stats().bytes_reserved == 16 << 20);
+}
+
+void small_limit_must_fit_a_slab() {
+  const cl::context ctx = test_queue().ctx;
+  CHECK_THROWS_CL(cl::buffer_pool(ctx, 0.5, 64 << 10, 1 << 20),
+      CL_INVALID_VALUE);
+  cl::buffer_pool pool(ctx, 0.5, 64 << 10, 64 << 10);
+  cl::pooled_buffer b = pool.allocate(CL_MEM_READ_WRITE, 64 << 10);
+  CHECK(pool.stats().bytes_reserved == 64 << 10);
+}
+
+}
+
+int main() {
+  stub::settings().global_mem_size = 64 << 20;
+  failed_whole_buffers_are_not_reserved();
+  failed_slabs_are_not_reserved();
+  cap_is_enforced();
+  small_limit_must_fit_a_slab();
+  return test_result();
+}
@@ -0,0 +1,128 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <utility>
+
+namespace {
+
+struct fixture : test_queue {
+  fixture() : host(256) {
+    b = cl::buffer(ctx, CL_MEM_READ_WRITE, host.size());
+  }
+  cl::event write(cl::command_queue &queue) {
+    return queue.write_buffer(b, 0, host.size(), &host[0]);
+  }
+  std::vector<char> host;
+  cl::buffer b;
+};
+
+void copies_enqueue_while_the_original_captures() {
+  fixture f;
+  cl::command_graph g;
+  f.q.begin_capture(g);
+  cl::command_queue copy(f.q);
+  cl::command_queue assigned;
+  assigned = f.q;
+  CHECK(!copy.capturing());
+  CHECK(!assigned.capturing());
+
+  stub::reset_counters();
+  f.write(copy);
+  f.write(assigned);
+  CHECK(stub::counters().enqueues == 2);
+  f.write(f.q);
+  CHECK(stub::counters().enqueues == 2);
+  f.q.end_capture();
+  CHECK(g.size() == 1);
+  copy.finish();
+}
+
+void moves_take_the_capture() {
+  fixture f;
+  cl::command_graph g;
+  f.q.begin_capture(g);
+  cl::command_queue moved(std::move(f.q));
+  CHECK(!f.q.capturing());
+  CHECK(moved.capturing());
+  f.write(moved);
+
+  cl::command_queue target;
+  target = std::move(moved);
+  CHECK(!moved.capturing());
+  CHECK(target.capturing());
+  f.write(target);
+  target.end_capture();
+  CHECK(g.size() == 2);
+}
+
+void destroying_the_queue_ends_the_capture() {
+  fixture f;
+  cl::command_graph g;
+  {
+    cl::command_queue q(f.q);
+    q.begin_capture(g);
+    f.write(q);
+  }
+  // replay throws while the graph is still capturing
+  g.replay(f.q).wait();
+  CHECK(g.size() == 1);
+
+  cl::command_graph h;
+  cl::command_queue q(f.q);
+  q.begin_capture(h);
+  q = f.q;
+  CHECK(!q.capturing());
+  h.replay(f.q).wait();
+}
+
+void placeholders_complete_with_the_first_replay() {
+  fixture f;
+  stub::settings().defer_until_flush = true;
+  cl::command_graph g;
+  f.q.begin_capture(g);
+  cl::event first = f.write(f.q);
+  cl::event second = f.write(f.q);
+  f.q.end_capture();
+  CHECK(first.status() > CL_COMPLETE);
+  CHECK(second.status() > CL_COMPLETE);
+
+  cl::event done = g.replay(f.q);
+  CHECK(first.status() > CL_COMPLETE);
+  f.q.finish();
+  CHECK(first.status() == CL_COMPLETE);
+  CHECK(second.status() == CL_COMPLETE);
+  g.replay(f.q).wait();
+  stub::settings().defer_until_flush = false;
+}
+
+void unreplayed_placeholders_fail() {
+  fixture f;
+  cl::command_graph g;
+  f.q.begin_capture(g);
+  cl::event e = f.write(f.q);
+  f.q.end_capture();
+  g.clear();
+  CHECK(e.status() < 0);
+
+  cl::event kept;
+  {
+    cl::command_graph h;
+    f.q.begin_capture(h);
+    kept = f.write(f.q);
+    f.q.end_capture();
+  }
+  CHECK(kept.status() < 0);
+}
+
+}
+
+int main() {
+  copies_enqueue_while_the_original_captures();
+  moves_take_the_capture();
+  destroying_the_queue_ends_the_capture();
+  placeholders_complete_with_the_first_replay();
+  unreplayed_placeholders_fail();
+  return test_result();
+}
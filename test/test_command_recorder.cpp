@@ -0,0 +1,90 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <cstdlib>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+struct fixture : test_queue {
+  fixture() : test_queue(CL_QUEUE_PROFILING_ENABLE) {
+    cl::program prog(ctx, "__kernel void scale(__global float *a) { }",
+        "");
+    k = prog.get_kernel("scale");
+    b = cl::buffer(ctx, CL_MEM_READ_WRITE, 1024);
+    k.set_arg(0, b.id());
+  }
+  cl::kernel k;
+  cl::buffer b;
+};
+
+void kernel_names_are_cached() {
+  fixture f;
+  cl::command_recorder r;
+  f.q.set_recorder(&r);
+  const size_t global = 256;
+  stub::reset_counters();
+  for(int i=0; i<100; ++i) f.q.run_kernel(f.k, 1, &global, NULL);
+  f.q.finish();
+  // the name's size and then its bytes, once
+  CHECK(stub::counters().kernel_queries <= 2);
+  std::vector<cl::command_recorder::record> recs = r.records();
+  CHECK(recs.size() == 100);
+  for(size_t i=0; i<recs.size(); ++i) CHECK(recs[i].label == "scale");
+  CHECK(r.stats()["scale"].count == 100);
+}
+
+/** \brief the numbers following each "key": in json */
+std::vector<std::string> values(const std::string &json,
+    const std::string &key) {
+  std::vector<std::string> to_return;
+  const std::string marker = "\"" + key + "\":";
+  for(size_t pos = json.find(marker); pos != std::string::npos;
+      pos = json.find(marker, pos + 1)) {
+    size_t begin = pos + marker.size();
+    size_t end = json.find_first_of(",}", begin);
+    to_return.push_back(json.substr(begin, end - begin));
+  }
+  return to_return;
+}
+
+bool three_decimals(const std::string &v) {
+  const size_t dot = v.find('.');
+  return dot != std::string::npos && dot > 0 && v.size() == dot + 4
+    && v.find_first_not_of("0123456789.") == std::string::npos;
+}
+
+void trace_keeps_nanosecond_resolution() {
+  fixture f;
+  cl::command_recorder r;
+  f.q.set_recorder(&r);
+  std::vector<char> host(1024);
+  f.q.write_buffer(f.b, 0, host.size(), &host[0]);
+  // far enough apart that default stream precision would round
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  f.q.read_buffer(f.b, 0, host.size(), &host[0]);
+  f.q.finish();
+
+  std::ostringstream out;
+  out.precision(2);
+  r.write_trace(out);
+  const char *keys[] = { "ts", "dur", "queued_us", "submit_us" };
+  for(size_t i=0; i<4; ++i) {
+    std::vector<std::string> v = values(out.str(), keys[i]);
+    CHECK(v.size() == 2);
+    for(size_t j=0; j<v.size(); ++j) CHECK(three_decimals(v[j]));
+  }
+  std::vector<std::string> ts = values(out.str(), "ts");
+  CHECK(ts.size() == 2 && std::atof(ts[1].c_str()) >= 20000);
+}
+
+}
+
+int main() {
+  kernel_names_are_cached();
+  trace_keeps_nanosecond_resolution();
+  return test_result();
+}
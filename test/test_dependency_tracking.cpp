@@ -0,0 +1,203 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+template<typename F>
+void within_seconds(int seconds, F f) {
+  std::future<void> done = std::async(std::launch::async, f);
+  if(done.wait_for(std::chrono::seconds(seconds)) !=
+      std::future_status::ready) {
+    std::cerr << "timed out" << std::endl;
+    std::_Exit(1);
+  }
+  done.get();
+}
+
+/** \brief holds kernel launches in the launch hook until opened */
+class gate {
+public:
+  gate() : inside_(false), open_(false) { }
+
+  void operator()(const stub::launch&) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    inside_ = true;
+    cv_.notify_all();
+    cv_.wait(lock, [this] { return open_; });
+  }
+  void wait_inside() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return inside_; });
+  }
+  void open() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    open_ = true;
+    cv_.notify_all();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool inside_;
+  bool open_;
+};
+
+struct fixture : test_queue {
+  fixture()
+      : test_queue(CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE), host(1024) {
+    q.set_tracking(true);
+    cl::program prog(ctx, "__kernel void touch(__global float *a) { }",
+        "");
+    k = prog.get_kernel("touch");
+    a = cl::buffer(ctx, CL_MEM_READ_WRITE, host.size());
+    b = cl::buffer(ctx, CL_MEM_READ_WRITE, host.size());
+    k.set_arg(0, a.id());
+  }
+  cl::event user_event() {
+    cl_int err;
+    cl::event to_return = clCreateUserEvent(ctx.id(), &err);
+    CHECK(err == CL_SUCCESS);
+    return to_return;
+  }
+  cl::event write(const cl::buffer &m, cl_uint n = 0, cl::event *e = NULL) {
+    return q.write_buffer(m, 0, host.size(), &host[0], n, e);
+  }
+  std::vector<char> host;
+  cl::kernel k;
+  cl::buffer a;
+  cl::buffer b;
+};
+
+void enqueues_do_not_hold_the_tracker() {
+  fixture f;
+  gate g;
+  stub::set_launch_hook(std::ref(g));
+  const size_t global = 256;
+  std::vector<cl::mem_access> access(1, cl::writes(f.a));
+  std::thread launcher([&] {
+    f.q.run_kernel(f.k, 1, &global, NULL, access);
+  });
+  g.wait_inside();
+
+  // the launch is stuck inside clEnqueueNDRangeKernel
+  cl::event other, after;
+  within_seconds(5, [&] {
+    other = f.write(f.b);
+    after = f.write(f.a);
+  });
+  CHECK(other.status() == CL_COMPLETE);
+  CHECK(after.status() > CL_COMPLETE);
+
+  g.open();
+  launcher.join();
+  stub::set_launch_hook(std::function<void(const stub::launch&)>());
+  f.q.finish();
+  CHECK(after.status() == CL_COMPLETE);
+}
+
+void late_commits_keep_the_later_writer() {
+  fixture f;
+  gate g;
+  stub::set_launch_hook(std::ref(g));
+  const size_t global = 256;
+  std::vector<cl::mem_access> access(1, cl::writes(f.a));
+  std::thread launcher([&] {
+    f.q.run_kernel(f.k, 1, &global, NULL, access);
+  });
+  g.wait_inside();
+
+  // numbered after the launch but committed before it
+  cl::event hold = f.user_event();
+  cl::event second = f.write(f.a, 1, &hold);
+  g.open();
+  launcher.join();
+  stub::set_launch_hook(std::function<void(const stub::launch&)>());
+
+  cl::event read = f.q.read_buffer(f.a, 0, f.host.size(), &f.host[0]);
+  CHECK(read.status() > CL_COMPLETE);
+  clSetUserEventStatus(hold.id(), CL_COMPLETE);
+  f.q.finish();
+  CHECK(second.status() == CL_COMPLETE);
+  CHECK(read.status() == CL_COMPLETE);
+}
+
+void sub_buffers_follow_their_parent() {
+  fixture f;
+  cl::buffer half = f.a.sub_buffer(CL_MEM_READ_WRITE, 0, 512);
+  for(int i=0; i<3; ++i) {
+    cl::event hold = f.user_event();
+    cl::event w = f.q.write_buffer(half, 0, 512, &f.host[0], 1, &hold);
+    cl::event r = f.q.read_buffer(f.a, 0, f.host.size(), &f.host[0]);
+    CHECK(r.status() > CL_COMPLETE);
+    clSetUserEventStatus(hold.id(), CL_COMPLETE);
+    f.q.finish();
+    CHECK(r.status() == CL_COMPLETE);
+  }
+}
+
+void offset_launches_take_accesses() {
+  fixture f;
+  cl::event hold = f.user_event();
+  f.write(f.a, 1, &hold);
+  const size_t offset = 64, global = 128;
+  std::vector<cl::mem_access> access(1, cl::reads(f.a));
+  cl::event e = f.q.run_kernel(f.k, 1, &offset, &global, NULL, access);
+  cl::event unrelated = f.write(f.b);
+  CHECK(e.status() > CL_COMPLETE);
+  CHECK(unrelated.status() == CL_COMPLETE);
+  clSetUserEventStatus(hold.id(), CL_COMPLETE);
+  f.q.finish();
+  CHECK(e.status() == CL_COMPLETE);
+}
+
+void staged_transfers_are_tracked() {
+  fixture f;
+  cl::staging_pool pool(f.ctx, f.q, 256, 4);
+  const size_t global = 256;
+
+  cl::event hold = f.user_event();
+  cl::event w = pool.staged_write(f.q, f.a, 0, f.host.size(), &f.host[0],
+      1, &hold);
+  std::vector<cl::mem_access> access(1, cl::reads(f.a));
+  cl::event k = f.q.run_kernel(f.k, 1, &global, NULL, access);
+  CHECK(k.status() > CL_COMPLETE);
+  clSetUserEventStatus(hold.id(), CL_COMPLETE);
+  f.q.finish();
+  w.wait();
+  CHECK(k.status() == CL_COMPLETE);
+
+  hold = f.user_event();
+  std::fill(f.host.begin(), f.host.end(), 7);
+  f.write(f.b, 1, &hold);
+  std::vector<char> out(f.host.size());
+  cl::event r = pool.staged_read(f.q, f.b, 0, out.size(), &out[0]);
+  CHECK(r.status() > CL_COMPLETE);
+  cl::event after = f.write(f.b);
+  CHECK(after.status() > CL_COMPLETE);
+  clSetUserEventStatus(hold.id(), CL_COMPLETE);
+  f.q.finish();
+  r.wait();
+  CHECK(r.status() == CL_COMPLETE);
+  CHECK(after.status() == CL_COMPLETE);
+  CHECK(out == f.host);
+}
+
+}
+
+int main() {
+  enqueues_do_not_hold_the_tracker();
+  late_commits_keep_the_later_writer();
+  sub_buffers_follow_their_parent();
+  offset_launches_take_accesses();
+  staged_transfers_are_tracked();
+  return test_result();
+}
@@ -0,0 +1,69 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+namespace {
+
+typedef cl::detail::device_info_registry<cl::device> registry;
+
+cl::device root_device() {
+  return test_queue().dev;
+}
+
+std::vector<cl_device_id> raw_split(const cl::device &root, cl_uint units) {
+  const cl_device_partition_property props[] = {
+    CL_DEVICE_PARTITION_EQUALLY,
+    static_cast<cl_device_partition_property>(units), 0 };
+  cl_uint n = 0;
+  clCreateSubDevices(root.id(), props, 0, NULL, &n);
+  std::vector<cl_device_id> ids(n);
+  clCreateSubDevices(root.id(), props, n, &ids[0], NULL);
+  return ids;
+}
+
+void unheld_sub_devices_are_not_cached() {
+  const cl::device root = root_device();
+  root.name();
+  const size_t before = registry::size();
+  for(int i=0; i<20; ++i) {
+    // ids no sub_device_ holds, as context::devices() hands out
+    std::vector<cl_device_id> ids = raw_split(root, 2);
+    CHECK(cl::device(ids[0]).max_compute_units() == 2);
+    CHECK(registry::size() == before);
+    for(size_t j=0; j<ids.size(); ++j) clReleaseDevice(ids[j]);
+
+    // a driver may reuse those ids for the next split
+    std::vector<cl::sub_device> parts = root.partition_equally(4);
+    for(size_t j=0; j<parts.size(); ++j) {
+      CHECK(parts[j].max_compute_units() == 4);
+      CHECK(cl::device(parts[j].id()).max_compute_units() == 4);
+    }
+  }
+  CHECK(registry::size() == before);
+}
+
+void copies_keep_their_snapshot() {
+  const cl::device root = root_device();
+  cl::device copy;
+  const cl::device_info *info = NULL;
+  {
+    std::vector<cl::sub_device> parts = root.partition_equally(2);
+    copy = parts[0];
+    info = &copy.info();
+    CHECK(copy.max_compute_units() == 2);
+  }
+  // the last sub_device_ is gone, and with it the registry entry
+  std::vector<cl::sub_device> others = root.partition_equally(4);
+  others[0].name();
+  CHECK(&copy.info() == info);
+  CHECK(copy.max_compute_units() == 2);
+}
+
+}
+
+int main() {
+  unheld_sub_devices_are_not_cached();
+  copies_keep_their_snapshot();
+  return test_result();
+}
@@ -0,0 +1,73 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <mutex>
+
+namespace {
+
+std::mutex launches_mutex;
+std::vector<stub::launch> launches;
+
+void every_device_is_measured() {
+  // guesses of 999:1 used to round the second device's share to 0 for
+  // good, so it never ran and was never measured
+  stub::settings().devices_per_platform = 2;
+  stub::settings().device_compute_units.push_back(999);
+  stub::settings().device_compute_units.push_back(1);
+  cl::platform p = cl::platform::platforms()[0];
+  std::vector<cl::device> devs = p.devices();
+  cl::context ctx(p, 2, &devs[0]);
+  cl::program prog(ctx, "__kernel void k(__global float *a) { }", "");
+  cl::kernel k = prog.get_kernel("k");
+  cl::buffer b(ctx, CL_MEM_READ_WRITE, 4096);
+  k.set_arg(0, b.id());
+
+  stub::set_launch_hook([](const stub::launch &l) {
+    std::lock_guard<std::mutex> lock(launches_mutex);
+    launches.push_back(l);
+  });
+  cl::device_scheduler sched(ctx);
+  const size_t global = 100;
+  sched.submit(k, 1, &global).wait();
+  sched.finish();
+  CHECK(launches.size() == 2);
+  size_t covered = 0;
+  for(size_t i=0; i<launches.size(); ++i) covered += launches[i].global[0];
+  CHECK(covered == global);
+
+  // after both devices are measured, the split follows the rates
+  std::vector<double> w = sched.weights(k);
+  CHECK(w.size() == 2 && w[0] > 0 && w[1] > 0);
+  launches.clear();
+  sched.submit(k, 1, &global).wait();
+  covered = 0;
+  for(size_t i=0; i<launches.size(); ++i) covered += launches[i].global[0];
+  CHECK(covered == global);
+  stub::set_launch_hook(std::function<void(const stub::launch&)>());
+}
+
+void no_device_starves_a_small_range() {
+  cl::platform p = cl::platform::platforms()[0];
+  std::vector<cl::device> devs = p.devices();
+  cl::context ctx(p, 2, &devs[0]);
+  cl::program prog(ctx, "__kernel void k2(__global float *a) { }", "");
+  cl::kernel k = prog.get_kernel("k2");
+  cl::buffer b(ctx, CL_MEM_READ_WRITE, 4096);
+  k.set_arg(0, b.id());
+  cl::device_scheduler sched(ctx);
+  // one unit cannot be split; the first device takes it
+  const size_t global = 1;
+  stub::reset_counters();
+  sched.submit(k, 1, &global).wait();
+  CHECK(stub::counters().launches == 1);
+}
+
+}
+
+int main() {
+  every_device_is_measured();
+  no_device_starves_a_small_range();
+  return test_result();
+}
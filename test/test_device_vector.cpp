@@ -0,0 +1,232 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+namespace {
+
+static_assert(!std::is_copy_constructible<
+    cl::device_vector<cl_float> >::value, "device_vector copies");
+static_assert(std::is_move_constructible<
+    cl::device_vector<cl_float> >::value, "device_vector does not move");
+
+std::mutex launches_mutex;
+std::vector<stub::launch> launches;
+
+void record(const stub::launch &l) {
+  std::lock_guard<std::mutex> lock(launches_mutex);
+  launches.push_back(l);
+}
+
+std::vector<stub::launch> take_launches() {
+  std::lock_guard<std::mutex> lock(launches_mutex);
+  std::vector<stub::launch> to_return;
+  to_return.swap(launches);
+  return to_return;
+}
+
+cl_uint refs(cl_context c) {
+  cl_uint to_return = 0;
+  clGetContextInfo(c, CL_CONTEXT_REFERENCE_COUNT, sizeof(to_return),
+      &to_return, NULL);
+  return to_return;
+}
+
+/** \brief work items of the one transform launch expr makes */
+size_t transform_items(const std::string &expr) {
+  test_queue f;
+  cl::device_vector<cl_int> in(f.q, 100), out(f.q, 100);
+  take_launches();
+  in.transform(out, expr).wait();
+  std::vector<stub::launch> seen = take_launches();
+  CHECK(seen.size() == 1);
+  return seen.empty() ? 0 : seen[0].global[0];
+}
+
+void comparisons_run_on_scalars() {
+  CHECK(transform_items("x * 2") == 25);
+  CHECK(transform_items("x >> 1") == 25);
+  CHECK(transform_items("x > 0") == 100);
+  CHECK(transform_items("x<<1 != 0") == 100);
+  CHECK(transform_items("!x") == 100);
+  CHECK(transform_items("x ? 1 : 2") == 100);
+  CHECK(transform_items("isnan((float)x)") == 100);
+  CHECK(!cl::detail::has_relational("abs(x) & 3"));
+  CHECK(!cl::detail::has_relational("isnanny(x)"));
+  CHECK(cl::detail::has_relational("x == 1"));
+  CHECK(cl::detail::has_relational("x > 0 && x < 9"));
+}
+
+void programs_are_built_once() {
+  test_queue f;
+  cl::device_vector<cl_float> in(f.q, 64), out(f.q, 64);
+  stub::reset_counters();
+  in.transform(out, "x * 3").wait();
+  in.transform(out, "x * 3").wait();
+  CHECK(stub::counters().builds == 1);
+  in.transform(out, "x * 4").wait();
+  CHECK(stub::counters().builds == 2);
+}
+
+void builds_run_outside_the_lock() {
+  test_queue f;
+  stub::settings().build_millis = 100;
+  stub::reset_counters();
+  std::thread other([&] {
+    cl::device_vector<cl_float> in(f.q, 64), out(f.q, 64);
+    in.transform(out, "x + 5").wait();
+  });
+  cl::device_vector<cl_float> in(f.q, 64), out(f.q, 64);
+  in.transform(out, "x + 6").wait();
+  other.join();
+  CHECK(stub::counters().peak_building == 2);
+  stub::settings().build_millis = 0;
+}
+
+void old_contexts_are_released() {
+  cl_context first = NULL;
+  {
+    test_queue f;
+    first = f.ctx.id();
+    clRetainContext(first);
+    cl::device_vector<cl_float> in(f.q, 64), out(f.q, 64);
+    in.transform(out, "x * 2").wait();
+  }
+  CHECK(refs(first) > 1);
+  for(int i=0; i<70; ++i) {
+    test_queue f;
+    cl::device_vector<cl_float> in(f.q, 64), out(f.q, 64);
+    in.transform(out, "x * 2").wait();
+  }
+  CHECK(cl::detail::algorithm_programs<0>::cached() == 64);
+  CHECK(refs(first) == 1);
+  clReleaseContext(first);
+}
+
+void moves_leave_an_empty_vector() {
+  test_queue f;
+  cl::device_vector<cl_float> a(f.q, 16);
+  const cl_mem id = a.get().id();
+  cl::device_vector<cl_float> b(std::move(a));
+  CHECK(a.empty());
+  CHECK(b.size() == 16);
+  CHECK(b.get().id() == id);
+  a = std::move(b);
+  CHECK(b.empty());
+  CHECK(a.get().id() == id);
+}
+
+void scans_recurse_to_one_group() {
+  // 256 work items of 4 elements a group: 1025 groups, then 2, then 1
+  test_queue f;
+  const size_t n = 1024 * 1024 + 1;
+  cl::device_vector<cl_uint> v(f.q, n);
+  take_launches();
+  v.inclusive_scan("a + b").wait();
+  std::vector<stub::launch> seen = take_launches();
+  const char *names[] = { "scan_blocks", "scan_blocks", "scan_blocks",
+    "add_prefix", "add_prefix" };
+  const cl_ulong counts[] = { n, 1025, 2, 1025, n };
+  const size_t groups[] = { 1025, 2, 1, 2, 1025 };
+  CHECK(seen.size() == 5);
+  for(size_t i=0; i<seen.size() && i<5; ++i) {
+    CHECK(seen[i].name == names[i]);
+    CHECK(seen[i].arg<cl_ulong>(i < 3 ? 2 : 1) == counts[i]);
+    CHECK(seen[i].local[0] == 256);
+    CHECK(seen[i].global[0] == groups[i] * 256);
+  }
+  if(seen.size() == 5) {
+    CHECK(seen[0].arg<cl_mem>(0) == v.get().id());
+    CHECK(seen[0].arg<cl_mem>(1) == v.get().id());
+    CHECK(seen[4].arg<cl_mem>(0) == v.get().id());
+  }
+}
+
+template<typename T>
+void check_radix_passes() {
+  test_queue f;
+  cl::device_vector<T> v(f.q, 1000);
+  take_launches();
+  v.radix_sort().wait();
+  std::vector<stub::launch> counts, scatters;
+  std::vector<stub::launch> seen = take_launches();
+  for(size_t i=0; i<seen.size(); ++i) {
+    if(seen[i].name == "radix_count") counts.push_back(seen[i]);
+    if(seen[i].name == "radix_scatter") scatters.push_back(seen[i]);
+  }
+  CHECK(counts.size() == 2 * sizeof(T));
+  CHECK(scatters.size() == 2 * sizeof(T));
+  if(counts.size() != scatters.size() || counts.empty()) return;
+  CHECK(counts[0].arg<cl_mem>(0) == v.get().id());
+  for(size_t i=0; i<counts.size(); ++i) {
+    CHECK(counts[i].arg<cl_uint>(3) == 4 * i);
+    CHECK(scatters[i].arg<cl_mem>(0) == counts[i].arg<cl_mem>(0));
+    if(i + 1 < counts.size()) {
+      CHECK(counts[i + 1].arg<cl_mem>(0) == scatters[i].arg<cl_mem>(1));
+    }
+  }
+  CHECK(scatters.back().arg<cl_mem>(1) == v.get().id());
+}
+
+void radix_sorts_end_in_their_buffer() {
+  check_radix_passes<cl_uchar>();
+  check_radix_passes<cl_uint>();
+  check_radix_passes<cl_ulong>();
+}
+
+void copy_if_counts_from_the_last_position() {
+  test_queue f;
+  const size_t n = 100;
+  cl::device_vector<cl_int> in(f.q, n), out(f.q, n);
+  // stands in for the scan: every position but the last is wrong
+  stub::set_launch_hook([](const stub::launch &l) {
+    record(l);
+    if(l.name != "compact") return;
+    const size_t count = size_t(l.arg<cl_ulong>(3));
+    cl_uint *pos = reinterpret_cast<cl_uint*>(
+        stub::mem_data(l.arg<cl_mem>(2)));
+    for(size_t i=0; i<count; ++i) pos[i] = 7;
+    pos[count - 1] = 42;
+  });
+  take_launches();
+  CHECK(in.copy_if(out, "x > 0") == 42);
+  stub::set_launch_hook(record);
+  std::vector<stub::launch> seen = take_launches();
+  CHECK(!seen.empty() && seen.back().name == "compact");
+  if(!seen.empty()) {
+    CHECK(seen.back().global[0] == n);
+    CHECK(seen.back().arg<cl_mem>(0) == in.get().id());
+    CHECK(seen.back().arg<cl_mem>(1) == out.get().id());
+  }
+}
+
+void copy_if_refuses_its_own_buffer() {
+  test_queue f;
+  cl::device_vector<cl_int> v(f.q, 100);
+  cl::device_vector<cl_int> view(f.q, v.get(), 100);
+  CHECK_THROWS_CL(v.copy_if(v, "x > 0"), CL_INVALID_VALUE);
+  CHECK_THROWS_CL(v.copy_if(view, "x > 0"), CL_INVALID_VALUE);
+  cl::device_vector<cl_int> empty, other;
+  CHECK(empty.copy_if(other, "x > 0") == 0);
+}
+
+}
+
+int main() {
+  stub::settings().preferred_vector_width = 4;
+  stub::set_launch_hook(record);
+  comparisons_run_on_scalars();
+  programs_are_built_once();
+  builds_run_outside_the_lock();
+  old_contexts_are_released();
+  moves_leave_an_empty_vector();
+  scans_recurse_to_one_group();
+  radix_sorts_end_in_their_buffer();
+  copy_if_counts_from_the_last_position();
+  copy_if_refuses_its_own_buffer();
+  return test_result();
+}
@@ -0,0 +1,92 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <stdexcept>
+
+namespace {
+
+cl::event user_event(const cl::context &ctx) {
+  cl_int err;
+  cl::event to_return = clCreateUserEvent(ctx.id(), &err);
+  CHECK(err == CL_SUCCESS);
+  return to_return;
+}
+
+void values_arrive_on_completion() {
+  test_queue f;
+  cl::event e = user_event(f.ctx);
+  int calls = 0;
+  cl::event_future<int> v = e.then([&calls] { ++calls; return 42; });
+  CHECK(v.valid());
+  CHECK(!v.ready());
+  CHECK(calls == 0);
+  clSetUserEventStatus(e.id(), CL_COMPLETE);
+  CHECK(v.ready());
+  CHECK(v.get() == 42);
+  CHECK(calls == 1);
+  CHECK(v.completion().id() == e.id());
+}
+
+void void_results_complete() {
+  test_queue f;
+  cl::event e = user_event(f.ctx);
+  bool ran = false;
+  cl::event_future<void> v = e.then([&ran] { ran = true; });
+  clSetUserEventStatus(e.id(), CL_COMPLETE);
+  v.get();
+  CHECK(ran);
+}
+
+void exceptions_reach_the_future() {
+  test_queue f;
+  cl::event e = user_event(f.ctx);
+  cl::event_future<int> v = e.then([]() -> int {
+    throw std::runtime_error("f");
+  });
+  clSetUserEventStatus(e.id(), CL_COMPLETE);
+  bool threw = false;
+  try {
+    v.get();
+  } catch(const std::runtime_error&) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+void failed_events_skip_f() {
+  test_queue f;
+  cl::event e = user_event(f.ctx);
+  bool ran = false;
+  cl::event_future<int> v = e.then([&ran] { ran = true; return 1; });
+  clSetUserEventStatus(e.id(), CL_OUT_OF_RESOURCES);
+  CHECK_THROWS_CL(v.get(), CL_OUT_OF_RESOURCES);
+  CHECK(!ran);
+}
+
+void held_values_are_returned() {
+  test_queue f;
+  cl::event e = user_event(f.ctx);
+  std::vector<float> host(16, 2.0f);
+  const float *data = &host[0];
+  cl::event_future<std::vector<float> > v =
+    cl::make_event_future(e, std::move(host));
+  CHECK(!v.ready());
+  clSetUserEventStatus(e.id(), CL_COMPLETE);
+  std::vector<float> back = v.get();
+  CHECK(back.size() == 16);
+  // moved through, not copied
+  CHECK(&back[0] == data);
+}
+
+}
+
+int main() {
+  values_arrive_on_completion();
+  void_results_complete();
+  exceptions_reach_the_future();
+  failed_events_skip_f();
+  held_values_are_returned();
+  return test_result();
+}
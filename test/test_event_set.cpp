@@ -0,0 +1,166 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <thread>
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+std::vector<cl::event> user_events(const cl::context &ctx, size_t n) {
+  std::vector<cl::event> to_return;
+  for(size_t i=0; i<n; ++i) {
+    cl_int err;
+    to_return.push_back(cl::event(clCreateUserEvent(ctx.id(), &err)));
+    CHECK(err == CL_SUCCESS);
+  }
+  return to_return;
+}
+
+void complete(const cl::event &e, cl_int status = CL_COMPLETE) {
+  clSetUserEventStatus(e.id(), status);
+}
+
+void empty_sets_return_at_once() {
+  cl::event_set s;
+  cl::event_completion c;
+  CHECK(s.empty());
+  CHECK(!s.try_pop_completed(c));
+  CHECK_THROWS_CL(s.wait_any(), CL_INVALID_VALUE);
+  const clock_type::time_point begin = clock_type::now();
+  CHECK(!s.wait_any_for(std::chrono::seconds(5), c));
+  std::vector<cl::event_completion> out;
+  CHECK(s.wait_n(3, out) == 0);
+  CHECK(clock_type::now() - begin < std::chrono::seconds(1));
+}
+
+void completions_come_in_arrival_order() {
+  test_queue f;
+  std::vector<cl::event> e = user_events(f.ctx, 3);
+  cl::event_set s;
+  for(size_t i=0; i<e.size(); ++i) s.add(e[i], i);
+  cl::event_completion c;
+  CHECK(!s.try_pop_completed(c));
+  complete(e[2]);
+  complete(e[0]);
+  complete(e[1]);
+  const size_t expected[] = { 2, 0, 1 };
+  for(size_t i=0; i<3; ++i) {
+    c = s.wait_any();
+    CHECK(c.tag == expected[i]);
+    CHECK(c.e.id() == e[expected[i]].id());
+    CHECK(c.status == CL_COMPLETE);
+  }
+  CHECK(s.empty());
+}
+
+void wait_n_stops_at_the_deadline() {
+  test_queue f;
+  std::vector<cl::event> e = user_events(f.ctx, 4);
+  cl::event_set s;
+  for(size_t i=0; i<e.size(); ++i) s.add(e[i], i);
+  for(size_t i=0; i<3; ++i) complete(e[i]);
+  std::vector<cl::event_completion> out;
+  CHECK(s.wait_n_for(4, std::chrono::milliseconds(20), out) == 3);
+  CHECK(s.size() == 1);
+  complete(e[3]);
+  CHECK(s.wait_n(4, out) == 1);
+  CHECK(out.size() == 4);
+  CHECK(out.at(3).tag == 3);
+}
+
+void waits_time_out() {
+  test_queue f;
+  std::vector<cl::event> e = user_events(f.ctx, 1);
+  cl::event_set s;
+  s.add(e[0]);
+  cl::event_completion c;
+  clock_type::time_point begin = clock_type::now();
+  CHECK(!s.wait_any_for(std::chrono::milliseconds(20), c));
+  CHECK(clock_type::now() - begin >= std::chrono::milliseconds(20));
+  begin = clock_type::now();
+  CHECK(!s.wait_any_until(begin + std::chrono::milliseconds(20), c));
+  CHECK(clock_type::now() - begin >= std::chrono::milliseconds(20));
+  std::vector<cl::event_completion> out;
+  CHECK(s.wait_n_until(1, clock_type::now(), out) == 0);
+  CHECK(s.size() == 1);
+  complete(e[0]);
+  CHECK(s.wait_any_for(std::chrono::seconds(5), c));
+}
+
+void failures_keep_their_status() {
+  test_queue f;
+  std::vector<cl::event> e = user_events(f.ctx, 1);
+  cl::event_set s;
+  s.add(e[0], 7);
+  complete(e[0], CL_OUT_OF_RESOURCES);
+  cl::event_completion c = s.wait_any();
+  CHECK(c.status == CL_OUT_OF_RESOURCES);
+  CHECK(c.tag == 7);
+}
+
+void sets_may_go_before_their_events() {
+  test_queue f;
+  std::vector<cl::event> e = user_events(f.ctx, 4);
+  {
+    cl::event_set s;
+    for(size_t i=0; i<e.size(); ++i) s.add(e[i]);
+    complete(e[0]);
+  }
+  for(size_t i=1; i<e.size(); ++i) complete(e[i]);
+}
+
+void many_producers() {
+  test_queue f;
+  const size_t producers = 8, each = 500;
+  std::vector<std::vector<cl::event> > e(producers);
+  cl::event_set s;
+  std::vector<std::thread> threads;
+  for(size_t p=0; p<producers; ++p) {
+    threads.push_back(std::thread([&, p] {
+      e[p] = user_events(f.ctx, each);
+      for(size_t i=0; i<each; ++i) s.add(e[p][i], p * each + i);
+    }));
+  }
+  for(size_t p=0; p<producers; ++p) threads[p].join();
+  threads.clear();
+  CHECK(s.size() == producers * each);
+
+  for(size_t p=0; p<producers; ++p) {
+    threads.push_back(std::thread([&, p] {
+      for(size_t i=0; i<each; ++i) complete(e[p][each - 1 - i]);
+    }));
+  }
+  std::vector<bool> seen(producers * each, false);
+  std::vector<size_t> last(producers, each);
+  for(size_t n=0; n<producers * each; ++n) {
+    cl::event_completion c;
+    if(!s.wait_any_for(std::chrono::seconds(10), c)) {
+      CHECK(false);
+      break;
+    }
+    CHECK(!seen.at(c.tag));
+    seen.at(c.tag) = true;
+    // each producer completes its events in reverse
+    const size_t p = c.tag / each, i = c.tag % each;
+    CHECK(i < last[p]);
+    last[p] = i;
+  }
+  for(size_t p=0; p<producers; ++p) threads[p].join();
+  CHECK(s.empty());
+}
+
+}
+
+int main() {
+  empty_sets_return_at_once();
+  completions_come_in_arrival_order();
+  wait_n_stops_at_the_deadline();
+  waits_time_out();
+  failures_keep_their_status();
+  sets_may_go_before_their_events();
+  many_producers();
+  return test_result();
+}
@@ -0,0 +1,158 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <mutex>
+
+namespace {
+
+std::mutex written_mutex;
+std::vector<cl_mem> written;
+
+/** \brief runs the fallback fill kernels on the host.  images are
+ * assumed CL_RGBA CL_UNSIGNED_INT32, so 16 bytes a pixel */
+void run_fill(const stub::launch &l) {
+  const cl_mem dst = l.arg<cl_mem>(0);
+  {
+    std::lock_guard<std::mutex> lock(written_mutex);
+    written.push_back(dst);
+  }
+  if(l.name == "fill_uint4" || l.name == "fill_uchar") {
+    const size_t unit = l.name == "fill_uint4" ? 16 : 1;
+    const char *pattern = stub::mem_data(l.arg<cl_mem>(1));
+    const cl_ulong first = l.arg<cl_ulong>(2);
+    const cl_uint mask = l.arg<cl_uint>(3);
+    for(size_t i=0; i<l.global[0]; ++i) {
+      std::memcpy(stub::mem_data(dst) + (first + i) * unit,
+          pattern + (i & mask) * unit, unit);
+    }
+  } else if(l.name == "fill_imageui") {
+    const std::vector<char> &color = l.args.at(1);
+    for(size_t i=0; i<l.global[0] * l.global[1]; ++i) {
+      std::memcpy(stub::mem_data(dst) + i * 16, &color[0], 16);
+    }
+  }
+}
+
+std::vector<cl_mem> take_written() {
+  std::lock_guard<std::mutex> lock(written_mutex);
+  std::vector<cl_mem> to_return;
+  to_return.swap(written);
+  return to_return;
+}
+
+cl_uint refs(cl_context c) {
+  cl_uint to_return = 0;
+  clGetContextInfo(c, CL_CONTEXT_REFERENCE_COUNT, sizeof(to_return),
+      &to_return, NULL);
+  return to_return;
+}
+
+void buffers_fill_without_image_support() {
+  stub::settings().image_support = false;
+  test_queue f;
+  std::vector<char> zero(256, 0);
+  cl::buffer b(f.ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+      zero.size(), &zero[0]);
+  const cl_uint wide = 0x01020304;
+  f.q.fill_buffer(b, &wide, sizeof(wide), 16, 64);
+  const char narrow = 9;
+  f.q.fill_buffer(b, &narrow, 1, 101, 7).wait();
+
+  std::vector<char> back(zero.size());
+  f.q.read_buffer(b, 0, back.size(), &back[0], 0, NULL, true);
+  for(size_t i=0; i<back.size(); ++i) {
+    if(i >= 16 && i < 80) {
+      CHECK(back[i] == reinterpret_cast<const char*>(&wide)[i % 4]);
+    } else if(i >= 101 && i < 108) {
+      CHECK(back[i] == narrow);
+    } else {
+      CHECK(back[i] == 0);
+    }
+  }
+  stub::settings().image_support = true;
+}
+
+void images_fill_through_a_copy() {
+  test_queue f;
+  cl::image2d image(f.ctx, CL_MEM_READ_ONLY, CL_RGBA, CL_UNSIGNED_INT32,
+      8, 8);
+  take_written();
+  const cl_uint color[] = { 1, 2, 3, 4 };
+  const size_t origin[] = { 2, 3, 0 };
+  const size_t region[] = { 4, 2, 1 };
+  f.q.fill_image(image, color, origin, region).wait();
+
+  std::vector<cl_mem> seen = take_written();
+  CHECK(seen.size() == 1);
+  CHECK(seen.at(0) != image.id());
+  const cl_uint *pixels =
+    reinterpret_cast<const cl_uint*>(stub::mem_data(image.id()));
+  for(size_t y=0; y<8; ++y) {
+    for(size_t x=0; x<8; ++x) {
+      const bool inside = x >= 2 && x < 6 && y >= 3 && y < 5;
+      for(size_t c=0; c<4; ++c) {
+        CHECK(pixels[(y * 8 + x) * 4 + c] == (inside ? color[c] : 0));
+      }
+    }
+  }
+}
+
+void failed_image_builds_are_retried() {
+  test_queue f;
+  stub::settings().build_error_marker = "write_image";
+  cl::image2d image(f.ctx, CL_MEM_READ_WRITE, CL_RGBA, CL_UNSIGNED_INT32,
+      4, 4);
+  const cl_uint color[] = { 5, 6, 7, 8 };
+  const size_t origin[] = { 0, 0, 0 };
+  const size_t region[] = { 4, 4, 1 };
+  bool threw = false;
+  try {
+    f.q.fill_image(image, color, origin, region);
+  } catch(const cl::build_error&) {
+    threw = true;
+  }
+  CHECK(threw);
+  cl::buffer b(f.ctx, CL_MEM_READ_WRITE, 64);
+  const char c = 1;
+  f.q.fill_buffer(b, &c, 1, 0, 64).wait();
+  stub::settings().build_error_marker.clear();
+  f.q.fill_image(image, color, origin, region).wait();
+  CHECK(stub::mem_data(image.id())[0] == 5);
+}
+
+void old_contexts_are_released() {
+  cl_context first = NULL;
+  {
+    test_queue f;
+    first = f.ctx.id();
+    clRetainContext(first);
+    cl::buffer b(f.ctx, CL_MEM_READ_WRITE, 64);
+    const char c = 1;
+    f.q.fill_buffer(b, &c, 1, 0, 64).wait();
+  }
+  CHECK(refs(first) > 1);
+  for(int i=0; i<10; ++i) {
+    test_queue f;
+    cl::buffer b(f.ctx, CL_MEM_READ_WRITE, 64);
+    const char c = 1;
+    f.q.fill_buffer(b, &c, 1, 0, 64).wait();
+  }
+  CHECK(cl::detail::fill_kernels<0>::cached() == 4);
+  CHECK(refs(first) == 1);
+  clReleaseContext(first);
+}
+
+}
+
+int main() {
+  // before OpenCL 1.2, so the kernels stand in for clEnqueueFill*
+  stub::settings().device_version = "OpenCL 1.1 stub";
+  stub::set_launch_hook(run_fill);
+  buffers_fill_without_image_support();
+  images_fill_through_a_copy();
+  failed_image_builds_are_retried();
+  old_contexts_are_released();
+  return test_result();
+}
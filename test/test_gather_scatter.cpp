@@ -0,0 +1,93 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+namespace {
+
+struct fixture : test_queue {
+  fixture() : data(256) {
+    b = cl::buffer(ctx, CL_MEM_READ_WRITE, data.size());
+    for(size_t i=0; i<data.size(); ++i) data[i] = char(i);
+    q.write_buffer(b, 0, data.size(), &data[0], 0, NULL, true);
+  }
+  std::vector<char> data;
+  cl::buffer b;
+};
+
+void strided_ranges_become_one_rect() {
+  std::vector<char> host(64);
+  std::vector<cl::transfer_range> ranges;
+  for(size_t i=0; i<4; ++i) {
+    ranges.push_back(cl::transfer_range(i * 32, 8, &host[i * 16]));
+  }
+  std::vector<cl::detail::transfer_run> runs =
+    cl::detail::coalesce_ranges(ranges);
+  CHECK(runs.size() == 1);
+  CHECK(runs.at(0).count == 4);
+  CHECK(runs.at(0).buffer_stride == 32);
+  CHECK(runs.at(0).host_stride == 16);
+}
+
+void repeated_ranges_stay_linear() {
+  fixture f;
+  std::vector<char> host(32, 0);
+  std::vector<cl::transfer_range> ranges;
+  // the same 8 bytes into four places
+  for(size_t i=0; i<4; ++i) {
+    ranges.push_back(cl::transfer_range(40, 8, &host[i * 8]));
+  }
+  std::vector<cl::detail::transfer_run> runs =
+    cl::detail::coalesce_ranges(ranges);
+  CHECK(runs.size() == 4);
+  for(size_t i=0; i<runs.size(); ++i) CHECK(runs[i].count == 1);
+
+  f.q.gather(f.b, ranges).wait();
+  for(size_t i=0; i<host.size(); ++i) CHECK(host[i] == char(40 + i % 8));
+}
+
+void overlapping_ranges_stay_linear() {
+  fixture f;
+  std::vector<char> host(48, 0);
+  std::vector<cl::transfer_range> ranges;
+  // 16 bytes every 4: each overlaps the next in the buffer
+  for(size_t i=0; i<3; ++i) {
+    ranges.push_back(cl::transfer_range(i * 4, 16, &host[i * 16]));
+  }
+  std::vector<cl::detail::transfer_run> runs =
+    cl::detail::coalesce_ranges(ranges);
+  CHECK(runs.size() == 3);
+  for(size_t i=0; i<runs.size(); ++i) CHECK(runs[i].count == 1);
+
+  f.q.gather(f.b, ranges).wait();
+  for(size_t i=0; i<3; ++i) {
+    for(size_t j=0; j<16; ++j) CHECK(host[i * 16 + j] == char(i * 4 + j));
+  }
+}
+
+void scatter_round_trips() {
+  fixture f;
+  std::vector<char> out(64);
+  for(size_t i=0; i<out.size(); ++i) out[i] = char(200 + i);
+  std::vector<cl::transfer_range> ranges;
+  for(size_t i=0; i<8; ++i) {
+    ranges.push_back(cl::transfer_range(i * 24, 8, &out[i * 8]));
+  }
+  f.q.scatter(f.b, ranges).wait();
+  std::vector<char> back(f.data.size());
+  f.q.read_buffer(f.b, 0, back.size(), &back[0], 0, NULL, true);
+  for(size_t i=0; i<8; ++i) {
+    for(size_t j=0; j<8; ++j) CHECK(back[i * 24 + j] == out[i * 8 + j]);
+    if(i < 7) CHECK(back[i * 24 + 8] == char(i * 24 + 8));
+  }
+}
+
+}
+
+int main() {
+  strided_ranges_become_one_rect();
+  repeated_ranges_stay_linear();
+  overlapping_ranges_stay_linear();
+  scatter_round_trips();
+  return test_result();
+}
@@ -0,0 +1,31 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+namespace {
+
+void rest_of_buffer_is_mapped() {
+  test_queue f;
+  cl::buffer b(f.ctx, CL_MEM_READ_WRITE, 64 * sizeof(cl_float));
+  cl::mapped_view<cl_float> v = f.q.map_buffer<cl_float>(b, CL_MAP_READ,
+      48);
+  CHECK(v.size() == 16);
+  CHECK(reinterpret_cast<char*>(v.data())
+      == stub::mem_data(b.id()) + 48 * sizeof(cl_float));
+}
+
+void offset_past_the_end_is_rejected() {
+  test_queue f;
+  cl::buffer b(f.ctx, CL_MEM_READ_WRITE, 64 * sizeof(cl_float));
+  CHECK_THROWS_CL(f.q.map_buffer<cl_float>(b, CL_MAP_READ, 65),
+      CL_INVALID_VALUE);
+}
+
+}
+
+int main() {
+  rest_of_buffer_is_mapped();
+  offset_past_the_end_is_rejected();
+  return test_result();
+}
@@ -0,0 +1,70 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+namespace {
+
+typedef cl::detail::device_info_registry<cl::device> registry;
+
+cl::device root_device() {
+  return cl::platform::platforms()[0].devices()[0];
+}
+
+void numa_splits_number_their_nodes() {
+  stub::settings().numa_nodes = 2;
+  cl::numa_domains domains(root_device());
+  CHECK(domains.by_numa());
+  CHECK(domains.size() == 2);
+  for(size_t i=0; i<domains.size(); ++i) CHECK(domains[i].node == i);
+}
+
+void fallback_splits_have_no_node() {
+  stub::settings().numa_nodes = 0;
+  cl::numa_domains domains(root_device());
+  CHECK(!domains.by_numa());
+  CHECK(domains.size() > 0);
+  for(size_t i=0; i<domains.size(); ++i) {
+    CHECK(domains[i].node == cl::numa_domains::no_node);
+  }
+  cl::buffer b = domains.host_buffer(0, CL_MEM_READ_WRITE, 4096);
+  CHECK(b.size() == 4096);
+  CHECK(domains.unbound() == 1);
+  stub::settings().numa_nodes = 2;
+}
+
+void snapshots_go_with_the_last_sub_device() {
+  const cl::device root = root_device();
+  root.name();
+  const size_t before = registry::size();
+  cl_device_id extra = NULL;
+  {
+    std::vector<cl::sub_device> parts = root.partition_equally(2);
+    CHECK(parts.size() == 4);
+    std::vector<cl::sub_device> copies = parts;
+    for(size_t i=0; i<parts.size(); ++i) parts[i].name();
+    CHECK(registry::size() == before + parts.size());
+    // a reference the wrapper does not know about
+    extra = parts[0].id();
+    clRetainDevice(extra);
+    parts.clear();
+    CHECK(registry::size() == before + copies.size());
+  }
+  CHECK(registry::size() == before);
+  clReleaseDevice(extra);
+
+  for(int i=0; i<100; ++i) {
+    std::vector<cl::sub_device> parts = root.partition_equally(4);
+    parts[0].name();
+  }
+  CHECK(registry::size() == before);
+}
+
+}
+
+int main() {
+  numa_splits_number_their_nodes();
+  fallback_splits_have_no_node();
+  snapshots_go_with_the_last_sub_device();
+  return test_result();
+}
@@ -0,0 +1,95 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <thread>
+
+namespace {
+
+const unsigned num_threads = 16;
+
+/** \brief runs f(thread index) on num_threads threads released together */
+template<typename F>
+void race(F f) {
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  for(unsigned i=0; i<num_threads; ++i) {
+    threads.push_back(std::thread([&go, &f, i] {
+      while(!go.load()) std::this_thread::yield();
+      f(i);
+    }));
+  }
+  go = true;
+  for(unsigned i=0; i<num_threads; ++i) threads[i].join();
+}
+
+void first_access() {
+  // every thread's first call races to enumerate; exactly one may
+  std::vector<size_t> seen(num_threads);
+  race([&seen](unsigned i) {
+    seen[i] = cl::platform::platforms().size();
+  });
+  for(unsigned i=0; i<num_threads; ++i) CHECK(seen[i] == 2);
+  // one clGetPlatformIDs for the count and one for the ids
+  CHECK(stub::counters().platform_queries == 2);
+}
+
+void concurrent_refresh() {
+  stub::reset_counters();
+  std::atomic<unsigned> refreshes(0);
+  std::atomic<unsigned> bad(0);
+  race([&](unsigned i) {
+    for(unsigned j=0; j<2000; ++j) {
+      const std::vector<cl::platform> &ps = cl::platform::platforms();
+      if(ps.size() != 2) ++bad;
+      for(size_t p=0; p<ps.size(); ++p) {
+        if(ps[p].devices().size() != 3) ++bad;
+        if(ps[p].devices(CL_DEVICE_TYPE_CPU).size() != 3) ++bad;
+        try {
+          ps[p].devices(CL_DEVICE_TYPE_GPU);
+          ++bad;
+        } catch(const cl::cl_error &e) {
+          if(e.err_code() != CL_DEVICE_NOT_FOUND) ++bad;
+        }
+      }
+      if(i % 4 == 0 && j % 250 == 0) {
+        if(cl::platform::refresh().size() != 2) ++bad;
+        ++refreshes;
+      }
+    }
+  });
+  CHECK(bad == 0);
+  // lookups after the first enumeration never reach the driver
+  CHECK(stub::counters().platform_queries == 2 * refreshes);
+}
+
+void refresh_keeps_old_lists() {
+  const std::vector<cl::platform> &before = cl::platform::platforms();
+  stub::settings().num_platforms = 3;
+  const std::vector<cl::platform> &after = cl::platform::refresh();
+  CHECK(before.size() == 2);
+  CHECK(after.size() == 3);
+  CHECK(&cl::platform::platforms() == &after);
+}
+
+void no_platforms() {
+  // the ICD loader's CL_PLATFORM_NOT_FOUND_KHR is an empty list
+  stub::settings().num_platforms = 0;
+  stub::reset_counters();
+  CHECK(cl::platform::refresh().empty());
+  CHECK(cl::platform::platforms().empty());
+  CHECK(stub::counters().platform_queries == 1);
+}
+
+}
+
+int main() {
+  stub::settings().num_platforms = 2;
+  stub::settings().devices_per_platform = 3;
+  first_access();
+  concurrent_refresh();
+  refresh_keeps_old_lists();
+  no_platforms();
+  return test_result();
+}
@@ -0,0 +1,198 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+#include <utime.h>
+
+namespace {
+
+std::string kernel_source(char name) {
+  return std::string("__kernel void k") + name + "(__global float *a) { }\n";
+}
+
+std::string contents(const std::string &path) {
+  std::ifstream in(path.c_str(), std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+      std::istreambuf_iterator<char>());
+}
+
+void write_over(const std::string &path, const std::string &bytes) {
+  std::ofstream(path.c_str(), std::ios::binary) << bytes;
+}
+
+void age(const std::string &path, time_t seconds) {
+  struct utimbuf times;
+  times.actime = times.modtime = time(NULL) - seconds;
+  utime(path.c_str(), &times);
+}
+
+bool exists(const std::string &path) {
+  return std::ifstream(path.c_str()).good();
+}
+
+void a_miss_then_a_hit() {
+  test_queue f;
+  test_dir dir;
+  const std::string source = kernel_source('a');
+  {
+    cl::program_cache cache(dir.path);
+    cl::program p = cache.build(f.ctx, source);
+    CHECK(p.get_kernel("ka").id() != NULL);
+    CHECK(cache.misses() == 1);
+    CHECK(cache.hits() == 0);
+  }
+  std::vector<std::string> paths = dir.files(".clbin");
+  CHECK(paths.size() == 1);
+  CHECK(contents(paths[0]).find(source) != std::string::npos);
+
+  cl::program_cache cache(dir.path);
+  cl::program p = cache.build(f.ctx, source);
+  CHECK(p.get_kernel("ka").id() != NULL);
+  CHECK(cache.hits() == 1);
+  CHECK(cache.misses() == 0);
+  CHECK(cache.rejected() == 0);
+}
+
+void rejected_binaries_are_rebuilt() {
+  test_queue f;
+  test_dir dir;
+  cl::program_cache cache(dir.path);
+  const std::string source = kernel_source('a');
+  cache.build(f.ctx, source);
+  const std::vector<std::string> paths = dir.files(".clbin");
+  CHECK(paths.size() == 1);
+  const std::string good = contents(paths[0]);
+
+  write_over(paths[0], "garbage");
+  cl::program p = cache.build(f.ctx, source);
+  CHECK(p.get_kernel("ka").id() != NULL);
+  CHECK(cache.rejected() == 1);
+  CHECK(cache.misses() == 2);
+  CHECK(contents(paths[0]) == good);
+
+  cache.build(f.ctx, source);
+  CHECK(cache.hits() == 1);
+  CHECK(cache.rejected() == 1);
+}
+
+void options_and_devices_key_apart() {
+  test_queue f;
+  test_dir dir;
+  cl::program_cache cache(dir.path);
+  const std::string source = kernel_source('a');
+  cache.build(f.ctx, source);
+  cache.build(f.ctx, source, "-DX=1");
+  CHECK(cache.misses() == 2);
+  CHECK(dir.files(".clbin").size() == 2);
+
+  // a sub-device reports a different name, so it gets its own binary
+  std::vector<cl::sub_device> parts = f.dev.partition_equally(2);
+  cl::device part = parts[0];
+  cl::context sub_ctx(cl::platform(part.platform()), 1, &part);
+  cache.build(sub_ctx, source);
+  CHECK(cache.misses() == 3);
+  CHECK(dir.files(".clbin").size() == 3);
+
+  cache.build(f.ctx, source, "-DX=1");
+  cache.build(sub_ctx, source);
+  CHECK(cache.hits() == 2);
+  CHECK(cache.misses() == 3);
+}
+
+void the_oldest_entries_are_evicted() {
+  test_queue f;
+  test_dir dir;
+  const size_t entry = std::string("stub binary\n").size() +
+    kernel_source('a').size();
+  cl::program_cache cache(dir.path, 2 * entry);
+
+  cache.build(f.ctx, kernel_source('a'));
+  const std::string a = dir.files(".clbin")[0];
+  age(a, 300);
+  cache.build(f.ctx, kernel_source('b'));
+  std::vector<std::string> paths = dir.files(".clbin");
+  CHECK(paths.size() == 2);
+  const std::string b = paths[0] == a ? paths[1] : paths[0];
+  age(b, 200);
+
+  cache.build(f.ctx, kernel_source('c'));
+  CHECK(dir.files(".clbin").size() == 2);
+  CHECK(!exists(a));
+  CHECK(exists(b));
+
+  cache.build(f.ctx, kernel_source('a'));
+  CHECK(cache.misses() == 4);
+  CHECK(!exists(b));
+}
+
+void stale_temporaries_are_removed() {
+  test_queue f;
+  test_dir dir;
+  const std::string stale = dir.path + "/deadbeef.clbin.1.0.tmp";
+  const std::string fresh = dir.path + "/deadbeef.clbin.2.0.tmp";
+  write_over(stale, "partial");
+  write_over(fresh, "partial");
+  age(stale, 2 * 60 * 60);
+
+  cl::program_cache cache(dir.path);
+  cache.build(f.ctx, kernel_source('a'));
+  CHECK(!exists(stale));
+  CHECK(exists(fresh));
+}
+
+void concurrent_writers_leave_whole_entries() {
+  test_queue f;
+  test_dir dir;
+  const std::string source = kernel_source('a');
+  const int threads = 4;
+  const int builds = 50;
+  // with no room every build evicts, so the entry is rewritten while
+  // other threads read it
+  std::vector<std::unique_ptr<cl::program_cache> > caches;
+  for(int i=0; i<threads; ++i) {
+    caches.emplace_back(new cl::program_cache(dir.path, 0));
+  }
+  std::vector<std::thread> workers;
+  for(int i=0; i<threads; ++i) {
+    cl::program_cache &cache = *caches[i];
+    workers.emplace_back([&cache, &f, &source, builds] {
+      for(int j=0; j<builds; ++j) cache.build(f.ctx, source);
+    });
+  }
+  for(size_t i=0; i<workers.size(); ++i) workers[i].join();
+
+  unsigned long hits = 0, misses = 0, rejected = 0;
+  for(int i=0; i<threads; ++i) {
+    hits += caches[i]->hits();
+    misses += caches[i]->misses();
+    rejected += caches[i]->rejected();
+  }
+  CHECK(hits + misses == threads * builds);
+  CHECK(rejected == 0);
+  CHECK(dir.files(".tmp").empty());
+
+  // leave an entry behind and check that it is whole
+  cl::program_cache keep(dir.path);
+  keep.build(f.ctx, source);
+  const std::vector<std::string> paths = dir.files(".clbin");
+  CHECK(paths.size() == 1);
+  CHECK(contents(paths[0]) == "stub binary\n" + source);
+}
+
+}
+
+int main() {
+  a_miss_then_a_hit();
+  rejected_binaries_are_rebuilt();
+  options_and_devices_key_apart();
+  the_oldest_entries_are_evicted();
+  stale_temporaries_are_removed();
+  concurrent_writers_leave_whole_entries();
+  return test_result();
+}
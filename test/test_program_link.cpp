@@ -0,0 +1,169 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <cstdio>
+
+namespace {
+
+const char *const helper_source =
+  "float twice(float x) { return 2 * x; }\n";
+const char *const kernel_source =
+  "float twice(float x);\n"
+  "__kernel void scale(__global float *a) { }\n";
+
+void write_over(const std::string &path, const std::string &bytes) {
+  FILE *f = std::fopen(path.c_str(), "wb");
+  std::fwrite(bytes.data(), 1, bytes.size(), f);
+  std::fclose(f);
+}
+
+void objects_link_into_an_executable() {
+  test_queue f;
+  cl::program helper(f.ctx, helper_source);
+  cl::program scale(f.ctx, kernel_source);
+  helper.compile();
+  scale.compile("-DX=1");
+  CHECK(helper.binary_type(f.dev) == CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT);
+
+  std::vector<cl::program> objects;
+  objects.push_back(helper);
+  objects.push_back(scale);
+  cl::program linked = cl::program::link(f.ctx, objects);
+  CHECK(linked.binary_type(f.dev) == CL_PROGRAM_BINARY_TYPE_EXECUTABLE);
+  CHECK(linked.get_kernel("scale").id() != NULL);
+}
+
+void compile_failures_carry_the_log() {
+  test_queue f;
+  stub::settings().build_error_marker = "#error";
+  cl::program broken(f.ctx, "#error no\n");
+  bool caught = false;
+  try {
+    broken.compile();
+  } catch(const cl::build_error &e) {
+    caught = true;
+    CHECK(e.err_code() == CL_BUILD_PROGRAM_FAILURE);
+    CHECK(e.builds().size() == 1);
+    CHECK(e.builds()[0].status == CL_BUILD_ERROR);
+    CHECK(e.builds()[0].log.find("#error") != std::string::npos);
+  }
+  CHECK(caught);
+  stub::settings().build_error_marker.clear();
+}
+
+void link_failures_carry_the_log() {
+  test_queue f;
+  stub::settings().link_error_marker = "missing";
+  cl::program object(f.ctx, "float missing(float x);\n");
+  object.compile();
+  bool caught = false;
+  try {
+    cl::program::link(f.ctx, std::vector<cl::program>(1, object));
+  } catch(const cl::build_error &e) {
+    caught = true;
+    CHECK(e.builds().size() == 1);
+    CHECK(e.builds()[0].status == CL_BUILD_ERROR);
+    CHECK(e.builds()[0].log.find("missing") != std::string::npos);
+  }
+  CHECK(caught);
+  stub::settings().link_error_marker.clear();
+}
+
+void cached_objects_are_kept_per_context() {
+  test_queue f, g;
+  test_dir dir;
+  cl::program_cache cache(dir.path);
+  stub::reset_counters();
+
+  cl::program first = cache.compile(f.ctx, kernel_source);
+  CHECK(cache.object_misses() == 1);
+  CHECK(stub::counters().compiles == 1);
+  cl::program again = cache.compile(f.ctx, kernel_source);
+  CHECK(again.id() == first.id());
+  CHECK(cache.object_hits() == 1);
+  CHECK(dir.files(".clobj").size() == 1);
+
+  // another context shares the disk entry but not the program
+  cl::program other = cache.compile(g.ctx, kernel_source);
+  CHECK(other.id() != first.id());
+  CHECK(other.binary_type(g.dev) == CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT);
+  CHECK(cache.object_hits() == 2);
+  CHECK(stub::counters().compiles == 1);
+
+  // options are part of the key
+  cache.compile(f.ctx, kernel_source, "-DX=1");
+  CHECK(cache.object_misses() == 2);
+  CHECK(stub::counters().compiles == 2);
+}
+
+void cleared_objects_come_back_from_disk() {
+  test_queue f;
+  test_dir dir;
+  cl::program_cache cache(dir.path);
+  stub::reset_counters();
+
+  cl::program first = cache.compile(f.ctx, kernel_source);
+  cache.clear_objects();
+  cl::program loaded = cache.compile(f.ctx, kernel_source);
+  CHECK(loaded.id() != first.id());
+  CHECK(cache.object_hits() == 1);
+  CHECK(cache.object_misses() == 1);
+  CHECK(stub::counters().compiles == 1);
+
+  std::vector<cl::program> objects;
+  objects.push_back(cache.compile(f.ctx, helper_source));
+  objects.push_back(loaded);
+  CHECK(cl::program::link(f.ctx, objects).get_kernel("scale").id()
+      != NULL);
+}
+
+void rejected_objects_are_recompiled() {
+  test_queue f;
+  test_dir dir;
+  cl::program_cache cache(dir.path);
+  cache.compile(f.ctx, kernel_source);
+  std::vector<std::string> paths = dir.files(".clobj");
+  CHECK(paths.size() == 1);
+  stub::reset_counters();
+
+  // bytes the driver refuses to load
+  write_over(paths[0], "garbage");
+  cache.clear_objects();
+  cl::program p = cache.compile(f.ctx, kernel_source);
+  CHECK(p.binary_type(f.dev) == CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT);
+  CHECK(cache.rejected() == 1);
+  CHECK(cache.object_misses() == 2);
+  CHECK(stub::counters().compiles == 1);
+
+  // a binary that loads, but as an executable rather than an object
+  cl::program exe(f.ctx, kernel_source);
+  exe.build();
+  const std::vector<unsigned char> bin = exe.binaries()[0];
+  write_over(paths[0], std::string(bin.begin(), bin.end()));
+  cache.clear_objects();
+  p = cache.compile(f.ctx, kernel_source);
+  CHECK(p.binary_type(f.dev) == CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT);
+  CHECK(cache.rejected() == 2);
+  CHECK(cache.object_misses() == 3);
+  CHECK(stub::counters().compiles == 2);
+
+  // the recompiled object replaced the bad file
+  cache.clear_objects();
+  cache.compile(f.ctx, kernel_source);
+  CHECK(cache.rejected() == 2);
+  CHECK(stub::counters().compiles == 2);
+}
+
+}
+
+int main() {
+  objects_link_into_an_executable();
+  compile_failures_carry_the_log();
+  link_failures_carry_the_log();
+  cached_objects_are_kept_per_context();
+  cleared_objects_come_back_from_disk();
+  rejected_objects_are_recompiled();
+  return test_result();
+}
@@ -0,0 +1,135 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <sstream>
+#include <thread>
+
+namespace {
+
+const char *source = "__kernel void f(__global float *a) { }";
+
+std::vector<cl::spec_params> variants(size_t n) {
+  std::vector<cl::spec_params> to_return(n);
+  for(size_t i=0; i<n; ++i) {
+    std::ostringstream value;
+    value << i;
+    to_return[i]["N"] = value.str();
+  }
+  return to_return;
+}
+
+void prewarm_uses_a_bounded_pool() {
+  test_queue f;
+  stub::settings().build_millis = 20;
+  stub::reset_counters();
+  {
+    cl::specialized_program sp(f.ctx, source, "", 16, NULL, 2);
+    std::vector<cl::spec_params> v = variants(8);
+    sp.prewarm(v);
+    for(size_t i=0; i<v.size(); ++i) sp.get_async(v[i]).get();
+    CHECK(sp.builds() == 8);
+  }
+  CHECK(stub::counters().peak_building <= 2);
+  CHECK(stub::counters().builds == 8);
+  stub::settings().build_millis = 0;
+}
+
+void prewarm_refuses_more_than_capacity() {
+  test_queue f;
+  cl::specialized_program sp(f.ctx, source, "", 4);
+  sp.get(variants(1)[0]);
+  CHECK_THROWS_CL(sp.prewarm(variants(5)), CL_INVALID_VALUE);
+  CHECK(sp.builds() == 1);
+  // the one already held does not count twice
+  sp.prewarm(variants(4));
+  CHECK(sp.builds() == 4);
+}
+
+void running_builds_are_not_evicted() {
+  test_queue f;
+  stub::settings().build_millis = 200;
+  cl::specialized_program sp(f.ctx, source, "", 2, NULL, 1);
+  std::vector<cl::spec_params> v = variants(4);
+  std::shared_future<cl::program> slow = sp.get_async(v[0]);
+  while(!stub::counters().building) std::this_thread::yield();
+  stub::settings().build_millis = 0;
+  sp.get(v[1]);
+  sp.get(v[2]);
+  sp.get(v[3]);
+  CHECK(sp.size() == 2);
+  slow.get();
+  const unsigned long hits = sp.hits();
+  CHECK(sp.builds() == 4);
+  sp.get(v[0]);
+  CHECK(sp.hits() == hits + 1);
+}
+
+void failed_builds_are_retried() {
+  test_queue f;
+  cl::specialized_program sp(f.ctx, source);
+  cl::spec_params params = variants(1)[0];
+  stub::settings().build_error_marker = "__kernel";
+  bool threw = false;
+  try {
+    sp.get(params);
+  } catch(const cl::build_error&) {
+    threw = true;
+  }
+  CHECK(threw);
+  CHECK(sp.size() == 0);
+  stub::settings().build_error_marker.clear();
+  sp.get(params);
+  CHECK(sp.builds() == 2);
+  CHECK(sp.size() == 1);
+}
+
+void destruction_joins_the_pool() {
+  test_queue f;
+  stub::settings().build_millis = 20;
+  std::vector<std::shared_future<cl::program> > pending;
+  {
+    cl::specialized_program sp(f.ctx, source, "", 16, NULL, 2);
+    std::vector<cl::spec_params> v = variants(8);
+    for(size_t i=0; i<v.size(); ++i) pending.push_back(sp.get_async(v[i]));
+  }
+  CHECK(stub::counters().building == 0);
+  size_t cancelled = 0;
+  for(size_t i=0; i<pending.size(); ++i) {
+    try {
+      pending[i].get();
+    } catch(const cl::cl_error &e) {
+      CHECK(e.err_code() == CL_INVALID_OPERATION);
+      ++cancelled;
+    }
+  }
+  CHECK(cancelled > 0);
+  stub::settings().build_millis = 0;
+}
+
+void get_takes_queued_builds() {
+  test_queue f;
+  stub::settings().build_millis = 20;
+  cl::specialized_program sp(f.ctx, source, "", 16, NULL, 1);
+  std::vector<cl::spec_params> v = variants(8);
+  sp.prewarm(v);
+  typedef std::chrono::steady_clock clock;
+  clock::time_point begin = clock::now();
+  sp.get(v[7]);
+  // one build on this thread, maybe waiting out one on the pool's
+  CHECK(clock::now() - begin < std::chrono::milliseconds(100));
+  stub::settings().build_millis = 0;
+}
+
+}
+
+int main() {
+  prewarm_uses_a_bounded_pool();
+  prewarm_refuses_more_than_capacity();
+  running_builds_are_not_evicted();
+  failed_builds_are_retried();
+  destruction_joins_the_pool();
+  get_takes_queued_builds();
+  return test_result();
+}
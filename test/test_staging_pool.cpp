@@ -0,0 +1,102 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <cstdlib>
+#include <future>
+
+namespace {
+
+/** \brief a second queue on the same device */
+struct fixture : test_queue {
+  fixture()
+      : q2(ctx, dev) { }
+  cl::command_queue q2;
+};
+
+/** \brief runs f, failing the test run instead of hanging */
+template<typename F>
+void within_seconds(int seconds, F f) {
+  std::future<void> done = std::async(std::launch::async, f);
+  if(done.wait_for(std::chrono::seconds(seconds)) !=
+      std::future_status::ready) {
+    std::cerr << "timed out" << std::endl;
+    std::_Exit(1);
+  }
+  done.get();
+}
+
+std::vector<unsigned char> pattern(size_t n, unsigned seed) {
+  std::vector<unsigned char> v(n);
+  for(size_t i=0; i<n; ++i) v[i] = static_cast<unsigned char>(i * 7 + seed);
+  return v;
+}
+
+void round_trip_in_chunks() {
+  fixture f;
+  const size_t size = 10000;
+  cl::buffer b(f.ctx, CL_MEM_READ_WRITE, size);
+  std::vector<unsigned char> in = pattern(size, 3), out(size);
+  {
+    // 4 chunks per transfer through 2 slabs: acquire must sleep until
+    // release() hands a slab back
+    cl::staging_pool pool(f.ctx, f.q, 2560, 2);
+    within_seconds(10, [&] {
+      cl::event w = pool.staged_write(f.q, b, 0, size, &in[0]);
+      cl::event r = pool.staged_read(f.q, b, 0, size, &out[0], 1, &w);
+      r.wait();
+    });
+  }
+  CHECK(in == out);
+}
+
+void shutdown_flushes_every_queue() {
+  // commands sit unsubmitted until their queue is flushed
+  stub::settings().defer_until_flush = true;
+  fixture f;
+  const size_t size = 4096;
+  cl::buffer b(f.ctx, CL_MEM_READ_WRITE, size);
+  std::vector<unsigned char> in = pattern(size, 5), out(size);
+  within_seconds(10, [&] {
+    cl::staging_pool pool(f.ctx, f.q, 1024, 4);
+    pool.staged_write(f.q2, b, 0, size, &in[0]);
+    // the pool was made for q1; destroying it must flush q2 as well
+  });
+  within_seconds(10, [&] {
+    cl::staging_pool pool(f.ctx, f.q, 1024, 4);
+    cl::event r = pool.staged_read(f.q2, b, 0, size, &out[0]);
+    f.q2.flush();
+    r.wait();
+    CHECK(in == out);
+  });
+  stub::settings().defer_until_flush = false;
+}
+
+void reads_complete_after_the_copy() {
+  fixture f;
+  const size_t size = 4096;
+  std::vector<unsigned char> in = pattern(size, 9), out(size, 0);
+  cl::buffer b(f.ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size,
+      &in[0]);
+  // one slab per chunk, since none returns before the gate opens
+  cl::staging_pool pool(f.ctx, f.q, 1024, 4);
+  within_seconds(10, [&] {
+    cl_int err;
+    cl::event gate(clCreateUserEvent(f.ctx.id(), &err));
+    cl::event r = pool.staged_read(f.q, b, 0, size, &out[0], 1, &gate);
+    CHECK(r.status() != CL_COMPLETE);
+    clSetUserEventStatus(gate.id(), CL_COMPLETE);
+    r.wait();
+    CHECK(in == out);
+  });
+}
+
+}
+
+int main() {
+  round_trip_in_chunks();
+  shutdown_flushes_every_queue();
+  reads_complete_after_the_copy();
+  return test_result();
+}
@@ -0,0 +1,123 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+namespace {
+
+const size_t chunk = 256;
+
+/** \brief chunk i is filled with the byte i, up to chunks of them */
+struct counting_source {
+  explicit counting_source(size_t n, size_t bytes = chunk)
+      : chunks(n), size(bytes), next(0) { }
+  size_t operator()(void *dst, size_t capacity) {
+    if(next == chunks) return 0;
+    const size_t n = std::min(size, capacity);
+    std::memset(dst, int(next++), n);
+    return size;
+  }
+  size_t chunks;
+  size_t size;
+  size_t next;
+};
+
+cl::event copy_stage(cl::command_queue &q, const cl::buffer &in,
+    size_t in_bytes, const cl::buffer &out, size_t &out_bytes,
+    cl_uint num_events, cl::event *events) {
+  out_bytes = in_bytes / 2;
+  return q.copy_buffer(in, out, 0, 0, out_bytes, num_events, events);
+}
+
+/** \brief checks that chunks arrive in order, each as copy_stage made it */
+struct ordered_sink {
+  ordered_sink() : next(0), bad(0) { }
+  void operator()(const void *src, size_t bytes) {
+    const unsigned char *p = static_cast<const unsigned char*>(src);
+    if(bytes != chunk / 2) ++bad;
+    for(size_t i=0; i<bytes; ++i) {
+      if(p[i] != static_cast<unsigned char>(next)) ++bad;
+    }
+    ++next;
+  }
+  size_t next;
+  size_t bad;
+};
+
+void run_in_order(size_t num_queues) {
+  test_queue f;
+  cl::stream_pipeline pipe(f.ctx, f.dev, chunk, chunk, 3, num_queues);
+  counting_source source(20);
+  ordered_sink sink;
+  cl::stream_stats stats = pipe.run(std::ref(source), copy_stage,
+      std::ref(sink));
+  CHECK(stats.chunks == 20);
+  CHECK(stats.bytes_in == 20 * chunk);
+  CHECK(stats.bytes_out == 20 * chunk / 2);
+  CHECK(sink.next == 20);
+  CHECK(sink.bad == 0);
+}
+
+void chunks_reach_the_sink_in_order() {
+  run_in_order(3);
+}
+
+void two_queues_share_compute_and_download() {
+  run_in_order(2);
+}
+
+void oversized_output_is_refused() {
+  test_queue f;
+  cl::stream_pipeline pipe(f.ctx, f.dev, chunk, chunk);
+  counting_source source(10);
+  ordered_sink sink;
+  size_t calls = 0;
+  CHECK_THROWS_CL(pipe.run(std::ref(source),
+        [&](cl::command_queue &q, const cl::buffer &in, size_t in_bytes,
+          const cl::buffer &out, size_t &out_bytes, cl_uint n,
+          cl::event *e) {
+        cl::event to_return = copy_stage(q, in, in_bytes, out, out_bytes,
+            n, e);
+        if(++calls == 5) out_bytes = chunk + 1;
+        return to_return;
+      }, std::ref(sink)), CL_INVALID_VALUE);
+  CHECK(sink.next < 5);
+
+  // every slot was left idle, so nothing of that run reaches this sink
+  counting_source again(7);
+  ordered_sink fresh;
+  CHECK(pipe.run(std::ref(again), copy_stage, std::ref(fresh)).chunks
+      == 7);
+  CHECK(fresh.next == 7);
+  CHECK(fresh.bad == 0);
+}
+
+void oversized_input_is_refused() {
+  test_queue f;
+  cl::stream_pipeline pipe(f.ctx, f.dev, chunk, chunk);
+  ordered_sink sink;
+  counting_source source(10, chunk + 1);
+  CHECK_THROWS_CL(pipe.run(std::ref(source), copy_stage, std::ref(sink)),
+      CL_INVALID_VALUE);
+  CHECK(sink.next == 0);
+
+  counting_source again(4);
+  ordered_sink fresh;
+  pipe.run(std::ref(again), copy_stage, std::ref(fresh));
+  CHECK(fresh.next == 4);
+  CHECK(fresh.bad == 0);
+}
+
+}
+
+int main() {
+  chunks_reach_the_sink_in_order();
+  two_queues_share_compute_and_download();
+  oversized_output_is_refused();
+  oversized_input_is_refused();
+  return test_result();
+}
@@ -0,0 +1,73 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace {
+
+const size_t unit = 64;
+const size_t units = 1024;
+
+std::atomic<size_t> launched;
+
+/** \brief 50us per work-group row */
+void slow_rows(const stub::launch &l) {
+  ++launched;
+  std::this_thread::sleep_for(std::chrono::microseconds(
+        50 * l.global[0] / unit));
+}
+
+struct fixture : test_queue {
+  explicit fixture(cl_command_queue_properties properties)
+      : test_queue(properties) {
+    cl::program prog(ctx, "__kernel void f(__global float *a) { }", "");
+    k = prog.get_kernel("f");
+    b = cl::buffer(ctx, CL_MEM_READ_WRITE, 1024);
+    k.set_arg(0, b.id());
+  }
+
+  /** \brief tiles launched before each call to between */
+  std::vector<size_t> run(unsigned in_flight) {
+    std::vector<size_t> to_return;
+    launched = 0;
+    const size_t global = unit * units, local = unit;
+    q.tiled_launch(k, 1, NULL, &global, &local, 1e-3,
+        [&](cl::command_queue&) { to_return.push_back(launched); },
+        in_flight).wait();
+    return to_return;
+  }
+
+  cl::kernel k;
+  cl::buffer b;
+};
+
+void host_timing_keeps_one_tile_in_flight() {
+  fixture f(0);
+  std::vector<size_t> seen = f.run(4);
+  CHECK(seen.size() > 4);
+  for(size_t i=0; i<seen.size(); ++i) CHECK(seen[i] == i + 1);
+}
+
+void profiling_pipelines_tiles() {
+  fixture f(CL_QUEUE_PROFILING_ENABLE);
+  std::vector<size_t> seen = f.run(2);
+  CHECK(seen.size() > 4);
+  // the probe runs alone, then one tile waits behind each one timed
+  CHECK(seen.at(0) == 1);
+  for(size_t i=1; i<seen.size(); ++i) {
+    CHECK(seen[i] == i + 2 || seen[i] == launched);
+  }
+}
+
+}
+
+int main() {
+  stub::set_launch_hook(slow_rows);
+  host_timing_keeps_one_tile_in_flight();
+  profiling_pipelines_tiles();
+  return test_result();
+}
@@ -0,0 +1,81 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <mutex>
+
+namespace {
+
+std::mutex launches_mutex;
+std::vector<stub::launch> launches;
+
+void record(const stub::launch &l) {
+  std::lock_guard<std::mutex> lock(launches_mutex);
+  launches.push_back(l);
+}
+
+size_t launch_count() {
+  std::lock_guard<std::mutex> lock(launches_mutex);
+  return launches.size();
+}
+
+struct fixture : test_queue {
+  fixture() {
+    cl::program prog(ctx,
+        "__kernel void axpy(__global float *y, float a, int n) { }", "");
+    k = cl::typed_kernel<cl::buffer, float, int>(prog.get_kernel("axpy"));
+    b = cl::buffer(ctx, CL_MEM_READ_WRITE, 1024);
+  }
+  cl::typed_kernel<cl::buffer, float, int> k;
+  cl::buffer b;
+};
+
+void launches_with_arguments() {
+  fixture f;
+  launches.clear();
+  const size_t global = 64;
+  f.k(f.q, 1, &global, NULL, f.b, 2.0f, 64).wait();
+  CHECK(launch_count() == 1);
+  CHECK(launches[0].arg<cl_mem>(0) == f.b.id());
+  CHECK(launches[0].arg<float>(1) == 2.0f);
+  CHECK(launches[0].arg<int>(2) == 64);
+  CHECK(launches[0].offset[0] == 0);
+}
+
+void waits_on_events() {
+  fixture f;
+  launches.clear();
+  cl_int err;
+  cl::event gate(clCreateUserEvent(f.ctx.id(), &err));
+  const size_t global = 64;
+  cl::event e = f.k(f.q, 1, &global, NULL, f.b, 1.0f, 64, 1, &gate);
+  CHECK(launch_count() == 0);
+  clSetUserEventStatus(gate.id(), CL_COMPLETE);
+  e.wait();
+  CHECK(launch_count() == 1);
+}
+
+void launches_at_an_offset() {
+  fixture f;
+  launches.clear();
+  const size_t offset = 128, global = 64, local = 16;
+  float zero = 0;
+  cl::event before = f.q.write_buffer(f.b, 0, sizeof(zero), &zero);
+  f.k(f.q, 1, &offset, &global, &local, f.b, 3.0f, 64, 1, &before).wait();
+  CHECK(launch_count() == 1);
+  CHECK(launches[0].offset[0] == 128);
+  CHECK(launches[0].global[0] == 64);
+  CHECK(launches[0].local[0] == 16);
+  CHECK(launches[0].arg<float>(1) == 3.0f);
+}
+
+}
+
+int main() {
+  stub::set_launch_hook(record);
+  launches_with_arguments();
+  waits_on_events();
+  launches_at_an_offset();
+  return test_result();
+}
@@ -0,0 +1,137 @@
+#include <cl_wrapper/cl_wrapper.hpp>
+
+#include "check.hpp"
+#include "stub_cl.hpp"
+
+#include <mutex>
+
+namespace {
+
+std::mutex launches_mutex;
+std::vector<stub::launch> launches;
+
+void record(const stub::launch &l) {
+  std::lock_guard<std::mutex> lock(launches_mutex);
+  launches.push_back(l);
+}
+
+std::vector<stub::launch> take_launches() {
+  std::lock_guard<std::mutex> lock(launches_mutex);
+  std::vector<stub::launch> to_return;
+  to_return.swap(launches);
+  return to_return;
+}
+
+struct fixture : test_queue {
+  fixture() : test_queue(CL_QUEUE_PROFILING_ENABLE) {
+    prog = cl::program(ctx, "__kernel void f(__global float *a) { }", "");
+    b = cl::buffer(ctx, CL_MEM_READ_WRITE, 1024);
+  }
+  cl::kernel make_kernel() {
+    cl::kernel k = prog.get_kernel("f");
+    k.set_arg(0, b.id());
+    return k;
+  }
+  cl::program prog;
+  cl::buffer b;
+};
+
+cl_uint refs(const cl::kernel &k) {
+  cl_uint to_return = 0;
+  clGetKernelInfo(k.id(), CL_KERNEL_REFERENCE_COUNT, sizeof(cl_uint),
+      &to_return, NULL);
+  return to_return;
+}
+
+void launches_never_tune() {
+  fixture f;
+  cl::work_group_tuner t;
+  f.q.set_tuner(&t);
+  cl::kernel k = f.make_kernel();
+  const size_t global = 1024;
+  take_launches();
+  f.q.run_kernel(k, 1, &global, NULL);
+  f.q.finish();
+  std::vector<stub::launch> seen = take_launches();
+  CHECK(seen.size() == 1);
+  CHECK(!seen.at(0).has_local);
+  CHECK(t.size() == 0);
+}
+
+void launches_use_tuned_sizes() {
+  fixture f;
+  cl::work_group_tuner t;
+  f.q.set_tuner(&t);
+  cl::kernel k = f.make_kernel();
+  const size_t global = 1024;
+  size_t local[3] = { 0, 0, 0 };
+  t.tune(f.q, k, 1, &global, local);
+  CHECK(t.size() == 1);
+  take_launches();
+  f.q.run_kernel(k, 1, &global, NULL);
+  f.q.finish();
+  std::vector<stub::launch> seen = take_launches();
+  CHECK(seen.size() == 1);
+  CHECK(seen.at(0).has_local == (local[0] != 0));
+  if(local[0]) CHECK(seen.at(0).local[0] == local[0]);
+}
+
+void memo_is_bounded() {
+  fixture f;
+  cl::work_group_tuner t("", 1, 4);
+  const size_t global = 1024;
+  size_t local[3];
+  cl::kernel first = f.make_kernel();
+  t.local_size(f.q, first, 1, &global, local);
+  CHECK(refs(first) == 2);
+  for(int i=0; i<10; ++i) {
+    cl::kernel k = f.make_kernel();
+    t.local_size(f.q, k, 1, &global, local);
+  }
+  CHECK(t.memo_size() == 4);
+  CHECK(refs(first) == 1);
+
+  // a lookup keeps an entry recent
+  cl::kernel kept = f.make_kernel();
+  t.local_size(f.q, kept, 1, &global, local);
+  for(int i=0; i<10; ++i) {
+    cl::kernel k = f.make_kernel();
+    t.local_size(f.q, k, 1, &global, local);
+    t.local_size(f.q, kept, 1, &global, local);
+  }
+  CHECK(refs(kept) == 2);
+}
+
+void programs_tune_apart() {
+  fixture f;
+  cl::work_group_tuner t;
+  const size_t global = 1024;
+  t.tune(f.q, f.make_kernel(), 1, &global);
+  CHECK(t.size() == 1);
+  // the same name in another program, and the same source with -D
+  cl::program other(f.ctx, "__kernel void f(__global int *a) { }", "");
+  cl::program defined(f.ctx, "__kernel void f(__global float *a) { }",
+      "-DN=2");
+  cl::kernel k = other.get_kernel("f");
+  k.set_arg(0, f.b.id());
+  t.tune(f.q, k, 1, &global);
+  CHECK(t.size() == 2);
+  k = defined.get_kernel("f");
+  k.set_arg(0, f.b.id());
+  t.tune(f.q, k, 1, &global);
+  CHECK(t.size() == 3);
+  // and the first program still finds its own
+  t.tune(f.q, f.make_kernel(), 1, &global);
+  CHECK(t.size() == 3);
+}
+
+}
+
+int main() {
+  stub::set_launch_hook(record);
+  launches_never_tune();
+  launches_use_tuned_sizes();
+  memo_is_bounded();
+  programs_tune_apart();
+  return test_result();
+}